@@ -62,6 +62,7 @@
 #include "util.h"
 #include "container.h"
 #include "compat.h"
+#include "ctassert.h"
 #include "sandbox.h"
 #include "util_format.h"
 
@@ -1670,6 +1671,26 @@ struct crypto_digest_t {
   digest_algorithm_bitfield_t algorithm : 8; /**< Which algorithm is in use? */
 };
 
+/* Every digest state we might checkpoint has to fit in a checkpoint. */
+CTASSERT(sizeof(((crypto_digest_t *)0)->d) <=
+         sizeof(((crypto_digest_checkpoint_t *)0)->mem));
+
+/** Return the number of bytes of hash state that are actually in use for a
+ * crypto_digest_t computing <b>alg</b>. */
+static INLINE size_t
+crypto_digest_state_bytes(digest_algorithm_t alg)
+{
+  switch (alg) {
+    case DIGEST_SHA1:
+      return sizeof(SHA_CTX);
+    case DIGEST_SHA256:
+      return sizeof(SHA256_CTX);
+    default:
+      tor_fragile_assert();
+      return sizeof(((crypto_digest_t*)NULL)->d);
+  }
+}
+
 /** Allocate and return a new digest object to compute SHA1 digests.
  */
 crypto_digest_t *
@@ -1744,8 +1765,10 @@ crypto_digest_get_digest(crypto_digest_t *digest,
   crypto_digest_t tmpenv;
   tor_assert(digest);
   tor_assert(out);
-  /* memcpy into a temporary ctx, since SHA*_Final clears the context */
-  memcpy(&tmpenv, digest, sizeof(crypto_digest_t));
+  /* memcpy into a temporary ctx, since SHA*_Final clears the context.  Only
+   * copy the part of the union that is in use: this runs once per relay
+   * cell. */
+  memcpy(&tmpenv.d, &digest->d, crypto_digest_state_bytes(digest->algorithm));
   switch (digest->algorithm) {
     case DIGEST_SHA1:
       tor_assert(out_len <= DIGEST_LEN);
@@ -1792,6 +1815,31 @@ crypto_digest_assign(crypto_digest_t *into,
   memcpy(into,from,sizeof(crypto_digest_t));
 }
 
+/** Save the running state of <b>digest</b> into <b>checkpoint</b>, so that
+ * it can later be rolled back with crypto_digest_restore().  Unlike
+ * crypto_digest_dup(), this does not allocate, so it is cheap enough to use
+ * on every cell.
+ */
+void
+crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                         const crypto_digest_t *digest)
+{
+  const size_t bytes = crypto_digest_state_bytes(digest->algorithm);
+  memcpy(checkpoint->mem, &digest->d, bytes);
+}
+
+/** Restore the running state of <b>digest</b> from <b>checkpoint</b>, which
+ * must have been filled in by crypto_digest_checkpoint() from a digest object
+ * using the same algorithm.
+ */
+void
+crypto_digest_restore(crypto_digest_t *digest,
+                      const crypto_digest_checkpoint_t *checkpoint)
+{
+  const size_t bytes = crypto_digest_state_bytes(digest->algorithm);
+  memcpy(&digest->d, checkpoint->mem, bytes);
+}
+
 /** Given a list of strings in <b>lst</b>, set the <b>len_out</b>-byte digest
  * at <b>digest_out</b> to the hash of the concatenation of those strings,
  * plus the optional string <b>append</b>, computed with the algorithm
@@ -0,0 +1,30 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ctassert.h
+ * \brief Compile-time assertions: CTASSERT(expression).
+ */
+
+#ifndef TOR_CTASSERT_H
+#define TOR_CTASSERT_H
+
+#include "compat.h"
+
+/**
+ * CTASSERT(expression)
+ *
+ *       Trigger a compiler error if expression is false.  Use it at file
+ *       scope, wherever a declaration is allowed.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define CTASSERT(x) _Static_assert((x), #x)
+#else
+#define CTASSERT(x) CTASSERT_EXPN((x), tor_ctassert_, __LINE__)
+#define CTASSERT_EXPN(x, a, b) CTASSERT_DECL(x, a, b)
+#define CTASSERT_DECL(x, a, b) \
+  typedef char a##b[(x) ? 1 : -1] ATTR_UNUSED
+#endif
+
+#endif
+
@@ -110,7 +110,8 @@ struct memarea_t {
 /** The number of memarea chunks currently in our freelist. */
 static int freelist_len=0;
 /** A linked list of unused memory area chunks.  Used to prevent us from
- * spinning in malloc/free loops. */
+ * spinning in malloc/free loops.  Only the main thread uses the freelist,
+ * so that other threads can safely use memareas of their own. */
 static memarea_chunk_t *freelist = NULL;
 
 /** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
@@ -118,7 +119,7 @@ static memarea_chunk_t *
 alloc_chunk(size_t sz, int freelist_ok)
 {
   tor_assert(sz < SIZE_T_CEILING);
-  if (freelist && freelist_ok) {
+  if (freelist && freelist_ok && in_main_thread()) {
     memarea_chunk_t *res = freelist;
     freelist = res->next_chunk;
     res->next_chunk = NULL;
@@ -147,7 +148,7 @@ static void
 chunk_free_unchecked(memarea_chunk_t *chunk)
 {
   CHECK_SENTINEL(chunk);
-  if (freelist_len < MAX_FREELIST_LEN) {
+  if (freelist_len < MAX_FREELIST_LEN && in_main_thread()) {
     ++freelist_len;
     chunk->next_chunk = freelist;
     freelist = chunk;
@@ -0,0 +1,254 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/** \file timewheel.c
+ * \brief Implementation for timewheel_t, a hierarchical timer wheel for
+ * scheduling large numbers of one-second-granularity timers.
+ *
+ * Scheduling and cancelling a timer are O(1), and advancing the wheel by a
+ * second only touches the timers that fire in that second, plus, once every
+ * TIMEWHEEL_SLOTS seconds, the timers that move down a level toward firing.
+ *
+ * The wheel has TIMEWHEEL_LEVELS levels of TIMEWHEEL_SLOTS slots each.
+ * Level 0 holds timers due in the next TIMEWHEEL_SLOTS seconds, one slot
+ * per second; each level above covers TIMEWHEEL_SLOTS times as long a span
+ * as the one below it, at that much coarser granularity.  When the wheel
+ * reaches the start of a coarse slot's span, it "cascades" that slot,
+ * rescheduling its timers into finer levels.  Timers too far away for even
+ * the top level wait on an overflow list until the top level wraps.
+ */
+
+#include "orconfig.h"
+#include <stdlib.h>
+#include "timewheel.h"
+#include "util.h"
+#include "torlog.h"
+
+/** log2 of the number of slots in each level of the wheel. */
+#define TIMEWHEEL_SLOT_BITS 6
+/** Number of slots in each level of the wheel. */
+#define TIMEWHEEL_SLOTS (1 << TIMEWHEEL_SLOT_BITS)
+/** Mask to get a slot number from a (shifted) time. */
+#define TIMEWHEEL_SLOT_MASK (TIMEWHEEL_SLOTS - 1)
+/** Number of levels in the wheel. With 64 slots per level, four levels
+ * cover about 194 days. */
+#define TIMEWHEEL_LEVELS 4
+
+/** If the wheel falls more than this many seconds behind (say, because the
+ * clock jumped), rebuild it instead of stepping through every second. */
+#define TIMEWHEEL_MAX_CATCHUP (TIMEWHEEL_SLOTS * TIMEWHEEL_SLOTS)
+
+/** A list of timewheel_entry_t. */
+TOR_LIST_HEAD(timewheel_slot_t, timewheel_entry_t);
+
+struct timewheel_t {
+  /** The last second that we have processed: every entry due at or before
+   * this time has fired. */
+  time_t now;
+  /** How many entries are scheduled? */
+  int n_entries;
+  /** The slots of each level of the wheel. */
+  struct timewheel_slot_t slots[TIMEWHEEL_LEVELS][TIMEWHEEL_SLOTS];
+  /** Entries too far in the future for any level. */
+  struct timewheel_slot_t overflow;
+};
+
+/** Return the slot number for <b>t</b> at level <b>level</b>. */
+static INLINE int
+timewheel_slot_idx(time_t t, int level)
+{
+  return (int)(((uint64_t)t >> (TIMEWHEEL_SLOT_BITS * level)) &
+               TIMEWHEEL_SLOT_MASK);
+}
+
+/** Helper: put <b>ent</b> into the right slot of <b>wheel</b> for its
+ * deadline, relative to the next second the wheel will process. Entries
+ * already due fire on that second. */
+static void
+timewheel_place(timewheel_t *wheel, timewheel_entry_t *ent)
+{
+  const time_t next = wheel->now + 1;
+  time_t when = ent->when;
+  int64_t delta;
+  int level;
+
+  if (when < next)
+    when = next;
+  delta = (int64_t)(when - next);
+
+  for (level = 0; level < TIMEWHEEL_LEVELS; ++level) {
+    if (delta < ((int64_t)1) << (TIMEWHEEL_SLOT_BITS * (level + 1))) {
+      TOR_LIST_INSERT_HEAD(
+          &wheel->slots[level][timewheel_slot_idx(when, level)], ent, node);
+      return;
+    }
+  }
+  TOR_LIST_INSERT_HEAD(&wheel->overflow, ent, node);
+}
+
+/** Helper: take every entry out of <b>slot</b> and place it again,
+ * relative to the wheel's current time. */
+static void
+timewheel_replace_all(timewheel_t *wheel, struct timewheel_slot_t *slot)
+{
+  struct timewheel_slot_t tmp = TOR_LIST_HEAD_INITIALIZER(tmp);
+  timewheel_entry_t *ent;
+
+  /* Move everything to a private list first, in case entries land back in
+   * the slot we're emptying. */
+  while ((ent = TOR_LIST_FIRST(slot))) {
+    TOR_LIST_REMOVE(ent, node);
+    TOR_LIST_INSERT_HEAD(&tmp, ent, node);
+  }
+  while ((ent = TOR_LIST_FIRST(&tmp))) {
+    TOR_LIST_REMOVE(ent, node);
+    timewheel_place(wheel, ent);
+  }
+}
+
+/** Return a new timewheel_t with no entries, whose current time is
+ * <b>now</b>. */
+timewheel_t *
+timewheel_new(time_t now)
+{
+  timewheel_t *wheel = tor_malloc_zero(sizeof(timewheel_t));
+  int level, i;
+
+  wheel->now = now;
+  for (level = 0; level < TIMEWHEEL_LEVELS; ++level) {
+    for (i = 0; i < TIMEWHEEL_SLOTS; ++i)
+      TOR_LIST_INIT(&wheel->slots[level][i]);
+  }
+  TOR_LIST_INIT(&wheel->overflow);
+  return wheel;
+}
+
+/** Release all storage held by <b>wheel</b>.  Entries still on the wheel
+ * belong to their owners, and are not touched. */
+void
+timewheel_free(timewheel_t *wheel)
+{
+  tor_free(wheel);
+}
+
+/** Schedule <b>ent</b> to fire when <b>wheel</b> reaches <b>when</b>. If
+ * <b>ent</b> was already scheduled, move it. */
+void
+timewheel_schedule(timewheel_t *wheel, timewheel_entry_t *ent, time_t when)
+{
+  tor_assert(wheel);
+  tor_assert(ent);
+
+  if (ent->scheduled) {
+    TOR_LIST_REMOVE(ent, node);
+  } else {
+    ent->scheduled = 1;
+    ++wheel->n_entries;
+  }
+  ent->when = when;
+  timewheel_place(wheel, ent);
+}
+
+/** Remove <b>ent</b> from <b>wheel</b> if it is scheduled there. */
+void
+timewheel_cancel(timewheel_t *wheel, timewheel_entry_t *ent)
+{
+  tor_assert(wheel);
+  tor_assert(ent);
+
+  if (!ent->scheduled)
+    return;
+  TOR_LIST_REMOVE(ent, node);
+  ent->scheduled = 0;
+  --wheel->n_entries;
+}
+
+/** Helper: unschedule <b>ent</b> and pass it to <b>cb</b>. */
+static INLINE void
+timewheel_fire(timewheel_t *wheel, timewheel_entry_t *ent, time_t now,
+               timewheel_cb_t cb, void *arg)
+{
+  TOR_LIST_REMOVE(ent, node);
+  ent->scheduled = 0;
+  --wheel->n_entries;
+  cb(ent, now, arg);
+}
+
+/** Advance <b>wheel</b> to <b>now</b>, invoking <b>cb</b>(entry, now,
+ * <b>arg</b>) for every entry whose time has come.  If the clock went
+ * backwards, do nothing: entries will fire once it catches up. */
+void
+timewheel_advance(timewheel_t *wheel, time_t now,
+                  timewheel_cb_t cb, void *arg)
+{
+  tor_assert(wheel);
+  tor_assert(cb);
+
+  if (now <= wheel->now)
+    return;
+
+  if (now - wheel->now > TIMEWHEEL_MAX_CATCHUP) {
+    /* Too far to step through; gather every entry, fire the ones that are
+     * due, and re-place the rest relative to now. */
+    struct timewheel_slot_t all = TOR_LIST_HEAD_INITIALIZER(all);
+    timewheel_entry_t *ent;
+    int level, i;
+    for (level = 0; level < TIMEWHEEL_LEVELS; ++level) {
+      for (i = 0; i < TIMEWHEEL_SLOTS; ++i) {
+        while ((ent = TOR_LIST_FIRST(&wheel->slots[level][i]))) {
+          TOR_LIST_REMOVE(ent, node);
+          TOR_LIST_INSERT_HEAD(&all, ent, node);
+        }
+      }
+    }
+    while ((ent = TOR_LIST_FIRST(&wheel->overflow))) {
+      TOR_LIST_REMOVE(ent, node);
+      TOR_LIST_INSERT_HEAD(&all, ent, node);
+    }
+    wheel->now = now;
+    while ((ent = TOR_LIST_FIRST(&all))) {
+      if (ent->when <= now) {
+        timewheel_fire(wheel, ent, now, cb, arg);
+      } else {
+        TOR_LIST_REMOVE(ent, node);
+        timewheel_place(wheel, ent);
+      }
+    }
+    return;
+  }
+
+  while (wheel->now < now) {
+    struct timewheel_slot_t *slot;
+    timewheel_entry_t *ent;
+    const time_t t = wheel->now + 1;
+    int level;
+
+    /* At the start of each coarse slot's span, move its entries down. This
+     * happens before we advance wheel->now, so that entries due at t
+     * itself land in t's level-0 slot. */
+    for (level = 1; level < TIMEWHEEL_LEVELS; ++level) {
+      if (timewheel_slot_idx(t, level - 1) != 0)
+        break;
+      timewheel_replace_all(
+          wheel, &wheel->slots[level][timewheel_slot_idx(t, level)]);
+    }
+    if (level == TIMEWHEEL_LEVELS &&
+        timewheel_slot_idx(t, TIMEWHEEL_LEVELS - 1) == 0)
+      timewheel_replace_all(wheel, &wheel->overflow);
+
+    wheel->now = t;
+    /* Callbacks can't add entries to this slot: anything due now or earlier
+     * goes into the next second's slot. */
+    slot = &wheel->slots[0][timewheel_slot_idx(t, 0)];
+    while ((ent = TOR_LIST_FIRST(slot)))
+      timewheel_fire(wheel, ent, now, cb, arg);
+  }
+}
+
+/** Return the number of entries scheduled on <b>wheel</b>. */
+int
+timewheel_get_n_entries(const timewheel_t *wheel)
+{
+  return wheel->n_entries;
+}
+
@@ -0,0 +1,40 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#ifndef TOR_TIMEWHEEL_H
+#define TOR_TIMEWHEEL_H
+
+#include <time.h>
+#include "tor_queue.h"
+
+typedef struct timewheel_t timewheel_t;
+
+/** An item that can be scheduled to fire at some second on a timewheel_t.
+ * Embed one in any structure that needs a timer, and use SUBTYPE_P to get
+ * back to the structure when it fires. */
+typedef struct timewheel_entry_t {
+  /** Links for the wheel slot that holds this entry. */
+  TOR_LIST_ENTRY(timewheel_entry_t) node;
+  /** The second at which this entry should fire. */
+  time_t when;
+  /** True iff this entry is currently on a wheel. */
+  unsigned int scheduled : 1;
+} timewheel_entry_t;
+
+/** Callback invoked for each entry that fires when a wheel advances to
+ * <b>now</b>.  The entry has already been unscheduled, and may be
+ * rescheduled from the callback. */
+typedef void (*timewheel_cb_t)(timewheel_entry_t *ent, time_t now,
+                               void *arg);
+
+timewheel_t *timewheel_new(time_t now);
+void timewheel_free(timewheel_t *wheel);
+void timewheel_schedule(timewheel_t *wheel, timewheel_entry_t *ent,
+                        time_t when);
+void timewheel_cancel(timewheel_t *wheel, timewheel_entry_t *ent);
+void timewheel_advance(timewheel_t *wheel, time_t now,
+                       timewheel_cb_t cb, void *arg);
+int timewheel_get_n_entries(const timewheel_t *wheel);
+
+#endif
+
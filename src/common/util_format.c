@@ -39,17 +39,39 @@ base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   dest[i] = '\0';
 }
 
+/** Marks an invalid character in base32_decode_table and
+ * hex_decode_table. */
+#define X 255
+/** Internal table mapping byte values to what they represent in base32, or
+ * X if they aren't base32. */
+static const uint8_t base32_decode_table[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, 26, 27, 28, 29, 30, 31, X, X, X, X, X, X, X, X,
+  X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, X, X, X, X, X,
+  X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+
 /** Implements base32 decoding as in RFC 4648.  Limitation: Requires
  * that srclen*5 is a multiple of 8. Returns 0 if successful, -1 otherwise.
  */
 int
 base32_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
-  /* XXXX we might want to rewrite this along the lines of base64_decode, if
-   * it ever shows up in the profile. */
-  unsigned int i;
-  size_t nbits, j, bit;
-  char *tmp;
+  const uint8_t *usrc = (const uint8_t *)src;
+  uint8_t *d = (uint8_t *)dest;
+  size_t nbits, j;
   nbits = srclen * 5;
 
   tor_assert(srclen < SIZE_T_CEILING / 5);
@@ -59,50 +81,29 @@ base32_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 
   memset(dest, 0, destlen);
 
-  /* Convert base32 encoded chars to the 5-bit values that they represent. */
-  tmp = tor_malloc_zero(srclen);
-  for (j = 0; j < srclen; ++j) {
-    if (src[j] > 0x60 && src[j] < 0x7B) tmp[j] = src[j] - 0x61;
-    else if (src[j] > 0x31 && src[j] < 0x38) tmp[j] = src[j] - 0x18;
-    else if (src[j] > 0x40 && src[j] < 0x5B) tmp[j] = src[j] - 0x41;
-    else {
+  /* Since srclen*5 is a multiple of 8, srclen is a multiple of 8: decode
+   * each group of 8 characters into 5 bytes. */
+  for (j = 0; j < srclen; j += 8) {
+    uint64_t v = 0;
+    uint8_t bad = 0;
+    int k;
+    for (k = 0; k < 8; ++k) {
+      uint8_t u = base32_decode_table[usrc[j+k]];
+      bad |= u;
+      v = (v << 5) | (u & 0x1f);
+    }
+    if (bad & 0xe0) {
       log_warn(LD_BUG, "illegal character in base32 encoded string");
-      tor_free(tmp);
+      memset(dest, 0, destlen);
       return -1;
     }
+    *d++ = (uint8_t)(v >> 32);
+    *d++ = (uint8_t)(v >> 24);
+    *d++ = (uint8_t)(v >> 16);
+    *d++ = (uint8_t)(v >> 8);
+    *d++ = (uint8_t)v;
   }
 
-  /* Assemble result byte-wise by applying five possible cases. */
-  for (i = 0, bit = 0; bit < nbits; ++i, bit += 8) {
-    switch (bit % 40) {
-    case 0:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 3) +
-                (((uint8_t)tmp[(bit/5)+1]) >> 2);
-      break;
-    case 8:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 6) +
-                (((uint8_t)tmp[(bit/5)+1]) << 1) +
-                (((uint8_t)tmp[(bit/5)+2]) >> 4);
-      break;
-    case 16:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 4) +
-                (((uint8_t)tmp[(bit/5)+1]) >> 1);
-      break;
-    case 24:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 7) +
-                (((uint8_t)tmp[(bit/5)+1]) << 2) +
-                (((uint8_t)tmp[(bit/5)+2]) >> 3);
-      break;
-    case 32:
-      dest[i] = (((uint8_t)tmp[(bit/5)]) << 5) +
-                ((uint8_t)tmp[(bit/5)+1]);
-      break;
-    }
-  }
-
-  memset(tmp, 0, srclen); /* on the heap, this should be safe */
-  tor_free(tmp);
-  tmp = NULL;
   return 0;
 }
 
@@ -181,10 +182,33 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
 
   memset(dest, 0, enclen);
 
-  /* XXX/Yawning: If this ends up being too slow, this can be sped up
-   * by separating the multiline format case and the normal case, and
-   * processing 48 bytes of input at a time when newlines are desired.
-   */
+#define ENCODE_GROUP()                                          \
+  STMT_BEGIN                                                    \
+    n = (usrc[0] << 16) | (usrc[1] << 8) | usrc[2];             \
+    *d++ = base64_encode_table[(n >> 18) & 0x3f];               \
+    *d++ = base64_encode_table[(n >> 12) & 0x3f];               \
+    *d++ = base64_encode_table[(n >> 6) & 0x3f];                \
+    *d++ = base64_encode_table[n & 0x3f];                       \
+    usrc += 3;                                                  \
+  STMT_END
+
+  /* Encode whole groups of 3 bytes, and for multiline output whole lines of
+   * 48 bytes, without checking for line breaks after every character. The
+   * loop below handles whatever is left. */
+  if (flags & BASE64_ENCODE_MULTILINE) {
+    while (eous - usrc >= (BASE64_OPENSSL_LINELEN / 4) * 3) {
+      int i;
+      for (i = 0; i < BASE64_OPENSSL_LINELEN / 4; ++i)
+        ENCODE_GROUP();
+      *d++ = '\n';
+    }
+  } else {
+    while (eous - usrc >= 3)
+      ENCODE_GROUP();
+  }
+  n = 0;
+#undef ENCODE_GROUP
+
 #define ENCODE_CHAR(ch) \
   STMT_BEGIN                                                    \
     *d++ = ch;                                                  \
@@ -292,39 +316,35 @@ int
 base64_decode_nopad(uint8_t *dest, size_t destlen,
                     const char *src, size_t srclen)
 {
+  size_t padded_len;
   if (srclen > SIZE_T_CEILING - 4)
     return -1;
-  char *buf = tor_malloc(srclen + 4);
-  memcpy(buf, src, srclen+1);
-  size_t buflen;
+  /* base64_decode() copes with missing padding; we only need to hold the
+   * output to the size that the padded input would need. */
   switch (srclen % 4)
     {
     case 0:
     default:
-      buflen = srclen;
+      padded_len = srclen;
       break;
     case 1:
-      tor_free(buf);
       return -1;
     case 2:
-      memcpy(buf+srclen, "==", 3);
-      buflen = srclen + 2;
+      padded_len = srclen + 2;
       break;
     case 3:
-      memcpy(buf+srclen, "=", 2);
-      buflen = srclen + 1;
+      padded_len = srclen + 1;
       break;
   }
-  int n = base64_decode((char*)dest, destlen, buf, buflen);
-  tor_free(buf);
-  return n;
+  if (destlen < (padded_len*3)/4)
+    return -1;
+  return base64_decode((char*)dest, destlen, src, srclen);
 }
 
 #undef BASE64_OPENSSL_LINELEN
 
 /** @{ */
 /** Special values used for the base64_decode_table */
-#define X 255
 #define SP 64
 #define PAD 65
 /** @} */
@@ -387,7 +407,30 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
    * 24 bits, batch them into 3 bytes and flush those bytes to dest.
    */
   for ( ; src < eos; ++src) {
-    unsigned char c = (unsigned char) *src;
+    unsigned char c;
+    if (n_idx == 0) {
+      /* Between groups, decode 4 characters at a time for as long as they
+       * are all ordinary base64 digits.  X, SP and PAD all have one of the
+       * top two bits set, and get handled one at a time below. */
+      while (eos - src >= 4) {
+        const uint8_t v0 = base64_decode_table[(unsigned char)src[0]];
+        const uint8_t v1 = base64_decode_table[(unsigned char)src[1]];
+        const uint8_t v2 = base64_decode_table[(unsigned char)src[2]];
+        const uint8_t v3 = base64_decode_table[(unsigned char)src[3]];
+        if ((v0 | v1 | v2 | v3) & 0xc0)
+          break;
+        n = ((uint32_t)v0 << 18) | ((uint32_t)v1 << 12) |
+            ((uint32_t)v2 << 6) | v3;
+        *dest++ = (n>>16);
+        *dest++ = (n>>8) & 0xff;
+        *dest++ = (n) & 0xff;
+        src += 4;
+      }
+      n = 0;
+      if (src == eos)
+        break;
+    }
+    c = (unsigned char) *src;
     uint8_t v = base64_decode_table[c];
     switch (v) {
       case X:
@@ -437,7 +480,6 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 
   return (int)(dest-dest_orig);
 }
-#undef X
 #undef SP
 #undef PAD
 
@@ -457,37 +499,42 @@ base16_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   cp = dest;
   end = src+srclen;
   while (src<end) {
-    *cp++ = "0123456789ABCDEF"[ (*(const uint8_t*)src) >> 4 ];
-    *cp++ = "0123456789ABCDEF"[ (*(const uint8_t*)src) & 0xf ];
+    const uint8_t b = *(const uint8_t*)src;
+    cp[0] = "0123456789ABCDEF"[b >> 4];
+    cp[1] = "0123456789ABCDEF"[b & 0xf];
+    cp += 2;
     ++src;
   }
   *cp = '\0';
 }
 
+/** Internal table mapping byte values to the hex digits they represent, or
+ * X if they aren't hex. */
+static const uint8_t hex_decode_table[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+
 /** Helper: given a hex digit, return its value, or -1 if it isn't hex. */
 static INLINE int
 hex_decode_digit_(char c)
 {
-  switch (c) {
-    case '0': return 0;
-    case '1': return 1;
-    case '2': return 2;
-    case '3': return 3;
-    case '4': return 4;
-    case '5': return 5;
-    case '6': return 6;
-    case '7': return 7;
-    case '8': return 8;
-    case '9': return 9;
-    case 'A': case 'a': return 10;
-    case 'B': case 'b': return 11;
-    case 'C': case 'c': return 12;
-    case 'D': case 'd': return 13;
-    case 'E': case 'e': return 14;
-    case 'F': case 'f': return 15;
-    default:
-      return -1;
-  }
+  const uint8_t v = hex_decode_table[(uint8_t)c];
+  return v == X ? -1 : v;
 }
 
 /** Helper: given a hex digit, return its value, or -1 if it isn't hex. */
@@ -503,9 +550,10 @@ hex_decode_digit(char c)
 int
 base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
-  const char *end;
+  const uint8_t *usrc = (const uint8_t *)src;
+  const uint8_t *end;
 
-  int v1,v2;
+  uint8_t v1,v2;
   if ((srclen % 2) != 0)
     return -1;
   if (destlen < srclen/2 || destlen > SIZE_T_CEILING)
@@ -513,16 +561,17 @@ base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 
   memset(dest, 0, destlen);
 
-  end = src+srclen;
-  while (src<end) {
-    v1 = hex_decode_digit_(*src);
-    v2 = hex_decode_digit_(*(src+1));
-    if (v1<0||v2<0)
+  end = usrc+srclen;
+  while (usrc<end) {
+    v1 = hex_decode_table[usrc[0]];
+    v2 = hex_decode_table[usrc[1]];
+    if ((v1|v2) & 0xf0)
       return -1;
     *(uint8_t*)dest = (v1<<4)|v2;
     ++dest;
-    src+=2;
+    usrc+=2;
   }
   return 0;
 }
+#undef X
 
@@ -33,6 +33,13 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
+  /** Number of threads currently blocked on <b>condition</b>, waiting for
+   * work.  When this is zero, nobody needs to be signaled about new work:
+   * every thread will check the queue before it goes back to sleep. */
+  int n_idle;
+  /** Number of times threadpool_queue_work() has signaled <b>condition</b>
+   * to wake an idle thread.  Only the tests look at this. */
+  unsigned n_wakeups;
   /** Mutex to protect all the above fields. */
   tor_mutex_t lock;
 
@@ -220,9 +227,11 @@ worker_thread_main(void *thread_)
     /* TODO: support an idle-function */
 
     /* Okay. Now, wait till somebody has work for us. */
+    ++pool->n_idle;
     if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
       log_warn(LD_GENERAL, "Fail tor_cond_wait.");
     }
+    --pool->n_idle;
   }
 }
 
@@ -294,7 +303,12 @@ threadpool_queue_work(threadpool_t *pool,
 
   TOR_TAILQ_INSERT_TAIL(&pool->work, ent, next_work);
 
-  tor_cond_signal_one(&pool->condition);
+  /* If every thread is busy, don't bother waking anybody: each of them will
+   * look at the queue again before it waits. */
+  if (pool->n_idle) {
+    tor_cond_signal_one(&pool->condition);
+    ++pool->n_wakeups;
+  }
 
   tor_mutex_release(&pool->lock);
 
@@ -470,14 +484,52 @@ replyqueue_get_socket(replyqueue_t *rq)
   return rq->alert.read_fd;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Set *<b>n_idle_out</b> to the number of threads in <b>pool</b> that are
+ * waiting for work, and *<b>n_wakeups_out</b> to the number of times that
+ * threadpool_queue_work() has woken one of them. */
+void
+threadpool_get_idle_counts(threadpool_t *pool, int *n_idle_out,
+                           unsigned *n_wakeups_out)
+{
+  tor_mutex_acquire(&pool->lock);
+  *n_idle_out = pool->n_idle;
+  *n_wakeups_out = pool->n_wakeups;
+  tor_mutex_release(&pool->lock);
+}
+
+/** Return the number of replies on <b>queue</b> that are waiting for
+ * replyqueue_process(). */
+int
+replyqueue_get_n_pending(replyqueue_t *queue)
+{
+  workqueue_entry_t *work;
+  int n = 0;
+  tor_mutex_acquire(&queue->lock);
+  TOR_TAILQ_FOREACH(work, &queue->answers, next_work)
+    ++n;
+  tor_mutex_release(&queue->lock);
+  return n;
+}
+#endif
+
 /**
  * Process all pending replies on a reply queue. The main thread should call
  * this function every time the socket returned by replyqueue_get_socket() is
  * readable.
+ *
+ * We take every reply that is pending when we're called in one locked
+ * operation, so that worker threads posting replies don't contend with us
+ * once per reply. Replies that arrive while we're running their reply
+ * functions will trigger the alert socket again, and get handled on the next
+ * call.
  */
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  TOR_TAILQ_HEAD(, workqueue_entry_s) batch;
+  TOR_TAILQ_INIT(&batch);
+
   if (queue->alert.drain_fn(queue->alert.read_fd) < 0) {
     static ratelim_t warn_limit = RATELIM_INIT(7200);
     log_fn_ratelim(&warn_limit, LOG_WARN, LD_GENERAL,
@@ -487,18 +539,19 @@ replyqueue_process(replyqueue_t *queue)
 
   tor_mutex_acquire(&queue->lock);
   while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
     workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
     TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
+    TOR_TAILQ_INSERT_TAIL(&batch, work, next_work);
+  }
+  tor_mutex_release(&queue->lock);
+
+  while (!TOR_TAILQ_EMPTY(&batch)) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&batch);
+    TOR_TAILQ_REMOVE(&batch, work, next_work);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
   }
-
-  tor_mutex_release(&queue->lock);
 }
 
@@ -45,5 +45,11 @@ replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
 tor_socket_t replyqueue_get_socket(replyqueue_t *rq);
 void replyqueue_process(replyqueue_t *queue);
 
+#ifdef TOR_UNIT_TESTS
+void threadpool_get_idle_counts(threadpool_t *pool, int *n_idle_out,
+                                unsigned *n_wakeups_out);
+int replyqueue_get_n_pending(replyqueue_t *queue);
+#endif
+
 #endif
 
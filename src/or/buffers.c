@@ -85,10 +85,13 @@ CHUNK_WRITE_PTR(chunk_t *chunk)
 }
 
 /** Return the number of bytes that can be written onto <b>chunk</b> without
- * running out of space. */
+ * running out of space.  Chunks that refer to memory they don't own can't
+ * be written onto at all. */
 static INLINE size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (chunk->ref_release)
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -116,6 +119,8 @@ chunk_free_unchecked(chunk_t *chunk)
   tor_assert(total_bytes_allocated_in_chunks >=
              CHUNK_ALLOC_SIZE(chunk->memlen));
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  if (chunk->ref_release)
+    chunk->ref_release(chunk->ref_arg);
   tor_free(chunk);
 }
 static INLINE chunk_t *
@@ -131,6 +136,8 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->ref_release = NULL;
+  ch->ref_arg = NULL;
   return ch;
 }
 
@@ -175,6 +182,21 @@ preferred_chunk_size(size_t target)
   return sz;
 }
 
+/** Return a chunk holding a copy of the data in <b>chunk</b>, which refers
+ * to memory it doesn't own, and free <b>chunk</b>. */
+static chunk_t *
+chunk_copy_ref_data(chunk_t *chunk)
+{
+  chunk_t *newch =
+    chunk_new_with_alloc_size(preferred_chunk_size(chunk->datalen));
+  memcpy(newch->mem, chunk->data, chunk->datalen);
+  newch->datalen = chunk->datalen;
+  newch->next = chunk->next;
+  newch->inserted_time = chunk->inserted_time;
+  chunk_free_unchecked(chunk);
+  return newch;
+}
+
 /** Collapse data from the first N chunks from <b>buf</b> into buf->head,
  * growing it as necessary, until buf->head has the first <b>bytes</b> bytes
  * of data from the buffer, or until buf->head has all the data in <b>buf</b>.
@@ -195,6 +217,15 @@ buf_pullup(buf_t *buf, size_t bytes)
   if (buf->head->datalen >= bytes)
     return;
 
+  if (buf->head->ref_release) {
+    /* We can't add anything to a chunk that refers to memory it doesn't
+     * own: copy its data into a chunk of our own. */
+    chunk_t *newhead = chunk_copy_ref_data(buf->head);
+    if (buf->tail == buf->head)
+      buf->tail = newhead;
+    buf->head = newhead;
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -364,7 +395,17 @@ buf_free(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
-  chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
+  chunk_t *newch;
+  if (in_chunk->ref_release) {
+    /* We can't share the reference; copy the data instead. */
+    newch = chunk_new_with_alloc_size(
+                               preferred_chunk_size(in_chunk->datalen));
+    memcpy(newch->mem, in_chunk->data, in_chunk->datalen);
+    newch->datalen = in_chunk->datalen;
+    newch->inserted_time = in_chunk->inserted_time;
+    return newch;
+  }
+  newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
   newch->DBG_alloc = CHUNK_ALLOC_SIZE(in_chunk->memlen);
@@ -718,8 +759,17 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   return (int)flushed;
 }
 
+/** The largest amount of plaintext that fits in a single TLS record. */
+#define TLS_RECORD_MAX_PLAINTEXT 16384
+
 /** As flush_buf(), but writes data to a TLS connection.  Can write more than
  * <b>flushlen</b> bytes.
+ *
+ * Cells are queued in chunks that are often much smaller than a TLS record,
+ * so before each write we pull up to a record's worth of data into the
+ * first chunk: that way each record we send is as full as it can be,
+ * instead of paying a record header, a MAC, and likely a syscall for every
+ * chunk.
  */
 int
 flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
@@ -740,6 +790,12 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
   check();
   do {
     size_t flushlen0;
+    if (buf->head && buf->head->next &&
+        buf->head->datalen < TLS_RECORD_MAX_PLAINTEXT &&
+        (ssize_t)buf->head->datalen < sz) {
+      buf_pullup(buf, sz < TLS_RECORD_MAX_PLAINTEXT ?
+                 (size_t)sz : TLS_RECORD_MAX_PLAINTEXT);
+    }
     if (buf->head) {
       if ((ssize_t)buf->head->datalen >= sz)
         flushlen0 = sz;
@@ -794,6 +850,50 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
+/** Append <b>string_len</b> bytes from <b>string</b> to the end of
+ * <b>buf</b> without copying them: <b>buf</b> refers to <b>string</b>
+ * until it no longer needs it, and then calls
+ * <b>release_fn</b>(<b>release_arg</b>).  The caller must keep
+ * <b>string</b> alive and unchanged until then.  <b>release_fn</b> is
+ * called exactly once, even on failure.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+write_ref_to_buf(const char *string, size_t string_len,
+                 void (*release_fn)(void *), void *release_arg,
+                 buf_t *buf)
+{
+  chunk_t *chunk;
+  struct timeval now;
+
+  tor_assert(release_fn);
+  if (!string_len || buf->datalen + string_len >= INT_MAX) {
+    release_fn(release_arg);
+    return string_len ? -1 : (int)buf->datalen;
+  }
+  check();
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *)string;
+  chunk->datalen = string_len;
+  chunk->ref_release = release_fn;
+  chunk->ref_arg = release_arg;
+  tor_gettimeofday_cached_monotonic(&now);
+  chunk->inserted_time = (uint32_t)tv_to_msec(&now);
+
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += string_len;
+
+  check();
+  return (int)buf->datalen;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -1021,10 +1121,41 @@ move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   cp = len; /* Remember the number of bytes we intend to copy. */
   tor_assert(cp < INT_MAX);
   while (len) {
+    size_t n;
+    chunk_t *ch = buf_in->head;
+    if (!ch->datalen) {
+      /* Drop empty chunks, such as a read chunk that got nothing before a
+       * reference was written after it: there's nothing in them to move. */
+      buf_in->head = ch->next;
+      if (buf_in->tail == ch)
+        buf_in->tail = NULL;
+      chunk_free_unchecked(ch);
+      continue;
+    }
+    if (ch->ref_release && ch->datalen <= len) {
+      /* Hand over chunks that refer to memory we don't own as they are:
+       * they're usually big, and copying them would defeat their purpose. */
+      buf_in->head = ch->next;
+      if (buf_in->tail == ch)
+        buf_in->tail = NULL;
+      buf_in->datalen -= ch->datalen;
+      ch->next = NULL;
+      if (buf_out->tail)
+        buf_out->tail->next = ch;
+      else
+        buf_out->head = ch;
+      buf_out->tail = ch;
+      buf_out->datalen += ch->datalen;
+      len -= ch->datalen;
+      continue;
+    }
     /* This isn't the most efficient implementation one could imagine, since
      * it does two copies instead of 1, but I kinda doubt that this will be
      * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
+    n = len > sizeof(b) ? sizeof(b) : len;
+    /* Stop at the end of this chunk, in case the next one can be moved. */
+    if (n > ch->datalen)
+      n = ch->datalen;
     fetch_from_buf(b, n, buf_in);
     write_to_buf(b, n, buf_out);
     len -= n;
@@ -2418,6 +2549,12 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (ch->ref_release) {
+        tor_assert(ch->memlen == 0);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
       tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
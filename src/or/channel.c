@@ -27,6 +27,7 @@
 #include "circuitmux.h"
 #include "entrynodes.h"
 #include "geoip.h"
+#include "main.h"
 #include "nodelist.h"
 #include "relay.h"
 #include "rephist.h"
@@ -3873,7 +3874,33 @@ channel_mark_bad_for_new_circs(channel_t *chan)
 {
   tor_assert(chan);
 
+  if (chan->is_bad_for_new_circs)
+    return;
   chan->is_bad_for_new_circs = 1;
+  /* If it has no circuits, it can close now. */
+  channel_reschedule_housekeeping(chan);
+}
+
+/**
+ * Tell the lower layer of a channel to look at it again soon
+ *
+ * Call this when something has happened that might let a channel close
+ * sooner than its lower layer expected: it lost its last circuit, or it
+ * became bad for new circuits.
+ */
+
+void
+channel_reschedule_housekeeping(channel_t *chan)
+{
+  channel_tls_t *tlschan;
+
+  tor_assert(chan);
+
+  if (chan->magic != TLS_CHAN_MAGIC)
+    return;
+  tlschan = BASE_CHAN_TO_TLS(chan);
+  if (tlschan->conn)
+    connection_reschedule_housekeeping(TO_CONN(tlschan->conn));
 }
 
 /**
@@ -28,6 +28,7 @@
 #include "onion_fast.h"
 #include "policies.h"
 #include "relay.h"
+#include "relay_crypto.h"
 #include "rendclient.h"
 #include "rendcommon.h"
 #include "rephist.h"
@@ -98,6 +99,33 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
+/** Helper for hash tables: return true iff <b>a</b> and <b>b</b> have the
+ * same global identifier. */
+static INLINE int
+origin_circuit_global_ids_eq_(const origin_circuit_t *a,
+                              const origin_circuit_t *b)
+{
+  return a->global_identifier == b->global_identifier;
+}
+
+/** Helper: return a hash based on the global identifier of <b>a</b>. */
+static INLINE unsigned int
+origin_circuit_global_id_hash_(const origin_circuit_t *a)
+{
+  return (unsigned) siphash24g(&a->global_identifier,
+                               sizeof(a->global_identifier));
+}
+
+/** Map from global identifier to origin circuit, so that the controller can
+ * look up circuits without walking the global circuit list. */
+static HT_HEAD(circ_global_id_map, origin_circuit_t)
+     circ_global_id_map = HT_INITIALIZER();
+HT_PROTOTYPE(circ_global_id_map, origin_circuit_t, global_id_node,
+             origin_circuit_global_id_hash_, origin_circuit_global_ids_eq_)
+HT_GENERATE2(circ_global_id_map, origin_circuit_t, global_id_node,
+             origin_circuit_global_id_hash_, origin_circuit_global_ids_eq_,
+             0.6, tor_reallocarray_, tor_free_)
+
 /** The most recently returned entry from circuit_get_by_circid_chan;
  * used to improve performance when many cells arrive in a row from the
  * same circuit.
@@ -169,6 +197,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
         /* One fewer circuits use old_chan as p_chan */
         --(old_chan->num_p_circuits);
       }
+      if (channel_num_circuits(old_chan) == 0) {
+        old_chan->timestamp_last_had_circuits = approx_time();
+        channel_reschedule_housekeeping(old_chan);
+      }
     }
   }
 
@@ -706,6 +738,9 @@ origin_circuit_new(void)
 
   circ->next_stream_id = crypto_rand_int(1<<16);
   circ->global_identifier = n_circuits_allocated++;
+  /* If the identifier has wrapped around onto a live circuit, the new one
+   * wins; circuit_free() only removes a circuit that's still mapped. */
+  HT_REPLACE(circ_global_id_map, &circ_global_id_map, circ);
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
   circ->remaining_relay_early_cells -= crypto_rand_int(2);
 
@@ -754,6 +789,8 @@ circuit_free(circuit_t *circ)
     mem = ocirc;
     memlen = sizeof(origin_circuit_t);
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+    if (HT_FIND(circ_global_id_map, &circ_global_id_map, ocirc) == ocirc)
+      HT_REMOVE(circ_global_id_map, &circ_global_id_map, ocirc);
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
         circuit_free_cpath_node(ocirc->build_state->pending_final_cpath);
@@ -787,10 +824,9 @@ circuit_free(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
-    crypto_cipher_free(ocirc->p_crypto);
-    crypto_digest_free(ocirc->p_digest);
-    crypto_cipher_free(ocirc->n_crypto);
-    crypto_digest_free(ocirc->n_digest);
+    circuit_cancel_serverside_expiry(ocirc);
+
+    relay_crypto_clear(&ocirc->crypto);
 
     circuit_clear_rend_token(ocirc);
 
@@ -908,6 +944,8 @@ circuit_free_all(void)
     }
   }
   HT_CLEAR(chan_circid_map, &chan_circid_map);
+  HT_CLEAR(circ_global_id_map, &circ_global_id_map);
+  circuit_free_serverside_expiry();
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -917,10 +955,7 @@ circuit_free_cpath_node(crypt_path_t *victim)
   if (!victim)
     return;
 
-  crypto_cipher_free(victim->f_crypto);
-  crypto_cipher_free(victim->b_crypto);
-  crypto_digest_free(victim->f_digest);
-  crypto_digest_free(victim->b_digest);
+  relay_crypto_clear(&victim->crypto);
   onion_handshake_state_release(&victim->handshake_state);
   crypto_dh_free(victim->rend_dh_handshake_state);
   extend_info_free(victim->extend_info);
@@ -1009,17 +1044,13 @@ circuit_dump_by_conn(connection_t *conn, int severity)
 origin_circuit_t *
 circuit_get_by_global_id(uint32_t id)
 {
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (CIRCUIT_IS_ORIGIN(circ) &&
-        TO_ORIGIN_CIRCUIT(circ)->global_identifier == id) {
-      if (circ->marked_for_close)
-        return NULL;
-      else
-        return TO_ORIGIN_CIRCUIT(circ);
-    }
-  }
-  SMARTLIST_FOREACH_END(circ);
-  return NULL;
+  origin_circuit_t search, *found;
+
+  search.global_identifier = id;
+  found = HT_FIND(circ_global_id_map, &circ_global_id_map, &search);
+  if (!found || TO_CIRCUIT(found)->marked_for_close)
+    return NULL;
+  return found;
 }
 
 /** Return a circ such that:
@@ -2003,42 +2034,47 @@ circuit_max_queued_item_age(const circuit_t *c, uint32_t now)
     return data_age;
 }
 
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
-static int
-circuits_compare_by_oldest_queued_item_(const void **a_, const void **b_)
-{
-  const circuit_t *a = *a_;
-  const circuit_t *b = *b_;
-  uint32_t age_a = a->age_tmp;
-  uint32_t age_b = b->age_tmp;
+/** A circuit or directory connection that circuits_handle_oom() might kill,
+ * along with the age of its oldest queued data. */
+typedef struct oom_victim_t {
+  /** Age in milliseconds of the oldest queued cell or buffer chunk. */
+  uint32_t age;
+  /** True iff <b>ptr</b> is a connection_t; otherwise it's a circuit_t. */
+  unsigned is_conn : 1;
+  void *ptr;
+} oom_victim_t;
 
-  if (age_a < age_b)
-    return 1;
-  else if (age_a == age_b)
-    return 0;
-  else
-    return -1;
+/** Return true iff <b>a</b> should be killed before <b>b</b> on OOM: if it
+ * has older data, or if they're the same age and <b>a</b> is a directory
+ * connection, since those are cheaper to lose than circuits. */
+static INLINE int
+oom_victim_worse(const oom_victim_t *a, const oom_victim_t *b)
+{
+  if (a->age != b->age)
+    return a->age > b->age;
+  return a->is_conn && !b->is_conn;
 }
 
-static uint32_t now_ms_for_buf_cmp;
-
-/** Helper to sort a list of circuit_t by age of oldest item, in descending
- * order. */
-static int
-conns_compare_by_buffer_age_(const void **a_, const void **b_)
+/** Helper: restore the heap property in the max-heap of <b>n</b> victims at
+ * <b>heap</b>, where the item at <b>idx</b> may be better than one of its
+ * children. */
+static void
+oom_victims_sift_down(oom_victim_t *heap, int n, int idx)
 {
-  const connection_t *a = *a_;
-  const connection_t *b = *b_;
-  time_t age_a = conn_get_buffer_age(a, now_ms_for_buf_cmp);
-  time_t age_b = conn_get_buffer_age(b, now_ms_for_buf_cmp);
+  oom_victim_t item = heap[idx];
 
-  if (age_a < age_b)
-    return 1;
-  else if (age_a == age_b)
-    return 0;
-  else
-    return -1;
+  while (1) {
+    int child = 2*idx + 1;
+    if (child >= n)
+      break;
+    if (child + 1 < n && oom_victim_worse(&heap[child+1], &heap[child]))
+      ++child;
+    if (!oom_victim_worse(&heap[child], &item))
+      break;
+    heap[idx] = heap[child];
+    idx = child;
+  }
+  heap[idx] = item;
 }
 
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
@@ -2051,7 +2087,8 @@ circuits_handle_oom(size_t current_allocation)
 {
   smartlist_t *circlist;
   smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
+  oom_victim_t *victims;
+  int n_victims = 0, i;
   size_t mem_to_recover;
   size_t mem_recovered=0;
   int n_circuits_killed=0;
@@ -2073,77 +2110,65 @@ circuits_handle_oom(size_t current_allocation)
   tor_gettimeofday_cached_monotonic(&now);
   now_ms = (uint32_t)tv_to_msec(&now);
 
+  /* Rather than sorting every circuit and connection, make one pass to
+   * find how old each one's data is, heapify that in linear time, and take
+   * victims off the top only until we've freed enough. */
   circlist = circuit_get_global_list();
+  victims = tor_calloc(smartlist_len(circlist) +
+                       smartlist_len(connection_array) + 1,
+                       sizeof(oom_victim_t));
   SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->age_tmp = circuit_max_queued_item_age(circ, now_ms);
+    victims[n_victims].age = circuit_max_queued_item_age(circ, now_ms);
+    victims[n_victims].ptr = circ;
+    ++n_victims;
   } SMARTLIST_FOREACH_END(circ);
-
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
-
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* Now sort the connection array ... */
-  now_ms_for_buf_cmp = now_ms;
-  smartlist_sort(connection_array, conns_compare_by_buffer_age_);
-  now_ms_for_buf_cmp = 0;
-
-  /* Fix up the connection array to its new order. */
+  /* We only free storage in non-linked directory connections. */
   SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
-    conn->conn_array_index = conn_sl_idx;
+    if (conn->type != CONN_TYPE_DIR || conn->linked_conn != NULL)
+      continue;
+    victims[n_victims].age = conn_get_buffer_age(conn, now_ms);
+    victims[n_victims].is_conn = 1;
+    victims[n_victims].ptr = conn;
+    ++n_victims;
   } SMARTLIST_FOREACH_END(conn);
 
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
-  conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    size_t n;
-    size_t freed;
-
-    /* Free storage in any non-linked directory connections that have buffered
-     * data older than this circuit. */
-    while (conn_idx < smartlist_len(connection_array)) {
-      connection_t *conn = smartlist_get(connection_array, conn_idx);
-      uint32_t conn_age = conn_get_buffer_age(conn, now_ms);
-      if (conn_age < circ->age_tmp) {
-        break;
-      }
-      if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
-        if (!conn->marked_for_close)
-          connection_mark_for_close(conn);
-        mem_recovered += single_conn_free_bytes(conn);
+  for (i = n_victims / 2 - 1; i >= 0; --i)
+    oom_victims_sift_down(victims, n_victims, i);
 
-        ++n_dirconns_killed;
+  /* Now the worst circuit or connection is always at the top of the heap.
+   * Mark them, and reclaim their storage aggressively. */
+  while (n_victims && mem_recovered < mem_to_recover) {
+    oom_victim_t worst = victims[0];
+    victims[0] = victims[--n_victims];
+    oom_victims_sift_down(victims, n_victims, 0);
 
-        if (mem_recovered >= mem_to_recover)
-          goto done_recovering_mem;
-      }
-      ++conn_idx;
-    }
+    if (worst.is_conn) {
+      connection_t *conn = worst.ptr;
+      if (!conn->marked_for_close)
+        connection_mark_for_close(conn);
+      mem_recovered += single_conn_free_bytes(conn);
 
-    /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
-    if (! circ->marked_for_close) {
-      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
-    }
-    marked_circuit_free_cells(circ);
-    freed = marked_circuit_free_stream_bytes(circ);
+      ++n_dirconns_killed;
+    } else {
+      circuit_t *circ = worst.ptr;
+      size_t n;
+      size_t freed;
 
-    ++n_circuits_killed;
+      n = n_cells_in_circ_queues(circ);
+      if (! circ->marked_for_close) {
+        circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+      }
+      marked_circuit_free_cells(circ);
+      freed = marked_circuit_free_stream_bytes(circ);
 
-    mem_recovered += n * packed_cell_mem_cost();
-    mem_recovered += freed;
+      ++n_circuits_killed;
 
-    if (mem_recovered >= mem_to_recover)
-      goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+      mem_recovered += n * packed_cell_mem_cost();
+      mem_recovered += freed;
+    }
+  }
 
- done_recovering_mem:
+  tor_free(victims);
 
   log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
@@ -2167,8 +2192,8 @@ assert_cpath_layer_ok(const crypt_path_t *cp)
   switch (cp->state)
     {
     case CPATH_STATE_OPEN:
-      tor_assert(cp->f_crypto);
-      tor_assert(cp->b_crypto);
+      tor_assert(cp->crypto.f_crypto);
+      tor_assert(cp->crypto.b_crypto);
       /* fall through */
     case CPATH_STATE_CLOSED:
       /*XXXX Assert that there's no handshake_state either. */
@@ -2257,10 +2282,7 @@ assert_circuit_ok(const circuit_t *c)
   if (c->state == CIRCUIT_STATE_OPEN) {
     tor_assert(!c->n_chan_create_cell);
     if (or_circ) {
-      tor_assert(or_circ->n_crypto);
-      tor_assert(or_circ->p_crypto);
-      tor_assert(or_circ->n_digest);
-      tor_assert(or_circ->p_digest);
+      relay_crypto_assert_ok(&or_circ->crypto);
     }
   }
   if (c->state == CIRCUIT_STATE_CHAN_WAIT && !c->marked_for_close) {
@@ -24,6 +24,13 @@
  * consensus or a configuration setting.  zero means "disabled". */
 #define EWMA_DEFAULT_HALFLIFE 0.0
 
+/** How far may the cell counts in a policy's priority queue drift from the
+ * current tick before we rebase them?  Expressed as the smallest value of
+ * ewma_scale_factor ** (ticks since the queue's base tick) we allow; the
+ * counts grow by the inverse of this, so it bounds how close we get to
+ * overflowing a double. */
+#define EWMA_MIN_REBASE_FACTOR 1e-20
+
 /*** Some useful constant #defines ***/
 
 /*DOCDOC*/
@@ -34,6 +41,7 @@
 /*** EWMA structures ***/
 
 typedef struct cell_ewma_s cell_ewma_t;
+typedef struct ewma_heap_entry_s ewma_heap_entry_t;
 typedef struct ewma_policy_data_s ewma_policy_data_t;
 typedef struct ewma_policy_circ_data_s ewma_policy_circ_data_t;
 
@@ -61,23 +69,53 @@ struct cell_ewma_s {
   int heap_index;
 };
 
+/**
+ * An entry in an ewma_policy_data_t's priority queue.  We keep a copy of
+ * the circuit's cell_count next to the pointer, so that comparing entries
+ * while fixing up the heap doesn't need to chase the pointer.
+ */
+
+struct ewma_heap_entry_s {
+  /** Same as ewma->cell_count. */
+  double cell_count;
+  /** The cell_ewma_t this entry is for. */
+  cell_ewma_t *ewma;
+};
+
+/** How many children does each node in an active circuit heap have? */
+#define EWMA_HEAP_ARITY 4
+
 struct ewma_policy_data_s {
   circuitmux_policy_data_t base_;
 
   /**
    * Priority queue of cell_ewma_t for circuits with queued cells waiting
    * for room to free up on the channel that owns this circuitmux.  Kept
-   * in heap order according to EWMA.  This was formerly in channel_t, and
-   * in or_connection_t before that.
+   * as a 4-ary heap ordered by EWMA, holding n_active_circuits entries
+   * out of active_circuit_pqueue_capacity allocated.  This was formerly a
+   * smartlist in channel_t, and in or_connection_t before that.
    */
-  smartlist_t *active_circuit_pqueue;
+  ewma_heap_entry_t *active_circuit_pqueue;
+  int n_active_circuits;
+  int active_circuit_pqueue_capacity;
 
   /**
-   * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
-   * or_connection_t before that.
+   * The base tick of active_circuit_pqueue: the cell_count of every
+   * cell_ewma_t in the queue is scaled so that a cell sent at the start of
+   * this tick has weight 1.0.  Since scaling every count by the same factor
+   * doesn't change their order, we don't move this forward when the tick
+   * advances; we only rebase when the counts would otherwise grow too big.
+   * This was formerly in channel_t, and in or_connection_t before that.
    */
   unsigned int active_circuit_pqueue_last_recalibrated;
+
+  /**
+   * The per-tick scale factor that the cell_counts in active_circuit_pqueue
+   * were computed with.  When ewma_scale_factor changes, we rebase the
+   * queue with this factor before using the new one, so that cells sent
+   * before and after the change are weighed consistently.
+   */
+  double active_circuit_pqueue_scale_factor;
 };
 
 struct ewma_policy_circ_data_s {
@@ -143,16 +181,21 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 /*** Static declarations for circuitmux_ewma.c ***/
 
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static int compare_cell_ewma_counts(const void *p1, const void *p2);
 static unsigned cell_ewma_tick_from_timeval(const struct timeval *now,
                                             double *remainder_out);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static INLINE double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
+static INLINE cell_ewma_t *first_cell_ewma(ewma_policy_data_t *pol);
+static void ewma_heap_sift_up(ewma_policy_data_t *pol, int idx,
+                              ewma_heap_entry_t entry);
+static void ewma_heap_sift_down(ewma_policy_data_t *pol, int idx,
+                                ewma_heap_entry_t entry);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
                                   unsigned cur_tick);
+static void rebase_active_circuits_if_needed(ewma_policy_data_t *pol,
+                                             unsigned cur_tick);
 
 /*** Circuitmux policy methods ***/
 
@@ -232,8 +275,12 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
+  pol->active_circuit_pqueue_capacity = 16;
+  pol->active_circuit_pqueue =
+    tor_calloc(pol->active_circuit_pqueue_capacity,
+               sizeof(ewma_heap_entry_t));
   pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  pol->active_circuit_pqueue_scale_factor = ewma_scale_factor;
 
   return TO_CMUX_POL_DATA(pol);
 }
@@ -253,7 +300,7 @@ ewma_free_cmux_data(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  tor_free(pol->active_circuit_pqueue);
   tor_free(pol);
 }
 
@@ -393,7 +440,7 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   double fractional_tick, ewma_increment;
   /* The current (hi-res) time */
   struct timeval now_hires;
-  cell_ewma_t *cell_ewma, *tmp;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -404,15 +451,15 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
+  /* Rebase the EWMAs if they've drifted too far from the current tick */
   tor_gettimeofday_cached(&now_hires);
   tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
+  rebase_active_circuits_if_needed(pol, tick);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
-    scale_active_circuits(pol, tick);
-  }
-
-  /* How much do we adjust the cell count in cell_ewma by? */
+  /* How much do we adjust the cell count in cell_ewma by?  Cells sent now
+   * weigh more the further we are past the queue's base tick. */
+  fractional_tick +=
+    (int)(tick - pol->active_circuit_pqueue_last_recalibrated);
   ewma_increment =
     ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
 
@@ -422,11 +469,11 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * the queue.  Its count only went up, so move it down from there.
    */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  tor_assert(first_cell_ewma(pol) == cell_ewma);
+  pol->active_circuit_pqueue[0].cell_count = cell_ewma->cell_count;
+  ewma_heap_sift_down(pol, 0, pol->active_circuit_pqueue[0]);
 }
 
 /**
@@ -448,9 +495,9 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
-    /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+  /* Get the head of the queue */
+  cell_ewma = first_cell_ewma(pol);
+  if (cell_ewma) {
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -479,18 +526,27 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 
   if (p1 != p2) {
     /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
-    }
-
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
-    }
+    ce1 = first_cell_ewma(p1);
+    ce2 = first_cell_ewma(p2);
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
-      /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      double count2;
+      unsigned cur_tick = cell_ewma_get_tick();
+      /* Make sure both queues use the current scale factor... */
+      rebase_active_circuits_if_needed(p1, cur_tick);
+      rebase_active_circuits_if_needed(p2, cur_tick);
+      /* ...then pick whichever one has the better best circuit, after
+       * putting both counts on the same base tick */
+      count2 = ce2->cell_count *
+        get_scale_factor(p2->active_circuit_pqueue_last_recalibrated,
+                         p1->active_circuit_pqueue_last_recalibrated);
+      if (ce1->cell_count < count2)
+        return -1;
+      else if (ce1->cell_count > count2)
+        return 1;
+      else
+        return 0;
     } else {
       if (ce1 != NULL ) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -509,20 +565,6 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   }
 }
 
-/** Helper for sorting cell_ewma_t values in their priority queue. */
-static int
-compare_cell_ewma_counts(const void *p1, const void *p2)
-{
-  const cell_ewma_t *e1 = p1, *e2 = p2;
-
-  if (e1->cell_count < e2->cell_count)
-    return -1;
-  else if (e1->cell_count > e2->cell_count)
-    return 1;
-  else
-    return 0;
-}
-
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -565,6 +607,12 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    worth F^N, and a cell sent N seconds after the start of the current tick is
    worth F^-N.  This way we don't overflow, and we don't need to constantly
    rescale.
+
+   Since multiplying every count in a priority queue by the same factor
+   doesn't change their order, each circuitmux doesn't even need to rescale
+   when the tick changes.  Its counts stay relative to the tick in which it
+   last rescaled, and we only rescale them all once F^-N gets large enough
+   to threaten the precision of a double.
  */
 
 /** Given a timeval <b>now</b>, compute the cell_ewma tick in which it occurs
@@ -664,30 +712,119 @@ scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
 }
 
 /** Adjust the cell count of every active circuit on <b>chan</b> so
- * that they are scaled with respect to <b>cur_tick</b> */
+ * that they are scaled with respect to <b>cur_tick</b>, using the scale
+ * factor that the counts were computed with; from then on, use the
+ * current scale factor. */
 static void
 scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 {
   double factor;
+  int i;
 
   tor_assert(pol);
   tor_assert(pol->active_circuit_pqueue);
 
-  factor =
-    get_scale_factor(
-      pol->active_circuit_pqueue_last_recalibrated,
-      cur_tick);
+  factor = pow(pol->active_circuit_pqueue_scale_factor,
+               (int)(cur_tick - pol->active_circuit_pqueue_last_recalibrated));
   /** Ordinarily it isn't okay to change the value of an element in a heap,
    * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
+  for (i = 0; i < pol->n_active_circuits; ++i) {
+    ewma_heap_entry_t *ent = &pol->active_circuit_pqueue[i];
+    cell_ewma_t *e = ent->ewma;
     tor_assert(e->last_adjusted_tick ==
                pol->active_circuit_pqueue_last_recalibrated);
     e->cell_count *= factor;
     e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
+    ent->cell_count = e->cell_count;
+  }
   pol->active_circuit_pqueue_last_recalibrated = cur_tick;
+  pol->active_circuit_pqueue_scale_factor = ewma_scale_factor;
+}
+
+/** If the counts in <b>pol</b>'s priority queue have drifted too far from
+ * <b>cur_tick</b>, or were computed with a scale factor other than the
+ * current one, rescale them all so that they are relative to
+ * <b>cur_tick</b>.  This is the only time we need to touch every active
+ * circuit; for an empty queue, it's free. */
+static void
+rebase_active_circuits_if_needed(ewma_policy_data_t *pol, unsigned cur_tick)
+{
+  tor_assert(pol);
+  tor_assert(pol->active_circuit_pqueue);
+
+  if (pol->n_active_circuits == 0) {
+    pol->active_circuit_pqueue_last_recalibrated = cur_tick;
+    pol->active_circuit_pqueue_scale_factor = ewma_scale_factor;
+  } else if (pol->active_circuit_pqueue_scale_factor != ewma_scale_factor ||
+             get_scale_factor(pol->active_circuit_pqueue_last_recalibrated,
+                              cur_tick) < EWMA_MIN_REBASE_FACTOR) {
+    scale_active_circuits(pol, cur_tick);
+  }
+}
+
+/** Return the cell_ewma_t at the head of <b>pol</b>'s priority queue of
+ * active circuits, or NULL if there are none. */
+static INLINE cell_ewma_t *
+first_cell_ewma(ewma_policy_data_t *pol)
+{
+  if (pol->n_active_circuits == 0)
+    return NULL;
+  return pol->active_circuit_pqueue[0].ewma;
+}
+
+/** Helper: store <b>entry</b> in the hole at <b>idx</b> in <b>pol</b>'s
+ * priority queue, moving it toward the head until its parent is no
+ * larger. */
+static void
+ewma_heap_sift_up(ewma_policy_data_t *pol, int idx, ewma_heap_entry_t entry)
+{
+  ewma_heap_entry_t *heap = pol->active_circuit_pqueue;
+
+  while (idx > 0) {
+    int parent = (idx - 1) / EWMA_HEAP_ARITY;
+    if (heap[parent].cell_count <= entry.cell_count)
+      break;
+    heap[idx] = heap[parent];
+    heap[idx].ewma->heap_index = idx;
+    idx = parent;
+  }
+
+  heap[idx] = entry;
+  entry.ewma->heap_index = idx;
+}
+
+/** Helper: store <b>entry</b> in the hole at <b>idx</b> in <b>pol</b>'s
+ * priority queue, moving it away from the head until none of its children
+ * is smaller. */
+static void
+ewma_heap_sift_down(ewma_policy_data_t *pol, int idx,
+                    ewma_heap_entry_t entry)
+{
+  ewma_heap_entry_t *heap = pol->active_circuit_pqueue;
+  const int n = pol->n_active_circuits;
+
+  while (1) {
+    int first = EWMA_HEAP_ARITY * idx + 1;
+    int last, best, i;
+
+    if (first >= n)
+      break;
+    last = MIN(first + EWMA_HEAP_ARITY, n);
+    best = first;
+    for (i = first + 1; i < last; ++i) {
+      if (heap[i].cell_count < heap[best].cell_count)
+        best = i;
+    }
+
+    if (entry.cell_count <= heap[best].cell_count)
+      break;
+    heap[idx] = heap[best];
+    heap[idx].ewma->heap_index = idx;
+    idx = best;
+  }
+
+  heap[idx] = entry;
+  entry.ewma->heap_index = idx;
 }
 
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
@@ -695,46 +832,59 @@ scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_heap_entry_t entry;
+
   tor_assert(pol);
   tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
+  rebase_active_circuits_if_needed(pol, cell_ewma_get_tick());
   scale_single_cell_ewma(
       ewma,
       pol->active_circuit_pqueue_last_recalibrated);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       STRUCT_OFFSET(cell_ewma_t, heap_index),
-                       ewma);
+  if (pol->n_active_circuits == pol->active_circuit_pqueue_capacity) {
+    pol->active_circuit_pqueue_capacity *= 2;
+    pol->active_circuit_pqueue =
+      tor_reallocarray(pol->active_circuit_pqueue,
+                       pol->active_circuit_pqueue_capacity,
+                       sizeof(ewma_heap_entry_t));
+  }
+
+  entry.cell_count = ewma->cell_count;
+  entry.ewma = ewma;
+  ewma_heap_sift_up(pol, pol->n_active_circuits++, entry);
 }
 
 /** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  ewma_heap_entry_t last;
+  int idx;
+
   tor_assert(pol);
   tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          STRUCT_OFFSET(cell_ewma_t, heap_index),
-                          ewma);
-}
-
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
-{
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
-
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              STRUCT_OFFSET(cell_ewma_t, heap_index));
+  idx = ewma->heap_index;
+  tor_assert(idx < pol->n_active_circuits);
+  tor_assert(pol->active_circuit_pqueue[idx].ewma == ewma);
+
+  ewma->heap_index = -1;
+  last = pol->active_circuit_pqueue[--pol->n_active_circuits];
+  if (idx == pol->n_active_circuits)
+    return;
+
+  /* Fill the hole with the last entry, which may belong either above or
+   * below it. */
+  if (idx > 0 &&
+      last.cell_count <
+      pol->active_circuit_pqueue[(idx - 1) / EWMA_HEAP_ARITY].cell_count)
+    ewma_heap_sift_up(pol, idx, last);
+  else
+    ewma_heap_sift_down(pol, idx, last);
 }
 
@@ -289,7 +289,7 @@ circuit_build_times_test_frequency(void)
  * The minimum is to prevent rounding to 0 (we only check once
  * per second).
  */
-static int32_t
+int32_t
 circuit_build_times_min_timeout(void)
 {
   int32_t num = networkstatus_get_param(NULL, "cbtmintimeout",
@@ -16,6 +16,7 @@ const circuit_build_times_t *get_circuit_build_times(void);
 circuit_build_times_t *get_circuit_build_times_mutable(void);
 double get_circuit_build_close_time_ms(void);
 double get_circuit_build_timeout_ms(void);
+int32_t circuit_build_times_min_timeout(void);
 
 int circuit_build_times_disabled(void);
 int circuit_build_times_enough_to_compute(const circuit_build_times_t *cbt);
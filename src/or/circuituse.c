@@ -1349,34 +1349,91 @@ circuit_expire_old_circuits_clientside(void)
  */
 #define IDLE_ONE_HOP_CIRC_TIMEOUT 60
 
-/** Find each non-origin circuit that has been unused for too long,
- * has no streams on it, used a create_fast, and ends here: mark it
- * for close.
+/** Timer wheel of first-hop OR circuits, each scheduled for the next second
+ * at which circuit_expire_old_circuits_serverside() might close it. */
+static timewheel_t *first_hop_circ_wheel = NULL;
+
+/** Schedule the next idleness check for <b>or_circ</b>, a circuit that was
+ * made with a CREATE_FAST cell.  If it could be closed right now except
+ * that its channel has sent something recently, check again once the
+ * channel could have been quiet for IDLE_ONE_HOP_CIRC_TIMEOUT seconds.
+ * If it has streams or another hop, check again IDLE_ONE_HOP_CIRC_TIMEOUT
+ * seconds from <b>now</b>. */
+void
+circuit_schedule_serverside_expiry(or_circuit_t *or_circ, time_t now)
+{
+  const circuit_t *circ = TO_CIRCUIT(or_circ);
+  time_t when = now + IDLE_ONE_HOP_CIRC_TIMEOUT;
+
+  if (circ->marked_for_close || !or_circ->is_first_hop)
+    return;
+
+  if (!circ->n_chan && !or_circ->n_streams && !or_circ->resolving_streams &&
+      or_circ->p_chan) {
+    when = channel_when_last_xmit(or_circ->p_chan) +
+      IDLE_ONE_HOP_CIRC_TIMEOUT;
+    if (when <= now)
+      when = now + 1;
+  }
+
+  if (!first_hop_circ_wheel)
+    first_hop_circ_wheel = timewheel_new(now);
+  timewheel_schedule(first_hop_circ_wheel, &or_circ->idle_timer, when);
+}
+
+/** Stop checking <b>or_circ</b> for idleness; it's about to be freed. */
+void
+circuit_cancel_serverside_expiry(or_circuit_t *or_circ)
+{
+  if (first_hop_circ_wheel)
+    timewheel_cancel(first_hop_circ_wheel, &or_circ->idle_timer);
+}
+
+/** Timer wheel callback: if the first-hop circuit whose timer is
+ * <b>ent</b> has been unused for too long, has no streams on it, and ends
+ * here, mark it for close.  Otherwise, schedule its next check. */
+static void
+circuit_serverside_expiry_cb(timewheel_entry_t *ent, time_t now, void *arg)
+{
+  or_circuit_t *or_circ = SUBTYPE_P(ent, or_circuit_t, idle_timer);
+  circuit_t *circ = TO_CIRCUIT(or_circ);
+  (void)arg;
+
+  if (circ->marked_for_close)
+    return;
+
+  if (!circ->n_chan &&
+      !or_circ->n_streams && !or_circ->resolving_streams &&
+      or_circ->p_chan &&
+      channel_when_last_xmit(or_circ->p_chan) <=
+        now - IDLE_ONE_HOP_CIRC_TIMEOUT) {
+    log_info(LD_CIRC, "Closing circ_id %u (empty %d secs ago)",
+             (unsigned)or_circ->p_circ_id,
+             (int)(now - channel_when_last_xmit(or_circ->p_chan)));
+    circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
+    return;
+  }
+
+  circuit_schedule_serverside_expiry(or_circ, now);
+}
+
+/** Mark for close each first-hop circuit whose idleness check is due, and
+ * which has been unused for too long, has no streams on it, and ends here.
  */
 void
 circuit_expire_old_circuits_serverside(time_t now)
 {
-  or_circuit_t *or_circ;
-  time_t cutoff = now - IDLE_ONE_HOP_CIRC_TIMEOUT;
+  if (first_hop_circ_wheel)
+    timewheel_advance(first_hop_circ_wheel, now,
+                      circuit_serverside_expiry_cb, NULL);
+}
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close || CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    or_circ = TO_OR_CIRCUIT(circ);
-    /* If the circuit has been idle for too long, and there are no streams
-     * on it, and it ends here, and it used a create_fast, mark it for close.
-     */
-    if (or_circ->is_first_hop && !circ->n_chan &&
-        !or_circ->n_streams && !or_circ->resolving_streams &&
-        or_circ->p_chan &&
-        channel_when_last_xmit(or_circ->p_chan) <= cutoff) {
-      log_info(LD_CIRC, "Closing circ_id %u (empty %d secs ago)",
-               (unsigned)or_circ->p_circ_id,
-               (int)(now - channel_when_last_xmit(or_circ->p_chan)));
-      circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
-    }
-  }
-  SMARTLIST_FOREACH_END(circ);
+/** Release the storage used to schedule circuit idleness checks. */
+void
+circuit_free_serverside_expiry(void)
+{
+  timewheel_free(first_hop_circ_wheel);
+  first_hop_circ_wheel = NULL;
 }
 
 /** Number of testing circuits we want open before testing our bandwidth. */
@@ -1590,7 +1647,7 @@ circuit_build_failed(origin_circuit_t *circ)
                "Our circuit failed to get a response from the first hop "
                "(%s). I'm going to try to rotate to a better connection.",
                channel_get_canonical_remote_descr(n_chan));
-      n_chan->is_bad_for_new_circs = 1;
+      channel_mark_bad_for_new_circs(n_chan);
     } else {
       log_info(LD_OR,
                "Our circuit died before the first hop with no connection");
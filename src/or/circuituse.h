@@ -25,7 +25,10 @@ void circuit_build_needed_circs(time_t now);
 void circuit_expire_old_circs_as_needed(time_t now);
 void circuit_detach_stream(circuit_t *circ, edge_connection_t *conn);
 
+void circuit_schedule_serverside_expiry(or_circuit_t *or_circ, time_t now);
+void circuit_cancel_serverside_expiry(or_circuit_t *or_circ);
 void circuit_expire_old_circuits_serverside(time_t now);
+void circuit_free_serverside_expiry(void);
 
 void reset_bandwidth_test(void);
 int circuit_enough_testing_circs(void);
@@ -154,6 +154,25 @@ MOCK_DECL(STATIC void, add_default_fallback_dir_servers, (void));
 STATIC int
 parse_dir_fallback_line(const char *line,
                         int validate_only);
+
+#define CL_PORT_NO_STREAM_OPTIONS (1u<<0)
+#define CL_PORT_WARN_NONLOCAL (1u<<1)
+#define CL_PORT_ALLOW_EXTRA_LISTENADDR (1u<<2)
+#define CL_PORT_SERVER_OPTIONS (1u<<3)
+#define CL_PORT_FORBID_NONLOCAL (1u<<4)
+#define CL_PORT_TAKES_HOSTNAMES (1u<<5)
+#define CL_PORT_IS_UNIXSOCKET (1u<<6)
+#define CL_PORT_DFLT_GROUP_WRITABLE (1u<<7)
+
+STATIC void port_cfg_free(port_cfg_t *port);
+STATIC int parse_port_config(smartlist_t *out,
+                             const config_line_t *ports,
+                             const config_line_t *listenaddrs,
+                             const char *portname,
+                             int listener_type,
+                             const char *defaultaddr,
+                             int defaultport,
+                             const unsigned flags);
 #endif
 
 #endif
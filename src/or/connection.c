@@ -103,6 +103,11 @@ static tor_addr_t *last_interface_ipv6 = NULL;
  * Used to detect IP address changes. */
 static smartlist_t *outgoing_addrs = NULL;
 
+/** List of every connection with read_blocked_on_bw or write_blocked_on_bw
+ * set, so that a refill only has to look at connections that are waiting
+ * for tokens. */
+static smartlist_t *conns_blocked_on_bw = NULL;
+
 #define CASE_ANY_LISTENER_TYPE \
     case CONN_TYPE_OR_LISTENER: \
     case CONN_TYPE_EXT_OR_LISTENER: \
@@ -543,6 +548,10 @@ connection_free_(connection_t *conn)
 
   tor_free(conn->address);
 
+  if ((conn->read_blocked_on_bw || conn->write_blocked_on_bw) &&
+      conns_blocked_on_bw)
+    smartlist_remove(conns_blocked_on_bw, conn);
+
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
     tor_tls_free(or_conn->tls);
@@ -1051,6 +1060,23 @@ make_socket_reuseable(tor_socket_t sock)
 #endif
 }
 
+#ifdef SO_REUSEPORT
+/** Let other sockets bind the same address and port as <b>sock</b>, so
+ * that several processes can share a listener and have the kernel balance
+ * incoming connections among them.  Return 0 on success, -1 on failure. */
+static int
+make_socket_port_shareable(tor_socket_t sock)
+{
+  int one=1;
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void*) &one,
+                 (socklen_t)sizeof(one)) == -1) {
+    return -1;
+  }
+  return 0;
+}
+#endif
+
 /** Max backlog to pass to listen.  We start at */
 static int listen_limit = INT_MAX;
 
@@ -1128,6 +1154,19 @@ connection_listener_new(const struct sockaddr *listensockaddr,
                tor_socket_strerror(errno));
     }
 
+    if (port_cfg->reuse_port) {
+#ifdef SO_REUSEPORT
+      if (make_socket_port_shareable(s) < 0) {
+        log_warn(LD_NET, "Error setting SO_REUSEPORT flag on %s: %s",
+                 conn_type_to_string(type),
+                 tor_socket_strerror(errno));
+      }
+#else
+      log_warn(LD_NET, "ReusePort is not supported on this platform; "
+               "opening %s without it.", conn_type_to_string(type));
+#endif
+    }
+
 #if defined USE_TRANSPARENT && defined(IP_TRANSPARENT)
     if (options->TransProxyType_parsed == TPT_TPROXY &&
         type == CONN_TYPE_AP_TRANS_LISTENER) {
@@ -1415,11 +1454,13 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
   return 0;
 }
 
-/** The listener connection <b>conn</b> told poll() it wanted to read.
- * Call accept() on conn-\>s, and add the new connection if necessary.
+/** Call accept() once on the listener connection <b>conn</b>, and add the
+ * new connection if necessary.  Return 1 if we took a socket off the accept
+ * queue (whether or not we kept it), 0 if there was nothing more to accept
+ * for now, and -1 if we had to close the listener.
  */
 static int
-connection_handle_listener_read(connection_t *conn, int new_type)
+connection_handle_listener_accept_one(connection_t *conn, int new_type)
 {
   tor_socket_t news; /* the new socket */
   connection_t *newconn = 0;
@@ -1462,7 +1503,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                tor_socket_strerror(errno));
     }
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (options->ConstrainedSockets)
@@ -1470,7 +1511,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (check_sockaddr_family_match(remote->sa_family, conn) < 0) {
     tor_close_socket(news);
-    return 0;
+    return 1;
   }
 
   if (conn->socket_family == AF_INET || conn->socket_family == AF_INET6 ||
@@ -1481,7 +1522,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       log_info(LD_NET,
                "accept() returned a strange address; closing connection.");
       tor_close_socket(news);
-      return 0;
+      return 1;
     }
 
     tor_addr_from_sockaddr(&addr, remote, &port);
@@ -1494,7 +1535,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
                    "Denying socks connection from untrusted address %s.",
                    fmt_and_decorate_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
     if (new_type == CONN_TYPE_DIR) {
@@ -1503,7 +1544,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
         log_notice(LD_DIRSERV,"Denying dir connection from address %s.",
                    fmt_and_decorate_addr(&addr));
         tor_close_socket(news);
-        return 0;
+        return 1;
       }
     }
 
@@ -1547,13 +1588,38 @@ connection_handle_listener_read(connection_t *conn, int new_type)
 
   if (connection_add(newconn) < 0) { /* no space, forget it */
     connection_free(newconn);
-    return 0; /* no need to tear down the parent */
+    return 0; /* no need to tear down the parent, but stop accepting */
   }
 
   if (connection_init_accepted_conn(newconn, TO_LISTENER_CONN(conn)) < 0) {
     if (! newconn->marked_for_close)
       connection_mark_for_close(newconn);
-    return 0;
+    return 1;
+  }
+  return 1;
+}
+
+/** Most connections we'll accept from one listener in a single call to
+ * connection_handle_listener_read(), so that a flood of new connections
+ * can't keep us from servicing the ones we already have. */
+#define MAX_ACCEPTS_PER_LISTENER_READ 64
+
+/** The listener connection <b>conn</b> told poll() it wanted to read.
+ * Accept connections from conn-\>s until its queue is empty, or until we
+ * have accepted MAX_ACCEPTS_PER_LISTENER_READ of them, and add the new
+ * connections as necessary.
+ */
+static int
+connection_handle_listener_read(connection_t *conn, int new_type)
+{
+  int i, r;
+
+  for (i = 0; i < MAX_ACCEPTS_PER_LISTENER_READ; ++i) {
+    r = connection_handle_listener_accept_one(conn, new_type);
+    if (r < 0)
+      return -1;
+    if (r == 0)
+      break;
   }
   return 0;
 }
@@ -2559,6 +2625,16 @@ extern int global_relayed_read_bucket, global_relayed_write_bucket;
  * we are likely to run dry again this second, so be stingy with the
  * tokens we just put in. */
 static int write_buckets_empty_last_second = 0;
+
+/** Thousandths of a byte owed to each global bucket from earlier refills
+ * that didn't add up to a whole byte. */
+static int global_read_carry = 0, global_write_carry = 0,
+           global_relayed_read_carry = 0, global_relayed_write_carry = 0;
+
+/** How many connections did we wake up for reading or writing at the last
+ * refill?  They are all about to compete for the fresh tokens, so we use
+ * these to give each of them a fair share. */
+static int n_conns_woken_for_read = 0, n_conns_woken_for_write = 0;
 #endif
 
 /** How many seconds of no active local circuits will make the
@@ -2585,10 +2661,12 @@ connection_counts_as_relayed_traffic(connection_t *conn, time_t now)
 /** Helper function to decide how many bytes out of <b>global_bucket</b>
  * we're willing to use for this transaction. <b>base</b> is the size
  * of a cell on the network; <b>priority</b> says whether we should
- * write many of them or just a few; and <b>conn_bucket</b> (if
- * non-negative) provides an upper limit for our answer. */
+ * write many of them or just a few; <b>n_contenders</b> is how many
+ * connections we just woke up to compete for the bucket; and
+ * <b>conn_bucket</b> (if non-negative) provides an upper limit for our
+ * answer. */
 static ssize_t
-connection_bucket_round_robin(int base, int priority,
+connection_bucket_round_robin(int base, int priority, int n_contenders,
                               ssize_t global_bucket, ssize_t conn_bucket)
 {
   ssize_t at_most;
@@ -2597,8 +2675,10 @@ connection_bucket_round_robin(int base, int priority,
 
   /* Do a rudimentary round-robin so one circuit can't hog a connection.
    * Pick at most 32 cells, at least 4 cells if possible, and if we're in
-   * the middle pick 1/8 of the available bandwidth. */
-  at_most = global_bucket / 8;
+   * the middle pick 1/8 of the available bandwidth -- or less, if more
+   * than 8 connections were waiting for this refill, so that the first
+   * ones to run don't starve the rest. */
+  at_most = global_bucket / (n_contenders > 8 ? n_contenders : 8);
   at_most -= (at_most % base); /* round down */
   if (at_most > num_bytes_high) /* 16 KB, or 8 KB for low-priority */
     at_most = num_bytes_high;
@@ -2627,8 +2707,12 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      struct timeval tvnow;
+      tor_gettimeofday_cached(&tvnow);
+      connection_or_bucket_refill(or_conn, &tvnow);
       conn_bucket = or_conn->read_bucket;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
@@ -2642,6 +2726,7 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
     global_bucket = global_relayed_read_bucket;
 
   return connection_bucket_round_robin(base, priority,
+                                       n_conns_woken_for_read,
                                        global_bucket, conn_bucket);
 }
 
@@ -2663,10 +2748,14 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      struct timeval tvnow;
+      tor_gettimeofday_cached(&tvnow);
+      connection_or_bucket_refill(or_conn, &tvnow);
       if (or_conn->write_bucket < conn_bucket)
         conn_bucket = or_conn->write_bucket >= 0 ?
                         or_conn->write_bucket : 0;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
@@ -2675,6 +2764,7 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     global_bucket = global_relayed_write_bucket;
 
   return connection_bucket_round_robin(base, priority,
+                                       n_conns_woken_for_write,
                                        global_bucket, conn_bucket);
 }
 #else
@@ -2847,6 +2937,42 @@ connection_buckets_note_empty_ts(uint32_t *timestamp_var,
     *timestamp_var = msec_since_midnight(tvnow);
 }
 
+/** Helper: remember that <b>conn</b> is blocked on bandwidth, if it wasn't
+ * already, so that the next refill can wake it up. */
+static void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+#ifndef USE_BUFFEREVENTS
+  if (conn->read_blocked_on_bw || conn->write_blocked_on_bw)
+    return; /* Already listed. */
+  if (!conns_blocked_on_bw)
+    conns_blocked_on_bw = smartlist_new();
+  smartlist_add(conns_blocked_on_bw, conn);
+#else
+  (void)conn;
+#endif
+}
+
+/** Stop reading on <b>conn</b> until the token buckets let us read again.
+ */
+void
+connection_read_bw_exhausted(connection_t *conn)
+{
+  connection_note_blocked_on_bw(conn);
+  conn->read_blocked_on_bw = 1;
+  connection_stop_reading(conn);
+}
+
+/** Stop writing on <b>conn</b> until the token buckets let us write again.
+ */
+void
+connection_write_bw_exhausted(connection_t *conn)
+{
+  connection_note_blocked_on_bw(conn);
+  conn->write_blocked_on_bw = 1;
+  connection_stop_writing(conn);
+}
+
 #ifndef USE_BUFFEREVENTS
 /** Last time at which the global or relay buckets were emptied in msec
  * since midnight. */
@@ -2936,8 +3062,7 @@ connection_consider_empty_read_buckets(connection_t *conn)
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
-  conn->read_blocked_on_bw = 1;
-  connection_stop_reading(conn);
+  connection_read_bw_exhausted(conn);
 }
 
 /** If we have exhausted our global buckets, or the buckets for conn,
@@ -2963,8 +3088,7 @@ connection_consider_empty_write_buckets(connection_t *conn)
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
-  conn->write_blocked_on_bw = 1;
-  connection_stop_writing(conn);
+  connection_write_bw_exhausted(conn);
 }
 
 /** Initialize the global read bucket to options-\>BandwidthBurst. */
@@ -2987,18 +3111,26 @@ connection_bucket_init(void)
 /** Refill a single <b>bucket</b> called <b>name</b> with bandwidth rate per
  * second <b>rate</b> and bandwidth burst <b>burst</b>, assuming that
  * <b>milliseconds_elapsed</b> milliseconds have passed since the last
- * call. */
+ * call.  <b>carry</b> holds the thousandths of a byte left over from
+ * earlier calls, so that short intervals and low rates don't round the
+ * rate down. */
 static void
-connection_bucket_refill_helper(int *bucket, int rate, int burst,
+connection_bucket_refill_helper(int *bucket, int *carry, int rate, int burst,
                                 int milliseconds_elapsed,
                                 const char *name)
 {
   int starting_bucket = *bucket;
-  if (starting_bucket < burst && milliseconds_elapsed > 0) {
-    int64_t incr = (((int64_t)rate) * milliseconds_elapsed) / 1000;
-    if ((burst - starting_bucket) < incr) {
+  if (starting_bucket >= burst) {
+    *carry = 0; /* Nothing owed to a full bucket. */
+  } else if (milliseconds_elapsed > 0) {
+    int64_t incr_thousandths =
+      ((int64_t)rate) * milliseconds_elapsed + *carry;
+    int64_t incr = incr_thousandths / 1000;
+    *carry = (int)(incr_thousandths % 1000);
+    if ((burst - starting_bucket) <= incr) {
       *bucket = burst;  /* We would overflow the bucket; just set it to
                          * the maximum. */
+      *carry = 0;
     } else {
       *bucket += (int)incr;
       if (*bucket > burst || *bucket < starting_bucket) {
@@ -3013,19 +3145,21 @@ connection_bucket_refill_helper(int *bucket, int rate, int burst,
   }
 }
 
-/** Time has passed; increment buckets appropriately. */
+/** Time has passed; increment the global buckets appropriately, and wake up
+ * any connections that were waiting for them.  <b>tvnow</b> is the current
+ * time; it is also used to catch up the per-connection buckets of the
+ * connections we consider waking. */
 void
-connection_bucket_refill(int milliseconds_elapsed, time_t now)
+connection_bucket_refill(int milliseconds_elapsed, const struct timeval *tvnow)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
+  const time_t now = tvnow->tv_sec;
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
 
   int prev_global_read = global_read_bucket;
   int prev_global_write = global_write_bucket;
   int prev_relay_read = global_relayed_read_bucket;
   int prev_relay_write = global_relayed_write_bucket;
-  struct timeval tvnow; /*< Only used if TB_EMPTY events are enabled. */
 
   bandwidthrate = (int)options->BandwidthRate;
   bandwidthburst = (int)options->BandwidthBurst;
@@ -3044,19 +3178,21 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
     global_relayed_write_bucket <= 0 || global_write_bucket <= 0;
 
   /* refill the global buckets */
-  connection_bucket_refill_helper(&global_read_bucket,
+  connection_bucket_refill_helper(&global_read_bucket, &global_read_carry,
                                   bandwidthrate, bandwidthburst,
                                   milliseconds_elapsed,
                                   "global_read_bucket");
-  connection_bucket_refill_helper(&global_write_bucket,
+  connection_bucket_refill_helper(&global_write_bucket, &global_write_carry,
                                   bandwidthrate, bandwidthburst,
                                   milliseconds_elapsed,
                                   "global_write_bucket");
   connection_bucket_refill_helper(&global_relayed_read_bucket,
+                                  &global_relayed_read_carry,
                                   relayrate, relayburst,
                                   milliseconds_elapsed,
                                   "global_relayed_read_bucket");
   connection_bucket_refill_helper(&global_relayed_write_bucket,
+                                  &global_relayed_write_carry,
                                   relayrate, relayburst,
                                   milliseconds_elapsed,
                                   "global_relayed_write_bucket");
@@ -3066,73 +3202,35 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
   if (get_options()->TestingEnableTbEmptyEvent) {
     uint32_t global_read_empty_time, global_write_empty_time,
              relay_read_empty_time, relay_write_empty_time;
-    tor_gettimeofday_cached(&tvnow);
     global_read_empty_time = bucket_millis_empty(prev_global_read,
                              global_read_emptied, global_read_bucket,
-                             milliseconds_elapsed, &tvnow);
+                             milliseconds_elapsed, tvnow);
     global_write_empty_time = bucket_millis_empty(prev_global_write,
                               global_write_emptied, global_write_bucket,
-                              milliseconds_elapsed, &tvnow);
+                              milliseconds_elapsed, tvnow);
     control_event_tb_empty("GLOBAL", global_read_empty_time,
                            global_write_empty_time, milliseconds_elapsed);
     relay_read_empty_time = bucket_millis_empty(prev_relay_read,
                             global_relayed_read_emptied,
                             global_relayed_read_bucket,
-                            milliseconds_elapsed, &tvnow);
+                            milliseconds_elapsed, tvnow);
     relay_write_empty_time = bucket_millis_empty(prev_relay_write,
                              global_relayed_write_emptied,
                              global_relayed_write_bucket,
-                             milliseconds_elapsed, &tvnow);
+                             milliseconds_elapsed, tvnow);
     control_event_tb_empty("RELAY", relay_read_empty_time,
                            relay_write_empty_time, milliseconds_elapsed);
   }
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-
-      int prev_conn_read = or_conn->read_bucket;
-      int prev_conn_write = or_conn->write_bucket;
-
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
-      }
-
-      /* If buckets were empty before and have now been refilled, tell any
-       * interested controllers. */
-      if (get_options()->TestingEnableTbEmptyEvent) {
-        char *bucket;
-        uint32_t conn_read_empty_time, conn_write_empty_time;
-        tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
-                     U64_PRINTF_ARG(or_conn->base_.global_identifier));
-        conn_read_empty_time = bucket_millis_empty(prev_conn_read,
-                               or_conn->read_emptied_time,
-                               or_conn->read_bucket,
-                               milliseconds_elapsed, &tvnow);
-        conn_write_empty_time = bucket_millis_empty(prev_conn_write,
-                                or_conn->write_emptied_time,
-                                or_conn->write_bucket,
-                                milliseconds_elapsed, &tvnow);
-        control_event_tb_empty(bucket, conn_read_empty_time,
-                               conn_write_empty_time,
-                               milliseconds_elapsed);
-        tor_free(bucket);
-      }
-    }
+  /* Wake up the connections that were waiting for tokens.  Per-connection
+   * buckets aren't refilled here: each one catches up the next time its
+   * connection asks for tokens. */
+  n_conns_woken_for_read = n_conns_woken_for_write = 0;
+  if (!conns_blocked_on_bw)
+    return;
+  SMARTLIST_FOREACH_BEGIN(conns_blocked_on_bw, connection_t *, conn) {
+    if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN)
+      connection_or_bucket_refill(TO_OR_CONN(conn), tvnow);
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
         && global_read_bucket > 0 /* and we're allowed to read */
@@ -3145,6 +3243,7 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
                          "waking up conn (fd %d) for read", (int)conn->s));
       conn->read_blocked_on_bw = 0;
+      ++n_conns_woken_for_read;
       connection_start_reading(conn);
     }
 
@@ -3158,11 +3257,84 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
                          "waking up conn (fd %d) for write", (int)conn->s));
       conn->write_blocked_on_bw = 0;
+      ++n_conns_woken_for_write;
       connection_start_writing(conn);
     }
+
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw)
+      SMARTLIST_DEL_CURRENT(conns_blocked_on_bw, conn);
   } SMARTLIST_FOREACH_END(conn);
 }
 
+/** Add the tokens that <b>or_conn</b>'s buckets have earned between the
+ * last time we refilled them and <b>tvnow</b>.  Called whenever we need to
+ * know how full they are, so that per-connection limits are as precise as
+ * the clock. */
+STATIC void
+connection_or_bucket_refill(or_connection_t *or_conn,
+                            const struct timeval *tvnow)
+{
+  uint64_t now_msec;
+  int milliseconds_elapsed;
+  int prev_conn_read = or_conn->read_bucket;
+  int prev_conn_write = or_conn->write_bucket;
+
+  now_msec = ((uint64_t)tvnow->tv_sec) * 1000 + tvnow->tv_usec / 1000;
+
+  if (or_conn->buckets_last_refilled_msec == 0 ||
+      now_msec < or_conn->buckets_last_refilled_msec) {
+    /* First time, or the clock went backwards: start counting from now. */
+    or_conn->buckets_last_refilled_msec = now_msec;
+    return;
+  }
+  if (now_msec - or_conn->buckets_last_refilled_msec > INT_MAX)
+    milliseconds_elapsed = INT_MAX;
+  else
+    milliseconds_elapsed =
+      (int)(now_msec - or_conn->buckets_last_refilled_msec);
+  if (milliseconds_elapsed == 0)
+    return;
+  or_conn->buckets_last_refilled_msec = now_msec;
+
+  if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->read_bucket,
+                                    &or_conn->read_bucket_carry,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->read_bucket");
+  }
+  if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->write_bucket,
+                                    &or_conn->write_bucket_carry,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->write_bucket");
+  }
+
+  /* If buckets were empty before and have now been refilled, tell any
+   * interested controllers. */
+  if (get_options()->TestingEnableTbEmptyEvent) {
+    char *bucket;
+    uint32_t conn_read_empty_time, conn_write_empty_time;
+    tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
+                 U64_PRINTF_ARG(or_conn->base_.global_identifier));
+    conn_read_empty_time = bucket_millis_empty(prev_conn_read,
+                           or_conn->read_emptied_time,
+                           or_conn->read_bucket,
+                           milliseconds_elapsed, tvnow);
+    conn_write_empty_time = bucket_millis_empty(prev_conn_write,
+                            or_conn->write_emptied_time,
+                            or_conn->write_bucket,
+                            milliseconds_elapsed, tvnow);
+    control_event_tb_empty(bucket, conn_read_empty_time,
+                           conn_write_empty_time,
+                           milliseconds_elapsed);
+    tor_free(bucket);
+  }
+}
+
 /** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
  * should add another pile of tokens to it?
  */
@@ -3191,10 +3363,10 @@ connection_buckets_decrement(connection_t *conn, time_t now,
 }
 
 void
-connection_bucket_refill(int seconds_elapsed, time_t now)
+connection_bucket_refill(int seconds_elapsed, const struct timeval *tvnow)
 {
   (void) seconds_elapsed;
-  (void) now;
+  (void) tvnow;
   /* Libevent does this for us. */
 }
 void
@@ -3974,8 +4146,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         /* Make sure to avoid a loop if the receive buckets are empty. */
         log_debug(LD_NET,"wanted read.");
         if (!connection_is_reading(conn)) {
-          connection_stop_writing(conn);
-          conn->write_blocked_on_bw = 1;
+          connection_write_bw_exhausted(conn);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -4146,6 +4317,11 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   if (conn->marked_for_close && !conn->hold_open_until_flushed)
     return;
 
+  /* Housekeeping only looks at OR connections now and then, so note here
+   * when the outbuf stops being empty. */
+  if (conn->type == CONN_TYPE_OR && !connection_get_outbuf_len(conn))
+    TO_OR_CONN(conn)->timestamp_lastempty = approx_time();
+
   IF_HAS_BUFFEREVENT(conn, {
     if (zlib) {
       int done = zlib < 0;
@@ -4209,6 +4385,45 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   }
 }
 
+/** Append <b>len</b> bytes of <b>string</b> to the outbuf of <b>conn</b>
+ * without copying them, as write_ref_to_buf() does: once the outbuf is done
+ * with <b>string</b>, it calls <b>release_fn</b>(<b>release_arg</b>).
+ * <b>release_fn</b> is called exactly once, even if we can't queue the
+ * data. */
+void
+connection_write_ref_to_buf(const char *string, size_t len,
+                            void (*release_fn)(void *), void *release_arg,
+                            connection_t *conn)
+{
+  int r;
+  if (!len || (conn->marked_for_close && !conn->hold_open_until_flushed)) {
+    release_fn(release_arg);
+    return;
+  }
+
+  IF_HAS_BUFFEREVENT(conn, {
+    /* Just copy: the release callback doesn't fit evbuffer_add_reference
+     * well enough to be worth it. */
+    connection_write_to_buf(string, len, conn);
+    release_fn(release_arg);
+    return;
+  });
+
+  CONN_LOG_PROTECT(conn, r = write_ref_to_buf(string, len,
+                                              release_fn, release_arg,
+                                              conn->outbuf));
+  if (r < 0) {
+    log_warn(LD_NET, "write_ref_to_buf failed. Closing connection (fd %d).",
+             (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+  if (conn->write_event) {
+    connection_start_writing(conn);
+  }
+  conn->outbuf_flushlen += len;
+}
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists. */
 connection_t *
@@ -4996,6 +5211,8 @@ connection_free_all(void)
   clear_broken_connection_map(0);
 
   SMARTLIST_FOREACH(conns, connection_t *, conn, connection_free_(conn));
+  smartlist_free(conns_blocked_on_bw);
+  conns_blocked_on_bw = NULL;
 
   if (outgoing_addrs) {
     SMARTLIST_FOREACH(outgoing_addrs, tor_addr_t *, addr, tor_free(addr));
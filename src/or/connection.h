@@ -121,7 +121,10 @@ void connection_mark_all_noncontrol_connections(void);
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
-void connection_bucket_refill(int seconds_elapsed, time_t now);
+void connection_read_bw_exhausted(connection_t *conn);
+void connection_write_bw_exhausted(connection_t *conn);
+void connection_bucket_refill(int seconds_elapsed,
+                              const struct timeval *tvnow);
 
 int connection_handle_read(connection_t *conn);
 
@@ -140,6 +143,9 @@ int connection_flush(connection_t *conn);
 
 MOCK_DECL(void, connection_write_to_buf_impl_,
           (const char *string, size_t len, connection_t *conn, int zlib));
+void connection_write_ref_to_buf(const char *string, size_t len,
+                                 void (*release_fn)(void *),
+                                 void *release_arg, connection_t *conn);
 /* DOCDOC connection_write_to_buf */
 static void connection_write_to_buf(const char *string, size_t len,
                                     connection_t *conn);
@@ -235,6 +241,10 @@ void connection_buckets_note_empty_ts(uint32_t *timestamp_var,
                                       int tokens_before,
                                       size_t tokens_removed,
                                       const struct timeval *tvnow);
+#ifndef USE_BUFFEREVENTS
+STATIC void connection_or_bucket_refill(or_connection_t *or_conn,
+                                        const struct timeval *tvnow);
+#endif
 #endif
 
 #endif
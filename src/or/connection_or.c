@@ -891,6 +891,7 @@ connection_or_set_canonical(or_connection_t *or_conn,
 
   or_conn->is_canonical = !! is_canonical; /* force to a 1-bit boolean */
   or_conn->idle_timeout = timeout_base + crypto_rand_int(timeout_base / 2);
+  connection_reschedule_housekeeping(TO_CONN(or_conn));
 }
 
 /** If we don't necessarily know the router we're connecting to, but we
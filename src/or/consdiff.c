@@ -0,0 +1,588 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Generate and apply diffs between consensus documents.
+ *
+ * A consensus diff is an ed-style script that turns one consensus (the
+ * "base") into another (the "target").  It looks like:
+ *
+ *   network-status-diff-version 1
+ *   hash [hex SHA256 of base] [hex SHA256 of target]
+ *   [commands]
+ *
+ * Each command names lines of the base document, numbered from 1:
+ * "N,Md" or "Nd" deletes lines; "N,Mc" or "Nc" replaces them with the
+ * lines that follow, up to a line holding only "."; and "Na" adds the lines
+ * that follow after line N.  Commands come in strictly decreasing order, so
+ * that every line number refers to the unmodified base.
+ *
+ * Computing a full longest-common-subsequence over two consensuses would be
+ * far too slow, so we use their structure instead: a header, a list of
+ * routerstatus entries sorted by identity, and a footer.  We pair up
+ * entries by identity, and only compare lines within the header, within
+ * the footer, and within each pair of entries for the same router.
+ **/
+
+#define CONSDIFF_PRIVATE
+#include "or.h"
+#include "consdiff.h"
+
+/** Largest number of (base line, target line) cells we are willing to
+ * allocate when comparing two sections.  Larger sections are treated as
+ * replaced wholesale, after their common prefix and suffix. */
+#define MAX_LCS_CELLS (1<<20)
+
+/** A growing list of pairs of matched lines, in increasing order. */
+typedef struct cdmatches_t {
+  int *base_idx;
+  int *target_idx;
+  int n;
+  int capacity;
+} cdmatches_t;
+
+/** Record that line <b>b</b> of the base matches line <b>t</b> of the
+ * target. */
+static void
+cdmatches_add(cdmatches_t *m, int b, int t)
+{
+  if (m->n == m->capacity) {
+    m->capacity = m->capacity ? m->capacity * 2 : 256;
+    m->base_idx = tor_reallocarray(m->base_idx, m->capacity, sizeof(int));
+    m->target_idx = tor_reallocarray(m->target_idx, m->capacity,
+                                     sizeof(int));
+  }
+  m->base_idx[m->n] = b;
+  m->target_idx[m->n] = t;
+  ++m->n;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> are the same line. */
+static INLINE int
+lines_eq(const cdline_t *a, const cdline_t *b)
+{
+  return a->len == b->len && fast_memeq(a->s, b->s, a->len);
+}
+
+/** Return true iff <b>line</b> begins with <b>prefix</b>. */
+static INLINE int
+line_starts_with(const cdline_t *line, const char *prefix)
+{
+  size_t n = strlen(prefix);
+  return line->len >= n && fast_memeq(line->s, prefix, n);
+}
+
+/** Split the <b>len</b>-byte document at <b>s</b> into lines.  Return a
+ * newly allocated array of lines pointing into <b>s</b>, and set
+ * *<b>n_lines_out</b> to its length.  Return NULL if the document is empty,
+ * contains a NUL, or doesn't end with a newline. */
+STATIC cdline_t *
+consdiff_split_lines(const char *s, size_t len, int *n_lines_out)
+{
+  cdline_t *lines = NULL;
+  int n = 0, capacity = 0;
+  const char *cp = s, *end = s + len;
+
+  *n_lines_out = 0;
+  if (len == 0 || len >= INT_MAX || s[len-1] != '\n' || memchr(s, 0, len))
+    return NULL;
+
+  while (cp < end) {
+    const char *eol = memchr(cp, '\n', end - cp);
+    tor_assert(eol);
+    if (n == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      lines = tor_reallocarray(lines, capacity, sizeof(cdline_t));
+    }
+    lines[n].s = cp;
+    lines[n].len = eol - cp;
+    ++n;
+    cp = eol + 1;
+  }
+  *n_lines_out = n;
+  return lines;
+}
+
+/** Find a longest common subsequence of base lines [<b>b0</b>,<b>b1</b>)
+ * and target lines [<b>t0</b>,<b>t1</b>), and add it to <b>out</b>.  If the
+ * sections differ in too many lines to compare cheaply, only match their
+ * common prefix and suffix. */
+static void
+consdiff_match_lines(const cdline_t *base, int b0, int b1,
+                     const cdline_t *target, int t0, int t1,
+                     cdmatches_t *out)
+{
+  int n_suffix = 0, nb, nt, i, j;
+
+  while (b0 < b1 && t0 < t1 && lines_eq(&base[b0], &target[t0])) {
+    cdmatches_add(out, b0, t0);
+    ++b0;
+    ++t0;
+  }
+  while (b1 > b0 && t1 > t0 && lines_eq(&base[b1-1], &target[t1-1])) {
+    --b1;
+    --t1;
+    ++n_suffix;
+  }
+
+  nb = b1 - b0;
+  nt = t1 - t0;
+  if (nb && nt && (uint64_t)nb * nt <= MAX_LCS_CELLS) {
+    /* lcs[i*w+j] is the length of the LCS of base[b0+i..] and
+     * target[t0+j..]. */
+    const int w = nt + 1;
+    int *lcs = tor_calloc((size_t)(nb + 1) * w, sizeof(int));
+    for (i = nb - 1; i >= 0; --i) {
+      for (j = nt - 1; j >= 0; --j) {
+        if (lines_eq(&base[b0+i], &target[t0+j]))
+          lcs[i*w+j] = lcs[(i+1)*w+j+1] + 1;
+        else
+          lcs[i*w+j] = MAX(lcs[(i+1)*w+j], lcs[i*w+j+1]);
+      }
+    }
+    i = j = 0;
+    while (i < nb && j < nt) {
+      if (lines_eq(&base[b0+i], &target[t0+j])) {
+        cdmatches_add(out, b0+i, t0+j);
+        ++i;
+        ++j;
+      } else if (lcs[(i+1)*w+j] >= lcs[i*w+j+1]) {
+        ++i;
+      } else {
+        ++j;
+      }
+    }
+    tor_free(lcs);
+  }
+
+  for (i = 0; i < n_suffix; ++i)
+    cdmatches_add(out, b1 + i, t1 + i);
+}
+
+/** Find the sections of the consensus in <b>lines</b>: set
+ * *<b>rs_start_out</b> to the index of the first routerstatus entry (or of
+ * the footer, if there are none), and *<b>footer_start_out</b> to the index
+ * of the "directory-footer" line.  Return 0 on success, -1 if there is no
+ * footer. */
+static int
+consdiff_find_sections(const cdline_t *lines, int n_lines,
+                       int *rs_start_out, int *footer_start_out)
+{
+  int i;
+  for (i = 0; i < n_lines; ++i) {
+    if (line_starts_with(&lines[i], "r ") ||
+        line_starts_with(&lines[i], "directory-footer"))
+      break;
+  }
+  *rs_start_out = i;
+  for ( ; i < n_lines; ++i) {
+    if (line_starts_with(&lines[i], "directory-footer"))
+      break;
+  }
+  if (i == n_lines)
+    return -1;
+  *footer_start_out = i;
+  return 0;
+}
+
+/** Set <b>key_out</b> to the identity digest named in the routerstatus
+ * "r" line <b>line</b>.  Return 0 on success, -1 on failure. */
+static int
+consdiff_get_rs_key(const cdline_t *line, char *key_out)
+{
+  const char *end = line->s + line->len;
+  const char *id, *id_end;
+  char b64[BASE64_DIGEST_LEN+1];
+
+  /* "r" SP nickname SP identity ... */
+  id = memchr(line->s + 2, ' ', end - (line->s + 2));
+  if (!id)
+    return -1;
+  ++id;
+  id_end = memchr(id, ' ', end - id);
+  if (!id_end)
+    id_end = end;
+  if (id_end - id != BASE64_DIGEST_LEN)
+    return -1;
+  memcpy(b64, id, BASE64_DIGEST_LEN);
+  b64[BASE64_DIGEST_LEN] = '\0';
+  return digest_from_base64(key_out, b64);
+}
+
+/** Find the routerstatus entries between lines <b>rs_start</b> and
+ * <b>footer_start</b>.  On success, return 0, set *<b>starts_out</b> to a
+ * newly allocated array of the index of each entry's "r" line,
+ * *<b>keys_out</b> to a newly allocated array of their identity digests,
+ * and *<b>n_out</b> to the number of entries.  Return -1 if an entry is
+ * malformed, or if the entries are not in strictly increasing order. */
+static int
+consdiff_find_entries(const cdline_t *lines, int rs_start, int footer_start,
+                      int **starts_out, char **keys_out, int *n_out)
+{
+  int *starts = NULL;
+  char *keys = NULL;
+  int n = 0, capacity = 0, i;
+
+  for (i = rs_start; i < footer_start; ++i) {
+    if (! line_starts_with(&lines[i], "r "))
+      continue;
+    if (n == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      starts = tor_reallocarray(starts, capacity, sizeof(int));
+      keys = tor_reallocarray(keys, capacity, DIGEST_LEN);
+    }
+    starts[n] = i;
+    if (consdiff_get_rs_key(&lines[i], keys + n*DIGEST_LEN) < 0 ||
+        (n && fast_memcmp(keys + (n-1)*DIGEST_LEN, keys + n*DIGEST_LEN,
+                          DIGEST_LEN) >= 0)) {
+      tor_free(starts);
+      tor_free(keys);
+      return -1;
+    }
+    ++n;
+  }
+
+  *starts_out = starts;
+  *keys_out = keys;
+  *n_out = n;
+  return 0;
+}
+
+/** Set <b>digest_out</b> to the SHA256 digest of the <b>doc_len</b>-byte
+ * document at <b>doc</b>, as used in the "hash" line of a diff. */
+void
+consdiff_digest_document(uint8_t *digest_out,
+                         const char *doc, size_t doc_len)
+{
+  crypto_digest256((char*)digest_out, doc, doc_len, DIGEST_SHA256);
+}
+
+/** Return true iff the <b>body_len</b>-byte document <b>body</b> claims to
+ * be a consensus diff. */
+int
+consdiff_looks_like_diff(const char *body, size_t body_len)
+{
+  const size_t n = strlen(CONSDIFF_FIRST_LINE "\n");
+  return body && body_len >= n &&
+    fast_memeq(body, CONSDIFF_FIRST_LINE "\n", n);
+}
+
+/** Return a newly allocated diff that turns the consensus <b>base</b> into
+ * the consensus <b>target</b>, or NULL if either one doesn't look enough
+ * like a consensus for us to diff it. */
+char *
+consdiff_gen_diff(const char *base, size_t base_len,
+                  const char *target, size_t target_len)
+{
+  cdline_t *bl = NULL, *tl = NULL;
+  int n_bl, n_tl, b_rs, b_foot, t_rs, t_foot, i, j, k;
+  int *b_ents = NULL, *t_ents = NULL, n_b_ents = 0, n_t_ents = 0;
+  char *b_keys = NULL, *t_keys = NULL;
+  cdmatches_t m;
+  smartlist_t *out = NULL;
+  char *result = NULL;
+  uint8_t digest[DIGEST256_LEN];
+  char base_hex[HEX_DIGEST256_LEN+1], target_hex[HEX_DIGEST256_LEN+1];
+
+  memset(&m, 0, sizeof(m));
+  bl = consdiff_split_lines(base, base_len, &n_bl);
+  tl = consdiff_split_lines(target, target_len, &n_tl);
+  if (!bl || !tl)
+    goto done;
+  if (consdiff_find_sections(bl, n_bl, &b_rs, &b_foot) < 0 ||
+      consdiff_find_sections(tl, n_tl, &t_rs, &t_foot) < 0)
+    goto done;
+  if (consdiff_find_entries(bl, b_rs, b_foot, &b_ents, &b_keys,
+                            &n_b_ents) < 0 ||
+      consdiff_find_entries(tl, t_rs, t_foot, &t_ents, &t_keys,
+                            &n_t_ents) < 0)
+    goto done;
+
+  /* Match lines section by section, so that the matches come out in
+   * increasing order in both documents. */
+  consdiff_match_lines(bl, 0, b_rs, tl, 0, t_rs, &m);
+  i = j = 0;
+  while (i < n_b_ents && j < n_t_ents) {
+    int c = fast_memcmp(b_keys + i*DIGEST_LEN, t_keys + j*DIGEST_LEN,
+                        DIGEST_LEN);
+    if (c == 0) {
+      int b_end = (i + 1 < n_b_ents) ? b_ents[i+1] : b_foot;
+      int t_end = (j + 1 < n_t_ents) ? t_ents[j+1] : t_foot;
+      consdiff_match_lines(bl, b_ents[i], b_end, tl, t_ents[j], t_end, &m);
+      ++i;
+      ++j;
+    } else if (c < 0) {
+      ++i;
+    } else {
+      ++j;
+    }
+  }
+  consdiff_match_lines(bl, b_foot, n_bl, tl, t_foot, n_tl, &m);
+
+  out = smartlist_new();
+  consdiff_digest_document(digest, base, base_len);
+  base16_encode(base_hex, sizeof(base_hex), (const char*)digest,
+                sizeof(digest));
+  consdiff_digest_document(digest, target, target_len);
+  base16_encode(target_hex, sizeof(target_hex), (const char*)digest,
+                sizeof(digest));
+  smartlist_add_asprintf(out, "%s\n", CONSDIFF_FIRST_LINE);
+  smartlist_add_asprintf(out, "hash %s %s\n", base_hex, target_hex);
+
+  /* Every gap between two consecutive matches becomes one command; walk
+   * the gaps from last to first. */
+  for (k = m.n; k >= 0; --k) {
+    const int b_lo = k ? m.base_idx[k-1] + 1 : 0;
+    const int t_lo = k ? m.target_idx[k-1] + 1 : 0;
+    const int b_hi = k < m.n ? m.base_idx[k] : n_bl;
+    const int t_hi = k < m.n ? m.target_idx[k] : n_tl;
+    const char cmd = (t_lo < t_hi) ? 'c' : 'd';
+
+    if (b_lo == b_hi && t_lo == t_hi)
+      continue;
+    if (b_lo == b_hi)
+      smartlist_add_asprintf(out, "%da\n", b_lo);
+    else if (b_hi == b_lo + 1)
+      smartlist_add_asprintf(out, "%d%c\n", b_hi, cmd);
+    else
+      smartlist_add_asprintf(out, "%d,%d%c\n", b_lo + 1, b_hi, cmd);
+
+    if (t_lo == t_hi)
+      continue;
+    for (j = t_lo; j < t_hi; ++j) {
+      if (tl[j].len == 1 && tl[j].s[0] == '.') {
+        /* A line holding only "." would end the command early. */
+        log_info(LD_DIR, "Can't diff a consensus containing a line that "
+                 "holds only \".\"");
+        goto done;
+      }
+      smartlist_add(out, tor_strndup(tl[j].s, tl[j].len + 1));
+    }
+    smartlist_add(out, tor_strdup(".\n"));
+  }
+
+  result = smartlist_join_strings(out, "", 0, NULL);
+
+ done:
+  if (out) {
+    SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+    smartlist_free(out);
+  }
+  tor_free(m.base_idx);
+  tor_free(m.target_idx);
+  tor_free(b_ents);
+  tor_free(t_ents);
+  tor_free(b_keys);
+  tor_free(t_keys);
+  tor_free(bl);
+  tor_free(tl);
+  return result;
+}
+
+/** One parsed command from a consensus diff. */
+typedef struct cdcommand_t {
+  /** The first base line (numbered from 1) that this command replaces. */
+  int first;
+  /** The last base line that this command replaces.  For an "a" command,
+   * this is first - 1: nothing is replaced, and the new lines go before
+   * <b>first</b>. */
+  int last;
+  /** Index into the diff's lines of the first line to add. */
+  int payload;
+  /** Number of lines to add. */
+  int n_payload;
+} cdcommand_t;
+
+/** Parse the command line <b>line</b> of a diff against a base of
+ * <b>n_base</b> lines into <b>cmd_out</b>, and set *<b>has_payload_out</b>
+ * to true iff lines to add follow it.  Return 0 on success, -1 on
+ * failure. */
+static int
+consdiff_parse_command(const cdline_t *line, int n_base,
+                       cdcommand_t *cmd_out, int *has_payload_out)
+{
+  char buf[64];
+  char *next = NULL;
+  long first, last;
+  int ok, has_comma = 0;
+
+  if (line->len == 0 || line->len >= sizeof(buf) ||
+      !TOR_ISDIGIT(line->s[0]))
+    return -1;
+  memcpy(buf, line->s, line->len);
+  buf[line->len] = '\0';
+
+  first = tor_parse_long(buf, 10, 0, INT_MAX - 1, &ok, &next);
+  if (!ok)
+    return -1;
+  last = first;
+  if (*next == ',') {
+    has_comma = 1;
+    if (!TOR_ISDIGIT(next[1]))
+      return -1;
+    last = tor_parse_long(next + 1, 10, 0, INT_MAX - 1, &ok, &next);
+    if (!ok)
+      return -1;
+  }
+  if (!next || next[0] == '\0' || next[1] != '\0')
+    return -1;
+
+  switch (*next) {
+    case 'a':
+      if (has_comma || first > n_base)
+        return -1;
+      cmd_out->first = (int)first + 1;
+      cmd_out->last = (int)first;
+      *has_payload_out = 1;
+      return 0;
+    case 'c':
+    case 'd':
+      if (first < 1 || last < first || last > n_base)
+        return -1;
+      cmd_out->first = (int)first;
+      cmd_out->last = (int)last;
+      *has_payload_out = (*next == 'c');
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/** Apply the <b>diff_len</b>-byte consensus diff <b>diff</b> to the
+ * <b>base_len</b>-byte consensus <b>base</b>.  Return the resulting
+ * document as a newly allocated string, or NULL if the diff is malformed,
+ * doesn't apply to <b>base</b>, or doesn't produce the document it
+ * promises. */
+char *
+consdiff_apply_diff(const char *base, size_t base_len,
+                    const char *diff, size_t diff_len)
+{
+  cdline_t *bl = NULL, *dl = NULL;
+  cdcommand_t *cmds = NULL;
+  int n_bl, n_dl, n_cmds = 0, i, k;
+  char *result = NULL, *cp;
+  size_t result_len = 0;
+  uint8_t digest[DIGEST256_LEN], want_digest[DIGEST256_LEN];
+  const char *hash_line;
+
+  bl = consdiff_split_lines(base, base_len, &n_bl);
+  dl = consdiff_split_lines(diff, diff_len, &n_dl);
+  if (!bl || !dl || n_dl < 2)
+    goto err;
+
+  /* Check the header, and make sure the diff is for this base. */
+  if (dl[0].len != strlen(CONSDIFF_FIRST_LINE) ||
+      !fast_memeq(dl[0].s, CONSDIFF_FIRST_LINE, dl[0].len)) {
+    log_info(LD_DIR, "Consensus diff has an unrecognized first line.");
+    goto err;
+  }
+  hash_line = dl[1].s;
+  if (dl[1].len != 5 + 2*HEX_DIGEST256_LEN + 1 ||
+      !fast_memeq(hash_line, "hash ", 5) ||
+      hash_line[5 + HEX_DIGEST256_LEN] != ' ' ||
+      base16_decode((char*)want_digest, sizeof(want_digest),
+                    hash_line + 5, HEX_DIGEST256_LEN) < 0) {
+    log_info(LD_DIR, "Consensus diff has a malformed hash line.");
+    goto err;
+  }
+  consdiff_digest_document(digest, base, base_len);
+  if (tor_memneq(digest, want_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff is not based on the consensus we "
+             "have.");
+    goto err;
+  }
+
+  /* Parse the commands, and make sure they are in strictly decreasing
+   * order, so that each one only touches lines that no later command
+   * will. */
+  cmds = tor_calloc(n_dl, sizeof(cdcommand_t));
+  for (i = 2; i < n_dl; ) {
+    cdcommand_t *cmd = &cmds[n_cmds];
+    int has_payload = 0;
+    if (consdiff_parse_command(&dl[i], n_bl, cmd, &has_payload) < 0) {
+      log_info(LD_DIR, "Malformed command on line %d of consensus diff.",
+               i + 1);
+      goto err;
+    }
+    if (n_cmds) {
+      /* Compare doubled positions, so that an "a" command sits between
+       * two lines. */
+      const cdcommand_t *prev = &cmds[n_cmds-1];
+      const int64_t prev_low = (prev->last < prev->first) ?
+        2*(int64_t)prev->last + 1 : 2*(int64_t)prev->first;
+      const int64_t this_high = (cmd->last < cmd->first) ?
+        2*(int64_t)cmd->last + 1 : 2*(int64_t)cmd->last;
+      if (this_high >= prev_low) {
+        log_info(LD_DIR, "Commands in consensus diff are out of order.");
+        goto err;
+      }
+    }
+    ++i;
+    cmd->payload = i;
+    if (has_payload) {
+      while (i < n_dl && !(dl[i].len == 1 && dl[i].s[0] == '.'))
+        ++i;
+      if (i == n_dl) {
+        log_info(LD_DIR, "Unterminated command in consensus diff.");
+        goto err;
+      }
+      cmd->n_payload = i - cmd->payload;
+      ++i;
+    }
+    ++n_cmds;
+  }
+
+  /* Work out how long the result will be, then build it. */
+  result_len = base_len;
+  for (k = 0; k < n_cmds; ++k) {
+    const cdcommand_t *cmd = &cmds[k];
+    for (i = cmd->first; i <= cmd->last; ++i)
+      result_len -= bl[i-1].len + 1;
+    for (i = 0; i < cmd->n_payload; ++i)
+      result_len += dl[cmd->payload + i].len + 1;
+  }
+  cp = result = tor_malloc(result_len + 1);
+  {
+    /* Index (from 0) of the next base line to copy. */
+    int next_base = 0;
+    for (k = n_cmds - 1; k >= -1; --k) {
+      const int copy_until = (k >= 0) ? cmds[k].first - 1 : n_bl;
+      for ( ; next_base < copy_until; ++next_base) {
+        memcpy(cp, bl[next_base].s, bl[next_base].len + 1);
+        cp += bl[next_base].len + 1;
+      }
+      if (k < 0)
+        break;
+      for (i = 0; i < cmds[k].n_payload; ++i) {
+        const cdline_t *line = &dl[cmds[k].payload + i];
+        memcpy(cp, line->s, line->len + 1);
+        cp += line->len + 1;
+      }
+      next_base = cmds[k].last;
+    }
+  }
+  tor_assert(cp == result + result_len);
+  *cp = '\0';
+
+  if (base16_decode((char*)want_digest, sizeof(want_digest),
+                    hash_line + 6 + HEX_DIGEST256_LEN,
+                    HEX_DIGEST256_LEN) < 0)
+    goto err;
+  consdiff_digest_document(digest, result, result_len);
+  if (tor_memneq(digest, want_digest, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Applying a consensus diff did not produce the "
+             "consensus it promised.");
+    goto err;
+  }
+
+  goto done;
+ err:
+  tor_free(result);
+ done:
+  tor_free(bl);
+  tor_free(dl);
+  tor_free(cmds);
+  return result;
+}
+
@@ -0,0 +1,39 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Header file for consdiff.c.
+ **/
+
+#ifndef TOR_CONSDIFF_H
+#define TOR_CONSDIFF_H
+
+#include "testsupport.h"
+#include "or.h"
+
+/** The first line of every consensus diff. */
+#define CONSDIFF_FIRST_LINE "network-status-diff-version 1"
+
+char *consdiff_gen_diff(const char *base, size_t base_len,
+                        const char *target, size_t target_len);
+char *consdiff_apply_diff(const char *base, size_t base_len,
+                          const char *diff, size_t diff_len);
+int consdiff_looks_like_diff(const char *body, size_t body_len);
+void consdiff_digest_document(uint8_t *digest_out,
+                              const char *doc, size_t doc_len);
+
+#ifdef CONSDIFF_PRIVATE
+/** One line of a document that we're diffing: not NUL-terminated, and not
+ * including its trailing newline. */
+typedef struct cdline_t {
+  const char *s;
+  size_t len;
+} cdline_t;
+
+STATIC cdline_t *consdiff_split_lines(const char *s, size_t len,
+                                      int *n_lines_out);
+#endif
+
+#endif
+
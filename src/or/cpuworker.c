@@ -10,6 +10,7 @@
  *
  * Right now, we only use this for processing onionskins.
  **/
+#define CPUWORKER_PRIVATE
 #include "or.h"
 #include "channel.h"
 #include "circuitbuild.h"
@@ -30,6 +31,7 @@
 #endif
 
 static void queue_pending_tasks(void);
+static void update_max_pending_tasks(void);
 
 typedef struct worker_state_s {
   int generation;
@@ -59,8 +61,15 @@ static struct event *reply_event = NULL;
 
 static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
+/** How many onionskins have we handed to the threadpool that haven't come
+ * back yet? */
 static int total_pending_tasks = 0;
+/** How many onionskins are we willing to hand to the threadpool at once?
+ * Anything beyond this waits in the onion queue, where it can still be
+ * prioritized or expired.  Recomputed by update_max_pending_tasks(). */
 static int max_pending_tasks = 128;
+/** How many worker threads did we launch? */
+static int n_worker_threads = 1;
 
 static void
 replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
@@ -69,6 +78,11 @@ replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
   (void) sock;
   (void) events;
   replyqueue_process(rq);
+  /* Now that we've answered every reply in this batch, refill the
+   * threadpool once, instead of once per reply.  (The created cells we just
+   * queued get flushed together when the scheduler next runs.) */
+  update_max_pending_tasks();
+  queue_pending_tasks();
 }
 
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
@@ -89,14 +103,14 @@ cpu_init(void)
     event_add(reply_event, NULL);
   }
   if (!threadpool) {
-    threadpool = threadpool_new(get_num_cpus(get_options()),
+    n_worker_threads = get_num_cpus(get_options());
+    threadpool = threadpool_new(n_worker_threads,
                                 replyqueue,
                                 worker_state_new,
                                 worker_state_free,
                                 NULL);
   }
-  /* Total voodoo. Can we make this more sensible? */
-  max_pending_tasks = get_num_cpus(get_options()) * 64;
+  update_max_pending_tasks();
   crypto_seed_weak_rng(&request_sample_rng);
 }
 
@@ -249,6 +263,58 @@ estimated_usec_for_onionskins(uint32_t n_requests, uint16_t onionskin_type)
   }
 }
 
+/** Return how many onionskins to hand to a threadpool of <b>n_threads</b>
+ * threads at once, given that its threads have spent <b>usec_total</b>
+ * microseconds on <b>n_processed</b> onionskins so far: enough for about
+ * CPUWORKER_TARGET_USEC_PER_THREAD microseconds of work per thread, but no
+ * fewer than CPUWORKER_MIN_TASKS_PER_THREAD and no more than
+ * CPUWORKER_MAX_TASKS_PER_THREAD onionskins each. */
+STATIC int
+cpuworker_compute_max_pending_tasks(int n_threads, uint64_t n_processed,
+                                    uint64_t usec_total)
+{
+  uint64_t usec_per_task;
+  int per_thread;
+
+  if (n_processed < 100 || usec_total == 0) {
+    /* Until we have some data, assume every handshake takes 1 msec, as
+     * estimated_usec_for_onionskins() does. */
+    usec_per_task = 1000;
+  } else {
+    usec_per_task = usec_total / n_processed;
+    if (usec_per_task == 0)
+      usec_per_task = 1;
+  }
+
+  per_thread = (int) MIN(CPUWORKER_TARGET_USEC_PER_THREAD / usec_per_task,
+                         CPUWORKER_MAX_TASKS_PER_THREAD);
+  if (per_thread < CPUWORKER_MIN_TASKS_PER_THREAD)
+    per_thread = CPUWORKER_MIN_TASKS_PER_THREAD;
+
+  return n_threads * per_thread;
+}
+
+/** Recompute max_pending_tasks from the handshake timings we've collected so
+ * far.  When handshakes are cheap, that keeps every thread busy through a
+ * burst; when they're expensive, it leaves the backlog in the onion queue,
+ * where ntor requests can still overtake TAP requests and stale requests
+ * can still be dropped. */
+static void
+update_max_pending_tasks(void)
+{
+  uint64_t n_processed = 0, usec_total = 0;
+  int i;
+
+  for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i) {
+    n_processed += onionskins_n_processed[i];
+    usec_total += onionskins_usec_internal[i];
+  }
+
+  max_pending_tasks = cpuworker_compute_max_pending_tasks(n_worker_threads,
+                                                          n_processed,
+                                                          usec_total);
+}
+
 /** Compute the absolute and relative overhead of using the cpuworker
  * framework for onionskins of type <b>onionskin_type</b>.*/
 static int
@@ -383,7 +449,8 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   tor_free(job);
-  queue_pending_tasks();
+  /* We'll refill the threadpool from replyqueue_process_cb() once the whole
+   * batch of replies is done. */
 }
 
 /** Implementation function for onion handshake requests. */
@@ -548,6 +615,150 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
   return 0;
 }
 
+/** Return true iff we have worker threads to hand work to. */
+int
+cpuworkers_running(void)
+{
+  return threadpool != NULL;
+}
+
+/** Queue <b>fn</b> to run with <b>arg</b> on one of our worker threads,
+ * and <b>reply_fn</b> to run with <b>arg</b> in the main thread once it
+ * is done.  Return 0 on success, or -1 if we have no worker threads, in
+ * which case the caller should do the work itself. */
+MOCK_IMPL(int,
+cpuworker_queue_work,(workqueue_reply_t (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg))
+{
+  if (!threadpool)
+    return -1;
+  if (!threadpool_queue_work(threadpool, fn, reply_fn, arg))
+    return -1;
+  return 0;
+}
+
+/** A set of independent jobs that cpuworker_run_batch() is running on the
+ * main thread and the worker threads together. */
+typedef struct cpuworker_batch_t {
+  /** Protects every field below. */
+  tor_mutex_t lock;
+  /** Signalled whenever a job finishes. */
+  tor_cond_t cond;
+  /** The function to run on each job. */
+  void (*fn)(void *);
+  /** The argument for each job. */
+  void **args;
+  /** How many jobs are there? */
+  int n_jobs;
+  /** Index of the next job that nobody has started. */
+  int next_job;
+  /** How many jobs have finished? */
+  int n_done;
+  /** How many threads (including the main thread) still refer to this
+   * batch?  Whoever drops the last reference frees it. */
+  int refcnt;
+} cpuworker_batch_t;
+
+/** Run jobs from <b>batch</b> until none are left unstarted, then drop our
+ * reference to it. */
+static void
+cpuworker_batch_work(cpuworker_batch_t *batch)
+{
+  int last;
+  tor_mutex_acquire(&batch->lock);
+  while (batch->next_job < batch->n_jobs) {
+    void *arg = batch->args[batch->next_job++];
+    tor_mutex_release(&batch->lock);
+    batch->fn(arg);
+    tor_mutex_acquire(&batch->lock);
+    ++batch->n_done;
+    tor_cond_signal_all(&batch->cond);
+  }
+  last = (--batch->refcnt == 0);
+  tor_mutex_release(&batch->lock);
+  if (last) {
+    tor_cond_uninit(&batch->cond);
+    tor_mutex_uninit(&batch->lock);
+    tor_free(batch);
+  }
+}
+
+/** Worker thread function: help with the batch in <b>batch_</b>. */
+static workqueue_reply_t
+cpuworker_batch_threadfn(void *state_, void *batch_)
+{
+  (void)state_;
+  cpuworker_batch_work(batch_);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread function: nothing to do once a worker has helped with a
+ * batch. */
+static void
+cpuworker_batch_replyfn(void *batch_)
+{
+  (void)batch_;
+}
+
+/** Call <b>fn</b> on each of the <b>n_jobs</b> elements of <b>args</b>,
+ * spreading the calls across our worker threads and the main thread, and
+ * return once every call has finished.  The jobs must be independent, and
+ * <b>fn</b> must be safe to call from any thread.  If we have no worker
+ * threads, just make the calls in order. */
+void
+cpuworker_run_batch(void (*fn)(void *), void **args, int n_jobs)
+{
+  cpuworker_batch_t *batch;
+  int i, n_helpers;
+
+  n_helpers = MIN(n_jobs - 1, n_worker_threads);
+  if (!threadpool || n_helpers <= 0) {
+    for (i = 0; i < n_jobs; ++i)
+      fn(args[i]);
+    return;
+  }
+
+  batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+  tor_mutex_init_for_cond(&batch->lock);
+  tor_cond_init(&batch->cond);
+  batch->fn = fn;
+  batch->args = args;
+  batch->n_jobs = n_jobs;
+  batch->refcnt = 1;
+
+  for (i = 0; i < n_helpers; ++i) {
+    tor_mutex_acquire(&batch->lock);
+    ++batch->refcnt;
+    tor_mutex_release(&batch->lock);
+    if (!threadpool_queue_work(threadpool, cpuworker_batch_threadfn,
+                               cpuworker_batch_replyfn, batch)) {
+      tor_mutex_acquire(&batch->lock);
+      --batch->refcnt;
+      tor_mutex_release(&batch->lock);
+      break;
+    }
+  }
+
+  /* Do our share, then wait for any jobs that a worker is still running.
+   * Since we take jobs ourselves, we never wait on a busy threadpool for a
+   * job that nobody has started. */
+  tor_mutex_acquire(&batch->lock);
+  while (batch->next_job < batch->n_jobs) {
+    void *arg = batch->args[batch->next_job++];
+    tor_mutex_release(&batch->lock);
+    fn(arg);
+    tor_mutex_acquire(&batch->lock);
+    ++batch->n_done;
+  }
+  while (batch->n_done < batch->n_jobs)
+    tor_cond_wait(&batch->cond, &batch->lock, NULL);
+  /* The workers may still hold references, but they won't touch args. */
+  batch->args = NULL;
+  tor_mutex_release(&batch->lock);
+  cpuworker_batch_work(batch);
+}
+
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
  * remove it from the worker queue. */
 void
@@ -12,6 +12,8 @@
 #ifndef TOR_CPUWORKER_H
 #define TOR_CPUWORKER_H
 
+#include "workqueue.h"
+
 void cpu_init(void);
 void cpuworkers_rotate_keyinfo(void);
 
@@ -25,5 +27,26 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+int cpuworkers_running(void);
+MOCK_DECL(int, cpuworker_queue_work,
+          (workqueue_reply_t (*fn)(void *, void *),
+           void (*reply_fn)(void *),
+           void *arg));
+void cpuworker_run_batch(void (*fn)(void *), void **args, int n_jobs);
+
+#ifdef CPUWORKER_PRIVATE
+/** Try to keep about this much work (in microseconds) committed to each
+ * worker thread. */
+#define CPUWORKER_TARGET_USEC_PER_THREAD (10*1000)
+/** Never commit fewer than this many onionskins to each worker thread... */
+#define CPUWORKER_MIN_TASKS_PER_THREAD 2
+/** ...and never more than this many. */
+#define CPUWORKER_MAX_TASKS_PER_THREAD 64
+
+STATIC int cpuworker_compute_max_pending_tasks(int n_threads,
+                                               uint64_t n_processed,
+                                               uint64_t usec_total);
+#endif
+
 #endif
 
@@ -9,6 +9,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -1205,6 +1206,18 @@ directory_send_command(dir_connection_t *conn,
       url = directory_get_consensus_url(resource);
       log_info(LD_DIR, "Downloading consensus from %s using %s",
                hoststring, url);
+      {
+        /* If we have a consensus already, a cache may be able to send us
+         * just the changes since then. */
+        const uint8_t *have =
+          networkstatus_get_consensus_sha256(resource ? resource : "ns");
+        if (have) {
+          char hex[HEX_DIGEST256_LEN+1];
+          base16_encode(hex, sizeof(hex), (const char*)have, DIGEST256_LEN);
+          smartlist_add_asprintf(headers,
+                                 "X-Or-Diff-From-Consensus: %s\r\n", hex);
+        }
+      }
       break;
     case DIR_PURPOSE_FETCH_CERTIFICATE:
       tor_assert(resource);
@@ -1775,6 +1788,24 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
     log_info(LD_DIR,"Received consensus directory (size %d) from server "
              "'%s:%d'", (int)body_len, conn->base_.address, conn->base_.port);
+    if (consdiff_looks_like_diff(body, body_len)) {
+      char *new_body = networkstatus_apply_consensus_diff(
+                                         flavname ? flavname : "ns", body);
+      if (!new_body) {
+        log_info(LD_DIR, "Unable to apply %s consensus diff from server "
+                 "'%s:%d'. I'll fetch a full consensus soon.",
+                 flavname ? flavname : "ns",
+                 conn->base_.address, conn->base_.port);
+        tor_free(body); tor_free(headers); tor_free(reason);
+        networkstatus_consensus_download_failed(0, flavname);
+        return -1;
+      }
+      log_info(LD_DIR, "Applied a consensus diff of %d bytes.",
+               (int)body_len);
+      tor_free(body);
+      body = new_body;
+      body_len = strlen(body);
+    }
     if ((r=networkstatus_set_current_consensus(body, flavname, 0))<0) {
       log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
              "Unable to load %s consensus directory downloaded from "
@@ -2683,6 +2714,7 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     /* v3 network status fetch. */
     smartlist_t *dir_fps = smartlist_new();
     const char *request_type = NULL;
+    const char *diff_flavor = NULL;
     long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
 
     if (1) {
@@ -2707,9 +2739,12 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
         flav = networkstatus_parse_flavor_name(flavor);
         if (flav < 0)
           flav = FLAV_NS;
+        else
+          diff_flavor = networkstatus_get_flavor_name(flav);
       } else {
         if (!strcmpstart(url, CONSENSUS_URL_PREFIX))
           want_fps = url+strlen(CONSENSUS_URL_PREFIX);
+        diff_flavor = "ns";
       }
 
       v = networkstatus_get_latest_consensus_by_flavor(flav);
@@ -2756,6 +2791,31 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       goto done;
     }
 
+    if (diff_flavor &&
+        (header = http_get_header(headers, "X-Or-Diff-From-Consensus: "))) {
+      /* The client has an older consensus: if we have a diff from it,
+       * send that instead of the whole document. */
+      cached_dir_t *diff = dirserv_get_consensus_diff(diff_flavor, header);
+      tor_free(header);
+      if (diff && (!compressed || diff->dir_z)) {
+        const char *body = compressed ? diff->dir_z : diff->dir;
+        dlen = compressed ? diff->dir_z_len : diff->dir_len;
+        SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+        smartlist_free(dir_fps);
+        if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
+          write_http_status_line(conn, 503, "Directory busy, try again later");
+          geoip_note_ns_response(GEOIP_REJECT_BUSY);
+        } else {
+          write_http_response_header(conn, dlen, compressed, lifetime);
+          connection_write_to_buf(body, dlen, TO_CONN(conn));
+          geoip_note_ns_response(GEOIP_SUCCESS);
+        }
+        cached_dir_decref(diff);
+        goto done;
+      }
+      cached_dir_decref(diff);
+    }
+
     dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_debug(LD_DIRSERV,
@@ -2931,9 +2991,11 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     conn->dir_spool_src = DIR_SPOOL_MICRODESC;
     conn->fingerprint_stack = fps;
 
-    if (compressed)
+    if (compressed) {
       conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
                                       choose_compression_level(dlen));
+      dirserv_spool_cached_response(conn);
+    }
 
     connection_dirserv_flushed_some(conn);
     goto done;
@@ -3000,9 +3062,11 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
         goto done;
       }
       write_http_response_header(conn, -1, compressed, cache_lifetime);
-      if (compressed)
+      if (compressed) {
         conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
                                         choose_compression_level(dlen));
+        dirserv_spool_cached_response(conn);
+      }
       /* Prime the connection with some data. */
       connection_dirserv_flushed_some(conn);
     }
@@ -13,7 +13,9 @@
 #include "command.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -1175,6 +1177,28 @@ directory_too_idle_to_fetch_descriptors(const or_options_t *options,
  * currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** How many earlier consensuses of each flavor do we keep around, so that
+ * we can serve diffs from them to the current one? */
+#define MAX_CONSENSUS_DIFF_BASES 3
+
+/** An earlier consensus that we can serve a diff from. */
+typedef struct consensus_diff_base_t {
+  /** SHA256 digest of the full text of <b>base</b>: clients name the
+   * consensus they have by this digest. */
+  uint8_t digest[DIGEST256_LEN];
+  /** The earlier consensus. */
+  cached_dir_t *base;
+  /** A diff from <b>base</b> to the consensus we're serving now, or NULL if
+   * we haven't made one yet. */
+  cached_dir_t *diff;
+  /** True iff we tried to make <b>diff</b>, and couldn't. */
+  unsigned int diff_failed : 1;
+} consensus_diff_base_t;
+
+/** Map from flavor name to a smartlist of consensus_diff_base_t for the
+ * consensuses we served before the current one, oldest first. */
+static strmap_t *consensus_diff_bases = NULL;
+
 /** Decrement the reference count on <b>d</b>, and free it if it no longer has
  * any references. */
 void
@@ -1224,6 +1248,64 @@ free_cached_dir_(void *_d)
   cached_dir_decref(d);
 }
 
+/** Release all storage held by the consensus_diff_base_t <b>b</b>. */
+static void
+consensus_diff_base_free(consensus_diff_base_t *b)
+{
+  if (!b)
+    return;
+  cached_dir_decref(b->base);
+  cached_dir_decref(b->diff);
+  tor_free(b);
+}
+
+/** Helper for strmap_free: free a smartlist of consensus_diff_base_t. */
+static void
+consensus_diff_base_list_free_(void *arg)
+{
+  smartlist_t *bases = arg;
+  if (!bases)
+    return;
+  SMARTLIST_FOREACH(bases, consensus_diff_base_t *, b,
+                    consensus_diff_base_free(b));
+  smartlist_free(bases);
+}
+
+/** We're about to stop serving <b>old</b> as our consensus of type
+ * <b>flavor_name</b>: remember it so we can serve diffs from it, and throw
+ * away the diffs we made to it, since they lead to the wrong place now. */
+static void
+dirserv_add_consensus_diff_base(const char *flavor_name, cached_dir_t *old)
+{
+  smartlist_t *bases;
+  consensus_diff_base_t *b;
+
+  if (!consensus_diff_bases)
+    consensus_diff_bases = strmap_new();
+  bases = strmap_get(consensus_diff_bases, flavor_name);
+  if (!bases) {
+    bases = smartlist_new();
+    strmap_set(consensus_diff_bases, flavor_name, bases);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(bases, consensus_diff_base_t *, ent) {
+    cached_dir_decref(ent->diff);
+    ent->diff = NULL;
+    ent->diff_failed = 0;
+  } SMARTLIST_FOREACH_END(ent);
+
+  b = tor_malloc_zero(sizeof(consensus_diff_base_t));
+  consdiff_digest_document(b->digest, old->dir, old->dir_len);
+  b->base = old;
+  ++old->refcnt;
+  smartlist_add(bases, b);
+
+  while (smartlist_len(bases) > MAX_CONSENSUS_DIFF_BASES) {
+    consensus_diff_base_free(smartlist_get(bases, 0));
+    smartlist_del_keeporder(bases, 0);
+  }
+}
+
 /** Replace the v3 consensus networkstatus of type <b>flavor_name</b> that
  * we're serving with <b>networkstatus</b>, published at <b>published</b>.  No
  * validation is performed. */
@@ -1242,8 +1324,10 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
   memcpy(&new_networkstatus->digests, digests, sizeof(digests_t));
   old_networkstatus = strmap_set(cached_consensuses, flavor_name,
                                  new_networkstatus);
-  if (old_networkstatus)
+  if (old_networkstatus) {
+    dirserv_add_consensus_diff_base(flavor_name, old_networkstatus);
     cached_dir_decref(old_networkstatus);
+  }
 }
 
 /** Return the latest downloaded consensus networkstatus in encoded, signed,
@@ -1256,6 +1340,61 @@ dirserv_get_consensus(const char *flavor_name)
   return strmap_get(cached_consensuses, flavor_name);
 }
 
+/** Given <b>have</b>, the value of a client's X-Or-Diff-From-Consensus
+ * header, listing hex SHA256 digests of consensuses it has, return a diff
+ * from one of them to our current consensus of type <b>flavor_name</b>.
+ * The caller must release the result with cached_dir_decref().  Return
+ * NULL if we don't know any of the client's consensuses, or can't diff
+ * from them. */
+cached_dir_t *
+dirserv_get_consensus_diff(const char *flavor_name, const char *have)
+{
+  smartlist_t *bases, *items;
+  cached_dir_t *current, *result = NULL;
+
+  if (!consensus_diff_bases || !have)
+    return NULL;
+  bases = strmap_get(consensus_diff_bases, flavor_name);
+  current = dirserv_get_consensus(flavor_name);
+  if (!bases || !current)
+    return NULL;
+
+  items = smartlist_new();
+  smartlist_split_string(items, have, ", ",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(items, const char *, hex) {
+    uint8_t digest[DIGEST256_LEN];
+    if (strlen(hex) != HEX_DIGEST256_LEN ||
+        base16_decode((char*)digest, sizeof(digest), hex,
+                      HEX_DIGEST256_LEN) < 0)
+      continue;
+    SMARTLIST_FOREACH_BEGIN(bases, consensus_diff_base_t *, b) {
+      if (tor_memneq(b->digest, digest, DIGEST256_LEN) || b->diff_failed)
+        continue;
+      if (!b->diff) {
+        char *diff = consdiff_gen_diff(b->base->dir, b->base->dir_len,
+                                       current->dir, current->dir_len);
+        if (!diff) {
+          log_info(LD_DIRSERV, "Couldn't generate a %s consensus diff.",
+                   flavor_name);
+          b->diff_failed = 1;
+          continue;
+        }
+        b->diff = new_cached_dir(diff, current->published);
+      }
+      result = b->diff;
+      ++result->refcnt;
+      break;
+    } SMARTLIST_FOREACH_END(b);
+    if (result)
+      break;
+  } SMARTLIST_FOREACH_END(hex);
+
+  SMARTLIST_FOREACH(items, char *, cp, tor_free(cp));
+  smartlist_free(items);
+  return result;
+}
+
 /** If a router's uptime is at least this value, then it is always
  * considered stable, regardless of the rest of the network. This
  * way we resist attacks where an attacker doubles the size of the
@@ -3467,6 +3606,322 @@ dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed)
   return result;
 }
 
+/********************************************************************/
+
+/* A cache of compressed responses to descriptor requests.
+ *
+ * Clients ask us for the same sets of descriptors again and again -- most
+ * of all, for the batches of microdescriptors that are new in each
+ * consensus -- and without this cache we would compress every one of those
+ * responses on the fly.  We key each compressed response by the digests of
+ * the descriptors it holds, in the order we send them.  Since the body of a
+ * descriptor never changes for a given digest, an entry can't go stale:
+ * once our descriptors change, requests resolve to a different key, and
+ * the old entry ages out of the cache.
+ *
+ * We only build a cached copy of a response once it has been requested
+ * more than once, and we compress it on a worker thread, spooling requests
+ * for it the usual way in the meantime.  (Consensuses don't need this: we
+ * keep each flavor compressed in cached_consensuses already.)
+ */
+
+/** How many bytes of compressed responses will we keep? */
+#define RESPONSE_CACHE_MAX_BYTES (32*1024*1024)
+/** How many responses, built or not, will we keep track of? */
+#define RESPONSE_CACHE_MAX_ENTRIES 4096
+/** How many requests for a response do we need to see before we build a
+ * cached copy of it? */
+#define RESPONSE_CACHE_MIN_REQUESTS 2
+
+/** Map from response key to response_cache_entry_t. */
+static digest256map_t *response_cache = NULL;
+/** Every entry in response_cache, from least to most recently requested. */
+static TOR_TAILQ_HEAD(response_cache_lru_t, response_cache_entry_t)
+  response_cache_lru = TOR_TAILQ_HEAD_INITIALIZER(response_cache_lru);
+/** Total length of the compressed bodies in response_cache. */
+static size_t response_cache_total_bytes = 0;
+
+/** Release all storage held by <b>ent</b>, and remove it from the list of
+ * cache entries and stop counting its body against the cache. */
+static void
+response_cache_entry_free(response_cache_entry_t *ent)
+{
+  if (!ent)
+    return;
+  TOR_TAILQ_REMOVE(&response_cache_lru, ent, lru_link);
+  if (ent->body) {
+    response_cache_total_bytes -= ent->body->dir_z_len;
+    cached_dir_decref(ent->body);
+  }
+  tor_free(ent);
+}
+
+/** Helper for digest256map_free: free a response_cache_entry_t. */
+static void
+response_cache_entry_free_(void *ent)
+{
+  response_cache_entry_free(ent);
+}
+
+/** Return the response cache entry for <b>key</b>, creating it if
+ * necessary, and note a request for it at <b>now</b>. */
+STATIC response_cache_entry_t *
+dirserv_response_cache_note_request(const uint8_t *key, time_t now)
+{
+  response_cache_entry_t *ent;
+  if (!response_cache)
+    response_cache = digest256map_new();
+  ent = digest256map_get(response_cache, key);
+  if (!ent) {
+    ent = tor_malloc_zero(sizeof(response_cache_entry_t));
+    memcpy(ent->key, key, DIGEST256_LEN);
+    digest256map_set(response_cache, key, ent);
+  } else {
+    TOR_TAILQ_REMOVE(&response_cache_lru, ent, lru_link);
+  }
+  TOR_TAILQ_INSERT_TAIL(&response_cache_lru, ent, lru_link);
+  ent->last_used = now;
+  ++ent->n_requests;
+  return ent;
+}
+
+/** Remove the least recently requested entries from the response cache
+ * until their bodies total no more than <b>max_bytes</b>, and there are no
+ * more than RESPONSE_CACHE_MAX_ENTRIES of them. */
+STATIC void
+dirserv_response_cache_shrink(size_t max_bytes)
+{
+  response_cache_entry_t *oldest;
+  if (!response_cache)
+    return;
+  while (response_cache_total_bytes > max_bytes ||
+         digest256map_size(response_cache) > RESPONSE_CACHE_MAX_ENTRIES) {
+    oldest = TOR_TAILQ_FIRST(&response_cache_lru);
+    if (!oldest)
+      break;
+    digest256map_remove(response_cache, oldest->key);
+    response_cache_entry_free(oldest);
+  }
+}
+
+/** Give the response cache entry for <b>key</b>, if we still have one,
+ * the compressed body <b>body_z</b> of length <b>body_z_len</b>, taking
+ * ownership of it. */
+STATIC void
+dirserv_response_cache_set_body(const uint8_t *key, char *body_z,
+                                size_t body_z_len)
+{
+  response_cache_entry_t *ent =
+    response_cache ? digest256map_get(response_cache, key) : NULL;
+  cached_dir_t *d;
+
+  if (!ent || ent->body) {
+    tor_free(body_z);
+    return;
+  }
+  d = tor_malloc_zero(sizeof(cached_dir_t));
+  d->refcnt = 1;
+  d->dir_z = body_z;
+  d->dir_z_len = body_z_len;
+  d->published = ent->last_used;
+  ent->body = d;
+  response_cache_total_bytes += body_z_len;
+  dirserv_response_cache_shrink(RESPONSE_CACHE_MAX_BYTES);
+}
+
+/** Return the compressed body that the response cache holds for
+ * <b>key</b>, or NULL if it has none. */
+STATIC cached_dir_t *
+dirserv_response_cache_lookup(const uint8_t *key)
+{
+  response_cache_entry_t *ent =
+    response_cache ? digest256map_get(response_cache, key) : NULL;
+  return ent ? ent->body : NULL;
+}
+
+/** Remove every entry from the response cache. */
+void
+dirserv_response_cache_clear(void)
+{
+  digest256map_free(response_cache, response_cache_entry_free_);
+  response_cache = NULL;
+  tor_assert(response_cache_total_bytes == 0);
+}
+
+/** Return the number of bytes of compressed responses that we're caching. */
+size_t
+dirserv_response_cache_get_total_allocation(void)
+{
+  return response_cache_total_bytes;
+}
+
+/** A compressed response that a worker thread is building for the response
+ * cache. */
+typedef struct response_build_job_t {
+  /** The response cache key for this response. */
+  uint8_t key[DIGEST256_LEN];
+  /** The uncompressed response.  The worker frees it when it's done. */
+  char *body;
+  size_t body_len;
+  /** The compressed response, or NULL if we couldn't compress it. */
+  char *body_z;
+  size_t body_z_len;
+} response_build_job_t;
+
+/** Worker thread: compress the response in a response_build_job_t. */
+static workqueue_reply_t
+response_build_threadfn(void *state_, void *arg)
+{
+  response_build_job_t *job = arg;
+  (void) state_;
+  if (tor_gzip_compress(&job->body_z, &job->body_z_len,
+                        job->body, job->body_len, ZLIB_METHOD) < 0) {
+    tor_free(job->body_z);
+  }
+  tor_free(job->body);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread: put the response that a worker thread compressed into the
+ * response cache. */
+static void
+response_build_replyfn(void *arg)
+{
+  response_build_job_t *job = arg;
+  response_cache_entry_t *ent =
+    response_cache ? digest256map_get(response_cache, job->key) : NULL;
+
+  if (ent)
+    ent->pending = 0;
+  if (job->body_z) {
+    dirserv_response_cache_set_body(job->key, job->body_z, job->body_z_len);
+    job->body_z = NULL;
+  } else {
+    log_info(LD_DIRSERV, "Unable to compress a response for our cache.");
+  }
+  tor_free(job);
+}
+
+/** Called when <b>conn</b> is about to spool a compressed response made of
+ * the descriptors in its fingerprint_stack.  If we have that response in
+ * the response cache, set <b>conn</b> up to send the cached copy instead,
+ * and return 1.  Otherwise leave <b>conn</b> alone, return 0, and, if we
+ * keep seeing requests for the same response, start building a cached copy
+ * of it. */
+int
+dirserv_spool_cached_response(dir_connection_t *conn)
+{
+  const int is_md = (conn->dir_spool_src == DIR_SPOOL_MICRODESC);
+  const int by_fp = (conn->dir_spool_src == DIR_SPOOL_SERVER_BY_FP ||
+                     conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_FP);
+  const int extra = (conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_FP ||
+                     conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_DIGEST);
+  const int encrypted = connection_dir_is_encrypted(conn);
+  const time_t now = time(NULL);
+  const time_t publish_cutoff = now - ROUTER_MAX_AGE_TO_PUBLISH;
+  smartlist_t *descs;
+  crypto_digest_t *d;
+  uint8_t key[DIGEST256_LEN];
+  response_cache_entry_t *ent;
+  cached_dir_t *body;
+  size_t body_len = 0;
+  int i;
+
+  if (!conn->zlib_state || !conn->fingerprint_stack)
+    return 0;
+  if (!is_md && !by_fp && !extra &&
+      conn->dir_spool_src != DIR_SPOOL_SERVER_BY_DIGEST)
+    return 0;
+  /* Bridge authorities note which descriptors they serve by fingerprint;
+   * don't skip that. */
+  if (by_fp && get_options()->BridgeAuthoritativeDir)
+    return 0;
+  if (!response_cache && !cpuworkers_running())
+    return 0;
+
+  /* Find the descriptors that we would spool, in the order we'd spool them,
+   * skipping the ones that the spooling functions would skip. */
+  descs = smartlist_new();
+  d = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_add_bytes(d, is_md ? "m" : extra ? "e" : "s", 1);
+  for (i = smartlist_len(conn->fingerprint_stack) - 1; i >= 0; --i) {
+    const char *fp = smartlist_get(conn->fingerprint_stack, i);
+    if (is_md) {
+      microdesc_t *md =
+        microdesc_cache_lookup_by_digest256(get_microdesc_cache(), fp);
+      if (!md || !md->body)
+        continue;
+      crypto_digest_add_bytes(d, md->digest, DIGEST256_LEN);
+      body_len += md->bodylen;
+      smartlist_add(descs, md);
+    } else {
+      const signed_descriptor_t *sd;
+      if (by_fp)
+        sd = get_signed_descriptor_by_fp(fp, extra, publish_cutoff);
+      else
+        sd = extra ? extrainfo_get_by_descriptor_digest(fp)
+          : router_get_by_descriptor_digest(fp);
+      if (!sd || (!encrypted && !sd->send_unencrypted))
+        continue;
+      crypto_digest_add_bytes(d, sd->signed_descriptor_digest, DIGEST_LEN);
+      body_len += sd->signed_descriptor_len;
+      smartlist_add(descs, (void*)sd);
+    }
+  }
+  crypto_digest_get_digest(d, (char*)key, sizeof(key));
+  crypto_digest_free(d);
+
+  if (!smartlist_len(descs) || body_len > RESPONSE_CACHE_MAX_BYTES) {
+    smartlist_free(descs);
+    return 0;
+  }
+
+  body = dirserv_response_cache_lookup(key);
+  ent = dirserv_response_cache_note_request(key, now);
+  if (body) {
+    ++body->refcnt;
+    conn->cached_dir = body;
+    conn->cached_dir_offset = 0;
+    conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+    tor_zlib_free(conn->zlib_state);
+    conn->zlib_state = NULL;
+    SMARTLIST_FOREACH(conn->fingerprint_stack, char *, fp, tor_free(fp));
+    smartlist_free(conn->fingerprint_stack);
+    conn->fingerprint_stack = NULL;
+    smartlist_free(descs);
+    return 1;
+  }
+
+  if (ent->n_requests >= RESPONSE_CACHE_MIN_REQUESTS && !ent->pending) {
+    response_build_job_t *job = tor_malloc_zero(sizeof(*job));
+    char *cp;
+    memcpy(job->key, key, DIGEST256_LEN);
+    cp = job->body = tor_malloc(body_len ? body_len : 1);
+    job->body_len = body_len;
+    SMARTLIST_FOREACH_BEGIN(descs, const void *, desc) {
+      if (is_md) {
+        const microdesc_t *md = desc;
+        memcpy(cp, md->body, md->bodylen);
+        cp += md->bodylen;
+      } else {
+        const signed_descriptor_t *sd = desc;
+        memcpy(cp, signed_descriptor_get_body(sd), sd->signed_descriptor_len);
+        cp += sd->signed_descriptor_len;
+      }
+    } SMARTLIST_FOREACH_END(desc);
+    if (cpuworker_queue_work(response_build_threadfn, response_build_replyfn,
+                             job) < 0) {
+      tor_free(job->body);
+      tor_free(job);
+    } else {
+      ent->pending = 1;
+    }
+  }
+  smartlist_free(descs);
+  dirserv_response_cache_shrink(RESPONSE_CACHE_MAX_BYTES);
+  return 0;
+}
+
 /** When we're spooling data onto our outbuf, add more whenever we dip
  * below this threshold. */
 #define DIRSERV_BUFFER_MIN 16384
@@ -3632,8 +4087,13 @@ connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn)
                              conn->cached_dir->dir_z + conn->cached_dir_offset,
                              bytes, conn, bytes == remaining);
   } else {
-    connection_write_to_buf(conn->cached_dir->dir_z + conn->cached_dir_offset,
-                            bytes, TO_CONN(conn));
+    /* We're sending the compressed bytes as they are: let the outbuf refer
+     * to them rather than copying them. */
+    ++conn->cached_dir->refcnt;
+    connection_write_ref_to_buf(
+                             conn->cached_dir->dir_z + conn->cached_dir_offset,
+                             bytes, free_cached_dir_, conn->cached_dir,
+                             TO_CONN(conn));
   }
   conn->cached_dir_offset += bytes;
   if (conn->cached_dir_offset == (int)conn->cached_dir->dir_z_len) {
@@ -3808,6 +4268,9 @@ dirserv_free_all(void)
 
   strmap_free(cached_consensuses, free_cached_dir_);
   cached_consensuses = NULL;
+  strmap_free(consensus_diff_bases, consensus_diff_base_list_free_);
+  consensus_diff_bases = NULL;
+  dirserv_response_cache_clear();
 
   dirserv_clear_measured_bw_cache();
 }
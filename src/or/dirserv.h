@@ -62,6 +62,8 @@ int directory_too_idle_to_fetch_descriptors(const or_options_t *options,
                                             time_t now);
 
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
+cached_dir_t *dirserv_get_consensus_diff(const char *flavor_name,
+                                         const char *have);
 void dirserv_set_cached_consensus_networkstatus(const char *consensus,
                                                 const char *flavor_name,
                                                 const digests_t *digests,
@@ -96,6 +98,9 @@ int dirserv_have_any_microdesc(const smartlist_t *fps);
 size_t dirserv_estimate_data_size(smartlist_t *fps, int is_serverdescs,
                                   int compressed);
 size_t dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed);
+int dirserv_spool_cached_response(dir_connection_t *conn);
+void dirserv_response_cache_clear(void);
+size_t dirserv_response_cache_get_total_allocation(void);
 
 char *routerstatus_format_entry(
                               const routerstatus_t *rs, const char *platform,
@@ -132,6 +137,30 @@ STATIC int dirserv_has_measured_bw(const char *node_id);
 STATIC int
 dirserv_read_guardfraction_file_from_str(const char *guardfraction_file_str,
                                       smartlist_t *vote_routerstatuses);
+
+/** A response in the compressed response cache. */
+typedef struct response_cache_entry_t {
+  /** The key under which this entry is stored in the response cache. */
+  uint8_t key[DIGEST256_LEN];
+  /** Links for the response cache's list of entries, in order from least
+   * to most recently requested. */
+  TOR_TAILQ_ENTRY(response_cache_entry_t) lru_link;
+  /** The compressed response, or NULL if we haven't built it yet. */
+  cached_dir_t *body;
+  /** When did we last get a request for this response? */
+  time_t last_used;
+  /** How many requests have we had for this response? */
+  unsigned int n_requests;
+  /** True iff a worker thread is compressing this response for us. */
+  unsigned int pending : 1;
+} response_cache_entry_t;
+
+STATIC response_cache_entry_t *dirserv_response_cache_note_request(
+                                             const uint8_t *key, time_t now);
+STATIC void dirserv_response_cache_shrink(size_t max_bytes);
+STATIC void dirserv_response_cache_set_body(const uint8_t *key, char *body_z,
+                                            size_t body_z_len);
+STATIC cached_dir_t *dirserv_response_cache_lookup(const uint8_t *key);
 #endif
 
 int dirserv_read_measured_bandwidths(const char *from_file,
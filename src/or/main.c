@@ -99,6 +99,8 @@ static void second_elapsed_callback(periodic_timer_t *timer, void *args);
 static int conn_close_if_marked(int i);
 static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
+static void connection_schedule_housekeeping(connection_t *conn,
+                                             time_t now);
 static int run_main_loop_until_done(void);
 static void process_signal(int sig);
 
@@ -152,6 +154,9 @@ static smartlist_t *closeable_connection_lst = NULL;
 /** List of linked connections that are currently reading data into their
  * inbuf from their partner's outbuf. */
 static smartlist_t *active_linked_connection_lst = NULL;
+/** Timer wheel of connections that need housekeeping, each scheduled for the
+ * next second at which run_connection_housekeeping() might act on it. */
+static timewheel_t *housekeeping_wheel = NULL;
 /** Flag: Set to true iff we entered the current libevent main loop via
  * <b>loop_once</b>. If so, there's no need to trigger a loopexit in order
  * to handle linked connections. */
@@ -345,6 +350,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
     /* XXXX CHECK FOR NULL RETURN! */
   }
 
+  connection_schedule_housekeeping(conn, approx_time());
+
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
             smartlist_len(connection_array));
@@ -402,6 +409,8 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  if (housekeeping_wheel)
+    timewheel_cancel(housekeeping_wheel, &conn->housekeeping_timer);
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -980,10 +989,8 @@ conn_close_if_marked(int i)
          * busy Libevent loops where we keep ending up here and returning
          * 0 until we are no longer blocked on bandwidth.
          */
-        if (connection_is_writing(conn)) {
-          conn->write_blocked_on_bw = 1;
-          connection_stop_writing(conn);
-        }
+        if (connection_is_writing(conn))
+          connection_write_bw_exhausted(conn);
         if (connection_is_reading(conn)) {
           /* XXXX024 We should make this code unreachable; if a connection is
            * marked for close and flushing, there is no point in reading to it
@@ -1003,8 +1010,7 @@ conn_close_if_marked(int i)
             tor_free(m);
           }
 #endif
-          conn->read_blocked_on_bw = 1;
-          connection_stop_reading(conn);
+          connection_read_bw_exhausted(conn);
         }
       }
       return 0;
@@ -1116,14 +1122,102 @@ directory_info_has_arrived(time_t now, int from_cache)
     consider_testing_reachability(1, 1);
 }
 
+/** Return the first second, at or after <b>now</b>, at which
+ * run_connection_housekeeping() might close <b>or_conn</b> or send it a
+ * keepalive, judging by its timestamps alone.  Activity only pushes these
+ * deadlines back.  The other reasons to close an OR connection -- losing its
+ * last circuit, being marked bad for new circuits, or our starting to
+ * hibernate -- call connection_reschedule_housekeeping() when they happen. */
+STATIC time_t
+connection_or_housekeeping_deadline(or_connection_t *or_conn, time_t now)
+{
+  const or_options_t *options = get_options();
+  connection_t *conn = TO_CONN(or_conn);
+  channel_t *chan;
+  time_t when;
+
+  if (!or_conn->chan)
+    return now;
+  chan = TLS_CHAN_TO_BASE(or_conn->chan);
+
+  /* Keepalives, and giving up on connections that never opened.  A
+   * connection can only be stuck once this has passed, and until it writes
+   * something we keep checking it every second. */
+  when = conn->timestamp_lastwritten + options->KeepalivePeriod;
+
+  if (channel_num_circuits(chan) == 0) {
+    if (channel_is_bad_for_new_circs(chan) || we_are_hibernating())
+      return now;
+    when = MIN(when, chan->timestamp_last_had_circuits +
+                     or_conn->idle_timeout);
+  }
+
+  return MAX(when, now);
+}
+
+/** Schedule housekeeping for <b>conn</b> at the first second after
+ * <b>now</b> at which run_connection_housekeeping() could do anything for
+ * it.  Directory connections only time out, and activity only pushes that
+ * back, so we wait for their stall deadline and check again then.  OR
+ * connections wait for the deadline from
+ * connection_or_housekeeping_deadline().  Other connections need no
+ * housekeeping at all. */
+static void
+connection_schedule_housekeeping(connection_t *conn, time_t now)
+{
+  time_t when;
+
+  if (conn->marked_for_close)
+    return;
+
+  if (conn->type == CONN_TYPE_DIR) {
+    time_t last_active = DIR_CONN_IS_SERVER(conn) ?
+      conn->timestamp_lastwritten : conn->timestamp_lastread;
+    when = last_active + get_options()->TestingDirConnectionMaxStall + 1;
+  } else if (connection_speaks_cells(conn)) {
+    when = connection_or_housekeeping_deadline(TO_OR_CONN(conn), now);
+  } else {
+    return;
+  }
+  if (when <= now)
+    when = now + 1;
+
+  if (!housekeeping_wheel)
+    housekeeping_wheel = timewheel_new(now);
+  timewheel_schedule(housekeeping_wheel, &conn->housekeeping_timer, when);
+}
+
+/** Something has happened that might let run_connection_housekeeping()
+ * act on <b>conn</b> sooner than its timestamps alone would suggest: check
+ * it on the next second. */
+void
+connection_reschedule_housekeeping(connection_t *conn)
+{
+  if (!housekeeping_wheel || !conn->housekeeping_timer.scheduled)
+    return;
+  timewheel_schedule(housekeeping_wheel, &conn->housekeeping_timer,
+                     approx_time() + 1);
+}
+
+/** Check every connection that needs housekeeping on the next second,
+ * since something that affects all their deadlines has changed. */
+void
+reschedule_all_connection_housekeeping(void)
+{
+  if (!connection_array)
+    return;
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn,
+                    connection_reschedule_housekeeping(conn));
+}
+
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run by run_scheduled_events, whenever <b>conn</b>'s
+ * housekeeping timer comes due.
  */
 static void
-run_connection_housekeeping(int i, time_t now)
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
@@ -1244,6 +1338,19 @@ run_connection_housekeeping(int i, time_t now)
   }
 }
 
+/** Timer wheel callback: run housekeeping on the connection whose timer is
+ * <b>ent</b>, and schedule its next check. */
+static void
+connection_housekeeping_timer_cb(timewheel_entry_t *ent, time_t now,
+                                 void *arg)
+{
+  connection_t *conn = SUBTYPE_P(ent, connection_t, housekeeping_timer);
+  (void)arg;
+
+  run_connection_housekeeping(conn, now);
+  connection_schedule_housekeeping(conn, now);
+}
+
 /** Honor a NEWNYM request: make future requests unlinkable to past
  * requests. */
 static void
@@ -1349,7 +1456,6 @@ run_scheduled_events(time_t now)
   const or_options_t *options = get_options();
 
   int is_server = server_mode(options);
-  int i;
   int have_dir_info;
 
   /* 0. See if we've been asked to shut down and our timeout has
@@ -1687,15 +1793,14 @@ run_scheduled_events(time_t now)
     circuit_expire_old_circs_as_needed(now);
   }
 
-  /* every 10 seconds, but not at the same second as other such events */
-  if (now % 10 == 5)
-    circuit_expire_old_circuits_serverside(now);
+  /* And close the idle first-hop circuits whose time has come. */
+  circuit_expire_old_circuits_serverside(now);
 
-  /* 5. We do housekeeping for each connection... */
+  /* 5. We do housekeeping for each connection that needs it now... */
   connection_or_set_bad_connections(NULL, 0);
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
+  if (housekeeping_wheel)
+    timewheel_advance(housekeeping_wheel, now,
+                      connection_housekeeping_timer_cb, NULL);
 
   /* 6. And remove any marked circuits... */
   circuit_close_all_marked();
@@ -1936,7 +2041,7 @@ refill_callback(periodic_timer_t *timer, void *arg)
     accounting_add_bytes(bytes_read, bytes_written, seconds_rolled_over);
 
   if (milliseconds_elapsed > 0)
-    connection_bucket_refill(milliseconds_elapsed, (time_t)now.tv_sec);
+    connection_bucket_refill(milliseconds_elapsed, &now);
 
   stats_prev_global_read_bucket = global_read_bucket;
   stats_prev_global_write_bucket = global_write_bucket;
@@ -2678,6 +2783,8 @@ tor_init(int argc, char *argv[])
   rep_hist_init();
   /* Initialize the service cache. */
   rend_cache_init();
+  /* Index the directory tokenizer's keyword tables. */
+  routerparse_init();
   addressmap_init(); /* Init the client dns cache. Do it always, since it's
                       * cheap. */
 
@@ -2878,6 +2985,7 @@ tor_free_all(int postfork)
   memarea_clear_freelist();
   nodelist_free_all();
   microdesc_free_all();
+  routerparse_free_all();
   ext_orport_free_all();
   control_free_all();
   sandbox_free_getaddrinfo_cache();
@@ -2899,6 +3007,8 @@ tor_free_all(int postfork)
   smartlist_free(connection_array);
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
+  timewheel_free(housekeeping_wheel);
+  housekeeping_wheel = NULL;
   periodic_timer_free(second_timer);
 #ifndef USE_BUFFEREVENTS
   periodic_timer_free(refill_timer);
@@ -3082,6 +3192,7 @@ sandbox_init_filter(void)
   OPEN_DATADIR_SUFFIX("cached-microdesc-consensus", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-microdescs", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-microdescs.new", ".tmp");
+  OPEN_DATADIR_SUFFIX("cached-microdescs.idx", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-descriptors", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-descriptors.new", ".tmp");
   OPEN_DATADIR("cached-descriptors.tmp.tmp");
@@ -3134,6 +3245,7 @@ sandbox_init_filter(void)
   RENAME_SUFFIX("cached-microdescs", ".tmp");
   RENAME_SUFFIX("cached-microdescs", ".new");
   RENAME_SUFFIX("cached-microdescs.new", ".tmp");
+  RENAME_SUFFIX("cached-microdescs.idx", ".tmp");
   RENAME_SUFFIX("cached-descriptors", ".tmp");
   RENAME_SUFFIX("cached-descriptors", ".new");
   RENAME_SUFFIX("cached-descriptors.new", ".tmp");
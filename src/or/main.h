@@ -55,6 +55,8 @@ void dns_servers_relaunch_checks(void);
 void reset_all_main_loop_timers(void);
 void reschedule_descriptor_update_check(void);
 void reschedule_directory_downloads(void);
+void connection_reschedule_housekeeping(connection_t *conn);
+void reschedule_all_connection_housekeeping(void);
 
 MOCK_DECL(long,get_uptime,(void));
 
@@ -78,6 +80,8 @@ int tor_init(int argc, char **argv);
 #ifdef MAIN_PRIVATE
 STATIC void init_connection_lists(void);
 STATIC void close_closeable_connections(void);
+STATIC time_t connection_or_housekeeping_deadline(or_connection_t *or_conn,
+                                                  time_t now);
 #endif
 
 #endif
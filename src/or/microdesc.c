@@ -1,9 +1,11 @@
 /* Copyright (c) 2009-2015, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define MICRODESC_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "entrynodes.h"
@@ -14,11 +16,17 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "sandbox.h"
 
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
  * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * only the microdescriptors that we want to keep.
+ *
+ * Next to the cache file we keep an "index file" listing the digest,
+ * location, and last-listed time of every microdescriptor in it.  When the
+ * index matches the cache file, we load the cache without parsing it, and
+ * parse each microdescriptor the first time somebody looks it up. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -28,6 +36,8 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file for the cache file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -42,6 +52,11 @@ struct microdesc_cache_t {
 
   /** True iff we have loaded this cache from disk ever. */
   int is_loaded;
+  /** True iff the index file describes the current cache file. */
+  int index_is_current;
+  /** If a worker thread is writing a new cache file for us, the identifier
+   * of that rebuild; otherwise 0. */
+  uint64_t pending_rebuild;
 };
 
 static microdesc_cache_t *get_microdesc_cache_noload(void);
@@ -66,6 +81,27 @@ HT_GENERATE2(microdesc_map, microdesc_t, node,
              microdesc_hash_, microdesc_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
+/** Largest number of bytes that microdesc_format_annotations() can
+ * produce. */
+#define MICRODESC_ANNOTATIONS_MAXLEN (ISO_TIME_LEN+32)
+
+/** Write the annotations that we store with <b>md</b> into the
+ * MICRODESC_ANNOTATIONS_MAXLEN-byte buffer <b>buf</b>, and return their
+ * length. */
+static size_t
+microdesc_format_annotations(const microdesc_t *md, char *buf)
+{
+  char tbuf[ISO_TIME_LEN+1];
+  /* XXXX drops unknown annotations. */
+  if (!md->last_listed) {
+    buf[0] = '\0';
+    return 0;
+  }
+  format_iso_time(tbuf, md->last_listed);
+  tor_snprintf(buf, MICRODESC_ANNOTATIONS_MAXLEN, "@last-listed %s\n", tbuf);
+  return strlen(buf);
+}
+
 /** Write the body of <b>md</b> into <b>f</b>, with appropriate annotations.
  * On success, return the total number of bytes written, and set
  * *<b>annotation_len_out</b> to the number of bytes written as
@@ -75,16 +111,12 @@ dump_microdescriptor(int fd, microdesc_t *md, size_t *annotation_len_out)
 {
   ssize_t r = 0;
   ssize_t written;
+  char annotation[MICRODESC_ANNOTATIONS_MAXLEN];
   if (md->body == NULL) {
     *annotation_len_out = 0;
     return 0;
   }
-  /* XXXX drops unknown annotations. */
-  if (md->last_listed) {
-    char buf[ISO_TIME_LEN+1];
-    char annotation[ISO_TIME_LEN+32];
-    format_iso_time(buf, md->last_listed);
-    tor_snprintf(annotation, sizeof(annotation), "@last-listed %s\n", buf);
+  if (microdesc_format_annotations(md, annotation)) {
     if (write_all(fd, annotation, strlen(annotation), 0) < 0) {
       log_warn(LD_DIR,
                "Couldn't write microdescriptor annotation: %s",
@@ -135,6 +167,7 @@ get_microdesc_cache_noload(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_datadir_fname("cached-microdescs");
     cache->journal_fname = get_datadir_fname("cached-microdescs.new");
+    cache->index_fname = get_datadir_fname("cached-microdescs.idx");
     the_microdesc_cache = cache;
   }
   return the_microdesc_cache;
@@ -341,6 +374,9 @@ microdesc_cache_clear(microdesc_cache_t *cache)
     microdesc_free(md);
   }
   HT_CLEAR(microdesc_map, &cache->map);
+  cache->index_is_current = 0;
+  /* Ignore the results of any rebuild in progress. */
+  cache->pending_rebuild = 0;
   if (cache->cache_content) {
     int res = tor_munmap_file(cache->cache_content);
     if (res != 0) {
@@ -356,6 +392,209 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->bytes_dropped = 0;
 }
 
+/** First bytes of a microdescriptor cache index file.  After it comes the
+ * length of the cache file as a 64-bit value, and then one
+ * MD_INDEX_ENTRY_LEN-byte entry for each microdescriptor in the cache file:
+ * its sha256 digest, its offset as a 64-bit value, its length as a 32-bit
+ * value, and its last-listed time as a 64-bit value.  All integers are in
+ * network order. */
+#define MD_INDEX_MAGIC "tor-md-index-v1\n"
+/** Length of MD_INDEX_MAGIC. */
+#define MD_INDEX_MAGIC_LEN 16
+/** Length of the header of a microdescriptor cache index file. */
+#define MD_INDEX_HEADER_LEN (MD_INDEX_MAGIC_LEN + 8)
+/** Length of each entry in a microdescriptor cache index file. */
+#define MD_INDEX_ENTRY_LEN (DIGEST256_LEN + 8 + 4 + 8)
+
+/** Store <b>v</b> in network order at <b>cp</b>. */
+static INLINE void
+set_uint64_be(char *cp, uint64_t v)
+{
+  set_uint32(cp, htonl((uint32_t)(v >> 32)));
+  set_uint32(cp + 4, htonl((uint32_t)v));
+}
+
+/** Return the 64-bit network-order value stored at <b>cp</b>. */
+static INLINE uint64_t
+get_uint64_be(const char *cp)
+{
+  return (((uint64_t)ntohl(get_uint32(cp))) << 32) |
+    ntohl(get_uint32(cp + 4));
+}
+
+/** Write an index file for the cache file of <b>cache</b>, listing every
+ * microdescriptor that we have stored there.  Return 0 on success, -1 on
+ * failure. */
+static int
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  char *buf, *cp;
+  size_t len;
+  int n = 0, r;
+
+  if (!cache->cache_content)
+    return 0;
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE && (*mdp)->body)
+      ++n;
+  }
+  len = MD_INDEX_HEADER_LEN + (size_t)n * MD_INDEX_ENTRY_LEN;
+  cp = buf = tor_malloc(len);
+  memcpy(cp, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN);
+  set_uint64_be(cp + MD_INDEX_MAGIC_LEN, cache->cache_content->size);
+  cp += MD_INDEX_HEADER_LEN;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    if (md->saved_location != SAVED_IN_CACHE || !md->body)
+      continue;
+    memcpy(cp, md->digest, DIGEST256_LEN);
+    set_uint64_be(cp + DIGEST256_LEN, (uint64_t)md->off);
+    set_uint32(cp + DIGEST256_LEN + 8, htonl((uint32_t)md->bodylen));
+    set_uint64_be(cp + DIGEST256_LEN + 12, (uint64_t)md->last_listed);
+    cp += MD_INDEX_ENTRY_LEN;
+  }
+  tor_assert(cp == buf + len);
+
+  r = write_bytes_to_file(cache->index_fname, buf, len, 1);
+  tor_free(buf);
+  if (r < 0) {
+    log_warn(LD_DIR, "Couldn't write microdescriptor cache index to %s",
+             cache->index_fname);
+    return -1;
+  }
+  cache->index_is_current = 1;
+  return 0;
+}
+
+/** Try to load the microdescriptors in the cache file of <b>cache</b>,
+ * which is already mapped, using its index file.  Add them to <b>cache</b>
+ * without parsing them.  Return the number of microdescriptors added, or
+ * -1 if the index is missing or doesn't match the cache file. */
+static int
+microdesc_cache_load_index(microdesc_cache_t *cache)
+{
+  const tor_mmap_t *mm = cache->cache_content;
+  struct stat st;
+  char *index;
+  smartlist_t *loaded = NULL;
+  const char *cp;
+  size_t n_entries, i;
+  int result = -1;
+
+  index = read_file_to_str(cache->index_fname,
+                           RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if (!index)
+    return -1;
+  if ((size_t)st.st_size < MD_INDEX_HEADER_LEN ||
+      ((size_t)st.st_size - MD_INDEX_HEADER_LEN) % MD_INDEX_ENTRY_LEN ||
+      fast_memneq(index, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN) ||
+      get_uint64_be(index + MD_INDEX_MAGIC_LEN) != (uint64_t)mm->size)
+    goto done;
+
+  n_entries = ((size_t)st.st_size - MD_INDEX_HEADER_LEN) / MD_INDEX_ENTRY_LEN;
+  loaded = smartlist_new();
+  cp = index + MD_INDEX_HEADER_LEN;
+  for (i = 0; i < n_entries; ++i, cp += MD_INDEX_ENTRY_LEN) {
+    const uint64_t off = get_uint64_be(cp + DIGEST256_LEN);
+    const uint32_t len = ntohl(get_uint32(cp + DIGEST256_LEN + 8));
+    microdesc_t *md;
+    if (off > mm->size || len > mm->size - off || len < 9 ||
+        fast_memneq(mm->data + off, "onion-key", 9))
+      goto done;
+    md = tor_malloc_zero(sizeof(microdesc_t));
+    memcpy(md->digest, cp, DIGEST256_LEN);
+    md->off = (off_t)off;
+    md->body = (char*)mm->data + off;
+    md->bodylen = len;
+    md->last_listed = (time_t)get_uint64_be(cp + DIGEST256_LEN + 12);
+    md->saved_location = SAVED_IN_CACHE;
+    md->not_yet_parsed = 1;
+    smartlist_add(loaded, md);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(loaded, microdesc_t *, md) {
+    if (HT_FIND(microdesc_map, &cache->map, md)) {
+      microdesc_free(md);
+      continue;
+    }
+    HT_INSERT(microdesc_map, &cache->map, md);
+    md->held_in_map = 1;
+    ++cache->n_seen;
+    cache->total_len_seen += md->bodylen;
+  } SMARTLIST_FOREACH_END(md);
+  result = smartlist_len(loaded);
+  smartlist_free(loaded);
+  loaded = NULL;
+  cache->index_is_current = 1;
+
+ done:
+  if (loaded) {
+    SMARTLIST_FOREACH(loaded, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(loaded);
+  }
+  tor_free(index);
+  if (result < 0)
+    log_info(LD_DIR, "Microdescriptor cache index didn't match the cache. "
+             "Parsing the whole cache instead.");
+  return result;
+}
+
+/** Parse the body of <b>md</b>, which we loaded from the cache index, and
+ * fill in its fields.  If it doesn't parse, or doesn't match its digest,
+ * take it away from the nodes holding it, remove it from <b>cache</b>, and
+ * free it.  Return 0 on success, -1 on failure. */
+static int
+microdesc_finish_parsing(microdesc_cache_t *cache, microdesc_t *md)
+{
+  smartlist_t *parsed;
+  microdesc_t *full = NULL;
+  int result = -1;
+
+  tor_assert(md->not_yet_parsed);
+  parsed = microdescs_parse_from_string(md->body, md->body + md->bodylen,
+                                        0, SAVED_IN_CACHE, NULL);
+  if (smartlist_len(parsed) == 1)
+    full = smartlist_get(parsed, 0);
+
+  if (full && tor_memeq(full->digest, md->digest, DIGEST256_LEN)) {
+    md->onion_pkey = full->onion_pkey;
+    full->onion_pkey = NULL;
+    md->onion_curve25519_pkey = full->onion_curve25519_pkey;
+    full->onion_curve25519_pkey = NULL;
+    md->ed25519_identity_pkey = full->ed25519_identity_pkey;
+    full->ed25519_identity_pkey = NULL;
+    tor_addr_copy(&md->ipv6_addr, &full->ipv6_addr);
+    md->ipv6_orport = full->ipv6_orport;
+    md->family = full->family;
+    full->family = NULL;
+    md->exit_policy = full->exit_policy;
+    full->exit_policy = NULL;
+    md->ipv6_exit_policy = full->ipv6_exit_policy;
+    full->ipv6_exit_policy = NULL;
+    md->not_yet_parsed = 0;
+    result = 0;
+  } else {
+    log_warn(LD_DIR, "Microdescriptor in cache index didn't parse, or "
+             "didn't match its digest. Dropping it.");
+    if (md->held_by_nodes) {
+      smartlist_t *nodes = nodelist_find_nodes_with_microdesc(md);
+      SMARTLIST_FOREACH(nodes, node_t *, node,
+                        nodelist_remove_microdesc(node->identity, md));
+      smartlist_free(nodes);
+    }
+    HT_REMOVE(microdesc_map, &cache->map, md);
+    md->held_in_map = 0;
+    cache->bytes_dropped += md->bodylen;
+    microdesc_free(md);
+  }
+
+  SMARTLIST_FOREACH(parsed, microdesc_t *, m, microdesc_free(m));
+  smartlist_free(parsed);
+  return result;
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -373,11 +612,16 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
-    if (added) {
-      total += smartlist_len(added);
-      smartlist_free(added);
+    int n_indexed = microdesc_cache_load_index(cache);
+    if (n_indexed >= 0) {
+      total += n_indexed;
+    } else {
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+      if (added) {
+        total += smartlist_len(added);
+        smartlist_free(added);
+      }
     }
   }
 
@@ -398,6 +642,8 @@ microdesc_cache_reload(microdesc_cache_t *cache)
            total);
 
   microdesc_cache_rebuild(cache, 0 /* don't force */);
+  if (!cache->index_is_current)
+    microdesc_cache_write_index(cache);
 
   return 0;
 }
@@ -521,6 +767,238 @@ should_rebuild_md_cache(microdesc_cache_t *cache)
     return 0;
 }
 
+/** Rewrite the journal file of <b>cache</b> to hold exactly the
+ * microdescriptors that we have marked as saved in it.  Return 0 on success,
+ * -1 on failure. */
+static int
+microdesc_cache_rewrite_journal(microdesc_cache_t *cache)
+{
+  open_file_t *open_file = NULL;
+  microdesc_t **mdp;
+  size_t len = 0;
+  int fd;
+
+  fd = start_writing_to_file(cache->journal_fname,
+                             OPEN_FLAGS_REPLACE|O_BINARY, 0600, &open_file);
+  if (fd < 0)
+    return -1;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    size_t annotation_len;
+    ssize_t size;
+    if (md->saved_location != SAVED_IN_JOURNAL || md->no_save || !md->body)
+      continue;
+    size = dump_microdescriptor(fd, md, &annotation_len);
+    if (size < 0) {
+      abort_writing_to_file(open_file);
+      return -1;
+    }
+    len += size;
+  }
+  if (finish_writing_to_file(open_file) < 0) {
+    log_warn(LD_DIR, "Error rewriting microdescriptor journal: %s",
+             strerror(errno));
+    return -1;
+  }
+  cache->journal_len = len;
+  return 0;
+}
+
+#ifndef _WIN32
+/** Last identifier that we gave to a microdescriptor cache rebuild. */
+static uint64_t md_rebuild_counter = 0;
+
+/** Release all storage held by <b>job</b>. */
+static void
+md_rebuild_job_free(md_rebuild_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->fname);
+  tor_free(job->body);
+  tor_free(job->digests);
+  tor_free(job->offsets);
+  tor_free(job->lens);
+  tor_free(job);
+}
+
+/** Worker thread function: write out the snapshot in <b>job_</b>. */
+STATIC workqueue_reply_t
+microdesc_rebuild_threadfn(void *state_, void *job_)
+{
+  md_rebuild_job_t *job = job_;
+  (void)state_;
+  job->write_ok =
+    write_bytes_to_file(job->fname, job->body, job->body_len, 1) == 0;
+  tor_free(job->body);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread function: a worker has written the new cache file for
+ * <b>job_</b>.  Unless the rebuild was cancelled, swap it in for the old
+ * cache file, point our microdescriptors at it, and rewrite the journal to
+ * hold whatever arrived in the meantime. */
+STATIC void
+microdesc_rebuild_replyfn(void *job_)
+{
+  md_rebuild_job_t *job = job_;
+  microdesc_cache_t *cache = the_microdesc_cache;
+  digest256map_t *written = NULL;
+  tor_mmap_t *new_content;
+  microdesc_t **mdp;
+  size_t kept_len = 0;
+  int i;
+
+  if (!cache || cache->pending_rebuild != job->id) {
+    log_info(LD_DIR, "Discarding a cancelled microdescriptor cache rebuild.");
+    if (job->write_ok)
+      unlink(job->fname);
+    goto done;
+  }
+  cache->pending_rebuild = 0;
+  if (!job->write_ok) {
+    log_warn(LD_DIR, "Couldn't write new microdescriptor cache to %s",
+             job->fname);
+    goto done;
+  }
+
+  written = digest256map_new();
+  for (i = 0; i < job->n; ++i) {
+    digest256map_set(written, (const uint8_t*)job->digests + i*DIGEST256_LEN,
+                     &job->offsets[i]);
+  }
+
+  /* Anything that lives in the old cache file, but isn't in the new one,
+   * needs its own copy of its body before the old file goes away. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location == SAVED_IN_CACHE && md->body &&
+        !digest256map_get(written, (const uint8_t*)md->digest)) {
+      md->body = tor_memdup_nulterm(md->body, md->bodylen);
+      md->saved_location = SAVED_IN_JOURNAL;
+    }
+  }
+
+  cache->index_is_current = 0;
+  if (unlink(cache->index_fname) < 0 && errno != ENOENT) {
+    log_warn(LD_FS, "Failed to unlink %s: %s",
+             cache->index_fname, strerror(errno));
+  }
+  /* The old file stays mapped after we replace it, so our microdescriptors
+   * are valid until we point them at the new one. */
+  if (replace_file(job->fname, cache->cache_fname) < 0) {
+    log_warn(LD_FS, "Error replacing microdescriptor cache: %s",
+             strerror(errno));
+    unlink(job->fname);
+    goto done;
+  }
+  new_content = tor_mmap_file(cache->cache_fname);
+  if (!new_content) {
+    log_warn(LD_FS, "Couldn't map new microdescriptor cache at %s; using "
+             "the old one until we restart.", cache->cache_fname);
+    goto done;
+  }
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    const off_t *offp;
+    if (!md->body ||
+        !(offp = digest256map_get(written, (const uint8_t*)md->digest)))
+      continue;
+    tor_assert((size_t)*offp + md->bodylen <= new_content->size);
+    if (md->saved_location != SAVED_IN_CACHE)
+      tor_free(md->body);
+    md->body = (char*)new_content->data + *offp;
+    md->off = *offp;
+    md->saved_location = SAVED_IN_CACHE;
+    kept_len += job->lens[offp - job->offsets];
+  }
+
+  if (cache->cache_content && tor_munmap_file(cache->cache_content) != 0) {
+    log_warn(LD_FS,
+             "Failed to unmap old microdescriptor cache while rebuilding");
+  }
+  cache->cache_content = new_content;
+
+  if (microdesc_cache_rewrite_journal(cache) < 0) {
+    log_warn(LD_DIR, "Couldn't rewrite the microdescriptor journal after "
+             "rebuilding the cache.");
+  }
+  cache->bytes_dropped = new_content->size - kept_len;
+  microdesc_cache_write_index(cache);
+
+  log_info(LD_DIR, "Done rebuilding microdesc cache in the background. "
+           "%d bytes now used.", (int)new_content->size);
+
+ done:
+  digest256map_free(written, NULL);
+  md_rebuild_job_free(job);
+}
+
+/** Take a snapshot of every microdescriptor that we want to save in
+ * <b>cache</b>, and hand it to a worker thread to write out as the new
+ * cache file.  Return 0 on success, or -1 if we couldn't queue the work, in
+ * which case the caller should rebuild the cache itself. */
+STATIC int
+microdesc_cache_rebuild_in_background(microdesc_cache_t *cache)
+{
+  md_rebuild_job_t *job;
+  microdesc_t **mdp;
+  char annotation[MICRODESC_ANNOTATIONS_MAXLEN];
+  size_t len = 0;
+  char *cp;
+  int n = 0, i = 0;
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    if (md->no_save || !md->body)
+      continue;
+    len += microdesc_format_annotations(md, annotation) + md->bodylen;
+    ++n;
+  }
+
+  job = tor_malloc_zero(sizeof(md_rebuild_job_t));
+  job->id = ++md_rebuild_counter;
+  /* Each rebuild gets its own file, so that a cancelled one can't clobber
+   * or remove the output of the rebuild that replaced it. */
+  tor_asprintf(&job->fname, "%s.bg."U64_FORMAT, cache->cache_fname,
+               U64_PRINTF_ARG(job->id));
+  job->body_len = len;
+  job->body = cp = tor_malloc(len + 1);
+  job->n = n;
+  job->digests = tor_malloc_zero((size_t)n * DIGEST256_LEN + 1);
+  job->offsets = tor_calloc(n + 1, sizeof(off_t));
+  job->lens = tor_calloc(n + 1, sizeof(size_t));
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    const microdesc_t *md = *mdp;
+    size_t annotation_len;
+    if (md->no_save || !md->body)
+      continue;
+    annotation_len = microdesc_format_annotations(md, annotation);
+    memcpy(cp, annotation, annotation_len);
+    cp += annotation_len;
+    memcpy(job->digests + i*DIGEST256_LEN, md->digest, DIGEST256_LEN);
+    job->offsets[i] = cp - job->body;
+    job->lens[i] = annotation_len + md->bodylen;
+    memcpy(cp, md->body, md->bodylen);
+    cp += md->bodylen;
+    ++i;
+  }
+  tor_assert(cp == job->body + len);
+
+  if (cpuworker_queue_work(microdesc_rebuild_threadfn,
+                           microdesc_rebuild_replyfn, job) < 0) {
+    md_rebuild_job_free(job);
+    return -1;
+  }
+  cache->pending_rebuild = job->id;
+  log_info(LD_DIR, "Rebuilding the microdescriptor cache in the "
+           "background...");
+  return 0;
+}
+#endif
+
 /**
  * Mark <b>md</b> as having no body, and release any storage previously held
  * by its body.
@@ -565,9 +1043,25 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   /* Remove dead descriptors */
   microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
 
+  if (!force && cache->pending_rebuild)
+    return 0; /* A worker is already on it. */
   if (!force && !should_rebuild_md_cache(cache))
     return 0;
 
+  /* If a worker is writing a rebuilt cache, its results are about to be out
+   * of date. */
+  cache->pending_rebuild = 0;
+
+#ifndef _WIN32
+  /* Windows won't let us replace the cache file while it's mapped, so we
+   * only do this in the background elsewhere.  The sandbox only lets us
+   * write to filenames that we knew about at startup, so we don't do it
+   * there either. */
+  if (!force && cpuworkers_running() && !sandbox_is_active() &&
+      microdesc_cache_rebuild_in_background(cache) == 0)
+    return 0;
+#endif
+
   log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
 
   orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
@@ -614,6 +1108,13 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     smartlist_add(wrote, md);
   }
 
+  /* The old index won't describe the new file. */
+  cache->index_is_current = 0;
+  if (unlink(cache->index_fname) < 0 && errno != ENOENT) {
+    log_warn(LD_FS, "Failed to unlink %s: %s",
+             cache->index_fname, strerror(errno));
+  }
+
   /* We must do this unmap _before_ we call finish_writing_to_file(), or
    * windows will not actually replace the file. */
   if (cache->cache_content) {
@@ -673,6 +1174,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   write_str_to_file(cache->journal_fname, "", 1);
   cache->journal_len = 0;
   cache->bytes_dropped = 0;
+  microdesc_cache_write_index(cache);
 
   new_size = cache->cache_content ? (int)cache->cache_content->size : 0;
   log_info(LD_DIR, "Done rebuilding microdesc cache. "
@@ -778,21 +1280,37 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 }
 
 /** If there is a microdescriptor in <b>cache</b> whose sha256 digest is
- * <b>d</b>, return it.  Otherwise return NULL. */
+ * <b>d</b>, return it.  Otherwise return NULL.
+ *
+ * The microdescriptor may not have been parsed yet: only its body, digest,
+ * and cache information are set.  Call microdesc_ensure_parsed() before
+ * looking at anything else. */
 microdesc_t *
 microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
 {
-  microdesc_t *md, search;
+  microdesc_t search;
   if (!cache)
     cache = get_microdesc_cache();
   memcpy(search.digest, d, DIGEST256_LEN);
-  md = HT_FIND(microdesc_map, &cache->map, &search);
-  return md;
+  return HT_FIND(microdesc_map, &cache->map, &search);
+}
+
+/** If <b>md</b> came from the cache index and we have not parsed it yet,
+ * parse it now.  Return 0 if <b>md</b> is ready to use.  If it fails to
+ * parse, take it away from every node that holds it, drop it from the
+ * cache, free it, and return -1. */
+int
+microdesc_ensure_parsed(microdesc_t *md)
+{
+  if (PREDICT_LIKELY(!md->not_yet_parsed))
+    return 0;
+  return microdesc_finish_parsing(get_microdesc_cache_noload(), md);
 }
 
 /** Return the mean size of decriptors added to <b>cache</b> since it was last
@@ -818,6 +1336,8 @@ microdesc_list_missing_digest256(networkstatus_t *ns, microdesc_cache_t *cache,
   smartlist_t *result = smartlist_new();
   time_t now = time(NULL);
   tor_assert(ns->flavor == FLAV_MICRODESC);
+  if (!cache)
+    cache = get_microdesc_cache();
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
       continue;
@@ -31,6 +31,7 @@ void microdesc_cache_clear(microdesc_cache_t *cache);
 
 microdesc_t *microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache,
                                                  const char *d);
+int microdesc_ensure_parsed(microdesc_t *md);
 
 size_t microdesc_average_size(microdesc_cache_t *cache);
 
@@ -52,5 +53,41 @@ int we_fetch_microdescriptors(const or_options_t *options);
 int we_fetch_router_descriptors(const or_options_t *options);
 int we_use_microdescriptors_for_circuits(const or_options_t *options);
 
+#ifdef MICRODESC_PRIVATE
+#ifndef _WIN32
+#include "workqueue.h"
+
+/** A snapshot of the microdescriptor cache for a worker thread to write to
+ * disk, while the main thread keeps using the old cache file. */
+typedef struct md_rebuild_job_t {
+  /** Identifier of this rebuild; see microdesc_cache_t.pending_rebuild. */
+  uint64_t id;
+  /** File that the worker writes; we rename it over the cache file once
+   * it's done. */
+  char *fname;
+  /** The contents of the new cache file. */
+  char *body;
+  /** Length of <b>body</b>. */
+  size_t body_len;
+  /** Number of microdescriptors in <b>body</b>. */
+  int n;
+  /** The sha256 digest of each microdescriptor in <b>body</b>, in order. */
+  char *digests;
+  /** The offset of each microdescriptor in <b>body</b>. */
+  off_t *offsets;
+  /** The length of each microdescriptor in <b>body</b>, with its
+   * annotations. */
+  size_t *lens;
+  /** Set by the worker: true iff we wrote <b>fname</b> successfully. */
+  int write_ok;
+} md_rebuild_job_t;
+
+STATIC workqueue_reply_t microdesc_rebuild_threadfn(void *state_,
+                                                    void *job_);
+STATIC void microdesc_rebuild_replyfn(void *job_);
+STATIC int microdesc_cache_rebuild_in_background(microdesc_cache_t *cache);
+#endif
+#endif
+
 #endif
 
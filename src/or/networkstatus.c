@@ -19,6 +19,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -28,6 +29,7 @@
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "nodelist.h"
+#include "onion.h"
 #include "relay.h"
 #include "router.h"
 #include "routerlist.h"
@@ -82,6 +84,9 @@ static consensus_waiting_for_certs_t
  * this will be at some point after the next consensus becomes valid, but
  * before the current consensus becomes invalid. */
 static time_t time_to_download_next_consensus[N_CONSENSUS_FLAVORS];
+/** SHA256 digest of the full text of our current consensus of each flavor,
+ * or all zeros if we don't have one we could apply a diff to. */
+static uint8_t current_consensus_sha256[N_CONSENSUS_FLAVORS][DIGEST256_LEN];
 /** Download status for the current consensus networkstatus. */
 static download_status_t consensus_dl_status[N_CONSENSUS_FLAVORS] =
   {
@@ -124,6 +129,21 @@ networkstatus_reset_download_failures(void)
     download_status_reset(&consensus_dl_status[i]);
 }
 
+/** Return a newly allocated filename for our cached consensus of type
+ * <b>flavor</b>, or for the one we're holding while we wait for
+ * certificates if <b>unverified</b> is true. */
+static char *
+networkstatus_get_cache_fname(const char *flavor, int unverified)
+{
+  char buf[128];
+  const char *prefix = unverified ? "unverified" : "cached";
+  if (!strcmp(flavor, "ns"))
+    tor_snprintf(buf, sizeof(buf), "%s-consensus", prefix);
+  else
+    tor_snprintf(buf, sizeof(buf), "%s-%s-consensus", prefix, flavor);
+  return get_datadir_fname(buf);
+}
+
 /** Read every cached v3 consensus networkstatus from the disk. */
 int
 router_reload_consensus_networkstatus(void)
@@ -135,14 +155,8 @@ router_reload_consensus_networkstatus(void)
 
   /* FFFF Suppress warnings if cached consensus is bad? */
   for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
-    char buf[128];
     const char *flavor = networkstatus_get_flavor_name(flav);
-    if (flav == FLAV_NS) {
-      filename = get_datadir_fname("cached-consensus");
-    } else {
-      tor_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavor);
-      filename = get_datadir_fname(buf);
-    }
+    filename = networkstatus_get_cache_fname(flavor, 0);
     s = read_file_to_str(filename, RFTS_IGNORE_MISSING, NULL);
     if (s) {
       if (networkstatus_set_current_consensus(s, flavor, flags) < -1) {
@@ -153,12 +167,7 @@ router_reload_consensus_networkstatus(void)
     }
     tor_free(filename);
 
-    if (flav == FLAV_NS) {
-      filename = get_datadir_fname("unverified-consensus");
-    } else {
-      tor_snprintf(buf, sizeof(buf), "unverified-%s-consensus", flavor);
-      filename = get_datadir_fname(buf);
-    }
+    filename = networkstatus_get_cache_fname(flavor, 1);
 
     s = read_file_to_str(filename, RFTS_IGNORE_MISSING, NULL);
     if (s) {
@@ -310,19 +319,18 @@ networkstatus_get_voter_by_id(networkstatus_t *vote,
   return NULL;
 }
 
-/** Check whether the signature <b>sig</b> is correctly signed with the
- * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
- * signing key; otherwise set the good_signature or bad_signature flag on
- * <b>voter</b>, and return 0. */
-int
-networkstatus_check_document_signature(const networkstatus_t *consensus,
-                                       document_signature_t *sig,
-                                       const authority_cert_t *cert)
+/** Helper: get ready to check whether the signature <b>sig</b> on
+ * <b>consensus</b> is correctly signed with the signing key in <b>cert</b>.
+ * Return -1 if <b>cert</b> doesn't match the signing key.  Return 1 if we
+ * already know what to think of the signature, and have marked it.
+ * Otherwise fill in <b>check_out</b> and return 0. */
+static int
+networkstatus_prepare_signature_check(const networkstatus_t *consensus,
+                                      document_signature_t *sig,
+                                      const authority_cert_t *cert,
+                                      rsa_sig_check_t *check_out)
 {
   char key_digest[DIGEST_LEN];
-  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
-  char *signed_digest;
-  size_t signed_digest_len;
 
   if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
     return -1;
@@ -339,26 +347,97 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
              " signing key %s",
              hex_str(cert->signing_key_digest, DIGEST_LEN));
     sig->bad_signature = 1;
-    return 0;
+    return 1;
   }
 
-  signed_digest_len = crypto_pk_keysize(cert->signing_key);
-  signed_digest = tor_malloc(signed_digest_len);
-  if (crypto_pk_public_checksig(cert->signing_key,
-                                signed_digest,
-                                signed_digest_len,
-                                sig->signature,
-                                sig->signature_len) < dlen ||
-      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
+  memset(check_out, 0, sizeof(*check_out));
+  check_out->pkey = cert->signing_key;
+  check_out->sig = sig->signature;
+  check_out->sig_len = sig->signature_len;
+  check_out->digest = consensus->digests.d[sig->alg];
+  check_out->digest_len = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
+  return 0;
+}
+
+/** Helper: mark <b>sig</b> according to the result of <b>check</b>. */
+static void
+networkstatus_finish_signature_check(document_signature_t *sig,
+                                     const rsa_sig_check_t *check)
+{
+  if (!check->ok) {
     log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
     sig->bad_signature = 1;
   } else {
     sig->good_signature = 1;
   }
-  tor_free(signed_digest);
+}
+
+/** Check whether the signature <b>sig</b> is correctly signed with the
+ * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
+ * signing key; otherwise set the good_signature or bad_signature flag on
+ * <b>voter</b>, and return 0. */
+int
+networkstatus_check_document_signature(const networkstatus_t *consensus,
+                                       document_signature_t *sig,
+                                       const authority_cert_t *cert)
+{
+  rsa_sig_check_t check;
+  int r = networkstatus_prepare_signature_check(consensus, sig, cert, &check);
+  if (r < 0)
+    return -1;
+  if (r == 0) {
+    check_rsa_sigs(&check, 1);
+    networkstatus_finish_signature_check(sig, &check);
+  }
   return 0;
 }
 
+/** Check every signature on <b>consensus</b> that
+ * networkstatus_check_consensus_signature() would check, all at once, so
+ * that the RSA work can run on our worker threads.  Mark each one good or
+ * bad, in the same order that the one-at-a-time checks would have.  Leave
+ * any signature that we can't check yet for the caller to sort out. */
+static void
+networkstatus_check_signatures_in_parallel(networkstatus_t *consensus,
+                                           time_t now)
+{
+  smartlist_t *sigs = smartlist_new();
+  rsa_sig_check_t *checks;
+  int n_sigs = 0, i = 0;
+
+  SMARTLIST_FOREACH(consensus->voters, networkstatus_voter_info_t *, voter,
+                    n_sigs += smartlist_len(voter->sigs));
+  checks = tor_calloc(n_sigs + 1, sizeof(rsa_sig_check_t));
+
+  SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
+                          voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      authority_cert_t *cert;
+      if (sig->good_signature || sig->bad_signature || !sig->signature)
+        continue;
+      if (!trusteddirserver_get_by_v3_auth_digest(sig->identity_digest))
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (!cert || cert->expires < now)
+        continue;
+      if (networkstatus_prepare_signature_check(consensus, sig, cert,
+                                                &checks[i]) == 0) {
+        smartlist_add(sigs, sig);
+        ++i;
+      }
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+
+  check_rsa_sigs(checks, i);
+  SMARTLIST_FOREACH(sigs, document_signature_t *, sig,
+                    networkstatus_finish_signature_check(sig,
+                                                 &checks[sig_sl_idx]));
+
+  smartlist_free(sigs);
+  tor_free(checks);
+}
+
 /** Given a v3 networkstatus consensus in <b>consensus</b>, check every
  * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
  * signature from every recognized authority on it, 0 if there are
@@ -388,6 +467,10 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  /* Do the expensive part first, in parallel; the loop below will find the
+   * results on each signature. */
+  networkstatus_check_signatures_in_parallel(consensus, now);
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
@@ -1224,27 +1307,20 @@ networkstatus_set_current_consensus(const char *consensus,
     goto done;
   }
 
+  consensus_fname = networkstatus_get_cache_fname(flavor, 0);
+  unverified_fname = networkstatus_get_cache_fname(flavor, 1);
   if (!strcmp(flavor, "ns")) {
-    consensus_fname = get_datadir_fname("cached-consensus");
-    unverified_fname = get_datadir_fname("unverified-consensus");
     if (current_ns_consensus) {
       current_digests = &current_ns_consensus->digests;
       current_valid_after = current_ns_consensus->valid_after;
     }
   } else if (!strcmp(flavor, "microdesc")) {
-    consensus_fname = get_datadir_fname("cached-microdesc-consensus");
-    unverified_fname = get_datadir_fname("unverified-microdesc-consensus");
     if (current_md_consensus) {
       current_digests = &current_md_consensus->digests;
       current_valid_after = current_md_consensus->valid_after;
     }
   } else {
     cached_dir_t *cur;
-    char buf[128];
-    tor_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavor);
-    consensus_fname = get_datadir_fname(buf);
-    tor_snprintf(buf, sizeof(buf), "unverified-%s-consensus", flavor);
-    unverified_fname = get_datadir_fname(buf);
     cur = dirserv_get_consensus(flavor);
     if (cur) {
       current_digests = &cur->digests;
@@ -1407,6 +1483,7 @@ networkstatus_set_current_consensus(const char *consensus,
 
     circuit_build_times_new_consensus_params(get_circuit_build_times_mutable(),
         current_consensus);
+    onion_consensus_has_changed(current_consensus);
   }
 
   if (directory_caches_dir_info(options)) {
@@ -1419,6 +1496,8 @@ networkstatus_set_current_consensus(const char *consensus,
   if (!from_cache) {
     write_str_to_file(consensus_fname, consensus, 0);
   }
+  consdiff_digest_document(current_consensus_sha256[flav],
+                           consensus, strlen(consensus));
 
 /** If a consensus appears more than this many seconds before its declared
  * valid-after time, declare that our clock is skewed. */
@@ -1949,6 +2028,43 @@ getinfo_helper_networkstatus(control_connection_t *conn,
   return 0;
 }
 
+/** Return the SHA256 digest of the full text of our current consensus of
+ * type <b>flavor</b>, suitable for asking a cache for a diff from it, or
+ * NULL if we have no such consensus. */
+const uint8_t *
+networkstatus_get_consensus_sha256(const char *flavor)
+{
+  int flav = networkstatus_parse_flavor_name(flavor);
+  if (flav < 0 ||
+      tor_digest256_is_zero((const char*)current_consensus_sha256[flav]))
+    return NULL;
+  return current_consensus_sha256[flav];
+}
+
+/** Apply the consensus diff <b>diff</b>, which we just downloaded, to our
+ * cached consensus of type <b>flavor</b>.  Return the resulting consensus
+ * as a newly allocated string, or NULL on failure.  On failure, forget our
+ * consensus digest, so that our next fetch asks for a full consensus. */
+char *
+networkstatus_apply_consensus_diff(const char *flavor, const char *diff)
+{
+  int flav = networkstatus_parse_flavor_name(flavor);
+  char *fname, *base, *result = NULL;
+
+  if (flav < 0)
+    return NULL;
+  fname = networkstatus_get_cache_fname(flavor, 0);
+  base = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  if (base) {
+    result = consdiff_apply_diff(base, strlen(base), diff, strlen(diff));
+    tor_free(base);
+  }
+  tor_free(fname);
+  if (!result)
+    memset(current_consensus_sha256[flav], 0, DIGEST256_LEN);
+  return result;
+}
+
 /** Free all storage held locally in this module. */
 void
 networkstatus_free_all(void)
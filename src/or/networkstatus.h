@@ -101,6 +101,9 @@ const char *networkstatus_get_flavor_name(consensus_flavor_t flav);
 int networkstatus_parse_flavor_name(const char *flavname);
 void document_signature_free(document_signature_t *sig);
 document_signature_t *document_signature_dup(const document_signature_t *sig);
+const uint8_t *networkstatus_get_consensus_sha256(const char *flavor);
+char *networkstatus_apply_consensus_diff(const char *flavor,
+                                         const char *diff);
 void networkstatus_free_all(void);
 int networkstatus_get_weight_scale_param(networkstatus_t *ns);
 
@@ -235,6 +235,7 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
+    const microdesc_t *md;
     node->rs = rs;
     if (ns->flavor == FLAV_MICRODESC) {
       if (node->md == NULL ||
@@ -263,7 +264,8 @@ nodelist_set_consensus(networkstatus_t *ns)
       node->ipv6_preferred = 0;
       if (client && options->ClientPreferIPv6ORPort == 1 &&
           (tor_addr_is_null(&rs->ipv6_addr) == 0 ||
-           (node->md && tor_addr_is_null(&node->md->ipv6_addr) == 0)))
+           ((md = node_get_md(node)) &&
+            tor_addr_is_null(&md->ipv6_addr) == 0)))
         node->ipv6_preferred = 1;
     }
 
@@ -661,6 +663,18 @@ node_has_descriptor(const node_t *node)
           (node->rs && node->md));
 }
 
+/** Return the microdescriptor for <b>node</b>, or NULL if it has none.
+ * Microdescriptors that we loaded from the cache index are parsed the first
+ * time we get here; one that fails to parse is dropped, and we return
+ * NULL. */
+const microdesc_t *
+node_get_md(const node_t *node)
+{
+  if (node->md && microdesc_ensure_parsed(node->md) < 0)
+    return NULL;
+  return node->md;
+}
+
 /** Return the router_purpose of <b>node</b>. */
 int
 node_get_purpose(const node_t *node)
@@ -724,14 +738,15 @@ node_allows_single_hop_exits(const node_t *node)
 int
 node_exit_policy_rejects_all(const node_t *node)
 {
+  const microdesc_t *md;
   if (node->rejects_all)
     return 1;
 
   if (node->ri)
     return node->ri->policy_is_reject_star;
-  else if (node->md)
-    return node->md->exit_policy == NULL ||
-      short_policy_is_reject_star(node->md->exit_policy);
+  else if ((md = node_get_md(node)))
+    return md->exit_policy == NULL ||
+      short_policy_is_reject_star(md->exit_policy);
   else
     return 1;
 }
@@ -875,10 +890,11 @@ node_is_me(const node_t *node)
 const smartlist_t *
 node_get_declared_family(const node_t *node)
 {
+  const microdesc_t *md;
   if (node->ri && node->ri->declared_family)
     return node->ri->declared_family;
-  else if (node->md && node->md->family)
-    return node->md->family;
+  else if ((md = node_get_md(node)) && md->family)
+    return md->family;
   else
     return NULL;
 }
@@ -894,13 +910,14 @@ int
 node_ipv6_preferred(const node_t *node)
 {
   tor_addr_port_t ipv4_addr;
+  const microdesc_t *md;
   node_assert_ok(node);
 
   if (node->ipv6_preferred || node_get_prim_orport(node, &ipv4_addr)) {
     if (node->ri)
       return !tor_addr_is_null(&node->ri->ipv6_addr);
-    if (node->md)
-      return !tor_addr_is_null(&node->md->ipv6_addr);
+    if ((md = node_get_md(node)))
+      return !tor_addr_is_null(&md->ipv6_addr);
     if (node->rs)
       return !tor_addr_is_null(&node->rs->ipv6_addr);
   }
@@ -962,6 +979,7 @@ node_get_pref_orport(const node_t *node, tor_addr_port_t *ap_out)
 void
 node_get_pref_ipv6_orport(const node_t *node, tor_addr_port_t *ap_out)
 {
+  const microdesc_t *md;
   node_assert_ok(node);
   tor_assert(ap_out);
 
@@ -973,9 +991,9 @@ node_get_pref_ipv6_orport(const node_t *node, tor_addr_port_t *ap_out)
   if (node->ri) {
     tor_addr_copy(&ap_out->addr, &node->ri->ipv6_addr);
     ap_out->port = node->ri->ipv6_orport;
-  } else if (node->md) {
-    tor_addr_copy(&ap_out->addr, &node->md->ipv6_addr);
-    ap_out->port = node->md->ipv6_orport;
+  } else if ((md = node_get_md(node))) {
+    tor_addr_copy(&ap_out->addr, &md->ipv6_addr);
+    ap_out->port = md->ipv6_orport;
   } else if (node->rs) {
     tor_addr_copy(&ap_out->addr, &node->rs->ipv6_addr);
     ap_out->port = node->rs->ipv6_orport;
@@ -986,10 +1004,11 @@ node_get_pref_ipv6_orport(const node_t *node, tor_addr_port_t *ap_out)
 int
 node_has_curve25519_onion_key(const node_t *node)
 {
+  const microdesc_t *md;
   if (node->ri)
     return node->ri->onion_curve25519_pkey != NULL;
-  else if (node->md)
-    return node->md->onion_curve25519_pkey != NULL;
+  else if ((md = node_get_md(node)))
+    return md->onion_curve25519_pkey != NULL;
   else
     return 0;
 }
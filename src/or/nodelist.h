@@ -40,6 +40,7 @@ void node_get_verbose_nickname_by_id(const char *id_digest,
 int node_is_named(const node_t *node);
 int node_is_dir(const node_t *node);
 int node_has_descriptor(const node_t *node);
+const microdesc_t *node_get_md(const node_t *node);
 int node_get_purpose(const node_t *node);
 #define node_is_bridge(node) \
   (node_get_purpose((node)) == ROUTER_PURPOSE_BRIDGE)
@@ -10,8 +10,10 @@
  * and parse and create the CREATE cell and its allies.
  **/
 
+#define ONION_PRIVATE
 #include "or.h"
 #include "circuitlist.h"
+#include "circuitstats.h"
 #include "config.h"
 #include "cpuworker.h"
 #include "networkstatus.h"
@@ -30,12 +32,30 @@ typedef struct onion_queue_t {
   or_circuit_t *circ;
   uint16_t handshake_type;
   create_cell_t *onionskin;
-  time_t when_added;
+  /** When was this request added to the queue? (msec since the epoch) */
+  uint64_t added_at_msec;
+  /** After what time is it no longer worth answering this request, since
+   * the client has most likely given up on the circuit? (msec since the
+   * epoch) */
+  uint64_t deadline_msec;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
+/** Upper bounds (in msec) of the buckets in our onion queue latency
+ * histogram.  The last bucket holds everything that waited longer. */
+static const uint32_t onion_queue_hist_bounds[] = { 10, 100, 1000 };
+#define N_ONION_QUEUE_HIST_BUCKETS (ARRAY_LENGTH(onion_queue_hist_bounds)+1)
+
+/** Indexed by handshake type and bucket: how many requests have left the
+ * onion queue for a cpuworker after waiting for the bucket's duration? */
+static uint32_t onion_queue_wait_hist[MAX_ONION_HANDSHAKE_TYPE+1]
+                                     [N_ONION_QUEUE_HIST_BUCKETS];
+/** Indexed by handshake type: how many requests have we dropped from the
+ * onion queue because they couldn't be answered before their deadline? */
+static uint32_t onion_queue_n_shed[MAX_ONION_HANDSHAKE_TYPE+1];
+
 /** Array of queues of circuits waiting for CPU workers. An element is NULL
  * if that queue is empty.*/
 TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
@@ -48,9 +68,85 @@ TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
 /** Number of entries of each type currently in each element of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** The smallest circuit build timeout (in msec) that the consensus lets
+ * clients use.  Kept up to date by onion_consensus_has_changed(), so that we
+ * don't look it up for every create request. */
+static int32_t onion_queue_min_timeout_ms = CBT_DEFAULT_TIMEOUT_MIN_VALUE;
+
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
 
+/** Return the current time in msec since the epoch. */
+MOCK_IMPL(STATIC uint64_t,
+onion_queue_now_msec,(void))
+{
+  struct timeval now;
+  tor_gettimeofday(&now);
+  return ((uint64_t)now.tv_sec) * 1000 + now.tv_usec / 1000;
+}
+
+/** Return how long (in msec) a create request may wait in the onion queue
+ * before we assume its client has given up on the circuit.  Clients
+ * abandon circuits that take longer than their circuit build timeout to
+ * build, so we use our own current build timeout as an estimate of theirs.
+ * We never go below the smallest build timeout that the consensus lets
+ * clients use, nor wait longer than ONIONQUEUE_WAIT_CUTOFF seconds. */
+STATIC uint64_t
+onion_queue_wait_cutoff_msec(void)
+{
+  double timeout_ms = get_circuit_build_timeout_ms();
+  double min_ms = onion_queue_min_timeout_ms;
+  uint64_t cutoff = ONIONQUEUE_WAIT_CUTOFF * 1000;
+
+  if (timeout_ms < min_ms)
+    timeout_ms = min_ms;
+  if (timeout_ms < (double)cutoff)
+    cutoff = (uint64_t)timeout_ms;
+  return cutoff;
+}
+
+/** Called when the consensus has changed: update the parameters that we
+ * use to decide how long create requests may wait. */
+void
+onion_consensus_has_changed(const networkstatus_t *ns)
+{
+  onion_queue_min_timeout_ms =
+    networkstatus_get_param(ns, "cbtmintimeout",
+                            CBT_DEFAULT_TIMEOUT_MIN_VALUE,
+                            CBT_MIN_TIMEOUT_MIN_VALUE,
+                            CBT_MAX_TIMEOUT_MIN_VALUE);
+}
+
+/** Remove <b>head</b> from the onion queue because we can't answer it before
+ * its deadline, and close its circuit. */
+static void
+onion_queue_shed_entry(onion_queue_t *head)
+{
+  or_circuit_t *circ = head->circ;
+  ++onion_queue_n_shed[head->handshake_type];
+  circ->onionqueue_entry = NULL;
+  onion_queue_entry_remove(head);
+  log_info(LD_CIRC,
+           "Circuit create request is too old; canceling due to overload.");
+  circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+}
+
+/** Note that <b>head</b> is leaving the onion queue at <b>now_msec</b>, and
+ * record how long it waited. */
+static void
+onion_queue_note_wait(const onion_queue_t *head, uint64_t now_msec)
+{
+  uint64_t waited = now_msec > head->added_at_msec ?
+    now_msec - head->added_at_msec : 0;
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(onion_queue_hist_bounds); ++i) {
+    if (waited < onion_queue_hist_bounds[i])
+      break;
+  }
+  ++onion_queue_wait_hist[head->handshake_type][i];
+}
+
 /* XXXX024 Check lengths vs MAX_ONIONSKIN_{CHALLENGE,REPLY}_LEN.
  *
  * (By which I think I meant, "make sure that no
@@ -127,7 +223,8 @@ int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  uint64_t now_msec = onion_queue_now_msec();
+  int i;
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     log_warn(LD_BUG, "Handshake %d out of range! Dropping.",
@@ -139,7 +236,8 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->circ = circ;
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
-  tmp->when_added = now;
+  tmp->added_at_msec = now_msec;
+  tmp->deadline_msec = now_msec + onion_queue_wait_cutoff_msec();
 
   if (!have_room_for_onionskin(onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
@@ -168,18 +266,15 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   circ->onionqueue_entry = tmp;
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
 
-  /* cull elderly requests. */
-  while (1) {
-    onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[onionskin->handshake_type]);
-    if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
-      break;
-
-    circ = head->circ;
-    circ->onionqueue_entry = NULL;
-    onion_queue_entry_remove(head);
-    log_info(LD_CIRC,
-             "Circuit create request is too old; canceling due to overload.");
-    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  /* cull elderly requests from every queue, not just this one: otherwise a
+   * queue that isn't getting new requests would keep its stale ones until
+   * they reached a cpuworker. */
+  for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i) {
+    onion_queue_t *head;
+    while ((head = TOR_TAILQ_FIRST(&ol_list[i])) &&
+           head->deadline_msec <= now_msec) {
+      onion_queue_shed_entry(head);
+    }
   }
   return 0;
 }
@@ -247,9 +342,25 @@ or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  onion_queue_t *head;
+  uint64_t now_msec = onion_queue_now_msec();
+  int i;
 
+  /* Don't waste a cpuworker on a request that we can't answer before the
+   * client gives up on it.  Drop those before choosing a queue, so that
+   * dropping a request doesn't count as that queue's turn. */
+  for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i) {
+    uint64_t needed_msec;
+    if (TOR_TAILQ_EMPTY(&ol_list[i]))
+      continue;
+    needed_msec = estimated_usec_for_onionskins(1, i) / 1000;
+    while ((head = TOR_TAILQ_FIRST(&ol_list[i])) &&
+           now_msec + needed_msec >= head->deadline_msec) {
+      onion_queue_shed_entry(head);
+    }
+  }
+
+  head = TOR_TAILQ_FIRST(&ol_list[decide_next_handshake_type()]);
   if (!head)
     return NULL; /* no onions pending, we're done */
 
@@ -266,6 +377,8 @@ onion_next_task(create_cell_t **onionskin_out)
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
     ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
 
+  onion_queue_note_wait(head, now_msec);
+
   *onionskin_out = head->onionskin;
   head->onionskin = NULL; /* prevent free. */
   circ->onionqueue_entry = NULL;
@@ -281,6 +394,34 @@ onion_num_pending(uint16_t handshake_type)
   return ol_entries[handshake_type];
 }
 
+/** Log how long create requests have waited in the onion queue since the
+ * last time we were called, and how many we dropped, then reset those
+ * statistics.  Requests that went straight to a cpuworker without being
+ * queued aren't counted. */
+void
+onion_queue_log_stats(void)
+{
+  const uint32_t *tap = onion_queue_wait_hist[ONION_HANDSHAKE_TYPE_TAP];
+  const uint32_t *ntor = onion_queue_wait_hist[ONION_HANDSHAKE_TYPE_NTOR];
+
+  if (tor_mem_is_zero((const char*)onion_queue_wait_hist,
+                      sizeof(onion_queue_wait_hist)) &&
+      tor_mem_is_zero((const char*)onion_queue_n_shed,
+                      sizeof(onion_queue_n_shed)))
+    return; /* Nothing went through the queue; don't clutter the log. */
+
+  log_notice(LD_HEARTBEAT, "Onion queue waits since last time "
+             "(<10ms/<100ms/<1s/longer): %u/%u/%u/%u TAP, "
+             "%u/%u/%u/%u NTor. Dropped %u TAP and %u NTor requests that "
+             "were too old to answer.",
+             tap[0], tap[1], tap[2], tap[3],
+             ntor[0], ntor[1], ntor[2], ntor[3],
+             onion_queue_n_shed[ONION_HANDSHAKE_TYPE_TAP],
+             onion_queue_n_shed[ONION_HANDSHAKE_TYPE_NTOR]);
+  memset(onion_queue_wait_hist, 0, sizeof(onion_queue_wait_hist));
+  memset(onion_queue_n_shed, 0, sizeof(onion_queue_n_shed));
+}
+
 /** Go through ol_list, find the onion_queue_t element which points to
  * circ, remove and free that element. Leave circ itself alone.
  */
@@ -18,6 +18,8 @@ or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
+void onion_queue_log_stats(void);
+void onion_consensus_has_changed(const networkstatus_t *ns);
 
 typedef struct server_onion_keys_t {
   uint8_t my_identity[DIGEST_LEN];
@@ -117,5 +119,10 @@ int extend_cell_format(uint8_t *command_out, uint16_t *len_out,
 int extended_cell_format(uint8_t *command_out, uint16_t *len_out,
                          uint8_t *payload_out, const extended_cell_t *cell_in);
 
+#ifdef ONION_PRIVATE
+MOCK_DECL(STATIC uint64_t, onion_queue_now_msec, (void));
+STATIC uint64_t onion_queue_wait_cutoff_msec(void);
+#endif
+
 #endif
 
@@ -93,6 +93,7 @@
 #include "crypto_curve25519.h"
 #include "crypto_ed25519.h"
 #include "tor_queue.h"
+#include "timewheel.h"
 #include "util_format.h"
 
 /* These signals are defined to help handle_control_signal work.
@@ -1270,6 +1271,9 @@ typedef struct connection_t {
    * or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  /** When we next need to run housekeeping on this connection; see
+   * run_connection_housekeeping(). */
+  timewheel_entry_t housekeeping_timer;
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
@@ -1525,6 +1529,13 @@ typedef struct or_connection_t {
                     * add 'bandwidthrate' to this, capping it at
                     * bandwidthburst. (OPEN ORs only) */
   int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  /** When did we last add tokens to read_bucket and write_bucket, in msec
+   * since the epoch?  The buckets are refilled lazily, whenever we want to
+   * know how much we may read or write. 0 if never. */
+  uint64_t buckets_last_refilled_msec;
+  /** Thousandths of a byte that we owe to read_bucket and write_bucket
+   * from earlier refills that didn't add up to a whole byte. */
+  int read_bucket_carry, write_bucket_carry;
 #else
   /** A rate-limiting configuration object to determine how this connection
    * set its read- and write- limits. */
@@ -2236,6 +2247,10 @@ typedef struct microdesc_t {
   unsigned int no_save : 1;
   /** If true, this microdesc has an entry in the microdesc_map */
   unsigned int held_in_map : 1;
+  /** If true, we loaded this microdesc from the cache index, and have not
+   * yet parsed its body: only the cache information, <b>body</b>, and
+   * <b>digest</b> are set. */
+  unsigned int not_yet_parsed : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -2551,6 +2566,9 @@ typedef struct desc_store_t {
   /** Total bytes dropped since last rebuild: this is space currently
    * used in the cache and the journal that could be freed by a rebuild. */
   size_t bytes_dropped;
+  /** If a worker thread is writing a rebuilt store for us, the identifier of
+   * that rebuild; otherwise 0. */
+  uint64_t pending_rebuild;
 } desc_store_t;
 
 /** Contents of a directory of onion routers. */
@@ -2653,11 +2671,10 @@ typedef struct {
   } u;
 } onion_handshake_state_t;
 
-/** Holds accounting information for a single step in the layered encryption
- * performed by a circuit.  Used only at the client edge of a circuit. */
-typedef struct crypt_path_t {
-  uint32_t magic;
-
+/** Holds the symmetric state used to encrypt, decrypt, and check the
+ * integrity of relay cells at one hop of a circuit.  Only relay_crypto.c
+ * looks inside this structure. */
+typedef struct relay_crypto_t {
   /* crypto environments */
   /** Encryption key and counter for cells heading towards the OR at this
    * step. */
@@ -2670,6 +2687,16 @@ typedef struct crypt_path_t {
   crypto_digest_t *f_digest; /* for integrity checking */
   /** Digest state for cells heading away from the OR at this step. */
   crypto_digest_t *b_digest;
+} relay_crypto_t;
+
+/** Holds accounting information for a single step in the layered encryption
+ * performed by a circuit.  Used only at the client edge of a circuit. */
+typedef struct crypt_path_t {
+  uint32_t magic;
+
+  /** Cryptographic state used for encrypting and authenticating relay
+   * cells to and from this hop. */
+  relay_crypto_t crypto;
 
   /** Current state of the handshake as performed with the OR at this
    * step. */
@@ -2856,9 +2883,6 @@ typedef struct circuit_t {
    * more. */
   int deliver_window;
 
-  /** Temporary field used during circuits_handle_oom. */
-  uint32_t age_tmp;
-
   /** For storage while n_chan is pending (state CIRCUIT_STATE_CHAN_WAIT). */
   struct create_cell_t *n_chan_create_cell;
 
@@ -3107,6 +3131,9 @@ typedef struct origin_circuit_t {
   /** Quasi-global identifier for this circuit; used for control.c */
   /* XXXX NM This can get re-used after 2**32 circuits. */
   uint32_t global_identifier;
+  /** Entry in the map from global_identifier to circuit in
+   * circuitlist.c. */
+  HT_ENTRY(origin_circuit_t) global_id_node;
 
   /** True if we have associated one stream to this circuit, thereby setting
    * the isolation paramaters for this circuit.  Note that this doesn't
@@ -3201,21 +3228,11 @@ typedef struct or_circuit_t {
   /** Linked list of Exit streams associated with this circuit that are
    * still being resolved. */
   edge_connection_t *resolving_streams;
-  /** The cipher used by intermediate hops for cells heading toward the
-   * OP. */
-  crypto_cipher_t *p_crypto;
-  /** The cipher used by intermediate hops for cells heading away from
-   * the OP. */
-  crypto_cipher_t *n_crypto;
-
-  /** The integrity-checking digest used by intermediate hops, for
-   * cells packaged here and heading towards the OP.
-   */
-  crypto_digest_t *p_digest;
-  /** The integrity-checking digest used by intermediate hops, for
-   * cells packaged at the OP and arriving here.
-   */
-  crypto_digest_t *n_digest;
+  /** Cryptographic state used by intermediate hops.  Its "forward"
+   * direction (f_crypto, f_digest) is for cells heading away from the OP
+   * and arriving here; its "backward" direction (b_crypto, b_digest) is
+   * for cells heading toward the OP, including those packaged here. */
+  relay_crypto_t crypto;
 
   /** Points to spliced circuit if purpose is REND_ESTABLISHED, and circuit
    * is not marked for close. */
@@ -3235,6 +3252,9 @@ typedef struct or_circuit_t {
 
   /** True iff this circuit was made with a CREATE_FAST cell. */
   unsigned int is_first_hop : 1;
+  /** If this is a first hop, when we next need to check whether it has
+   * been idle too long; see circuit_expire_old_circuits_serverside(). */
+  timewheel_entry_t idle_timer;
 
   /** If set, this circuit carries HS traffic. Consider it in any HS
    *  statistics. */
@@ -3376,6 +3396,9 @@ typedef struct port_cfg_t {
 
   unsigned is_group_writable : 1;
   unsigned is_world_writable : 1;
+  /** True iff other processes may bind the same address and port, and
+   * have the kernel spread incoming connections among them. */
+  unsigned reuse_port : 1;
 
   entry_port_cfg_t entry_cfg;
 
@@ -4294,6 +4317,12 @@ typedef struct {
    * when sending.
    */
   int SchedulerMaxFlushCells__;
+  /** If nonzero, run the scheduler in KIST mode once every this many
+   * milliseconds, writing only what each socket can send. */
+  int KISTSchedRunInterval;
+  /** In KIST mode, how many congestion windows' worth of data beyond what
+   * it can send immediately we let each socket hold. */
+  double KISTSockBufSizeFactor;
 
   /** Is this an exit node?  This is a tristate, where "1" means "yes, and use
    * the default exit policy if none is given" and "0" means "no; exit policy
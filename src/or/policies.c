@@ -1906,15 +1906,19 @@ addr_policy_result_t
 compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
                                 const node_t *node)
 {
+  const microdesc_t *md = NULL;
   if (node->rejects_all)
     return ADDR_POLICY_REJECTED;
 
+  if (!node->ri)
+    md = node_get_md(node);
+
   if (addr && tor_addr_family(addr) == AF_INET6) {
     const short_policy_t *p = NULL;
     if (node->ri)
       p = node->ri->ipv6_exit_policy;
-    else if (node->md)
-      p = node->md->ipv6_exit_policy;
+    else if (md)
+      p = md->ipv6_exit_policy;
     if (p)
       return compare_tor_addr_to_short_policy(addr, port, p);
     else
@@ -1923,12 +1927,11 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
 
   if (node->ri) {
     return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
-  } else if (node->md) {
-    if (node->md->exit_policy == NULL)
+  } else if (md) {
+    if (md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
     else
-      return compare_tor_addr_to_short_policy(addr, port,
-                                              node->md->exit_policy);
+      return compare_tor_addr_to_short_policy(addr, port, md->exit_policy);
   } else {
     return ADDR_POLICY_PROBABLY_REJECTED;
   }
@@ -0,0 +1,311 @@
+/* Copyright (c) 2001 Matej Pfajfar.
+ * Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_crypto.c
+ * \brief Per-hop relay cell encryption, decryption, and integrity checking.
+ *
+ * All of the symmetric state that a circuit hop needs to process relay
+ * cells lives in a single relay_crypto_t, and only the functions in this
+ * file look inside it.  Keeping that state self-contained means the cell
+ * crypto for a circuit does not depend on anything else in the circuit or
+ * channel structures.
+ **/
+
+#include "or.h"
+#include "config.h" /* For LOG_PROTOCOL_WARN */
+#include "relay.h"
+#include "relay_crypto.h"
+
+/** Update digest from the payload of cell. Assign integrity part to
+ * cell.
+ */
+static void
+relay_set_digest(crypto_digest_t *digest, cell_t *cell)
+{
+  char integrity[4];
+  relay_header_t rh;
+
+  crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_get_digest(digest, integrity, 4);
+//  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
+//    integrity[0], integrity[1], integrity[2], integrity[3]);
+  relay_header_unpack(&rh, cell->payload);
+  memcpy(rh.integrity, integrity, 4);
+  relay_header_pack(cell->payload, &rh);
+}
+
+/** Does the digest for this circuit indicate that this cell is for us?
+ *
+ * Update digest from the payload of cell (with the integrity part set
+ * to 0). If the integrity part is valid, return 1, else restore digest
+ * and cell to their original state and return 0.
+ */
+static int
+relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
+{
+  uint32_t received_integrity, calculated_integrity;
+  relay_header_t rh;
+  crypto_digest_checkpoint_t backup_digest;
+
+  crypto_digest_checkpoint(&backup_digest, digest);
+
+  relay_header_unpack(&rh, cell->payload);
+  memcpy(&received_integrity, rh.integrity, 4);
+  memset(rh.integrity, 0, 4);
+  relay_header_pack(cell->payload, &rh);
+
+//  log_fn(LOG_DEBUG,"Reading digest of %u %u %u %u from relay cell.",
+//    received_integrity[0], received_integrity[1],
+//    received_integrity[2], received_integrity[3]);
+
+  crypto_digest_add_bytes(digest, (char*) cell->payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_get_digest(digest, (char*) &calculated_integrity, 4);
+
+  if (calculated_integrity != received_integrity) {
+//    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
+// (%d vs %d).", received_integrity, calculated_integrity);
+    /* restore digest to its old form */
+    crypto_digest_restore(digest, &backup_digest);
+    /* restore the relay header */
+    memcpy(rh.integrity, &received_integrity, 4);
+    relay_header_pack(cell->payload, &rh);
+    memwipe(&backup_digest, 0, sizeof(backup_digest));
+    return 0;
+  }
+  memwipe(&backup_digest, 0, sizeof(backup_digest));
+  return 1;
+}
+
+/** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
+ * (in place).
+ *
+ * If <b>encrypt_mode</b> is 1 then encrypt, else decrypt.
+ *
+ * Return -1 if the crypto fails, else return 0.
+ */
+static int
+relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in,
+                        int encrypt_mode)
+{
+  int r;
+  (void)encrypt_mode;
+  r = crypto_cipher_crypt_inplace(cipher, (char*) in, CELL_PAYLOAD_SIZE);
+
+  if (r) {
+    log_warn(LD_BUG,"Error during relay encryption");
+    return -1;
+  }
+  return 0;
+}
+
+/** Initialize <b>crypto</b> from the key material in key_data.  key_data
+ * must contain CPATH_KEY_MATERIAL_LEN bytes, which are used as follows:
+ *   - 20 to initialize f_digest
+ *   - 20 to initialize b_digest
+ *   - 16 to key f_crypto
+ *   - 16 to key b_crypto
+ *
+ * (If 'reverse' is true, then f_XX and b_XX are swapped.)
+ *
+ * Return 0 on success, -1 on failure.  On failure, <b>crypto</b> may be
+ * partially initialized, and must be released with relay_crypto_clear().
+ */
+int
+relay_crypto_init(relay_crypto_t *crypto,
+                  const char *key_data, int reverse)
+{
+  crypto_digest_t *tmp_digest;
+  crypto_cipher_t *tmp_crypto;
+
+  tor_assert(crypto);
+  tor_assert(key_data);
+  tor_assert(!(crypto->f_crypto || crypto->b_crypto ||
+             crypto->f_digest || crypto->b_digest));
+
+  crypto->f_digest = crypto_digest_new();
+  crypto_digest_add_bytes(crypto->f_digest, key_data, DIGEST_LEN);
+  crypto->b_digest = crypto_digest_new();
+  crypto_digest_add_bytes(crypto->b_digest, key_data+DIGEST_LEN, DIGEST_LEN);
+
+  if (!(crypto->f_crypto =
+        crypto_cipher_new(key_data+(2*DIGEST_LEN)))) {
+    log_warn(LD_BUG,"Forward cipher initialization failed.");
+    return -1;
+  }
+  if (!(crypto->b_crypto =
+        crypto_cipher_new(key_data+(2*DIGEST_LEN)+CIPHER_KEY_LEN))) {
+    log_warn(LD_BUG,"Backward cipher initialization failed.");
+    return -1;
+  }
+
+  if (reverse) {
+    tmp_digest = crypto->f_digest;
+    crypto->f_digest = crypto->b_digest;
+    crypto->b_digest = tmp_digest;
+    tmp_crypto = crypto->f_crypto;
+    crypto->f_crypto = crypto->b_crypto;
+    crypto->b_crypto = tmp_crypto;
+  }
+
+  return 0;
+}
+
+/** Release all storage held inside <b>crypto</b>, but do not free
+ * <b>crypto</b> itself: it lives inside another object. */
+void
+relay_crypto_clear(relay_crypto_t *crypto)
+{
+  if (!crypto)
+    return;
+  crypto_cipher_free(crypto->f_crypto);
+  crypto_cipher_free(crypto->b_crypto);
+  crypto_digest_free(crypto->f_digest);
+  crypto_digest_free(crypto->b_digest);
+  memwipe(crypto, 0, sizeof(relay_crypto_t));
+}
+
+/** Assert that <b>crypto</b> is fully initialized. */
+void
+relay_crypto_assert_ok(const relay_crypto_t *crypto)
+{
+  tor_assert(crypto);
+  tor_assert(crypto->f_crypto);
+  tor_assert(crypto->b_crypto);
+  tor_assert(crypto->f_digest);
+  tor_assert(crypto->b_digest);
+}
+
+/** Do the appropriate en/decryptions for <b>cell</b> arriving on
+ * <b>circ</b> in direction <b>cell_direction</b>.
+ *
+ * If cell_direction == CELL_DIRECTION_IN:
+ *   - If we're at the origin (we're the OP), for hops 1..N,
+ *     decrypt cell. If recognized, stop.
+ *   - Else (we're not the OP), encrypt one hop. Cell is not recognized.
+ *
+ * If cell_direction == CELL_DIRECTION_OUT:
+ *   - decrypt one hop. Check if recognized.
+ *
+ * If cell is recognized, set *recognized to 1, and set
+ * *layer_hint to the hop that recognized it.
+ *
+ * Return -1 to indicate that we should mark the circuit for close,
+ * else return 0.
+ */
+int
+relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
+            crypt_path_t **layer_hint, char *recognized)
+{
+  relay_header_t rh;
+
+  tor_assert(circ);
+  tor_assert(cell);
+  tor_assert(recognized);
+  tor_assert(cell_direction == CELL_DIRECTION_IN ||
+             cell_direction == CELL_DIRECTION_OUT);
+
+  if (cell_direction == CELL_DIRECTION_IN) {
+    if (CIRCUIT_IS_ORIGIN(circ)) { /* We're at the beginning of the circuit.
+                                    * We'll want to do layered decrypts. */
+      crypt_path_t *thishop, *cpath = TO_ORIGIN_CIRCUIT(circ)->cpath;
+      thishop = cpath;
+      if (thishop->state != CPATH_STATE_OPEN) {
+        log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+               "Relay cell before first created cell? Closing.");
+        return -1;
+      }
+      do { /* Remember: cpath is in forward order, that is, first hop first. */
+        tor_assert(thishop);
+
+        if (relay_crypt_one_payload(thishop->crypto.b_crypto,
+                                    cell->payload, 0) < 0)
+          return -1;
+
+        relay_header_unpack(&rh, cell->payload);
+        if (rh.recognized == 0) {
+          /* it's possibly recognized. have to check digest to be sure. */
+          if (relay_digest_matches(thishop->crypto.b_digest, cell)) {
+            *recognized = 1;
+            *layer_hint = thishop;
+            return 0;
+          }
+        }
+
+        thishop = thishop->next;
+      } while (thishop != cpath && thishop->state == CPATH_STATE_OPEN);
+      log_fn(LOG_PROTOCOL_WARN, LD_OR,
+             "Incoming cell at client not recognized. Closing.");
+      return -1;
+    } else { /* we're in the middle. Just one crypt. */
+      if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->crypto.b_crypto,
+                                  cell->payload, 1) < 0)
+        return -1;
+//      log_fn(LOG_DEBUG,"Skipping recognized check, because we're not "
+//             "the client.");
+    }
+  } else /* cell_direction == CELL_DIRECTION_OUT */ {
+    /* we're in the middle. Just one crypt. */
+
+    if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->crypto.f_crypto,
+                                cell->payload, 0) < 0)
+      return -1;
+
+    relay_header_unpack(&rh, cell->payload);
+    if (rh.recognized == 0) {
+      /* it's possibly recognized. have to check digest to be sure. */
+      if (relay_digest_matches(TO_OR_CIRCUIT(circ)->crypto.f_digest, cell)) {
+        *recognized = 1;
+        return 0;
+      }
+    }
+  }
+  return 0;
+}
+
+/** Set the digest of the outbound relay cell <b>cell</b> for the hop
+ * <b>layer_hint</b> on <b>circ</b>, then encrypt it once for every hop
+ * from <b>layer_hint</b> back to the first hop.
+ *
+ * Return -1 if the crypto fails, else return 0.
+ */
+int
+relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *circ,
+                            crypt_path_t *layer_hint)
+{
+  crypt_path_t *thishop; /* counter for repeated crypts */
+
+  relay_set_digest(layer_hint->crypto.f_digest, cell);
+
+  thishop = layer_hint;
+  /* moving from farthest to nearest hop */
+  do {
+    tor_assert(thishop);
+    /* XXXX RD This is a bug, right? */
+    log_debug(LD_OR,"crypting a layer of the relay cell.");
+    if (relay_crypt_one_payload(thishop->crypto.f_crypto,
+                                cell->payload, 1) < 0) {
+      return -1;
+    }
+
+    thishop = thishop->prev;
+  } while (thishop != circ->cpath->prev);
+
+  return 0;
+}
+
+/** Set the digest of the inbound relay cell <b>cell</b>, which originates
+ * at this hop of <b>or_circ</b>, and encrypt it.
+ *
+ * Return -1 if the crypto fails, else return 0.
+ */
+int
+relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ)
+{
+  relay_set_digest(or_circ->crypto.b_digest, cell);
+  return relay_crypt_one_payload(or_circ->crypto.b_crypto, cell->payload, 1);
+}
+
@@ -18,6 +18,7 @@
 #include "config.h"
 #include "connection.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -1034,6 +1035,246 @@ compare_signed_descriptors_by_age_(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
+/** Return a newly allocated list of every signed_descriptor_t that belongs
+ * in <b>store</b>, oldest first. */
+static smartlist_t *
+router_store_list_descriptors(desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = smartlist_new();
+  if (store->type == EXTRAINFO_STORE) {
+    eimap_iter_t *iter;
+    for (iter = eimap_iter_init(routerlist->extra_info_map);
+         !eimap_iter_done(iter);
+         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
+      const char *key;
+      extrainfo_t *ei;
+      eimap_iter_get(iter, &key, &ei);
+      smartlist_add(signed_descriptors, &ei->cache_info);
+    }
+  } else {
+    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                      smartlist_add(signed_descriptors, sd));
+    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+                      smartlist_add(signed_descriptors, &ri->cache_info));
+  }
+
+  /* We sort the routers by age to enhance locality on disk. */
+  smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
+  return signed_descriptors;
+}
+
+#ifndef _WIN32
+/** Last identifier that we gave to a store rebuild. */
+static uint64_t store_rebuild_counter = 0;
+
+/** Release all storage held by <b>job</b>. */
+static void
+store_rebuild_job_free(store_rebuild_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->fname);
+  tor_free(job->body);
+  digestmap_free(job->written, NULL);
+  tor_free(job->offsets);
+  tor_free(job);
+}
+
+/** Worker thread function: write out the snapshot in <b>job_</b>. */
+STATIC workqueue_reply_t
+store_rebuild_threadfn(void *state_, void *job_)
+{
+  store_rebuild_job_t *job = job_;
+  (void)state_;
+  job->write_ok =
+    write_bytes_to_file(job->fname, job->body, job->body_len, 1) == 0;
+  tor_free(job->body);
+  return WQ_RPL_REPLY;
+}
+
+/** Replace the journal of <b>store</b> with the descriptors in
+ * <b>signed_descriptors</b> that we have marked as saved in it.  Return 0 on
+ * success, -1 on failure. */
+static int
+router_store_rewrite_journal(desc_store_t *store,
+                             smartlist_t *signed_descriptors)
+{
+  smartlist_t *chunk_list = smartlist_new();
+  char *fname = get_datadir_fname_suffix(store->fname_base, ".new");
+  size_t len = 0;
+  int r;
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    sized_chunk_t *c;
+    if (sd->saved_location != SAVED_IN_JOURNAL)
+      continue;
+    c = tor_malloc(sizeof(sized_chunk_t));
+    c->bytes = signed_descriptor_get_body_impl(sd, 1);
+    c->len = sd->signed_descriptor_len + sd->annotations_len;
+    sd->saved_offset = len;
+    len += c->len;
+    smartlist_add(chunk_list, c);
+  } SMARTLIST_FOREACH_END(sd);
+
+  r = write_chunks_to_file(fname, chunk_list, 1, 1);
+  if (r == 0)
+    store->journal_len = len;
+  else
+    log_warn(LD_FS, "Error rewriting %s journal.", store->description);
+
+  SMARTLIST_FOREACH(chunk_list, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(chunk_list);
+  tor_free(fname);
+  return r;
+}
+
+/** Main thread function: a worker has written the new store file for
+ * <b>job_</b>.  Unless the rebuild was cancelled, swap it in for the old
+ * store, point our descriptors at it, and rewrite the journal to hold
+ * whatever arrived in the meantime. */
+STATIC void
+store_rebuild_replyfn(void *job_)
+{
+  store_rebuild_job_t *job = job_;
+  desc_store_t *store = NULL;
+  smartlist_t *signed_descriptors = NULL;
+  tor_mmap_t *new_mmap;
+  char *fname = NULL;
+  size_t kept_len = 0;
+
+  if (routerlist) {
+    store = (job->type == EXTRAINFO_STORE) ?
+      &routerlist->extrainfo_store : &routerlist->desc_store;
+  }
+  if (!store || store->pending_rebuild != job->id) {
+    log_info(LD_DIR, "Discarding a cancelled store rebuild.");
+    if (job->write_ok)
+      unlink(job->fname);
+    goto done;
+  }
+  store->pending_rebuild = 0;
+  if (!job->write_ok) {
+    log_warn(LD_FS, "Error writing %s to disk.", store->description);
+    goto done;
+  }
+
+  /* Anything that lives in the old store, but isn't in the new one, needs
+   * its own copy of its body before the old store goes away. */
+  signed_descriptors = router_store_list_descriptors(store);
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    if (sd->saved_location == SAVED_IN_CACHE &&
+        !digestmap_get(job->written, sd->signed_descriptor_digest)) {
+      const char *body = signed_descriptor_get_body_impl(sd, 1);
+      char *copy = tor_memdup_nulterm(body, sd->signed_descriptor_len +
+                                      sd->annotations_len);
+      tor_free(sd->signed_descriptor_body);
+      sd->signed_descriptor_body = copy;
+      sd->saved_location = SAVED_IN_JOURNAL;
+    }
+  } SMARTLIST_FOREACH_END(sd);
+
+  /* The old store stays mapped after we replace it, so our descriptors are
+   * valid until we point them at the new one. */
+  fname = get_datadir_fname(store->fname_base);
+  if (replace_file(job->fname, fname) < 0) {
+    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+    unlink(job->fname);
+    goto done;
+  }
+  errno = 0;
+  new_mmap = tor_mmap_file(fname);
+  if (!new_mmap) {
+    if (job->body_len)
+      log_warn(LD_FS, "Unable to mmap new descriptor file at '%s'.", fname);
+    /* Keep the old mapping, so that what we've marked as cached stays
+     * readable; the journal below will still hold everything new. */
+  } else {
+    SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+      const off_t *offp = digestmap_get(job->written,
+                                        sd->signed_descriptor_digest);
+      size_t len = sd->signed_descriptor_len + sd->annotations_len;
+      if (!offp)
+        continue;
+      tor_assert((size_t)*offp + len <= new_mmap->size);
+      tor_free(sd->signed_descriptor_body);
+      sd->saved_offset = *offp;
+      sd->saved_location = SAVED_IN_CACHE;
+      kept_len += len;
+    } SMARTLIST_FOREACH_END(sd);
+
+    if (store->mmap && tor_munmap_file(store->mmap) != 0)
+      log_warn(LD_FS, "Unable to munmap route store in %s", fname);
+    store->mmap = new_mmap;
+    store->store_len = new_mmap->size;
+    store->bytes_dropped = new_mmap->size - kept_len;
+  }
+
+  router_store_rewrite_journal(store, signed_descriptors);
+  log_info(LD_DIR, "Done rebuilding %s cache in the background.",
+           store->description);
+
+ done:
+  smartlist_free(signed_descriptors);
+  tor_free(fname);
+  store_rebuild_job_free(job);
+}
+
+/** Copy every descriptor in <b>signed_descriptors</b> that we want to save
+ * in <b>store</b>, and hand the copy to a worker thread to write out as the
+ * new store.  Return 0 on success, or -1 if we couldn't queue the work, in
+ * which case the caller should rebuild the store itself. */
+STATIC int
+router_rebuild_store_in_background(desc_store_t *store,
+                                   smartlist_t *signed_descriptors)
+{
+  store_rebuild_job_t *job;
+  size_t len = 0;
+  char *cp, *suffix = NULL;
+  int i = 0;
+
+  SMARTLIST_FOREACH(signed_descriptors, signed_descriptor_t *, sd,
+    if (!sd->do_not_cache)
+      len += sd->signed_descriptor_len + sd->annotations_len);
+
+  job = tor_malloc_zero(sizeof(store_rebuild_job_t));
+  job->id = ++store_rebuild_counter;
+  job->type = store->type;
+  /* Name the file after the job: a superseded rebuild must never write or
+   * unlink the file of the rebuild that replaced it. */
+  tor_asprintf(&suffix, ".bg."U64_FORMAT, U64_PRINTF_ARG(job->id));
+  job->fname = get_datadir_fname_suffix(store->fname_base, suffix);
+  tor_free(suffix);
+  job->body_len = len;
+  job->body = cp = tor_malloc(len + 1);
+  job->written = digestmap_new();
+  job->offsets = tor_calloc(smartlist_len(signed_descriptors) + 1,
+                            sizeof(off_t));
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    size_t sdlen = sd->signed_descriptor_len + sd->annotations_len;
+    if (sd->do_not_cache)
+      continue;
+    memcpy(cp, signed_descriptor_get_body_impl(sd, 1), sdlen);
+    job->offsets[i] = cp - job->body;
+    digestmap_set(job->written, sd->signed_descriptor_digest,
+                  &job->offsets[i]);
+    cp += sdlen;
+    ++i;
+  } SMARTLIST_FOREACH_END(sd);
+  tor_assert(cp == job->body + len);
+
+  if (cpuworker_queue_work(store_rebuild_threadfn,
+                           store_rebuild_replyfn, job) < 0) {
+    store_rebuild_job_free(job);
+    return -1;
+  }
+  store->pending_rebuild = job->id;
+  log_info(LD_DIR, "Rebuilding %s cache in the background...",
+           store->description);
+  return 0;
+}
+#endif
+
 #define RRS_FORCE 1
 #define RRS_DONT_REMOVE_OLD 2
 
@@ -1056,6 +1297,10 @@ router_rebuild_store(int flags, desc_store_t *store)
   int had_any;
   int force = flags & RRS_FORCE;
 
+  if (!force && store->pending_rebuild) {
+    r = 0; /* A worker is already on it. */
+    goto done;
+  }
   if (!force && !router_should_rebuild_store(store)) {
     r = 0;
     goto done;
@@ -1075,6 +1320,23 @@ router_rebuild_store(int flags, desc_store_t *store)
   if (!(flags & RRS_DONT_REMOVE_OLD))
     routerlist_remove_old_routers();
 
+  signed_descriptors = router_store_list_descriptors(store);
+
+  /* If a worker is writing a rebuilt store, its results are about to be out
+   * of date. */
+  store->pending_rebuild = 0;
+
+#ifndef _WIN32
+  /* Windows won't let us replace the store while it's mapped, so we only do
+   * this in the background elsewhere.  Nor under the sandbox, which can't
+   * know our per-rebuild filenames in advance. */
+  if (!force && cpuworkers_running() && !sandbox_is_active() &&
+      router_rebuild_store_in_background(store, signed_descriptors) == 0) {
+    r = 0;
+    goto done;
+  }
+#endif
+
   log_info(LD_DIR, "Rebuilding %s cache", store->description);
 
   fname = get_datadir_fname(store->fname_base);
@@ -1082,27 +1344,6 @@ router_rebuild_store(int flags, desc_store_t *store)
 
   chunk_list = smartlist_new();
 
-  /* We sort the routers by age to enhance locality on disk. */
-  signed_descriptors = smartlist_new();
-  if (store->type == EXTRAINFO_STORE) {
-    eimap_iter_t *iter;
-    for (iter = eimap_iter_init(routerlist->extra_info_map);
-         !eimap_iter_done(iter);
-         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
-      const char *key;
-      extrainfo_t *ei;
-      eimap_iter_get(iter, &key, &ei);
-      smartlist_add(signed_descriptors, &ei->cache_info);
-    }
-  } else {
-    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-                      smartlist_add(signed_descriptors, sd));
-    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-                      smartlist_add(signed_descriptors, &ri->cache_info));
-  }
-
-  smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
-
   /* Now, add the appropriate members to chunk_list */
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
       sized_chunk_t *c;
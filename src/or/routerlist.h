@@ -242,6 +242,38 @@ MOCK_DECL(STATIC void, initiate_descriptor_downloads,
           (const routerstatus_t *source, int purpose, smartlist_t *digests,
            int lo, int hi, int pds_flags));
 
+#ifndef _WIN32
+#include "workqueue.h"
+
+/** A snapshot of a descriptor store for a worker thread to write to disk,
+ * while the main thread keeps using the old store file. */
+typedef struct store_rebuild_job_t {
+  /** Identifier of this rebuild; see desc_store_t.pending_rebuild. */
+  uint64_t id;
+  /** Which store are we rebuilding? */
+  store_type_t type;
+  /** File that the worker writes; we rename it over the store once it's
+   * done. */
+  char *fname;
+  /** The contents of the new store. */
+  char *body;
+  /** Length of <b>body</b>. */
+  size_t body_len;
+  /** Map from the digest of each descriptor in <b>body</b> to a pointer to
+   * its offset there, in <b>offsets</b>. */
+  digestmap_t *written;
+  /** The offset of each descriptor in <b>body</b>. */
+  off_t *offsets;
+  /** Set by the worker: true iff we wrote <b>fname</b> successfully. */
+  int write_ok;
+} store_rebuild_job_t;
+
+STATIC workqueue_reply_t store_rebuild_threadfn(void *state_, void *job_);
+STATIC void store_rebuild_replyfn(void *job_);
+STATIC int router_rebuild_store_in_background(desc_store_t *store,
+                                            smartlist_t *signed_descriptors);
+#endif
+
 #endif
 
 #endif
@@ -14,6 +14,7 @@
 #include "or.h"
 #include "config.h"
 #include "circuitstats.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "policies.h"
@@ -28,221 +29,13 @@
 #include "routerparse.h"
 #include "entrynodes.h"
 #include "torcert.h"
+#include "ht.h"
 
 #undef log
 #include <math.h>
 
 /****************************************************************************/
 
-/** Enumeration of possible token types.  The ones starting with K_ correspond
- * to directory 'keywords'. ERR_ is an error in the tokenizing process, EOF_
- * is an end-of-file marker, and NIL_ is used to encode not-a-token.
- */
-typedef enum {
-  K_ACCEPT = 0,
-  K_ACCEPT6,
-  K_DIRECTORY_SIGNATURE,
-  K_RECOMMENDED_SOFTWARE,
-  K_REJECT,
-  K_REJECT6,
-  K_ROUTER,
-  K_SIGNED_DIRECTORY,
-  K_SIGNING_KEY,
-  K_ONION_KEY,
-  K_ONION_KEY_NTOR,
-  K_ROUTER_SIGNATURE,
-  K_PUBLISHED,
-  K_RUNNING_ROUTERS,
-  K_ROUTER_STATUS,
-  K_PLATFORM,
-  K_OPT,
-  K_BANDWIDTH,
-  K_CONTACT,
-  K_NETWORK_STATUS,
-  K_UPTIME,
-  K_DIR_SIGNING_KEY,
-  K_FAMILY,
-  K_FINGERPRINT,
-  K_HIBERNATING,
-  K_READ_HISTORY,
-  K_WRITE_HISTORY,
-  K_NETWORK_STATUS_VERSION,
-  K_DIR_SOURCE,
-  K_DIR_OPTIONS,
-  K_CLIENT_VERSIONS,
-  K_SERVER_VERSIONS,
-  K_OR_ADDRESS,
-  K_ID,
-  K_P,
-  K_P6,
-  K_R,
-  K_A,
-  K_S,
-  K_V,
-  K_W,
-  K_M,
-  K_EXTRA_INFO,
-  K_EXTRA_INFO_DIGEST,
-  K_CACHES_EXTRA_INFO,
-  K_HIDDEN_SERVICE_DIR,
-  K_ALLOW_SINGLE_HOP_EXITS,
-  K_IPV6_POLICY,
-  K_ROUTER_SIG_ED25519,
-  K_IDENTITY_ED25519,
-  K_MASTER_KEY_ED25519,
-  K_ONION_KEY_CROSSCERT,
-  K_NTOR_ONION_KEY_CROSSCERT,
-
-  K_DIRREQ_END,
-  K_DIRREQ_V2_IPS,
-  K_DIRREQ_V3_IPS,
-  K_DIRREQ_V2_REQS,
-  K_DIRREQ_V3_REQS,
-  K_DIRREQ_V2_SHARE,
-  K_DIRREQ_V3_SHARE,
-  K_DIRREQ_V2_RESP,
-  K_DIRREQ_V3_RESP,
-  K_DIRREQ_V2_DIR,
-  K_DIRREQ_V3_DIR,
-  K_DIRREQ_V2_TUN,
-  K_DIRREQ_V3_TUN,
-  K_ENTRY_END,
-  K_ENTRY_IPS,
-  K_CELL_END,
-  K_CELL_PROCESSED,
-  K_CELL_QUEUED,
-  K_CELL_TIME,
-  K_CELL_CIRCS,
-  K_EXIT_END,
-  K_EXIT_WRITTEN,
-  K_EXIT_READ,
-  K_EXIT_OPENED,
-
-  K_DIR_KEY_CERTIFICATE_VERSION,
-  K_DIR_IDENTITY_KEY,
-  K_DIR_KEY_PUBLISHED,
-  K_DIR_KEY_EXPIRES,
-  K_DIR_KEY_CERTIFICATION,
-  K_DIR_KEY_CROSSCERT,
-  K_DIR_ADDRESS,
-
-  K_VOTE_STATUS,
-  K_VALID_AFTER,
-  K_FRESH_UNTIL,
-  K_VALID_UNTIL,
-  K_VOTING_DELAY,
-
-  K_KNOWN_FLAGS,
-  K_PARAMS,
-  K_BW_WEIGHTS,
-  K_VOTE_DIGEST,
-  K_CONSENSUS_DIGEST,
-  K_ADDITIONAL_DIGEST,
-  K_ADDITIONAL_SIGNATURE,
-  K_CONSENSUS_METHODS,
-  K_CONSENSUS_METHOD,
-  K_LEGACY_DIR_KEY,
-  K_DIRECTORY_FOOTER,
-  K_PACKAGE,
-
-  A_PURPOSE,
-  A_LAST_LISTED,
-  A_UNKNOWN_,
-
-  R_RENDEZVOUS_SERVICE_DESCRIPTOR,
-  R_VERSION,
-  R_PERMANENT_KEY,
-  R_SECRET_ID_PART,
-  R_PUBLICATION_TIME,
-  R_PROTOCOL_VERSIONS,
-  R_INTRODUCTION_POINTS,
-  R_SIGNATURE,
-
-  R_IPO_IDENTIFIER,
-  R_IPO_IP_ADDRESS,
-  R_IPO_ONION_PORT,
-  R_IPO_ONION_KEY,
-  R_IPO_SERVICE_KEY,
-
-  C_CLIENT_NAME,
-  C_DESCRIPTOR_COOKIE,
-  C_CLIENT_KEY,
-
-  ERR_,
-  EOF_,
-  NIL_
-} directory_keyword;
-
-#define MIN_ANNOTATION A_PURPOSE
-#define MAX_ANNOTATION A_UNKNOWN_
-
-/** Structure to hold a single directory token.
- *
- * We parse a directory by breaking it into "tokens", each consisting
- * of a keyword, a line full of arguments, and a binary object.  The
- * arguments and object are both optional, depending on the keyword
- * type.
- *
- * This structure is only allocated in memareas; do not allocate it on
- * the heap, or token_clear() won't work.
- */
-typedef struct directory_token_t {
-  directory_keyword tp;        /**< Type of the token. */
-  int n_args:30;               /**< Number of elements in args */
-  char **args;                 /**< Array of arguments from keyword line. */
-
-  char *object_type;           /**< -----BEGIN [object_type]-----*/
-  size_t object_size;          /**< Bytes in object_body */
-  char *object_body;           /**< Contents of object, base64-decoded. */
-
-  crypto_pk_t *key;        /**< For public keys only.  Heap-allocated. */
-
-  char *error;                 /**< For ERR_ tokens only. */
-} directory_token_t;
-
-/* ********************************************************************** */
-
-/** We use a table of rules to decide how to parse each token type. */
-
-/** Rules for whether the keyword needs an object. */
-typedef enum {
-  NO_OBJ,        /**< No object, ever. */
-  NEED_OBJ,      /**< Object is required. */
-  NEED_SKEY_1024,/**< Object is required, and must be a 1024 bit private key */
-  NEED_KEY_1024, /**< Object is required, and must be a 1024 bit public key */
-  NEED_KEY,      /**< Object is required, and must be a public key. */
-  OBJ_OK,        /**< Object is optional. */
-} obj_syntax;
-
-#define AT_START 1
-#define AT_END 2
-
-/** Determines the parsing rules for a single token type. */
-typedef struct token_rule_t {
-  /** The string value of the keyword identifying the type of item. */
-  const char *t;
-  /** The corresponding directory_keyword enum. */
-  directory_keyword v;
-  /** Minimum number of arguments for this item */
-  int min_args;
-  /** Maximum number of arguments for this item */
-  int max_args;
-  /** If true, we concatenate all arguments for this item into a single
-   * string. */
-  int concat_args;
-  /** Requirements on object syntax for this item. */
-  obj_syntax os;
-  /** Lowest number of times this item may appear in a document. */
-  int min_cnt;
-  /** Highest number of times this item may appear in a document. */
-  int max_cnt;
-  /** One or more of AT_START/AT_END to limit where the item may appear in a
-   * document. */
-  int pos;
-  /** True iff this token is an annotation. */
-  int is_annotation;
-} token_rule_t;
-
 /*
  * Helper macros to define token tables.  's' is a string, 't' is a
  * directory_keyword, 'a' is a trio of argument multiplicities, and 'o' is an
@@ -281,7 +74,7 @@ typedef struct token_rule_t {
 #define EQ(n)       n,n,0
 
 /** List of tokens recognized in router descriptors */
-static token_rule_t routerdesc_token_table[] = {
+STATIC token_rule_t routerdesc_token_table[] = {
   T0N("reject",              K_REJECT,              ARGS,    NO_OBJ ),
   T0N("accept",              K_ACCEPT,              ARGS,    NO_OBJ ),
   T0N("reject6",             K_REJECT6,             ARGS,    NO_OBJ ),
@@ -323,7 +116,7 @@ static token_rule_t routerdesc_token_table[] = {
 };
 
 /** List of tokens recognized in extra-info documents. */
-static token_rule_t extrainfo_token_table[] = {
+STATIC token_rule_t extrainfo_token_table[] = {
   T1_END( "router-signature",    K_ROUTER_SIGNATURE,    NO_ARGS, NEED_OBJ ),
   T1( "published",           K_PUBLISHED,       CONCAT_ARGS, NO_OBJ ),
   T01("identity-ed25519",    K_IDENTITY_ED25519,    NO_ARGS, NEED_OBJ ),
@@ -556,10 +349,6 @@ static int tokenize_string(memarea_t *area,
                            smartlist_t *out,
                            token_rule_t *table,
                            int flags);
-static directory_token_t *get_next_token(memarea_t *area,
-                                         const char **s,
-                                         const char *eos,
-                                         token_rule_t *table);
 #define CST_CHECK_AUTHORITY   (1<<0)
 #define CST_NO_CHECK_OBJTYPE  (1<<1)
 static int check_signature_token(const char *digest,
@@ -931,6 +720,225 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
+/** Worker function for check_rsa_sigs(): check the signature in
+ * <b>check_</b>, an rsa_sig_check_t. */
+static void
+check_rsa_sig_job(void *check_)
+{
+  rsa_sig_check_t *check = check_;
+  size_t keysize = crypto_pk_keysize(check->pkey);
+  char *signed_digest = tor_malloc(keysize);
+  int r = crypto_pk_public_checksig(check->pkey, signed_digest, keysize,
+                                    check->sig, check->sig_len);
+  check->ok = r >= (int)check->digest_len &&
+    tor_memeq(check->digest, signed_digest, check->digest_len);
+  tor_free(signed_digest);
+}
+
+/** Check each of the <b>n_checks</b> RSA signatures in <b>checks</b>,
+ * spreading the work across our worker threads if we have any, and set the
+ * <b>ok</b> field of each one.  Don't return until all the checks are
+ * done. */
+void
+check_rsa_sigs(rsa_sig_check_t *checks, int n_checks)
+{
+  void **args;
+  int i;
+  if (n_checks <= 0)
+    return;
+  args = tor_calloc(n_checks, sizeof(void*));
+  for (i = 0; i < n_checks; ++i)
+    args[i] = &checks[i];
+  cpuworker_run_batch(check_rsa_sig_job, args, n_checks);
+  tor_free(args);
+}
+
+/** The signatures on one descriptor, held back by
+ * router_parse_list_from_string() so that it can check the signatures on
+ * every descriptor that it parses together. */
+typedef struct desc_sig_checks_t {
+  /** The routerinfo_t or extrainfo_t that these signatures cover. */
+  void *desc;
+  /** True iff <b>desc</b> is an extrainfo_t. */
+  int is_extrainfo;
+  /** The start of the text that we parsed <b>desc</b> from, to dump if its
+   * signatures turn out bad.  It points into the caller's string. */
+  const char *desc_text;
+  /** True iff we'd be willing to download the same descriptor again if only
+   * its RSA signature turns out bad: that signature isn't covered by the
+   * descriptor digest, so someone else may have a good copy. */
+  int can_dl_again;
+  /** True iff we could compute <b>raw_digest</b>. */
+  int have_raw_digest;
+  /** The digest of the descriptor, to report if it turns out invalid. */
+  char raw_digest[DIGEST_LEN];
+  /** True iff <b>rsa</b> holds a signature to check. */
+  int has_rsa;
+  /** The RSA signature on the descriptor.  Its key is our own reference,
+   * and its signature and digest point into <b>rsa_sig</b> and
+   * <b>rsa_digest</b>. */
+  rsa_sig_check_t rsa;
+  /** A copy of the RSA signature. */
+  char *rsa_sig;
+  /** The digest that the RSA signature should hold. */
+  char rsa_digest[DIGEST_LEN];
+  /** How many of <b>ed_checks</b> are in use? */
+  int n_ed_checks;
+  /** The ed25519 signatures to check.  They point into <b>ed_pubkeys</b>
+   * and <b>ed_msgs</b>, not into the descriptor. */
+  ed25519_checkable_t ed_checks[3];
+  /** Copies of the keys that <b>ed_checks</b> use. */
+  ed25519_public_key_t ed_pubkeys[3];
+  /** Copies of the messages that <b>ed_checks</b> cover. */
+  uint8_t *ed_msgs[3];
+} desc_sig_checks_t;
+
+/** Remember copies of the <b>n_checks</b> ed25519 signatures in
+ * <b>checks</b>, so that we can check them later as part of <b>dc</b>. */
+static void
+desc_sig_checks_add_ed(desc_sig_checks_t *dc,
+                       const ed25519_checkable_t *checks, int n_checks)
+{
+  int i;
+  tor_assert(dc->n_ed_checks == 0);
+  tor_assert(n_checks <= (int)ARRAY_LENGTH(dc->ed_checks));
+  dc->n_ed_checks = n_checks;
+  for (i = 0; i < n_checks; ++i) {
+    memcpy(&dc->ed_pubkeys[i], checks[i].pubkey,
+           sizeof(ed25519_public_key_t));
+    dc->ed_msgs[i] = tor_memdup(checks[i].msg, checks[i].len);
+    memcpy(&dc->ed_checks[i].signature, &checks[i].signature,
+           sizeof(ed25519_signature_t));
+    dc->ed_checks[i].pubkey = &dc->ed_pubkeys[i];
+    dc->ed_checks[i].msg = dc->ed_msgs[i];
+    dc->ed_checks[i].len = checks[i].len;
+  }
+}
+
+/** Remember a copy of the RSA signature in <b>tok</b>, which should hold
+ * the DIGEST_LEN-byte <b>digest</b> signed with <b>pkey</b>, so that we can
+ * check it later as part of <b>dc</b>. */
+static void
+desc_sig_checks_add_rsa(desc_sig_checks_t *dc, const char *digest,
+                        const directory_token_t *tok, crypto_pk_t *pkey)
+{
+  tor_assert(!dc->has_rsa);
+  dc->has_rsa = 1;
+  memcpy(dc->rsa_digest, digest, DIGEST_LEN);
+  dc->rsa.pkey = crypto_pk_dup_key(pkey);
+  dc->rsa_sig = tor_memdup(tok->object_body, tok->object_size);
+  dc->rsa.sig = dc->rsa_sig;
+  dc->rsa.sig_len = tok->object_size;
+  dc->rsa.digest = dc->rsa_digest;
+  dc->rsa.digest_len = DIGEST_LEN;
+}
+
+/** Release all storage held by <b>dc</b>, but not the descriptor it
+ * covers. */
+static void
+desc_sig_checks_free(desc_sig_checks_t *dc)
+{
+  int i;
+  if (!dc)
+    return;
+  if (dc->has_rsa)
+    crypto_pk_free(dc->rsa.pkey);
+  tor_free(dc->rsa_sig);
+  for (i = 0; i < dc->n_ed_checks; ++i)
+    tor_free(dc->ed_msgs[i]);
+  tor_free(dc);
+}
+
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                 int cache_copy, int allow_annotations,
+                                 const char *prepend_annotations,
+                                 int *can_dl_again_out,
+                                 desc_sig_checks_t **sig_checks_out);
+static extrainfo_t *extrainfo_parse_entry_impl(const char *s,
+                                 const char *end, int cache_copy,
+                                 struct digest_ri_map_t *routermap,
+                                 int *can_dl_again_out,
+                                 desc_sig_checks_t **sig_checks_out);
+
+/** Check every signature in <b>pending</b>, a list of desc_sig_checks_t:
+ * the RSA signatures in parallel on our worker threads, and the ed25519
+ * signatures in one batch.  Remove from <b>dest</b> and free every
+ * descriptor with a bad signature.  If <b>invalid_digests_out</b> is
+ * provided, add to it the digest of every such descriptor that we wouldn't
+ * download again.  Free the members of <b>pending</b>, and empty it. */
+static void
+check_deferred_sigs(smartlist_t *pending, smartlist_t *dest,
+                    smartlist_t *invalid_digests_out)
+{
+  ed25519_checkable_t *ed_checks;
+  rsa_sig_check_t *rsa_checks;
+  int *ed_okay;
+  int n_ed = 0, n_rsa = 0, i, all_ed_ok;
+
+  if (!smartlist_len(pending))
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(pending, desc_sig_checks_t *, dc) {
+    n_ed += dc->n_ed_checks;
+    n_rsa += dc->has_rsa;
+  } SMARTLIST_FOREACH_END(dc);
+  ed_checks = tor_calloc(n_ed + 1, sizeof(ed25519_checkable_t));
+  ed_okay = tor_calloc(n_ed + 1, sizeof(int));
+  rsa_checks = tor_calloc(n_rsa + 1, sizeof(rsa_sig_check_t));
+  n_ed = n_rsa = 0;
+  SMARTLIST_FOREACH_BEGIN(pending, desc_sig_checks_t *, dc) {
+    memcpy(&ed_checks[n_ed], dc->ed_checks,
+           dc->n_ed_checks*sizeof(ed25519_checkable_t));
+    n_ed += dc->n_ed_checks;
+    if (dc->has_rsa)
+      memcpy(&rsa_checks[n_rsa++], &dc->rsa, sizeof(rsa_sig_check_t));
+  } SMARTLIST_FOREACH_END(dc);
+
+  check_rsa_sigs(rsa_checks, n_rsa);
+  all_ed_ok = n_ed == 0 ||
+    ed25519_checksig_batch(ed_okay, ed_checks, n_ed) == 0;
+
+  /* Go through the results in order, so our logs and our choices are the
+   * same as if we had checked each descriptor as we parsed it. */
+  n_ed = n_rsa = 0;
+  SMARTLIST_FOREACH_BEGIN(pending, desc_sig_checks_t *, dc) {
+    const char *doctype =
+      dc->is_extrainfo ? "extra-info document" : "router descriptor";
+    int bad = 0, can_dl_again = 0;
+    for (i = 0; i < dc->n_ed_checks && !all_ed_ok; ++i)
+      bad |= !ed_okay[n_ed+i];
+    n_ed += dc->n_ed_checks;
+    if (bad)
+      log_warn(LD_DIR, "Incorrect ed25519 signature(s) on %s", doctype);
+    if (dc->has_rsa && !rsa_checks[n_rsa++].ok && !bad) {
+      log_warn(LD_DIR, "Error reading %s: signature does not match.",
+               doctype);
+      bad = 1;
+      can_dl_again = dc->can_dl_again;
+    }
+    if (bad) {
+      int idx = smartlist_pos(dest, dc->desc);
+      dump_desc(dc->desc_text, dc->is_extrainfo ?
+                "extra-info descriptor" : "router descriptor");
+      if (idx >= 0)
+        smartlist_del_keeporder(dest, idx);
+      if (dc->is_extrainfo)
+        extrainfo_free(dc->desc);
+      else
+        routerinfo_free(dc->desc);
+      if (dc->have_raw_digest && !can_dl_again && invalid_digests_out)
+        smartlist_add(invalid_digests_out,
+                      tor_memdup(dc->raw_digest, DIGEST_LEN));
+    }
+    desc_sig_checks_free(dc);
+  } SMARTLIST_FOREACH_END(dc);
+  smartlist_clear(pending);
+
+  tor_free(ed_checks);
+  tor_free(ed_okay);
+  tor_free(rsa_checks);
+}
+
 /** Given a string *<b>s</b> containing a concatenated sequence of router
  * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
  * them and stores the result in <b>dest</b>.  All routers are marked running
@@ -960,6 +968,7 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  smartlist_t *pending_sig_checks = smartlist_new();
 
   tor_assert(s);
   tor_assert(*s);
@@ -975,6 +984,7 @@ router_parse_list_from_string(const char **s, const char *eos,
     char raw_digest[DIGEST_LEN];
     int have_raw_digest = 0;
     int dl_again = 0;
+    desc_sig_checks_t *sig_checks = NULL;
     if (find_start_of_next_router_or_extrainfo(s, eos, &have_extrainfo) < 0)
       break;
 
@@ -992,19 +1002,21 @@ router_parse_list_from_string(const char **s, const char *eos,
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
       have_raw_digest = router_get_extrainfo_hash(*s, end-*s, raw_digest) == 0;
-      extrainfo = extrainfo_parse_entry_from_string(*s, end,
+      extrainfo = extrainfo_parse_entry_impl(*s, end,
                                        saved_location != SAVED_IN_CACHE,
-                                       rl->identity_map, &dl_again);
+                                       rl->identity_map, &dl_again,
+                                       &sig_checks);
       if (extrainfo) {
         signed_desc = &extrainfo->cache_info;
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again,
+                                       &sig_checks);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -1025,10 +1037,19 @@ router_parse_list_from_string(const char **s, const char *eos,
       signed_desc->saved_location = saved_location;
       signed_desc->saved_offset = *s - start;
     }
+    if (sig_checks) {
+      sig_checks->desc = elt;
+      sig_checks->is_extrainfo = signed_desc->is_extrainfo;
+      sig_checks->have_raw_digest = have_raw_digest;
+      memcpy(sig_checks->raw_digest, raw_digest, DIGEST_LEN);
+      smartlist_add(pending_sig_checks, sig_checks);
+    }
     *s = end;
     smartlist_add(dest, elt);
   }
 
+  check_deferred_sigs(pending_sig_checks, dest, invalid_digests_out);
+  smartlist_free(pending_sig_checks);
   return 0;
 }
 
@@ -1120,6 +1141,21 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out, NULL);
+}
+
+/** As router_parse_entry_from_string(), but if <b>sig_checks_out</b> is
+ * provided, don't check the signatures on the descriptor: instead, on
+ * success, set *<b>sig_checks_out</b> to a new desc_sig_checks_t holding
+ * them.  The caller must check them before trusting the descriptor. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        desc_sig_checks_t **sig_checks_out)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1136,6 +1172,10 @@ router_parse_entry_from_string(const char *s, const char *end,
   int can_dl_again = 0;
 
   tor_assert(!allow_annotations || !prepend_annotations);
+  if (sig_checks_out) {
+    *sig_checks_out = tor_malloc_zero(sizeof(desc_sig_checks_t));
+    (*sig_checks_out)->desc_text = s_dup;
+  }
 
   if (!end) {
     end = s + strlen(s);
@@ -1481,7 +1521,9 @@ router_parse_entry_from_string(const char *s, const char *end,
       check[2].msg = d256;
       check[2].len = DIGEST256_LEN;
 
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
+      if (sig_checks_out) {
+        desc_sig_checks_add_ed(*sig_checks_out, check, 3);
+      } else if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
         log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
         goto err;
       }
@@ -1624,9 +1666,19 @@ router_parse_entry_from_string(const char *s, const char *end,
 
   /* We've checked everything that's covered by the hash. */
   can_dl_again = 1;
-  if (check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
-                            "router descriptor") < 0)
+  if (sig_checks_out) {
+    if (strcmp(tok->object_type, "SIGNATURE")) {
+      log_warn(LD_DIR, "Bad object type on router descriptor signature");
+      goto err;
+    }
+    desc_sig_checks_add_rsa(*sig_checks_out, digest, tok,
+                            router->identity_pkey);
+    (*sig_checks_out)->can_dl_again = can_dl_again;
+  } else if (check_signature_token(digest, DIGEST_LEN, tok,
+                                   router->identity_pkey, 0,
+                                   "router descriptor") < 0) {
     goto err;
+  }
 
   if (!router->platform) {
     router->platform = tor_strdup("<unknown>");
@@ -1637,6 +1689,10 @@ router_parse_entry_from_string(const char *s, const char *end,
   dump_desc(s_dup, "router descriptor");
   routerinfo_free(router);
   router = NULL;
+  if (sig_checks_out) {
+    desc_sig_checks_free(*sig_checks_out);
+    *sig_checks_out = NULL;
+  }
  done:
   tor_cert_free(ntor_cc_cert);
   if (tokens) {
@@ -1668,6 +1724,20 @@ extrainfo_t *
 extrainfo_parse_entry_from_string(const char *s, const char *end,
                             int cache_copy, struct digest_ri_map_t *routermap,
                             int *can_dl_again_out)
+{
+  return extrainfo_parse_entry_impl(s, end, cache_copy, routermap,
+                                    can_dl_again_out, NULL);
+}
+
+/** As extrainfo_parse_entry_from_string(), but if <b>sig_checks_out</b> is
+ * provided, don't check the signatures on the document: instead, on
+ * success, set *<b>sig_checks_out</b> to a new desc_sig_checks_t holding
+ * them.  The caller must check them before trusting the document. */
+static extrainfo_t *
+extrainfo_parse_entry_impl(const char *s, const char *end,
+                           int cache_copy, struct digest_ri_map_t *routermap,
+                           int *can_dl_again_out,
+                           desc_sig_checks_t **sig_checks_out)
 {
   extrainfo_t *extrainfo = NULL;
   char digest[128];
@@ -1681,6 +1751,10 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
    * parse that's covered by the hash. */
   int can_dl_again = 0;
 
+  if (sig_checks_out) {
+    *sig_checks_out = tor_malloc_zero(sizeof(desc_sig_checks_t));
+    (*sig_checks_out)->desc_text = s_dup;
+  }
   if (!end) {
     end = s + strlen(s);
   }
@@ -1813,7 +1887,9 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
       check[1].msg = d256;
       check[1].len = DIGEST256_LEN;
 
-      if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
+      if (sig_checks_out) {
+        desc_sig_checks_add_ed(*sig_checks_out, check, 2);
+      } else if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
         log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
         goto err;
       }
@@ -1838,7 +1914,14 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
     goto err;
   }
 
-  if (key) {
+  if (key && sig_checks_out) {
+    note_crypto_pk_op(VERIFY_RTR);
+    desc_sig_checks_add_rsa(*sig_checks_out, digest, tok, key);
+    (*sig_checks_out)->can_dl_again = can_dl_again;
+    if (router)
+      extrainfo->cache_info.send_unencrypted =
+        router->cache_info.send_unencrypted;
+  } else if (key) {
     note_crypto_pk_op(VERIFY_RTR);
     if (check_signature_token(digest, DIGEST_LEN, tok, key, 0,
                               "extra-info") < 0)
@@ -1858,6 +1941,10 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
   dump_desc(s_dup, "extra-info descriptor");
   extrainfo_free(extrainfo);
   extrainfo = NULL;
+  if (sig_checks_out) {
+    desc_sig_checks_free(*sig_checks_out);
+    *sig_checks_out = NULL;
+  }
  done:
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
@@ -2140,29 +2227,17 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   return 0;
 }
 
-/** Given a string at *<b>s</b>, containing a routerstatus object, and an
- * empty smartlist at <b>tokens</b>, parse and return the first router status
- * object in the string, and advance *<b>s</b> to just after the end of the
- * router status.  Return NULL and advance *<b>s</b> on error.
- *
- * If <b>vote</b> and <b>vote_rs</b> are provided, don't allocate a fresh
- * routerstatus but use <b>vote_rs</b> instead.
- *
- * If <b>consensus_method</b> is nonzero, this routerstatus is part of a
- * consensus, and we should parse it according to the method used to
- * make that consensus.
- *
- * Parse according to the syntax used by the consensus flavor <b>flav</b>.
- **/
+/** Helper for routerstatus_parse_entry_from_string(): given the
+ * <b>tokens</b> of the router status object at <b>s</b>, build and return
+ * the router status.  Return NULL on error.  The other arguments are as for
+ * routerstatus_parse_entry_from_string(). */
 static routerstatus_t *
-routerstatus_parse_entry_from_string(memarea_t *area,
-                                     const char **s, smartlist_t *tokens,
+routerstatus_parse_entry_from_tokens(const char *s, smartlist_t *tokens,
                                      networkstatus_t *vote,
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav)
 {
-  const char *eos, *s_dup = *s;
   routerstatus_t *rs = NULL;
   directory_token_t *tok;
   char timebuf[ISO_TIME_LEN+1];
@@ -2175,12 +2250,6 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     flav = FLAV_NS;
   tor_assert(flav == FLAV_NS || flav == FLAV_MICRODESC);
 
-  eos = find_start_of_next_routerstatus(*s);
-
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
-    log_warn(LD_DIR, "Error tokenizing router status");
-    goto err;
-  }
   if (smartlist_len(tokens) < 1) {
     log_warn(LD_DIR, "Impossibly short router status");
     goto err;
@@ -2407,13 +2476,50 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (!strcasecmp(rs->nickname, UNNAMED_ROUTER_NICKNAME))
     rs->is_named = 0;
 
-  goto done;
+  return rs;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  dump_desc(s, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
-  rs = NULL;
- done:
+  return NULL;
+}
+
+/** Given a string at *<b>s</b>, containing a routerstatus object, and an
+ * empty smartlist at <b>tokens</b>, parse and return the first router status
+ * object in the string, and advance *<b>s</b> to just after the end of the
+ * router status.  Return NULL and advance *<b>s</b> on error.
+ *
+ * If <b>vote</b> and <b>vote_rs</b> are provided, don't allocate a fresh
+ * routerstatus but use <b>vote_rs</b> instead.
+ *
+ * If <b>consensus_method</b> is nonzero, this routerstatus is part of a
+ * consensus, and we should parse it according to the method used to
+ * make that consensus.
+ *
+ * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ **/
+static routerstatus_t *
+routerstatus_parse_entry_from_string(memarea_t *area,
+                                     const char **s, smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav)
+{
+  const char *eos;
+  routerstatus_t *rs = NULL;
+  tor_assert(tokens);
+
+  eos = find_start_of_next_routerstatus(*s);
+
+  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
+    log_warn(LD_DIR, "Error tokenizing router status");
+    dump_desc(*s, "routerstatus entry");
+  } else {
+    rs = routerstatus_parse_entry_from_tokens(*s, tokens, vote, vote_rs,
+                                              consensus_method, flav);
+  }
+
   SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   smartlist_clear(tokens);
   if (area) {
@@ -2425,6 +2531,114 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+/** How many routerstatus entries should each job tokenize when we parse a
+ * consensus? */
+#define ROUTERSTATUS_PER_TOKENIZE_JOB 256
+
+/** A run of consecutive routerstatus entries from a consensus, for one job
+ * to tokenize. */
+typedef struct rs_tokenize_job_t {
+  /** The start of each entry in the run, followed by the end of the last
+   * entry. */
+  const char **starts;
+  /** How many entries are in the run? */
+  int n_entries;
+  /** The memory area that holds all the tokens from this run. */
+  memarea_t *area;
+  /** Set by the job: for each entry, a list of its tokens, or NULL if it
+   * didn't tokenize. */
+  smartlist_t **tokens;
+} rs_tokenize_job_t;
+
+/** Tokenize every entry in the rs_tokenize_job_t <b>job_</b>.  This
+ * touches nothing but the job and the (immutable) token tables, so it's
+ * safe to run on a worker thread. */
+static void
+rs_tokenize_job_run(void *job_)
+{
+  rs_tokenize_job_t *job = job_;
+  smartlist_t *tokens;
+  int i;
+
+  for (i = 0; i < job->n_entries; ++i) {
+    tokens = smartlist_new();
+    if (tokenize_string(job->area, job->starts[i], job->starts[i+1], tokens,
+                        rtrstatus_token_table, 0)) {
+      SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+      smartlist_free(tokens);
+      tokens = NULL;
+    }
+    job->tokens[i] = tokens;
+  }
+}
+
+/** Parse every routerstatus entry at the start of <b>s</b>, from the
+ * consensus <b>ns</b> of flavor <b>flav</b>, and add them in order to
+ * ns-\>routerstatus_list, skipping any that are invalid.  Return a pointer
+ * to just after the last entry.
+ *
+ * We split the entries into runs, and tokenize the runs in parallel on our
+ * worker threads, each into its own memory area.  Then we build the
+ * routerstatuses from the tokens here in the main thread, since that can
+ * dump documents and use non-reentrant helpers like escaped(). */
+static const char *
+routerstatus_parse_consensus_entries(const char *s, networkstatus_t *ns,
+                                     consensus_flavor_t flav)
+{
+  smartlist_t *starts = smartlist_new();
+  rs_tokenize_job_t *jobs;
+  void **args;
+  int n_entries, n_jobs, i, j;
+
+  while (!strcmpstart(s, "r ")) {
+    smartlist_add(starts, (char*)s);
+    s = find_start_of_next_routerstatus(s);
+  }
+  n_entries = smartlist_len(starts);
+  smartlist_add(starts, (char*)s);
+
+  n_jobs = CEIL_DIV(n_entries, ROUTERSTATUS_PER_TOKENIZE_JOB);
+  jobs = tor_calloc(n_jobs, sizeof(rs_tokenize_job_t));
+  args = tor_calloc(n_jobs, sizeof(void*));
+  for (i = 0; i < n_jobs; ++i) {
+    jobs[i].starts = (const char **)starts->list +
+      i*ROUTERSTATUS_PER_TOKENIZE_JOB;
+    jobs[i].n_entries = MIN(ROUTERSTATUS_PER_TOKENIZE_JOB,
+                            n_entries - i*ROUTERSTATUS_PER_TOKENIZE_JOB);
+    jobs[i].area = memarea_new();
+    jobs[i].tokens = tor_calloc(jobs[i].n_entries, sizeof(smartlist_t *));
+    args[i] = &jobs[i];
+  }
+
+  cpuworker_run_batch(rs_tokenize_job_run, args, n_jobs);
+
+  for (i = 0; i < n_jobs; ++i) {
+    for (j = 0; j < jobs[i].n_entries; ++j) {
+      smartlist_t *tokens = jobs[i].tokens[j];
+      routerstatus_t *rs;
+      if (!tokens) {
+        log_warn(LD_DIR, "Error tokenizing router status");
+        dump_desc(jobs[i].starts[j], "routerstatus entry");
+        continue;
+      }
+      rs = routerstatus_parse_entry_from_tokens(jobs[i].starts[j], tokens,
+                                                NULL, NULL,
+                                                ns->consensus_method, flav);
+      if (rs)
+        smartlist_add(ns->routerstatus_list, rs);
+      SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+      smartlist_free(tokens);
+    }
+    tor_free(jobs[i].tokens);
+    memarea_drop_all(jobs[i].area);
+  }
+
+  tor_free(args);
+  tor_free(jobs);
+  smartlist_free(starts);
+  return s;
+}
+
 int
 compare_vote_routerstatus_entries(const void **_a, const void **_b)
 {
@@ -3174,8 +3388,10 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
-  while (!strcmpstart(s, "r ")) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
+  if (ns->type == NS_TYPE_CONSENSUS) {
+    s = routerstatus_parse_consensus_entries(s, ns, flav);
+  } else {
+    while (!strcmpstart(s, "r ")) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
       if (routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens, ns,
                                                rs, 0, 0))
@@ -3184,13 +3400,6 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
         tor_free(rs->version);
         tor_free(rs);
       }
-    } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav)))
-        smartlist_add(ns->routerstatus_list, rs);
     }
   }
   for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
@@ -4020,11 +4229,133 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 #undef MAX_ARGS
 }
 
+/** An entry in token_index_map: says that the keyword <b>kw</b> is
+ * recognized by rule number <b>idx</b> of the token table <b>table</b>. */
+typedef struct token_index_entry_t {
+  HT_ENTRY(token_index_entry_t) node;
+  /** The token table that this entry indexes. */
+  const token_rule_t *table;
+  /** The keyword, and its length.  Not necessarily NUL-terminated when we
+   * use this entry as a search key. */
+  const char *kw;
+  size_t kw_len;
+  /** The index of the keyword's rule in <b>table</b>. */
+  int idx;
+} token_index_entry_t;
+
+/** Helper for hash tables: return true iff <b>a</b> and <b>b</b> are the
+ * same keyword in the same table. */
+static INLINE int
+token_index_entries_eq_(const token_index_entry_t *a,
+                        const token_index_entry_t *b)
+{
+  return a->table == b->table && a->kw_len == b->kw_len &&
+    fast_memeq(a->kw, b->kw, a->kw_len);
+}
+
+/** Helper: return a hash of <b>a</b>'s table and keyword. */
+static INLINE unsigned int
+token_index_entry_hash_(const token_index_entry_t *a)
+{
+  return ((unsigned) siphash24g(a->kw, a->kw_len)) ^
+    ((unsigned) (uintptr_t) a->table);
+}
+
+/** Map from (token table, keyword) to the index of the keyword's rule in
+ * the table, so that get_next_token() doesn't have to compare each line
+ * against every rule in turn.  We build it for every table in
+ * routerparse_init(), and never modify it after that, so it's safe to read
+ * from any thread. */
+static HT_HEAD(token_index_map, token_index_entry_t)
+     token_index_map = HT_INITIALIZER();
+HT_PROTOTYPE(token_index_map, token_index_entry_t, node,
+             token_index_entry_hash_, token_index_entries_eq_)
+HT_GENERATE2(token_index_map, token_index_entry_t, node,
+             token_index_entry_hash_, token_index_entries_eq_,
+             0.6, tor_reallocarray_, tor_free_)
+
+/** Add every rule in <b>table</b> to token_index_map.  If a keyword
+ * appears twice, its first rule wins, as it would in a linear search. */
+static void
+token_index_add_table(const token_rule_t *table)
+{
+  token_index_entry_t *ent;
+  int i;
+
+  for (i = 0; table[i].t; ++i) {
+    ent = tor_malloc_zero(sizeof(token_index_entry_t));
+    ent->table = table;
+    ent->kw = table[i].t;
+    ent->kw_len = strlen(table[i].t);
+    ent->idx = i;
+    if (HT_FIND(token_index_map, &token_index_map, ent))
+      tor_free(ent);
+    else
+      HT_INSERT(token_index_map, &token_index_map, ent);
+  }
+}
+
+/** True iff routerparse_init() has built token_index_map. */
+static int token_index_built = 0;
+
+/** Return the index of the rule in <b>table</b> for the <b>kw_len</b>-byte
+ * keyword at <b>kw</b>, or -1 if <b>table</b> has no such rule. */
+STATIC int
+token_table_lookup(const token_rule_t *table, const char *kw, size_t kw_len)
+{
+  token_index_entry_t search, *found;
+
+  tor_assert(token_index_built);
+  search.table = table;
+  search.kw = kw;
+  search.kw_len = kw_len;
+  found = HT_FIND(token_index_map, &token_index_map, &search);
+  return found ? found->idx : -1;
+}
+
+/** Set up the token table index.  Call this once, after the crypto
+ * subsystem is initialized and before we parse anything. */
+void
+routerparse_init(void)
+{
+  if (token_index_built)
+    return;
+  token_index_add_table(routerdesc_token_table);
+  token_index_add_table(extrainfo_token_table);
+  token_index_add_table(rtrstatus_token_table);
+  token_index_add_table(dir_key_certificate_table);
+  token_index_add_table(desc_token_table);
+  token_index_add_table(ipo_token_table);
+  token_index_add_table(client_keys_token_table);
+  token_index_add_table(networkstatus_token_table);
+  token_index_add_table(networkstatus_consensus_token_table);
+  token_index_add_table(networkstatus_vote_footer_token_table);
+  token_index_add_table(networkstatus_detached_signature_token_table);
+  token_index_add_table(microdesc_token_table);
+  token_index_built = 1;
+}
+
+/** Release all storage held by the token table index. */
+void
+routerparse_free_all(void)
+{
+  token_index_entry_t **ent, **next, *this;
+
+  for (ent = HT_START(token_index_map, &token_index_map);
+       ent != NULL; ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(token_index_map, &token_index_map, ent);
+    tor_free(this);
+  }
+  HT_CLEAR(token_index_map, &token_index_map);
+  token_index_built = 0;
+}
+
 /** Helper function: read the next token from *s, advance *s to the end of the
  * token, and return the parsed token.  Parse *<b>s</b> according to the list
  * of tokens in <b>table</b>.
  */
-static directory_token_t *
+STATIC directory_token_t *
 get_next_token(memarea_t *area,
                const char **s, const char *eos, token_rule_t *table)
 {
@@ -4067,38 +4398,35 @@ get_next_token(memarea_t *area,
     RET_ERR("Unexpected EOF");
   }
 
-  /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
-  for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
-      /* We've found the keyword. */
-      kwd = table[i].t;
-      tok->tp = table[i].v;
-      o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
-      /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
-      }
-      if (tok->n_args < table[i].min_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-        RET_ERR(ebuf);
-      } else if (tok->n_args > table[i].max_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+  /* Look up the appropriate entry in the table. */
+  i = token_table_lookup(table, *s, next-*s);
+  if (i >= 0) {
+    /* We've found the keyword. */
+    kwd = table[i].t;
+    tok->tp = table[i].v;
+    o_syn = table[i].os;
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    /* We go ahead whether there are arguments or not, so that tok->args is
+     * always set if we want arguments. */
+    if (table[i].concat_args) {
+      /* The keyword takes the line as a single argument */
+      tok->args = ALLOC(sizeof(char*));
+      tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
+      tok->n_args = 1;
+    } else {
+      /* This keyword takes multiple arguments. */
+      if (get_token_arguments(area, tok, *s, eol)<0) {
+        tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
         RET_ERR(ebuf);
       }
-      break;
+      *s = eol;
+    }
+    if (tok->n_args < table[i].min_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
+      RET_ERR(ebuf);
+    } else if (tok->n_args > table[i].max_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+      RET_ERR(ebuf);
     }
   }
 
@@ -10,6 +10,8 @@
 
 #define TOR_CHANNEL_INTERNAL_ /* For channel_flush_some_cells() */
 #include "channel.h"
+#include "channeltls.h"
+#include "connection.h"
 
 #include "compat_libevent.h"
 #define SCHEDULER_PRIVATE_
@@ -21,6 +23,22 @@
 #include <event.h>
 #endif
 
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+
+#if defined(HAVE_NETINET_TCP_H) && defined(HAVE_LINUX_SOCKIOS_H) && \
+  defined(TCP_INFO) && defined(SIOCOUTQNSD)
+/** Defined if we can ask the kernel how much each socket can send. */
+#define HAVE_KIST_SUPPORT 1
+#endif
+
 /*
  * Scheduler high/low watermarks
  */
@@ -36,6 +54,31 @@ static uint32_t sched_q_high_water = 32768;
 
 static uint32_t sched_max_flush_cells = 16;
 
+/*
+ * Kernel-informed socket transport (KIST) scheduling.  When
+ * kist_run_interval_msec is nonzero, we ignore the queue heuristic above,
+ * and instead only run the scheduler once per interval, writing to each
+ * channel only as much as its TCP socket can put on the wire before the
+ * next run.  The rest of the cells stay in the circuitmux, where the
+ * circuit priority policy can still reorder them.
+ */
+
+static uint32_t kist_run_interval_msec = 0;
+
+/*
+ * How much to write to each socket beyond what its congestion window can
+ * send right now, as a fraction of the congestion window.
+ */
+
+static double kist_sock_buf_size_factor = 1.0;
+
+/*
+ * Per-cell TLS record overhead we assume when turning a socket's byte limit
+ * into a cell limit.
+ */
+
+#define KIST_TLS_PER_CELL_OVERHEAD 29
+
 /*
  * Write scheduling works by keeping track of which channels can
  * accept cells, and have cells to write.  From the scheduler's perspective,
@@ -349,6 +392,9 @@ scheduler_more_work(void)
 {
   tor_assert(channels_pending);
 
+  if (kist_run_interval_msec)
+    return smartlist_len(channels_pending) > 0;
+
   return ((scheduler_get_queue_heuristic() < sched_q_low_water) &&
           ((smartlist_len(channels_pending) > 0))) ? 1 : 0;
 }
@@ -359,6 +405,18 @@ static void
 scheduler_retrigger(void)
 {
   tor_assert(run_sched_ev);
+
+  if (kist_run_interval_msec) {
+    /* Run at the next tick, unless a run is already scheduled. */
+    if (!event_pending(run_sched_ev, EV_TIMEOUT, NULL)) {
+      struct timeval tv;
+      tv.tv_sec = kist_run_interval_msec / 1000;
+      tv.tv_usec = (kist_run_interval_msec % 1000) * 1000;
+      event_add(run_sched_ev, &tv);
+    }
+    return;
+  }
+
   event_active(run_sched_ev, EV_TIMEOUT, 1);
 }
 
@@ -390,15 +448,18 @@ scheduler_run, (void))
   ssize_t flushed, flushed_this_time;
   smartlist_t *to_readd = NULL;
   channel_t *chan = NULL;
+  const int use_kist = kist_run_interval_msec != 0;
+  int kist_cells;
 
   log_debug(LD_SCHED, "We have a chance to run the scheduler");
 
-  if (scheduler_get_queue_heuristic() < sched_q_low_water) {
+  if (use_kist || scheduler_get_queue_heuristic() < sched_q_low_water) {
     n_chans_before = smartlist_len(channels_pending);
     q_len_before = channel_get_global_queue_estimate();
     q_heur_before = scheduler_get_queue_heuristic();
 
-    while (scheduler_get_queue_heuristic() <= sched_q_high_water &&
+    while ((use_kist ||
+            scheduler_get_queue_heuristic() <= sched_q_high_water) &&
            smartlist_len(channels_pending) > 0) {
       /* Pop off a channel */
       chan = smartlist_pqueue_pop(channels_pending,
@@ -408,6 +469,24 @@ scheduler_run, (void))
 
       /* Figure out how many cells we can write */
       n_cells = channel_num_cells_writeable(chan);
+      if (use_kist && n_cells > 0) {
+        kist_cells = scheduler_kist_cells_writeable(chan);
+        if (kist_cells <= 0) {
+          /*
+           * Tor could take more cells, but the kernel can't send them
+           * before our next run; leave them in the circuitmux and try
+           * again then.
+           */
+          if (!to_readd) to_readd = smartlist_new();
+          smartlist_add(to_readd, chan);
+          log_debug(LD_SCHED,
+                    "Channel " U64_FORMAT " at %p has a full socket; "
+                    "still pending",
+                    U64_PRINTF_ARG(chan->global_identifier), chan);
+          continue;
+        }
+        n_cells = MIN(n_cells, kist_cells);
+      }
       if (n_cells > 0) {
         log_debug(LD_SCHED,
                   "Scheduler saw pending channel " U64_FORMAT " at %p with "
@@ -416,7 +495,8 @@ scheduler_run, (void))
 
         flushed = 0;
         while (flushed < n_cells &&
-               scheduler_get_queue_heuristic() <= sched_q_high_water) {
+               (use_kist ||
+                scheduler_get_queue_heuristic() <= sched_q_high_water)) {
           flushed_this_time =
             channel_flush_some_cells(chan,
                                      MIN(sched_max_flush_cells,
@@ -438,7 +518,8 @@ scheduler_run, (void))
           if (channel_more_to_flush(chan)) {
           /* The channel goes to either pending or waiting_to_write */
             if (channel_num_cells_writeable(chan) > 0) {
-              /* Add it back to pending later */
+              /* Add it back to pending later; with KIST, that means the
+               * next run, when the socket has drained some. */
               if (!to_readd) to_readd = smartlist_new();
               smartlist_add(to_readd, chan);
               log_debug(LD_SCHED,
@@ -692,6 +773,119 @@ scheduler_update_queue_heuristic(time_t now)
   /* else no update needed, or time went backward */
 }
 
+/**
+ * Ask the kernel about the TCP socket <b>s</b> for KIST, and fill in
+ * <b>info_out</b>.  Return 0 on success, or -1 if we can't find out.
+ */
+
+MOCK_IMPL(STATIC int,
+scheduler_kist_get_sock_info, (tor_socket_t s, kist_sock_info_t *info_out))
+{
+#ifdef HAVE_KIST_SUPPORT
+  struct tcp_info tcp;
+  socklen_t tcp_len = sizeof(tcp);
+  int notsent = 0;
+
+  if (getsockopt(s, SOL_TCP, TCP_INFO, (void*)&tcp, &tcp_len) < 0 ||
+      ioctl(s, SIOCOUTQNSD, &notsent) < 0)
+    return -1;
+
+  info_out->cwnd = tcp.tcpi_snd_cwnd;
+  info_out->unacked = tcp.tcpi_unacked;
+  info_out->mss = tcp.tcpi_snd_mss;
+  info_out->notsent = notsent < 0 ? 0 : (uint32_t)notsent;
+  return 0;
+#else
+  (void)s;
+  (void)info_out;
+  return -1;
+#endif
+}
+
+/**
+ * Return how many cells we should write to <b>chan</b> in this run of the
+ * KIST scheduler: as many as its socket can send before the next run, plus
+ * kist_sock_buf_size_factor congestion windows of slack, less whatever is
+ * already in the kernel and in the connection's outbuf.  If we can't ask
+ * the kernel, don't impose any limit.
+ */
+
+STATIC int
+scheduler_kist_cells_writeable(channel_t *chan)
+{
+  channel_tls_t *tlschan;
+  connection_t *conn;
+  kist_sock_info_t info;
+  int64_t cwnd_bytes, tcp_space, extra_space, limit;
+
+  if (chan->magic != TLS_CHAN_MAGIC)
+    return INT_MAX;
+  tlschan = BASE_CHAN_TO_TLS(chan);
+  if (!tlschan->conn)
+    return INT_MAX;
+  conn = TO_CONN(tlschan->conn);
+  if (!SOCKET_OK(conn->s))
+    return INT_MAX;
+
+  memset(&info, 0, sizeof(info));
+  if (scheduler_kist_get_sock_info(conn->s, &info) < 0) {
+    log_debug(LD_SCHED, "Couldn't get socket info for channel " U64_FORMAT,
+              U64_PRINTF_ARG(chan->global_identifier));
+    return INT_MAX;
+  }
+
+  cwnd_bytes = ((int64_t)info.cwnd) * info.mss;
+  tcp_space = ((int64_t)info.cwnd - info.unacked) * info.mss;
+  if (tcp_space < 0)
+    tcp_space = 0;
+  extra_space = (int64_t)(cwnd_bytes * kist_sock_buf_size_factor) -
+    info.notsent - (int64_t)connection_get_outbuf_len(conn);
+
+  limit = tcp_space + extra_space;
+  if (limit <= 0)
+    return 0;
+
+  limit /= (CELL_MAX_NETWORK_SIZE + KIST_TLS_PER_CELL_OVERHEAD);
+  return (int) MIN(limit, INT_MAX);
+}
+
+/**
+ * Return true iff this platform lets us run the KIST scheduler.
+ */
+
+int
+scheduler_can_use_kist(void)
+{
+#ifdef HAVE_KIST_SUPPORT
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Configure KIST scheduling: run the scheduler every <b>run_interval_msec</b>
+ * milliseconds, and let each socket take up to <b>sock_buf_size_factor</b>
+ * congestion windows of data beyond what it can send right away.  A
+ * <b>run_interval_msec</b> of 0 turns KIST off, and goes back to the queue
+ * heuristic.
+ */
+
+void
+scheduler_set_kist_params(uint32_t run_interval_msec,
+                          double sock_buf_size_factor)
+{
+  if (run_interval_msec && !scheduler_can_use_kist()) {
+    log_warn(LD_CONFIG, "KISTSchedRunInterval is set, but this platform "
+             "can't tell us how much data our sockets can send. Using the "
+             "default scheduler instead.");
+    run_interval_msec = 0;
+  }
+
+  kist_run_interval_msec = run_interval_msec;
+  kist_sock_buf_size_factor = sock_buf_size_factor;
+}
+
 /**
  * Set scheduler watermarks and flush size
  */
@@ -37,6 +37,11 @@ void scheduler_touch_channel(channel_t *chan);
 /* Adjust the watermarks from config file*/
 void scheduler_set_watermarks(uint32_t lo, uint32_t hi, uint32_t max_flush);
 
+/* Configure the kernel-informed (KIST) scheduling mode */
+int scheduler_can_use_kist(void);
+void scheduler_set_kist_params(uint32_t run_interval_msec,
+                               double sock_buf_size_factor);
+
 /* Things only scheduler.c and its test suite should see */
 
 #ifdef SCHEDULER_PRIVATE_
@@ -44,6 +49,22 @@ MOCK_DECL(STATIC int, scheduler_compare_channels,
           (const void *c1_v, const void *c2_v));
 STATIC uint64_t scheduler_get_queue_heuristic(void);
 STATIC void scheduler_update_queue_heuristic(time_t now);
+
+/** What the kernel told us about a TCP socket's send state, for KIST. */
+typedef struct kist_sock_info_t {
+  /** Congestion window, in segments. */
+  uint32_t cwnd;
+  /** Segments sent but not yet acknowledged. */
+  uint32_t unacked;
+  /** Maximum segment size, in bytes. */
+  uint32_t mss;
+  /** Bytes in the socket's send buffer that haven't been sent yet. */
+  uint32_t notsent;
+} kist_sock_info_t;
+
+MOCK_DECL(STATIC int, scheduler_kist_get_sock_info,
+          (tor_socket_t s, kist_sock_info_t *info_out));
+STATIC int scheduler_kist_cells_writeable(channel_t *chan);
 #endif
 
 #endif /* !defined(TOR_SCHEDULER_H) */
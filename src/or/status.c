@@ -13,6 +13,7 @@
 #include "config.h"
 #include "status.h"
 #include "nodelist.h"
+#include "onion.h"
 #include "relay.h"
 #include "router.h"
 #include "circuitlist.h"
@@ -138,6 +139,7 @@ log_heartbeat(time_t now)
 
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
+    onion_queue_log_stats();
     rep_hist_log_link_protocol_counts();
   }
 
@@ -17,6 +17,7 @@ const char tor_git_revision[] = "";
 #include "or.h"
 #include "onion_tap.h"
 #include "relay.h"
+#include "relay_crypto.h"
 #include <openssl/opensslv.h>
 #include <openssl/evp.h>
 #include <openssl/ec.h>
@@ -442,6 +443,96 @@ bench_siphash(void)
   }
 }
 
+static void
+bench_base64(void)
+{
+  char raw[512], enc[1024], dec[512];
+  int lens[] = { 20, 32, 128, 512, -1 };
+  int i, j, enclen;
+  uint64_t start, end;
+  const int N = 100000;
+  crypto_rand(raw, sizeof(raw));
+
+  for (i = 0; lens[i] > 0; ++i) {
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < N; ++j) {
+      base64_encode(enc, sizeof(enc), raw, lens[i], 0);
+    }
+    end = perftime();
+    printf("base64_encode(%d): %.2f ns per call\n",
+           lens[i], NANOCOUNT(start,end,N));
+
+    enclen = base64_encode(enc, sizeof(enc), raw, lens[i], 0);
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < N; ++j) {
+      base64_decode(dec, sizeof(dec), enc, enclen);
+    }
+    end = perftime();
+    printf("base64_decode(%d): %.2f ns per call\n",
+           lens[i], NANOCOUNT(start,end,N));
+  }
+
+  enclen = base64_encode(enc, sizeof(enc), raw, 128,
+                         BASE64_ENCODE_MULTILINE);
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < N; ++j) {
+    base64_encode(enc, sizeof(enc), raw, 128, BASE64_ENCODE_MULTILINE);
+  }
+  end = perftime();
+  printf("base64_encode(128, multiline): %.2f ns per call\n",
+         NANOCOUNT(start,end,N));
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < N; ++j) {
+    base64_decode(dec, sizeof(dec), enc, enclen);
+  }
+  end = perftime();
+  printf("base64_decode(128, multiline): %.2f ns per call\n",
+         NANOCOUNT(start,end,N));
+}
+
+static void
+bench_base16(void)
+{
+  char raw[DIGEST256_LEN], enc[HEX_DIGEST256_LEN+1];
+  char b32[DIGEST_LEN*8/5+1];
+  int j;
+  uint64_t start, end;
+  const int N = 300000;
+  crypto_rand(raw, sizeof(raw));
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < N; ++j) {
+    base16_encode(enc, sizeof(enc), raw, DIGEST_LEN);
+  }
+  end = perftime();
+  printf("base16_encode(%d): %.2f ns per call\n",
+         DIGEST_LEN, NANOCOUNT(start,end,N));
+
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < N; ++j) {
+    base16_decode(raw, sizeof(raw), enc, HEX_DIGEST_LEN);
+  }
+  end = perftime();
+  printf("base16_decode(%d): %.2f ns per call\n",
+         HEX_DIGEST_LEN, NANOCOUNT(start,end,N));
+
+  base32_encode(b32, sizeof(b32), raw, DIGEST_LEN);
+  reset_perftime();
+  start = perftime();
+  for (j = 0; j < N; ++j) {
+    base32_decode(raw, sizeof(raw), b32, DIGEST_LEN*8/5);
+  }
+  end = perftime();
+  printf("base32_decode(%d): %.2f ns per call\n",
+         DIGEST_LEN*8/5, NANOCOUNT(start,end,N));
+}
+
 static void
 bench_cell_ops(void)
 {
@@ -461,10 +552,10 @@ bench_cell_ops(void)
   or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
 
   /* Initialize crypto */
-  or_circ->p_crypto = crypto_cipher_new(NULL);
-  or_circ->n_crypto = crypto_cipher_new(NULL);
-  or_circ->p_digest = crypto_digest_new();
-  or_circ->n_digest = crypto_digest_new();
+  or_circ->crypto.b_crypto = crypto_cipher_new(NULL);
+  or_circ->crypto.f_crypto = crypto_cipher_new(NULL);
+  or_circ->crypto.b_digest = crypto_digest_new();
+  or_circ->crypto.f_digest = crypto_digest_new();
 
   reset_perftime();
 
@@ -483,10 +574,7 @@ bench_cell_ops(void)
            NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
   }
 
-  crypto_digest_free(or_circ->p_digest);
-  crypto_digest_free(or_circ->n_digest);
-  crypto_cipher_free(or_circ->p_crypto);
-  crypto_cipher_free(or_circ->n_crypto);
+  relay_crypto_clear(&or_circ->crypto);
   tor_free(or_circ);
   tor_free(cell);
 }
@@ -589,6 +677,8 @@ typedef struct benchmark_t {
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
   ENT(siphash),
+  ENT(base64),
+  ENT(base16),
   ENT(aes),
   ENT(onion_TAP),
   ENT(onion_ntor),
@@ -28,6 +28,8 @@
 #define ROUTER_PRIVATE
 #define CIRCUITSTATS_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define ONION_PRIVATE
+#define CPUWORKER_PRIVATE
 #define STATEFILE_PRIVATE
 
 /*
@@ -45,6 +47,7 @@ double fabs(double x);
 #include "circuitstats.h"
 #include "config.h"
 #include "connection_edge.h"
+#include "cpuworker.h"
 #include "geoip.h"
 #include "rendcommon.h"
 #include "test.h"
@@ -296,6 +299,245 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+/** The time that mock_onion_queue_now_msec() reports. */
+static uint64_t onion_queue_mock_now = 0;
+
+static uint64_t
+mock_onion_queue_now_msec(void)
+{
+  return onion_queue_mock_now;
+}
+
+/** Make sure that queued create requests wait about as long as our circuit
+ * build timeout, within bounds. */
+static void
+test_onion_queue_cutoff(void *arg)
+{
+  circuit_build_times_t *cbt = get_circuit_build_times_mutable();
+  double orig_timeout = cbt->timeout_ms;
+  (void)arg;
+
+  cbt->timeout_ms = 2500;
+  tt_u64_op(onion_queue_wait_cutoff_msec(), OP_EQ, 2500);
+  /* Never less than the smallest timeout a client will use... */
+  cbt->timeout_ms = 100;
+  tt_u64_op(onion_queue_wait_cutoff_msec(), OP_EQ,
+            circuit_build_times_min_timeout());
+  /* ...and never more than the old fixed cutoff. */
+  cbt->timeout_ms = 60000;
+  tt_u64_op(onion_queue_wait_cutoff_msec(), OP_EQ, 5000);
+
+ done:
+  cbt->timeout_ms = orig_timeout;
+}
+
+/** Make sure that adding a create request drops the expired ones from every
+ * onion queue. */
+static void
+test_onion_queue_cull(void *arg)
+{
+  uint8_t buf1[TAP_ONIONSKIN_CHALLENGE_LEN] = {0};
+  uint8_t buf2[NTOR_ONIONSKIN_LEN] = {0};
+  circuit_build_times_t *cbt = get_circuit_build_times_mutable();
+  double orig_timeout = cbt->timeout_ms;
+  or_circuit_t *circ1 = or_circuit_new(0, NULL);
+  or_circuit_t *circ2 = or_circuit_new(0, NULL);
+  or_circuit_t *circ3 = or_circuit_new(0, NULL);
+  create_cell_t *create;
+  (void)arg;
+
+  /* We'll be closing some of these circuits. */
+  circ1->base_.purpose = circ2->base_.purpose = circ3->base_.purpose =
+    CIRCUIT_PURPOSE_OR;
+  MOCK(onion_queue_now_msec, mock_onion_queue_now_msec);
+  cbt->timeout_ms = 2000;
+  onion_queue_mock_now = 1000000;
+
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_TAP,
+                   TAP_ONIONSKIN_CHALLENGE_LEN, buf1);
+  tt_int_op(0,OP_EQ, onion_pending_add(circ1, create));
+
+  /* Just before circ1's deadline, it stays. */
+  onion_queue_mock_now += 1999;
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf2);
+  tt_int_op(0,OP_EQ, onion_pending_add(circ2, create));
+  tt_int_op(1,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+  tt_int_op(1,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(0,OP_EQ, circ1->base_.marked_for_close);
+
+  /* At its deadline, a new ntor request culls it from the tap queue, and
+   * its circuit gets closed. */
+  onion_queue_mock_now += 1;
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf2);
+  tt_int_op(0,OP_EQ, onion_pending_add(circ3, create));
+  tt_int_op(0,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+  tt_int_op(2,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_ptr_op(circ1->onionqueue_entry, OP_EQ, NULL);
+  tt_assert(circ1->base_.marked_for_close);
+  tt_int_op(0,OP_EQ, circ2->base_.marked_for_close);
+
+ done:
+  UNMOCK(onion_queue_now_msec);
+  cbt->timeout_ms = orig_timeout;
+  clear_pending_onions();
+  circuit_free(TO_CIRCUIT(circ1));
+  circuit_free(TO_CIRCUIT(circ2));
+  circuit_free(TO_CIRCUIT(circ3));
+}
+
+/** Make sure that onion_next_task() drops requests that it can't answer
+ * before their deadline, instead of handing them to a cpuworker. */
+static void
+test_onion_queue_shed(void *arg)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  circuit_build_times_t *cbt = get_circuit_build_times_mutable();
+  double orig_timeout = cbt->timeout_ms;
+  or_circuit_t *circ1 = or_circuit_new(0, NULL);
+  or_circuit_t *circ2 = or_circuit_new(0, NULL);
+  create_cell_t *create, *create2_ptr, *onionskin = NULL;
+  (void)arg;
+
+  circ1->base_.purpose = circ2->base_.purpose = CIRCUIT_PURPOSE_OR;
+  MOCK(onion_queue_now_msec, mock_onion_queue_now_msec);
+  cbt->timeout_ms = 2000;
+  onion_queue_mock_now = 1000000;
+
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  tt_int_op(0,OP_EQ, onion_pending_add(circ1, create));
+
+  /* With no measurements yet, we expect a handshake to take 1 msec, so
+   * with 1 msec left, circ1 can't make it. */
+  onion_queue_mock_now += 1999;
+  tt_ptr_op(NULL,OP_EQ, onion_next_task(&onionskin));
+  tt_ptr_op(NULL,OP_EQ, onionskin);
+  tt_int_op(0,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_assert(circ1->base_.marked_for_close);
+
+  /* With 2 msec left, circ2 can. */
+  create2_ptr = create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  tt_int_op(0,OP_EQ, onion_pending_add(circ2, create));
+  onion_queue_mock_now += 1998;
+  tt_ptr_op(circ2,OP_EQ, onion_next_task(&onionskin));
+  tt_ptr_op(create2_ptr,OP_EQ, onionskin);
+  tt_int_op(0,OP_EQ, circ2->base_.marked_for_close);
+
+ done:
+  UNMOCK(onion_queue_now_msec);
+  cbt->timeout_ms = orig_timeout;
+  clear_pending_onions();
+  circuit_free(TO_CIRCUIT(circ1));
+  circuit_free(TO_CIRCUIT(circ2));
+  tor_free(onionskin);
+}
+
+/** Make sure that the requests onion_next_task() drops don't count as turns
+ * when it balances the ntor and tap queues. */
+static void
+test_onion_queue_shed_fairness(void *arg)
+{
+  uint8_t buf1[TAP_ONIONSKIN_CHALLENGE_LEN] = {0};
+  uint8_t buf2[NTOR_ONIONSKIN_LEN] = {0};
+  circuit_build_times_t *cbt = get_circuit_build_times_mutable();
+  double orig_timeout = cbt->timeout_ms;
+  or_circuit_t *old_circs[12];
+  or_circuit_t *tap_circ = or_circuit_new(0, NULL);
+  or_circuit_t *ntor_circ = or_circuit_new(0, NULL);
+  create_cell_t *create, *onionskin = NULL;
+  int i;
+  (void)arg;
+
+  memset(old_circs, 0, sizeof(old_circs));
+  MOCK(onion_queue_now_msec, mock_onion_queue_now_msec);
+  cbt->timeout_ms = 2000;
+  onion_queue_mock_now = 1000000;
+
+  /* More ntor requests than NumNTorsPerTAP, all of which will be too old
+   * to answer... */
+  for (i = 0; i < (int)ARRAY_LENGTH(old_circs); ++i) {
+    old_circs[i] = or_circuit_new(0, NULL);
+    old_circs[i]->base_.purpose = CIRCUIT_PURPOSE_OR;
+    create = tor_malloc_zero(sizeof(create_cell_t));
+    create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                     NTOR_ONIONSKIN_LEN, buf2);
+    tt_int_op(0,OP_EQ, onion_pending_add(old_circs[i], create));
+  }
+
+  /* ...followed by a fresh tap request and a fresh ntor request. */
+  onion_queue_mock_now += 1999;
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_TAP,
+                   TAP_ONIONSKIN_CHALLENGE_LEN, buf1);
+  tt_int_op(0,OP_EQ, onion_pending_add(tap_circ, create));
+  create = tor_malloc_zero(sizeof(create_cell_t));
+  create_cell_init(create, CELL_CREATE, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf2);
+  tt_int_op(0,OP_EQ, onion_pending_add(ntor_circ, create));
+  tt_int_op(13,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* Dropping the old ones doesn't use up ntor's turns. */
+  tt_ptr_op(ntor_circ,OP_EQ, onion_next_task(&onionskin));
+  tt_int_op(0,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_int_op(1,OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+  for (i = 0; i < (int)ARRAY_LENGTH(old_circs); ++i)
+    tt_assert(old_circs[i]->base_.marked_for_close);
+
+ done:
+  UNMOCK(onion_queue_now_msec);
+  cbt->timeout_ms = orig_timeout;
+  clear_pending_onions();
+  for (i = 0; i < (int)ARRAY_LENGTH(old_circs); ++i) {
+    if (old_circs[i])
+      circuit_free(TO_CIRCUIT(old_circs[i]));
+  }
+  circuit_free(TO_CIRCUIT(tap_circ));
+  circuit_free(TO_CIRCUIT(ntor_circ));
+  tor_free(onionskin);
+}
+
+/** Make sure that we hand the threadpool about 10 msec of onionskins per
+ * thread, within bounds. */
+static void
+test_cpuworker_max_pending(void *arg)
+{
+  (void)arg;
+
+  /* Until we have 100 samples, assume 1 msec per onionskin. */
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 0, 0), OP_EQ, 40);
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 99, 99), OP_EQ, 40);
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 500, 0), OP_EQ, 40);
+
+  /* 2 msec per onionskin: 5 each. */
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 1000, 2000000),
+            OP_EQ, 20);
+  tt_int_op(cpuworker_compute_max_pending_tasks(1, 1000, 2000000),
+            OP_EQ, 5);
+
+  /* Cheap onionskins are capped at CPUWORKER_MAX_TASKS_PER_THREAD... */
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 1000, 10000),
+            OP_EQ, 4 * CPUWORKER_MAX_TASKS_PER_THREAD);
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 1000, 50),
+            OP_EQ, 4 * CPUWORKER_MAX_TASKS_PER_THREAD);
+
+  /* ...and expensive ones never go below CPUWORKER_MIN_TASKS_PER_THREAD. */
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 1000, 10000000),
+            OP_EQ, 4 * CPUWORKER_MIN_TASKS_PER_THREAD);
+  tt_int_op(cpuworker_compute_max_pending_tasks(4, 1000, 100000000),
+            OP_EQ, 4 * CPUWORKER_MIN_TASKS_PER_THREAD);
+
+ done:
+  ;
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -1104,6 +1346,11 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  ENT(onion_queue_cutoff),
+  FORK(onion_queue_cull),
+  FORK(onion_queue_shed),
+  FORK(onion_queue_shed_fairness),
+  ENT(cpuworker_max_pending),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   ENT(circuit_timeout),
   ENT(rend_fns),
@@ -1118,6 +1365,7 @@ extern struct testcase_t accounting_tests[];
 extern struct testcase_t addr_tests[];
 extern struct testcase_t address_tests[];
 extern struct testcase_t buffer_tests[];
+extern struct testcase_t bwmgt_tests[];
 extern struct testcase_t cell_format_tests[];
 extern struct testcase_t cell_queue_tests[];
 extern struct testcase_t channel_tests[];
@@ -1126,6 +1374,7 @@ extern struct testcase_t checkdir_tests[];
 extern struct testcase_t circuitlist_tests[];
 extern struct testcase_t circuitmux_tests[];
 extern struct testcase_t config_tests[];
+extern struct testcase_t consdiff_tests[];
 extern struct testcase_t container_tests[];
 extern struct testcase_t controller_tests[];
 extern struct testcase_t controller_event_tests[];
@@ -1166,6 +1415,7 @@ struct testgroup_t testgroups[] = {
   { "addr/", addr_tests },
   { "address/", address_tests },
   { "buffer/", buffer_tests },
+  { "bwmgt/", bwmgt_tests },
   { "cellfmt/", cell_format_tests },
   { "cellqueue/", cell_queue_tests },
   { "channel/", channel_tests },
@@ -1174,6 +1424,7 @@ struct testgroup_t testgroups[] = {
   { "circuitlist/", circuitlist_tests },
   { "circuitmux/", circuitmux_tests },
   { "config/", config_tests },
+  { "consdiff/", consdiff_tests },
   { "container/", container_tests },
   { "control/", controller_tests },
   { "control/event/", controller_event_tests },
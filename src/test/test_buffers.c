@@ -439,6 +439,126 @@ test_buffer_ext_or_cmd(void *arg)
   tor_free(tmp);
 }
 
+/** Helper for test_buffer_ref_chunks: count releases. */
+static void
+count_release(void *arg)
+{
+  ++*(int *)arg;
+}
+
+static void
+test_buffer_ref_chunks(void *arg)
+{
+  static const char ref[] = "A chunk that refers to memory it doesn't own.";
+  static char big[65536];
+  const size_t ref_len = strlen(ref);
+  buf_t *buf = NULL, *buf2 = NULL, *buf3 = NULL;
+  char out[256];
+  size_t n;
+  int released = 0, eof = 0, sock_err = 0;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  (void)arg;
+
+  buf = buf_new();
+  buf2 = buf_new();
+
+  /* Data added by reference takes no chunk storage. */
+  tt_int_op(write_ref_to_buf(big, sizeof(big), count_release, &released,
+                             buf), OP_EQ, sizeof(big));
+  tt_int_op(buf_allocation(buf), OP_LT, 1024);
+  buf_clear(buf);
+  tt_int_op(released, OP_EQ, 1);
+  released = 0;
+
+  write_to_buf("Head. ", 6, buf);
+  tt_int_op(write_ref_to_buf(ref, ref_len, count_release, &released, buf),
+            OP_EQ, 6 + ref_len);
+  /* Nothing gets appended to a reference chunk. */
+  write_to_buf(" Tail.", 6, buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, ref_len + 12);
+  assert_buf_ok(buf);
+
+  /* Copies copy the data, not the reference. */
+  buf3 = buf_copy(buf);
+  assert_buf_ok(buf3);
+  fetch_from_buf(out, buf_datalen(buf3), buf3);
+  tt_mem_op(out, OP_EQ, "Head. ", 6);
+  tt_mem_op(out+6, OP_EQ, ref, ref_len);
+  tt_mem_op(out+6+ref_len, OP_EQ, " Tail.", 6);
+  buf_free(buf3);
+  buf3 = NULL;
+  tt_int_op(released, OP_EQ, 0);
+
+  /* Whole reference chunks move between buffers as they are. */
+  n = 6 + ref_len;
+  tt_int_op(move_buf_to_buf(buf2, buf, &n), OP_EQ, 6 + ref_len);
+  tt_int_op(released, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 6 + ref_len);
+  tt_int_op(buf_datalen(buf), OP_EQ, 6);
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+
+  /* Reading part of one, or pulling it up, works. */
+  fetch_from_buf(out, 10, buf2);
+  tt_mem_op(out, OP_EQ, "Head. A ch", 10);
+  write_to_buf(" Tail.", 6, buf2);
+  buf_pullup(buf2, buf_datalen(buf2));
+  tt_int_op(released, OP_EQ, 1);
+  assert_buf_ok(buf2);
+  fetch_from_buf(out, buf_datalen(buf2), buf2);
+  tt_mem_op(out, OP_EQ, ref+4, ref_len-4);
+  tt_mem_op(out+ref_len-4, OP_EQ, " Tail.", 6);
+
+  /* Draining a reference chunk releases it. */
+  write_ref_to_buf(ref, ref_len, count_release, &released, buf);
+  fetch_from_buf(out, 6 + ref_len - 1, buf);
+  tt_int_op(released, OP_EQ, 1);
+  fetch_from_buf(out, 1, buf);
+  tt_int_op(released, OP_EQ, 2);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+  /* So do freeing the buffer and adding nothing. */
+  write_ref_to_buf(ref, ref_len, count_release, &released, buf);
+  write_ref_to_buf(ref, 0, count_release, &released, buf);
+  tt_int_op(released, OP_EQ, 3);
+  buf_free(buf);
+  buf = NULL;
+  tt_int_op(released, OP_EQ, 4);
+
+  /* A read that gets nothing leaves an empty chunk behind; a reference
+   * written after it still moves. */
+  released = 0;
+  buf = buf_new();
+  buf_clear(buf2);
+  tt_int_op(0, OP_EQ, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  tt_int_op(0, OP_EQ, set_socket_nonblocking(fds[0]));
+  tt_int_op(read_to_buf(fds[0], 100, buf, &eof, &sock_err), OP_EQ, 0);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  tt_assert(buf->head);
+  write_ref_to_buf(ref, ref_len, count_release, &released, buf);
+  tt_ptr_op(buf->head->next, OP_EQ, buf->tail);
+  n = ref_len;
+  tt_int_op(move_buf_to_buf(buf2, buf, &n), OP_EQ, ref_len);
+  tt_int_op(n, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  tt_int_op(buf_datalen(buf2), OP_EQ, ref_len);
+  assert_buf_ok(buf);
+  assert_buf_ok(buf2);
+  tt_int_op(released, OP_EQ, 0);
+  fetch_from_buf(out, ref_len, buf2);
+  tt_mem_op(out, OP_EQ, ref, ref_len);
+  tt_int_op(released, OP_EQ, 1);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  buf_free(buf3);
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+}
+
 static void
 test_buffer_allocation_tracking(void *arg)
 {
@@ -747,10 +867,92 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+static int n_tls_writes = 0;
+static size_t tls_write_sizes[64];
+static char *tls_written = NULL;
+static size_t tls_written_len = 0;
+
+static int
+mock_tls_write(tor_tls_t *tls, const char *cp, size_t n)
+{
+  (void)tls;
+  tor_assert(n_tls_writes < 64);
+  tls_write_sizes[n_tls_writes++] = n;
+  memcpy(tls_written + tls_written_len, cp, n);
+  tls_written_len += n;
+  return (int)n;
+}
+
+static size_t
+mock_tls_get_forced_write_size(tor_tls_t *tls)
+{
+  (void)tls;
+  return 0;
+}
+
+/** Make sure that flush_buf_tls() hands whole TLS records to the TLS layer
+ * even when the buffer holds its data in many small chunks. */
+static void
+test_buffers_tls_flush_coalesce(void *arg)
+{
+  const size_t n_cells = 40, cell_len = 514;
+  const size_t total = n_cells * cell_len;
+  buf_t *buf = NULL;
+  char *stuff = NULL;
+  const char *cp;
+  size_t sz, flushlen, i;
+  (void)arg;
+
+  MOCK(tor_tls_write, mock_tls_write);
+  MOCK(tor_tls_get_forced_write_size, mock_tls_get_forced_write_size);
+
+  stuff = tor_malloc(total);
+  crypto_rand(stuff, total);
+  tls_written = tor_malloc_zero(total);
+
+  /* Chunks of under 1K each: far less than a TLS record, and less than
+   * the first flush below. */
+  buf = buf_new_with_capacity(500);
+  for (i = 0; i < n_cells; ++i)
+    write_to_buf(stuff + i * cell_len, cell_len, buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, total);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_int_op(sz, OP_LT, 1000);
+
+  /* Flushing part of the buffer writes that part in one go. */
+  flushlen = 1000;
+  tt_int_op(flush_buf_tls(NULL, buf, 1000, &flushlen), OP_EQ, 1000);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(n_tls_writes, OP_EQ, 1);
+  tt_int_op(tls_write_sizes[0], OP_EQ, 1000);
+
+  /* Flushing the rest fills a whole record, then writes what's left. */
+  flushlen = total - 1000;
+  tt_int_op(flush_buf_tls(NULL, buf, total - 1000, &flushlen), OP_EQ,
+            total - 1000);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  tt_int_op(n_tls_writes, OP_EQ, 3);
+  tt_int_op(tls_write_sizes[1], OP_EQ, 16384);
+  tt_int_op(tls_write_sizes[2], OP_EQ, total - 1000 - 16384);
+
+  /* And nothing got lost or reordered along the way. */
+  tt_int_op(tls_written_len, OP_EQ, total);
+  tt_mem_op(tls_written, OP_EQ, stuff, total);
+
+ done:
+  UNMOCK(tor_tls_write);
+  UNMOCK(tor_tls_get_forced_write_size);
+  buf_free(buf);
+  tor_free(stuff);
+  tor_free(tls_written);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
+  { "ref_chunks", test_buffer_ref_chunks, TT_FORK, NULL, NULL },
   { "ext_or_cmd", test_buffer_ext_or_cmd, TT_FORK, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
@@ -761,6 +963,8 @@ struct testcase_t buffer_tests[] = {
     NULL, NULL},
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "tls_flush_coalesce", test_buffers_tls_flush_coalesce, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -0,0 +1,246 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file test_bwmgt.c
+ * \brief Unit tests for the per-connection token buckets.
+ **/
+
+#define CONNECTION_PRIVATE
+#include "or.h"
+#include "compat_libevent.h"
+#include "connection.h"
+#include "main.h"
+#include "test.h"
+
+#ifndef USE_BUFFEREVENTS
+
+/** Set *<b>tv</b> to <b>msec</b> milliseconds since the epoch, and return
+ * it. */
+static const struct timeval *
+bwmgt_tv(struct timeval *tv, uint64_t msec)
+{
+  tv->tv_sec = (time_t)(msec / 1000);
+  tv->tv_usec = (int)(msec % 1000) * 1000;
+  return tv;
+}
+
+/** Return a new open OR connection whose buckets are empty, and which may
+ * read and write <b>rate</b> bytes per second, up to <b>burst</b>. */
+static or_connection_t *
+new_bwmgt_or_conn(int rate, int burst)
+{
+  or_connection_t *or_conn = tor_malloc_zero(sizeof(or_connection_t));
+  or_conn->base_.magic = OR_CONNECTION_MAGIC;
+  or_conn->base_.type = CONN_TYPE_OR;
+  or_conn->base_.state = OR_CONN_STATE_OPEN;
+  or_conn->base_.s = TOR_INVALID_SOCKET;
+  or_conn->bandwidthrate = rate;
+  or_conn->bandwidthburst = burst;
+  return or_conn;
+}
+
+static int n_start_reading = 0, n_start_writing = 0;
+
+static void
+mock_connection_start_reading(connection_t *conn)
+{
+  (void)conn;
+  ++n_start_reading;
+}
+
+static void
+mock_connection_start_writing(connection_t *conn)
+{
+  (void)conn;
+  ++n_start_writing;
+}
+
+static void
+mock_connection_stop(connection_t *conn)
+{
+  (void)conn;
+}
+
+/** Make sure that refilling a connection's buckets every few milliseconds
+ * adds up to its full rate, without losing the fractions of a byte. */
+static void
+test_bwmgt_partial_refill(void *arg)
+{
+  const uint64_t start = U64_LITERAL(1389631200000);
+  or_connection_t *or_conn = NULL;
+  struct timeval tv;
+  int i;
+  (void)arg;
+
+  /* 1500 bytes per second is one and a half bytes per millisecond. */
+  or_conn = new_bwmgt_or_conn(1500, 100000);
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 0);
+
+  /* Nothing happens within a millisecond. */
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 1));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 1);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 1);
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 2));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 3);
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 3));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 4);
+
+  /* One millisecond at a time for the rest of the second... */
+  for (i = 4; i <= 1000; ++i) {
+    connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + i));
+  }
+  /* ...adds up to exactly one second's worth. */
+  tt_int_op(or_conn->read_bucket, OP_EQ, 1500);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 1500);
+
+  /* Uneven steps within the next second still add up. */
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 1333));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 1500 + 499);
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 1667));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 1500 + 1000);
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 2000));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 3000);
+
+  /* The burst caps the buckets. */
+  or_conn->bandwidthburst = 3100;
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 3000));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 3100);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 3100);
+
+ done:
+  tor_free(or_conn);
+}
+
+/** Make sure that a connection that ran out of tokens stays blocked until
+ * its own buckets have refilled, and is woken up exactly once then. */
+static void
+test_bwmgt_wake_blocked(void *arg)
+{
+  const uint64_t start = U64_LITERAL(1389631200000);
+  or_connection_t *or_conn = NULL;
+  connection_t *conn;
+  struct timeval tv;
+  (void)arg;
+
+  MOCK(connection_start_reading, mock_connection_start_reading);
+  MOCK(connection_start_writing, mock_connection_start_writing);
+  MOCK(connection_stop_reading, mock_connection_stop);
+  MOCK(connection_stop_writing, mock_connection_stop);
+
+  or_conn = new_bwmgt_or_conn(1000, 1000);
+  conn = TO_CONN(or_conn);
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start));
+
+  connection_read_bw_exhausted(conn);
+  connection_write_bw_exhausted(conn);
+  tt_int_op(conn->read_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(conn->write_blocked_on_bw, OP_EQ, 1);
+
+  /* The global buckets refill, but this connection hasn't earned anything
+   * yet, so it stays blocked. */
+  connection_bucket_refill(100, bwmgt_tv(&tv, start));
+  tt_int_op(conn->read_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(conn->write_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(n_start_reading, OP_EQ, 0);
+  tt_int_op(n_start_writing, OP_EQ, 0);
+
+  /* Once it has, the next refill wakes it up. */
+  connection_bucket_refill(10, bwmgt_tv(&tv, start + 10));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 10);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 10);
+  tt_int_op(conn->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(conn->write_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(n_start_reading, OP_EQ, 1);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+
+  /* It's no longer waiting, so later refills leave it alone. */
+  connection_bucket_refill(10, bwmgt_tv(&tv, start + 20));
+  tt_int_op(n_start_reading, OP_EQ, 1);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+
+  /* Blocking it again works the same way, once it has used up what it
+   * has earned so far. */
+  connection_or_bucket_refill(or_conn, bwmgt_tv(&tv, start + 20));
+  or_conn->read_bucket = 0;
+  connection_read_bw_exhausted(conn);
+  connection_bucket_refill(0, bwmgt_tv(&tv, start + 20));
+  tt_int_op(conn->read_blocked_on_bw, OP_EQ, 1);
+  connection_bucket_refill(1, bwmgt_tv(&tv, start + 21));
+  tt_int_op(conn->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(n_start_reading, OP_EQ, 2);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+
+ done:
+  tor_free(or_conn);
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_reading);
+  UNMOCK(connection_stop_writing);
+}
+
+/** Make sure that a blocked connection is woken up by the refill timer
+ * once its own buckets have refilled, even when nothing has refreshed the
+ * cached time since it was blocked. */
+static void
+test_bwmgt_stale_time_cache(void *arg)
+{
+  or_connection_t *or_conn = NULL;
+  connection_t *conn;
+  struct timeval start, tv;
+  uint64_t start_msec;
+  (void)arg;
+
+  MOCK(connection_start_reading, mock_connection_start_reading);
+  MOCK(connection_start_writing, mock_connection_start_writing);
+  MOCK(connection_stop_reading, mock_connection_stop);
+  MOCK(connection_stop_writing, mock_connection_stop);
+  n_start_reading = n_start_writing = 0;
+
+  /* Fill the time cache from the real clock, and leave it that way. */
+  tor_gettimeofday_cache_clear();
+  tor_gettimeofday_cached(&start);
+  start_msec = ((uint64_t)start.tv_sec) * 1000 + start.tv_usec / 1000;
+
+  or_conn = new_bwmgt_or_conn(1000, 1000);
+  conn = TO_CONN(or_conn);
+  connection_or_bucket_refill(or_conn, &start);
+  connection_read_bw_exhausted(conn);
+  connection_write_bw_exhausted(conn);
+  tt_int_op(conn->read_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(conn->write_blocked_on_bw, OP_EQ, 1);
+
+  /* The refill timer fires 50 msec later; the cache still holds the time
+   * at which the connection was blocked. */
+  connection_bucket_refill(50, bwmgt_tv(&tv, start_msec + 50));
+  tt_int_op(or_conn->read_bucket, OP_EQ, 50);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 50);
+  tt_int_op(conn->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(conn->write_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(n_start_reading, OP_EQ, 1);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+
+ done:
+  tor_free(or_conn);
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_reading);
+  UNMOCK(connection_stop_writing);
+}
+
+#endif
+
+struct testcase_t bwmgt_tests[] = {
+#ifndef USE_BUFFEREVENTS
+  { "partial_refill", test_bwmgt_partial_refill, TT_FORK, NULL, NULL },
+  { "wake_blocked", test_bwmgt_wake_blocked, TT_FORK, NULL, NULL },
+  { "stale_time_cache", test_bwmgt_stale_time_cache, TT_FORK, NULL, NULL },
+#endif
+  END_OF_TESTCASES
+};
+
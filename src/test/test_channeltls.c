@@ -4,6 +4,7 @@
 #include <math.h>
 
 #define TOR_CHANNEL_INTERNAL_
+#define MAIN_PRIVATE
 #include "or.h"
 #include "address.h"
 #include "buffers.h"
@@ -11,6 +12,8 @@
 #include "channeltls.h"
 #include "connection_or.h"
 #include "config.h"
+#include "hibernate.h"
+#include "main.h"
 /* For init/free stuff */
 #include "scheduler.h"
 #include "tortls.h"
@@ -23,6 +26,7 @@
 static void test_channeltls_create(void *arg);
 static void test_channeltls_num_bytes_queued(void *arg);
 static void test_channeltls_overhead_estimate(void *arg);
+static void test_channeltls_housekeeping_deadline(void *arg);
 
 /* Mocks used by channeltls unit tests */
 static size_t tlschan_buf_datalen_mock(const buf_t *buf);
@@ -322,12 +326,88 @@ tlschan_is_local_addr_mock(const tor_addr_t *addr)
   return tlschan_local;
 }
 
+static int tlschan_hibernating = 0;
+
+static int
+tlschan_we_are_hibernating_mock(void)
+{
+  return tlschan_hibernating;
+}
+
+static void
+test_channeltls_housekeeping_deadline(void *arg)
+{
+  or_connection_t *or_conn = tor_malloc_zero(sizeof(or_connection_t));
+  channel_tls_t *tlschan = tor_malloc_zero(sizeof(channel_tls_t));
+  channel_t *chan = TLS_CHAN_TO_BASE(tlschan);
+  connection_t *conn = TO_CONN(or_conn);
+  const time_t now = 1389631200;
+
+  (void)arg;
+
+  MOCK(we_are_hibernating, tlschan_we_are_hibernating_mock);
+  get_options_mutable()->KeepalivePeriod = 300;
+
+  conn->magic = OR_CONNECTION_MAGIC;
+  conn->type = CONN_TYPE_OR;
+  conn->state = OR_CONN_STATE_OPEN;
+  or_conn->chan = tlschan;
+  tlschan->conn = or_conn;
+  chan->magic = TLS_CHAN_MAGIC;
+  or_conn->idle_timeout = 180;
+  conn->timestamp_lastwritten = now - 100;
+  or_conn->timestamp_lastempty = now - 100;
+  chan->timestamp_last_had_circuits = now - 100;
+
+  /* With no circuits, it closes once it has been idle long enough. */
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ,
+            now + 80);
+
+  /* With circuits, the next thing to do is send a keepalive. */
+  chan->num_p_circuits = 1;
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ,
+            now + 200);
+  /* ... and writing something pushes that back. */
+  conn->timestamp_lastwritten = now - 10;
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ,
+            now + 290);
+
+  /* Once we're past the keepalive deadline, check every second until it
+   * writes something. */
+  conn->timestamp_lastwritten = now - 400;
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ, now);
+  conn->timestamp_lastwritten = now - 10;
+
+  /* Being bad for new circuits, or hibernating, doesn't matter while it
+   * has circuits... */
+  chan->is_bad_for_new_circs = 1;
+  tlschan_hibernating = 1;
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ,
+            now + 290);
+
+  /* ... but without any, it can close right away. */
+  chan->num_p_circuits = 0;
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ, now);
+  chan->is_bad_for_new_circs = 0;
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ, now);
+  tlschan_hibernating = 0;
+  tt_int_op(connection_or_housekeeping_deadline(or_conn, now), OP_EQ,
+            now + 80);
+
+ done:
+  tor_free(or_conn);
+  tor_free(tlschan);
+  UNMOCK(we_are_hibernating);
+}
+
 struct testcase_t channeltls_tests[] = {
   { "create", test_channeltls_create, TT_FORK, NULL, NULL },
   { "num_bytes_queued", test_channeltls_num_bytes_queued,
     TT_FORK, NULL, NULL },
   { "overhead_estimate", test_channeltls_overhead_estimate,
     TT_FORK, NULL, NULL },
+  { "housekeeping_deadline", test_channeltls_housekeeping_deadline,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
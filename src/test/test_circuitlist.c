@@ -8,6 +8,7 @@
 #include "channel.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
+#include "circuituse.h"
 #include "test.h"
 
 static channel_t *
@@ -269,6 +270,42 @@ test_rend_token_maps(void *arg)
     circuit_free(TO_CIRCUIT(c4));
 }
 
+static void
+test_global_id_map(void *arg)
+{
+  origin_circuit_t *c1, *c2;
+  uint32_t id1, id2;
+
+  (void)arg;
+  c1 = origin_circuit_new();
+  c2 = origin_circuit_new();
+  TO_CIRCUIT(c1)->purpose = TO_CIRCUIT(c2)->purpose =
+    CIRCUIT_PURPOSE_C_GENERAL;
+  id1 = c1->global_identifier;
+  id2 = c2->global_identifier;
+  tt_int_op(id1, OP_NE, id2);
+
+  tt_ptr_op(c1, OP_EQ, circuit_get_by_global_id(id1));
+  tt_ptr_op(c2, OP_EQ, circuit_get_by_global_id(id2));
+  tt_ptr_op(NULL, OP_EQ, circuit_get_by_global_id(id2 + 1000));
+
+  /* Marked circuits aren't returned. */
+  TO_CIRCUIT(c1)->marked_for_close = __LINE__;
+  tt_ptr_op(NULL, OP_EQ, circuit_get_by_global_id(id1));
+
+  /* Neither are freed ones. */
+  circuit_free(TO_CIRCUIT(c1));
+  c1 = NULL;
+  tt_ptr_op(NULL, OP_EQ, circuit_get_by_global_id(id1));
+  tt_ptr_op(c2, OP_EQ, circuit_get_by_global_id(id2));
+
+ done:
+  if (c1)
+    circuit_free(TO_CIRCUIT(c1));
+  if (c2)
+    circuit_free(TO_CIRCUIT(c2));
+}
+
 static void
 test_pick_circid(void *arg)
 {
@@ -343,10 +380,92 @@ test_pick_circid(void *arg)
   circuit_free_all();
 }
 
+static void
+circuit_mark_for_close_mock(circuit_t *circ, int reason, int line,
+                            const char *file)
+{
+  (void)reason;
+  (void)file;
+  circ->marked_for_close = line;
+}
+
+static void
+test_serverside_expiry(void *arg)
+{
+  channel_t *ch = new_fake_channel();
+  or_circuit_t *idle = NULL, *busy = NULL;
+  edge_connection_t *stream = NULL;
+  const time_t now = 1389631200;
+
+  (void)arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  MOCK(circuit_mark_for_close_, circuit_mark_for_close_mock);
+  ch->cmux = tor_malloc(1);
+  update_approx_time(now);
+
+  idle = or_circuit_new(100, ch);
+  busy = or_circuit_new(101, ch);
+  idle->is_first_hop = busy->is_first_hop = 1;
+  stream = tor_malloc_zero(sizeof(edge_connection_t));
+  busy->n_streams = stream;
+
+  /* The channel last sent something 10 seconds ago, so the idle circuit
+   * can close 50 seconds from now; the busy one needs a look later. */
+  ch->timestamp_xmit = now - 10;
+  circuit_schedule_serverside_expiry(idle, now);
+  circuit_schedule_serverside_expiry(busy, now);
+  tt_int_op(idle->idle_timer.when, OP_EQ, now + 50);
+  tt_int_op(busy->idle_timer.when, OP_EQ, now + 60);
+
+  circuit_expire_old_circuits_serverside(now + 49);
+  tt_assert(! TO_CIRCUIT(idle)->marked_for_close);
+
+  /* The channel sent something in the meantime; that pushes the idle
+   * circuit's deadline back. */
+  ch->timestamp_xmit = now + 30;
+  circuit_expire_old_circuits_serverside(now + 50);
+  tt_assert(! TO_CIRCUIT(idle)->marked_for_close);
+  tt_int_op(idle->idle_timer.when, OP_EQ, now + 90);
+
+  /* The busy circuit isn't closed while it has a stream. */
+  circuit_expire_old_circuits_serverside(now + 60);
+  tt_assert(! TO_CIRCUIT(busy)->marked_for_close);
+  tt_int_op(busy->idle_timer.when, OP_EQ, now + 120);
+
+  circuit_expire_old_circuits_serverside(now + 90);
+  tt_assert(TO_CIRCUIT(idle)->marked_for_close);
+  tt_assert(! idle->idle_timer.scheduled);
+
+  /* Once its stream is gone, its next check closes it. */
+  busy->n_streams = NULL;
+  circuit_expire_old_circuits_serverside(now + 119);
+  tt_assert(! TO_CIRCUIT(busy)->marked_for_close);
+  circuit_expire_old_circuits_serverside(now + 120);
+  tt_assert(TO_CIRCUIT(busy)->marked_for_close);
+
+ done:
+  if (busy)
+    busy->n_streams = NULL;
+  tor_free(stream);
+  if (idle)
+    circuit_free(TO_CIRCUIT(idle));
+  if (busy)
+    circuit_free(TO_CIRCUIT(busy));
+  tor_free(ch->cmux);
+  tor_free(ch);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+  UNMOCK(circuit_mark_for_close_);
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
+  { "global_id_map", test_global_id_map, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
+  { "serverside_expiry", test_serverside_expiry, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -7,6 +7,8 @@
 #include "or.h"
 #include "channel.h"
 #include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "config.h"
 #include "relay.h"
 #include "scheduler.h"
 #include "test.h"
@@ -81,8 +83,105 @@ test_cmux_destroy_cell_queue(void *arg)
   packed_cell_free(pc);
 }
 
+/** Set the EWMA clock to <b>when</b>. */
+static void
+set_ewma_time(time_t when)
+{
+  struct timeval tv;
+  tv.tv_sec = when;
+  tv.tv_usec = 0;
+  update_approx_time(when);
+  tor_gettimeofday_cache_set(&tv);
+}
+
+/** Set the EWMA halflife to <b>halflife</b> seconds. */
+static void
+set_ewma_halflife(double halflife)
+{
+  or_options_t *options = tor_malloc_zero(sizeof(or_options_t));
+  options->CircuitPriorityHalflife = halflife;
+  cell_ewma_set_scale_factor(options, NULL);
+  tor_free(options);
+}
+
+/** Make sure that the EWMA policy keeps weighing old and new cells
+ * consistently when the queue crosses tick boundaries and the halflife
+ * changes while circuits are active. */
+static void
+test_cmux_ewma_halflife_change(void *arg)
+{
+  const circuitmux_policy_t *pol = &ewma_policy;
+  const time_t start = 1389631200; /* A multiple of the tick length. */
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t *circ[3] = { NULL, NULL, NULL };
+  circuitmux_policy_circ_data_t *cdata[3] = { NULL, NULL, NULL };
+  int i;
+
+  (void) arg;
+
+  set_ewma_time(start);
+  set_ewma_halflife(30.0);
+
+  cmux = circuitmux_alloc();
+  pol_data = pol->alloc_cmux_data(cmux);
+  tt_assert(pol_data);
+  for (i = 0; i < 3; ++i) {
+    circ[i] = tor_malloc_zero(sizeof(circuit_t));
+    cdata[i] = pol->alloc_circ_data(cmux, pol_data, circ[i],
+                                    CELL_DIRECTION_OUT, 0);
+    tt_assert(cdata[i]);
+  }
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, NULL);
+
+  /* A sends 16 cells now. */
+  pol->notify_circ_active(cmux, pol_data, circ[0], cdata[0]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, circ[0]);
+  pol->notify_xmit_cells(cmux, pol_data, circ[0], cdata[0], 16);
+
+  /* Four halflives and twelve ticks later, B sends 4 cells; A's 16 have
+   * decayed to 1 by now, so A should still be preferred. */
+  set_ewma_time(start + 120);
+  pol->notify_circ_active(cmux, pol_data, circ[1], cdata[1]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, circ[1]);
+  pol->notify_xmit_cells(cmux, pol_data, circ[1], cdata[1], 4);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, circ[0]);
+
+  /* Now the halflife gets much longer, and one tick later C sends 2
+   * cells.  A's count is still below 1, so A must stay at the head: the
+   * counts that A and B accumulated under the old halflife mustn't be
+   * reinterpreted with the new one. */
+  set_ewma_halflife(600.0);
+  set_ewma_time(start + 130);
+  pol->notify_circ_active(cmux, pol_data, circ[2], cdata[2]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, circ[2]);
+  pol->notify_xmit_cells(cmux, pol_data, circ[2], cdata[2], 2);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, circ[0]);
+
+  /* Without A, C's 2 cells beat B's decayed 4. */
+  pol->notify_circ_inactive(cmux, pol_data, circ[0], cdata[0]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, circ[2]);
+  pol->notify_circ_inactive(cmux, pol_data, circ[2], cdata[2]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, circ[1]);
+  pol->notify_circ_inactive(cmux, pol_data, circ[1], cdata[1]);
+  tt_ptr_op(pol->pick_active_circuit(cmux, pol_data), OP_EQ, NULL);
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (cdata[i])
+      pol->free_circ_data(cmux, pol_data, circ[i], cdata[i]);
+    tor_free(circ[i]);
+  }
+  if (pol_data)
+    pol->free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_gettimeofday_cache_clear();
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
+  { "ewma_halflife_change", test_cmux_ewma_halflife_change, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
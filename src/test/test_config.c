@@ -3209,6 +3209,106 @@ test_config_adding_dir_servers(void *arg)
   UNMOCK(add_default_fallback_dir_servers);
 }
 
+/** Parse a single <b>portname</b>Port line with value <b>value</b> into
+ * <b>out</b>, as parse_ports() would for a client port of type
+ * <b>listener_type</b>. */
+static int
+parse_one_port_line(smartlist_t *out, const char *portname,
+                    const char *value, int listener_type, unsigned flags)
+{
+  config_line_t *line = tor_malloc_zero(sizeof(config_line_t));
+  int r;
+  tor_asprintf(&line->key, "%sPort", portname);
+  line->value = tor_strdup(value);
+  r = parse_port_config(out, line, NULL, portname, listener_type,
+                        "127.0.0.1", 0, flags);
+  config_free_lines(line);
+  return r;
+}
+
+static void
+test_config_parse_port_reuseport(void *arg)
+{
+  smartlist_t *ports = smartlist_new();
+  port_cfg_t *port;
+  (void)arg;
+
+  /* Off unless asked for. */
+  tt_int_op(parse_one_port_line(ports, "Socks", "9050",
+                                CONN_TYPE_AP_LISTENER,
+                                CL_PORT_TAKES_HOSTNAMES), OP_EQ, 0);
+  tt_int_op(smartlist_len(ports), OP_EQ, 1);
+  port = smartlist_get(ports, 0);
+  tt_int_op(port->port, OP_EQ, 9050);
+  tt_int_op(port->reuse_port, OP_EQ, 0);
+
+  /* Accepted on TCP client ports... */
+  tt_int_op(parse_one_port_line(ports, "Socks", "127.0.0.1:9051 ReusePort",
+                                CONN_TYPE_AP_LISTENER,
+                                CL_PORT_TAKES_HOSTNAMES), OP_EQ, 0);
+  tt_int_op(parse_one_port_line(ports, "Trans", "9040 ReusePort",
+                                CONN_TYPE_AP_TRANS_LISTENER, 0), OP_EQ, 0);
+  tt_int_op(parse_one_port_line(ports, "DNS", "5353 ReusePort",
+                                CONN_TYPE_AP_DNS_LISTENER,
+                                CL_PORT_TAKES_HOSTNAMES), OP_EQ, 0);
+  tt_int_op(parse_one_port_line(ports, "Socks", "9052 ReusePort NoReusePort",
+                                CONN_TYPE_AP_LISTENER,
+                                CL_PORT_TAKES_HOSTNAMES), OP_EQ, 0);
+  tt_int_op(smartlist_len(ports), OP_EQ, 5);
+  port = smartlist_get(ports, 1);
+  tt_int_op(port->port, OP_EQ, 9051);
+  tt_int_op(port->reuse_port, OP_EQ, 1);
+  port = smartlist_get(ports, 2);
+  tt_int_op(port->type, OP_EQ, CONN_TYPE_AP_TRANS_LISTENER);
+  tt_int_op(port->reuse_port, OP_EQ, 1);
+  port = smartlist_get(ports, 3);
+  tt_int_op(port->type, OP_EQ, CONN_TYPE_AP_DNS_LISTENER);
+  tt_int_op(port->reuse_port, OP_EQ, 1);
+  port = smartlist_get(ports, 4);
+  tt_int_op(port->reuse_port, OP_EQ, 0);
+
+  /* ControlPorts don't take stream options, so they ignore it. */
+  tt_int_op(parse_one_port_line(ports, "Control", "9151 ReusePort",
+                                CONN_TYPE_CONTROL_LISTENER,
+                                CL_PORT_NO_STREAM_OPTIONS), OP_EQ, 0);
+  tt_int_op(smartlist_len(ports), OP_EQ, 6);
+  port = smartlist_get(ports, 5);
+  tt_int_op(port->type, OP_EQ, CONN_TYPE_CONTROL_LISTENER);
+  tt_int_op(port->port, OP_EQ, 9151);
+  tt_int_op(port->reuse_port, OP_EQ, 0);
+
+#ifdef HAVE_SYS_UN_H
+  /* ...and so do unix-socket ControlPorts. */
+  tt_int_op(parse_one_port_line(ports, "Control", "/tmp/control ReusePort",
+                                CONN_TYPE_CONTROL_LISTENER,
+                                CL_PORT_NO_STREAM_OPTIONS|
+                                CL_PORT_IS_UNIXSOCKET), OP_EQ, 0);
+  tt_int_op(smartlist_len(ports), OP_EQ, 7);
+  port = smartlist_get(ports, 6);
+  tt_int_op(port->is_unix_addr, OP_EQ, 1);
+  tt_int_op(port->reuse_port, OP_EQ, 0);
+
+  /* Other unix sockets refuse it, since it means nothing there. */
+  tt_int_op(parse_one_port_line(ports, "Socks", "unix:/tmp/socks ReusePort",
+                                CONN_TYPE_AP_LISTENER,
+                                CL_PORT_TAKES_HOSTNAMES), OP_EQ, -1);
+  tt_int_op(smartlist_len(ports), OP_EQ, 7);
+
+  /* Unix sockets without it are still fine. */
+  tt_int_op(parse_one_port_line(ports, "Socks", "unix:/tmp/socks",
+                                CONN_TYPE_AP_LISTENER,
+                                CL_PORT_TAKES_HOSTNAMES), OP_EQ, 0);
+  tt_int_op(smartlist_len(ports), OP_EQ, 8);
+  port = smartlist_get(ports, 7);
+  tt_int_op(port->is_unix_addr, OP_EQ, 1);
+  tt_int_op(port->reuse_port, OP_EQ, 0);
+#endif
+
+ done:
+  SMARTLIST_FOREACH(ports, port_cfg_t *, p, port_cfg_free(p));
+  smartlist_free(ports);
+}
+
 #define CONFIG_TEST(name, flags)                          \
   { #name, test_config_ ## name, flags, NULL, NULL }
 
@@ -3222,6 +3322,7 @@ struct testcase_t config_tests[] = {
   CONFIG_TEST(check_or_create_data_subdir, TT_FORK),
   CONFIG_TEST(write_to_data_subdir, TT_FORK),
   CONFIG_TEST(fix_my_family, 0),
+  CONFIG_TEST(parse_port_reuseport, 0),
   END_OF_TESTCASES
 };
 
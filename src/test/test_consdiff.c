@@ -0,0 +1,216 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#define CONSDIFF_PRIVATE
+#include "or.h"
+#include "consdiff.h"
+
+#include "test.h"
+
+#define ID1 "AQEBAQEBAQEBAQEBAQEBAQEBAQE"
+#define ID2 "AgICAgICAgICAgICAgICAgICAgI"
+#define ID3 "AwMDAwMDAwMDAwMDAwMDAwMDAwM"
+#define ID4 "BAQEBAQEBAQEBAQEBAQEBAQEBAQ"
+
+static const char base_consensus[] =
+  "network-status-version 3\n"
+  "vote-status consensus\n"
+  "valid-after 2015-09-01 00:00:00\n"
+  "r alpha " ID1 " 2015-08-31 10:00:00 1.2.3.4 9001 0\n"
+  "s Fast Running\n"
+  "w Bandwidth=10\n"
+  "r bravo " ID2 " 2015-08-31 11:00:00 1.2.3.5 9001 0\n"
+  "s Running\n"
+  "w Bandwidth=20\n"
+  "r charlie " ID3 " 2015-08-31 12:00:00 1.2.3.6 443 0\n"
+  "s Fast Running Stable\n"
+  "w Bandwidth=30\n"
+  "directory-footer\n"
+  "directory-signature aaaa\n";
+
+static const char target_consensus[] =
+  "network-status-version 3\n"
+  "vote-status consensus\n"
+  "valid-after 2015-09-01 01:00:00\n"
+  "r bravo " ID2 " 2015-08-31 11:00:00 1.2.3.5 9001 0\n"
+  "s Fast Running\n"
+  "w Bandwidth=25\n"
+  "r charlie " ID3 " 2015-08-31 12:00:00 1.2.3.6 443 0\n"
+  "s Fast Running Stable\n"
+  "w Bandwidth=30\n"
+  "r delta " ID4 " 2015-09-01 00:30:00 1.2.3.7 443 0\n"
+  "s Running\n"
+  "w Bandwidth=5\n"
+  "directory-footer\n"
+  "directory-signature bbbb\n";
+
+static void
+test_consdiff_split_lines(void *arg)
+{
+  cdline_t *lines = NULL;
+  int n = -1;
+  (void)arg;
+
+  lines = consdiff_split_lines("a\n\nbcd\n", 7, &n);
+  tt_assert(lines);
+  tt_int_op(n, OP_EQ, 3);
+  tt_int_op(lines[0].len, OP_EQ, 1);
+  tt_mem_op(lines[0].s, OP_EQ, "a", 1);
+  tt_int_op(lines[1].len, OP_EQ, 0);
+  tt_int_op(lines[2].len, OP_EQ, 3);
+  tt_mem_op(lines[2].s, OP_EQ, "bcd", 3);
+  tor_free(lines);
+
+  /* No final newline. */
+  tt_ptr_op(consdiff_split_lines("a\nb", 3, &n), OP_EQ, NULL);
+  /* Embedded NUL. */
+  tt_ptr_op(consdiff_split_lines("a\0b\n", 4, &n), OP_EQ, NULL);
+  /* Empty. */
+  tt_ptr_op(consdiff_split_lines("", 0, &n), OP_EQ, NULL);
+
+ done:
+  tor_free(lines);
+}
+
+static void
+test_consdiff_roundtrip(void *arg)
+{
+  char *diff = NULL, *result = NULL;
+  (void)arg;
+
+  diff = consdiff_gen_diff(base_consensus, strlen(base_consensus),
+                           target_consensus, strlen(target_consensus));
+  tt_assert(diff);
+  tt_assert(consdiff_looks_like_diff(diff, strlen(diff)));
+  tt_assert(!consdiff_looks_like_diff(base_consensus,
+                                      strlen(base_consensus)));
+  /* The unchanged entry for charlie shouldn't appear in the diff. */
+  tt_ptr_op(strstr(diff, "r charlie"), OP_EQ, NULL);
+
+  result = consdiff_apply_diff(base_consensus, strlen(base_consensus),
+                               diff, strlen(diff));
+  tt_assert(result);
+  tt_str_op(result, OP_EQ, target_consensus);
+  tor_free(result);
+
+  /* The diff doesn't apply to any other base. */
+  result = consdiff_apply_diff(target_consensus, strlen(target_consensus),
+                               diff, strlen(diff));
+  tt_ptr_op(result, OP_EQ, NULL);
+  tor_free(diff);
+
+  /* Diffing a document against itself gives an empty script. */
+  diff = consdiff_gen_diff(base_consensus, strlen(base_consensus),
+                           base_consensus, strlen(base_consensus));
+  tt_assert(diff);
+  result = consdiff_apply_diff(base_consensus, strlen(base_consensus),
+                               diff, strlen(diff));
+  tt_str_op(result, OP_EQ, base_consensus);
+
+ done:
+  tor_free(diff);
+  tor_free(result);
+}
+
+static void
+test_consdiff_gen_failures(void *arg)
+{
+  static const char no_footer[] =
+    "network-status-version 3\n"
+    "r alpha " ID1 " 2015-08-31 10:00:00 1.2.3.4 9001 0\n";
+  static const char misordered[] =
+    "network-status-version 3\n"
+    "r bravo " ID2 " 2015-08-31 11:00:00 1.2.3.5 9001 0\n"
+    "r alpha " ID1 " 2015-08-31 10:00:00 1.2.3.4 9001 0\n"
+    "directory-footer\n";
+  static const char has_dot[] =
+    "network-status-version 3\n"
+    ".\n"
+    "directory-footer\n";
+  char *diff = NULL;
+  (void)arg;
+
+  diff = consdiff_gen_diff(base_consensus, strlen(base_consensus),
+                           no_footer, strlen(no_footer));
+  tt_ptr_op(diff, OP_EQ, NULL);
+  diff = consdiff_gen_diff(misordered, strlen(misordered),
+                           base_consensus, strlen(base_consensus));
+  tt_ptr_op(diff, OP_EQ, NULL);
+  diff = consdiff_gen_diff(base_consensus, strlen(base_consensus),
+                           has_dot, strlen(has_dot));
+  tt_ptr_op(diff, OP_EQ, NULL);
+
+ done:
+  tor_free(diff);
+}
+
+/** Helper: apply a diff made of a correct header for <b>base</b> followed
+ * by <b>commands</b>, whose target hash is that of <b>target</b>. */
+static char *
+apply_commands(const char *base, const char *target, const char *commands)
+{
+  uint8_t digest[DIGEST256_LEN];
+  char base_hex[HEX_DIGEST256_LEN+1], target_hex[HEX_DIGEST256_LEN+1];
+  char *diff = NULL, *result;
+
+  consdiff_digest_document(digest, base, strlen(base));
+  base16_encode(base_hex, sizeof(base_hex), (char*)digest, sizeof(digest));
+  consdiff_digest_document(digest, target, strlen(target));
+  base16_encode(target_hex, sizeof(target_hex), (char*)digest,
+                sizeof(digest));
+  tor_asprintf(&diff, "%s\nhash %s %s\n%s", CONSDIFF_FIRST_LINE,
+               base_hex, target_hex, commands);
+  result = consdiff_apply_diff(base, strlen(base), diff, strlen(diff));
+  tor_free(diff);
+  return result;
+}
+
+static void
+test_consdiff_apply_commands(void *arg)
+{
+  const char *base = "one\ntwo\nthree\nfour\n";
+  char *result = NULL;
+  (void)arg;
+
+  /* Well-formed commands, in decreasing order. */
+  result = apply_commands(base, "zero\none\n3\nfour\nfive\n",
+                          "4a\nfive\n.\n2,3c\n3\n.\n0a\nzero\n.\n");
+  tt_str_op(result, OP_EQ, "zero\none\n3\nfour\nfive\n");
+  tor_free(result);
+  result = apply_commands(base, "one\nfour\n", "2,3d\n");
+  tt_str_op(result, OP_EQ, "one\nfour\n");
+  tor_free(result);
+
+  /* Commands out of order, or overlapping. */
+  tt_ptr_op(apply_commands(base, "two\nthree\n", "1d\n4d\n"), OP_EQ, NULL);
+  tt_ptr_op(apply_commands(base, "one\n", "2,4d\n3d\n"), OP_EQ, NULL);
+  tt_ptr_op(apply_commands(base, "one\nx\ny\nthree\nfour\n",
+                           "1a\nx\n.\n1a\ny\n.\n"), OP_EQ, NULL);
+  /* Lines out of range. */
+  tt_ptr_op(apply_commands(base, "one\n", "2,5d\n"), OP_EQ, NULL);
+  tt_ptr_op(apply_commands(base, "one\n", "0d\n"), OP_EQ, NULL);
+  tt_ptr_op(apply_commands(base, "one\n", "5a\nx\n.\n"), OP_EQ, NULL);
+  /* Malformed commands. */
+  tt_ptr_op(apply_commands(base, "one\n", "2,3\n"), OP_EQ, NULL);
+  tt_ptr_op(apply_commands(base, "one\n", "2x\n"), OP_EQ, NULL);
+  tt_ptr_op(apply_commands(base, "one\n", "-2d\n"), OP_EQ, NULL);
+  tt_ptr_op(apply_commands(base, "one\n", "2,3c\nfoo\n"), OP_EQ, NULL);
+  /* Right commands, wrong promised result. */
+  tt_ptr_op(apply_commands(base, "one\n", "2,3d\n"), OP_EQ, NULL);
+
+ done:
+  tor_free(result);
+}
+
+#define CONSDIFF_TEST(name)                                             \
+  { #name, test_consdiff_ ## name, 0, NULL, NULL }
+
+struct testcase_t consdiff_tests[] = {
+  CONSDIFF_TEST(split_lines),
+  CONSDIFF_TEST(roundtrip),
+  CONSDIFF_TEST(gen_failures),
+  CONSDIFF_TEST(apply_commands),
+  END_OF_TESTCASES
+};
+
@@ -767,6 +767,35 @@ test_container_pqueue(void *arg)
   tt_int_op(smartlist_len(sl),OP_EQ, 0);
   OK();
 
+  /* Removing from the middle may need to move the last item up or down;
+   * try lots of cases. */
+  {
+    pq_entry_t many[64];
+    char names[64][8];
+    const char *prev = "";
+    int i;
+    for (i = 0; i < 64; ++i) {
+      tor_snprintf(names[i], sizeof(names[i]), "%05d",
+                   (int)crypto_rand_int(100000));
+      many[i].val = names[i];
+      many[i].idx = -1;
+      smartlist_pqueue_add(sl, cmp, offset, &many[i]);
+      OK();
+    }
+    for (i = 0; i < 64; i += 3) {
+      smartlist_pqueue_remove(sl, cmp, offset, &many[i]);
+      tt_int_op(many[i].idx, OP_EQ, -1);
+      OK();
+    }
+    tt_int_op(smartlist_len(sl), OP_EQ, 64 - 22);
+    while (smartlist_len(sl)) {
+      pq_entry_t *e = smartlist_pqueue_pop(sl, cmp, offset);
+      tt_int_op(strcmp(prev, e->val), OP_LE, 0);
+      prev = e->val;
+      OK();
+    }
+  }
+
 #undef OK
 
  done:
@@ -1226,6 +1255,96 @@ test_container_smartlist_strings_eq(void *arg)
   smartlist_free(sl2);
 }
 
+/** A timer for test_container_timewheel. */
+typedef struct tw_item_t {
+  timewheel_entry_t ent;
+  time_t due;
+  int n_fired;
+  time_t fired_at;
+} tw_item_t;
+
+/** Helper for test_container_timewheel: note that a timer fired. */
+static void
+timewheel_test_cb(timewheel_entry_t *ent, time_t now, void *arg)
+{
+  tw_item_t *item = SUBTYPE_P(ent, tw_item_t, ent);
+  int *n_fired = arg;
+  ++item->n_fired;
+  item->fired_at = now;
+  ++*n_fired;
+}
+
+/** Run unit tests for the hierarchical timer wheel. */
+static void
+test_container_timewheel(void *arg)
+{
+  const time_t start = 1420070400;
+  timewheel_t *wheel = timewheel_new(start);
+  tw_item_t items[200];
+  int i, n_fired = 0;
+  time_t now = start;
+
+  (void)arg;
+  memset(items, 0, sizeof(items));
+
+  /* Timers spread over every level of the wheel, plus one that's already
+   * due and one far enough away to need the overflow list. */
+  for (i = 0; i < 200; ++i) {
+    if (i == 0)
+      items[i].due = start - 10;
+    else if (i == 1)
+      items[i].due = start + 1000*86400;
+    else
+      items[i].due = start + (time_t)i * i * i * 7;
+    timewheel_schedule(wheel, &items[i].ent, items[i].due);
+  }
+  tt_int_op(timewheel_get_n_entries(wheel), OP_EQ, 200);
+
+  /* Cancel one, and move one. */
+  timewheel_cancel(wheel, &items[50].ent);
+  tt_int_op(items[50].ent.scheduled, OP_EQ, 0);
+  items[60].due = start + 100;
+  timewheel_schedule(wheel, &items[60].ent, items[60].due);
+  tt_int_op(timewheel_get_n_entries(wheel), OP_EQ, 199);
+
+  /* Step a second at a time for a while: everything fires exactly when it's
+   * due. */
+  for (now = start + 1; now < start + 20000; ++now) {
+    timewheel_advance(wheel, now, timewheel_test_cb, &n_fired);
+    for (i = 0; i < 200; ++i) {
+      if (i == 50)
+        continue;
+      if (items[i].due <= now) {
+        tt_int_op(items[i].n_fired, OP_EQ, 1);
+        if (i)
+          tt_assert(items[i].fired_at == MAX(items[i].due, start + 1));
+      } else {
+        tt_int_op(items[i].n_fired, OP_EQ, 0);
+      }
+    }
+  }
+
+  /* Then jump: timers fire late, but still exactly once. */
+  timewheel_advance(wheel, start + 700*86400, timewheel_test_cb, &n_fired);
+  timewheel_advance(wheel, start + 700*86400 - 5, timewheel_test_cb,
+                    &n_fired);
+  for (i = 2; i < 200; ++i) {
+    if (i != 50)
+      tt_int_op(items[i].n_fired, OP_EQ, 1);
+  }
+  tt_int_op(items[1].n_fired, OP_EQ, 0);
+  tt_int_op(items[50].n_fired, OP_EQ, 0);
+  tt_int_op(timewheel_get_n_entries(wheel), OP_EQ, 1);
+
+  timewheel_advance(wheel, start + 1100*86400, timewheel_test_cb, &n_fired);
+  tt_int_op(items[1].n_fired, OP_EQ, 1);
+  tt_int_op(n_fired, OP_EQ, 199);
+  tt_int_op(timewheel_get_n_entries(wheel), OP_EQ, 0);
+
+ done:
+  timewheel_free(wheel);
+}
+
 #define CONTAINER_LEGACY(name)                                          \
   { #name, test_container_ ## name , 0, NULL, NULL }
 
@@ -1250,6 +1369,7 @@ struct testcase_t container_tests[] = {
   CONTAINER(smartlist_most_frequent, 0),
   CONTAINER(smartlist_sort_ptrs, 0),
   CONTAINER(smartlist_strings_eq, 0),
+  CONTAINER(timewheel, 0),
   END_OF_TESTCASES
 };
 
@@ -288,6 +288,7 @@ test_crypto_sha(void *arg)
   char digest[32];
   char data[50];
   char d_out1[DIGEST_LEN], d_out2[DIGEST256_LEN];
+  crypto_digest_checkpoint_t checkpoint;
   char *mem_op_hex_tmp=NULL;
 
   /* Test SHA-1 with a test vector from the specification. */
@@ -392,6 +393,22 @@ test_crypto_sha(void *arg)
   crypto_digest_free(d1);
   crypto_digest_free(d2);
 
+  /* Checkpoint and restore. */
+  d1 = crypto_digest_new();
+  tt_assert(d1);
+  crypto_digest_add_bytes(d1, "abcdef", 6);
+  crypto_digest_checkpoint(&checkpoint, d1);
+  crypto_digest_add_bytes(d1, "ghijkl", 6);
+  crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+  crypto_digest(d_out2, "abcdefghijkl", 12);
+  tt_mem_op(d_out1,OP_EQ, d_out2, DIGEST_LEN);
+  crypto_digest_restore(d1, &checkpoint);
+  crypto_digest_add_bytes(d1, "mno", 3);
+  crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+  crypto_digest(d_out2, "abcdefmno", 9);
+  tt_mem_op(d_out1,OP_EQ, d_out2, DIGEST_LEN);
+  crypto_digest_free(d1);
+
   /* Incremental digest code with sha256 */
   d1 = crypto_digest256_new(DIGEST_SHA256);
   tt_assert(d1);
@@ -12,13 +12,16 @@
 #define ROUTERLIST_PRIVATE
 #define HIBERNATE_PRIVATE
 #define NETWORKSTATUS_PRIVATE
+#define ROUTERPARSE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "crypto_ed25519.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "hibernate.h"
+#include "memarea.h"
 #include "networkstatus.h"
 #include "router.h"
 #include "routerkeys.h"
@@ -92,6 +95,8 @@ test_dir_formats(void *arg)
   addr_policy_t *ex1, *ex2;
   routerlist_t *dir1 = NULL, *dir2 = NULL;
   uint8_t *rsa_cc = NULL;
+  smartlist_t *parsed = smartlist_new(), *invalid = smartlist_new();
+  const char *ccp;
   or_options_t *options = get_options_mutable();
   const addr_policy_t *p;
   time_t now = time(NULL);
@@ -300,6 +305,43 @@ test_dir_formats(void *arg)
   tt_str_op(buf, OP_EQ, buf2);
   tor_free(buf);
 
+  /* Parsing a list checks the ed25519 signatures in a batch at the end. */
+  buf = router_dump_router_to_string(r2, pk1, pk2, &r2_onion_keypair, &kp2);
+  tt_assert(buf);
+  ccp = buf;
+  tt_int_op(0, OP_EQ, router_parse_list_from_string(&ccp, NULL, parsed,
+                                          SAVED_NOWHERE, 0, 0, NULL, invalid));
+  tt_int_op(smartlist_len(parsed), OP_EQ, 1);
+  tt_int_op(smartlist_len(invalid), OP_EQ, 0);
+  SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_clear(parsed);
+  /* Corrupt the ed25519 signature, and the descriptor gets dropped. */
+  cp = strstr(buf, "router-sig-ed25519 ");
+  tt_assert(cp);
+  cp += strlen("router-sig-ed25519 ");
+  *cp = (*cp == 'A') ? 'B' : 'A';
+  ccp = buf;
+  tt_int_op(0, OP_EQ, router_parse_list_from_string(&ccp, NULL, parsed,
+                                          SAVED_NOWHERE, 0, 0, NULL, invalid));
+  tt_int_op(smartlist_len(parsed), OP_EQ, 0);
+  tt_int_op(smartlist_len(invalid), OP_EQ, 1);
+  tor_free(buf);
+
+  /* Likewise for the RSA signature, but since that isn't covered by the
+   * descriptor digest, we don't mark the digest as undownloadable. */
+  buf = router_dump_router_to_string(r2, pk1, NULL, NULL, NULL);
+  tt_assert(buf);
+  cp = strstr(buf, "-----BEGIN SIGNATURE-----\n");
+  tt_assert(cp);
+  cp += strlen("-----BEGIN SIGNATURE-----\n");
+  *cp = (*cp == 'A') ? 'B' : 'A';
+  ccp = buf;
+  tt_int_op(0, OP_EQ, router_parse_list_from_string(&ccp, NULL, parsed,
+                                          SAVED_NOWHERE, 0, 0, NULL, invalid));
+  tt_int_op(smartlist_len(parsed), OP_EQ, 0);
+  tt_int_op(smartlist_len(invalid), OP_EQ, 1);
+  tor_free(buf);
+
   buf = router_dump_router_to_string(r2, pk1, NULL, NULL, NULL);
   cp = buf;
   rp2 = router_parse_entry_from_string((const char*)cp,NULL,1,0,NULL,NULL);
@@ -353,6 +395,10 @@ test_dir_formats(void *arg)
   if (rp2)
     routerinfo_free(rp2);
 
+  SMARTLIST_FOREACH(parsed, routerinfo_t *, ri, routerinfo_free(ri));
+  smartlist_free(parsed);
+  SMARTLIST_FOREACH(invalid, char *, d, tor_free(d));
+  smartlist_free(invalid);
   tor_free(rsa_cc);
   tor_free(buf);
   tor_free(pk1_str);
@@ -798,6 +844,128 @@ test_dir_load_routers(void *arg)
   tor_free(list);
 }
 
+#ifndef _WIN32
+/** The store rebuilds that router_rebuild_store_in_background() handed to
+ * mock_cpuworker_queue_work(). */
+static store_rebuild_job_t *queued_store_jobs[3];
+static int n_queued_store_jobs = 0;
+
+static int
+mock_cpuworker_queue_work(workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  tor_assert(fn == store_rebuild_threadfn);
+  tor_assert(reply_fn == store_rebuild_replyfn);
+  tor_assert(n_queued_store_jobs < 3);
+  queued_store_jobs[n_queued_store_jobs++] = arg;
+  return 0;
+}
+
+static void
+test_dir_store_rebuild_bg(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  smartlist_t *wanted = smartlist_new(), *sds = smartlist_new();
+  routerlist_t *rl;
+  desc_store_t *store;
+  signed_descriptor_t *sd_max, *sd_min;
+  store_rebuild_job_t *job_a, *job_b;
+  char buf[DIGEST_LEN];
+  char *fname_a = NULL, *fname_b = NULL, *journal_fn = NULL, *j = NULL;
+  const char *body;
+  (void) arg;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  update_approx_time(1412510400);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("dir_store_rebuild_bg"));
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+  journal_fn = get_datadir_fname("cached-descriptors.new");
+
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_MAXIMAL,
+                                             strlen(EX_RI_MAXIMAL), buf));
+  smartlist_add(wanted, tor_strdup(hex_str(buf, DIGEST_LEN)));
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_MINIMAL,
+                                             strlen(EX_RI_MINIMAL), buf));
+  smartlist_add(wanted, tor_strdup(hex_str(buf, DIGEST_LEN)));
+
+  tt_int_op(1, OP_EQ,
+            router_load_routers_from_string(EX_RI_MAXIMAL, NULL,
+                                            SAVED_IN_JOURNAL, wanted, 1,
+                                            NULL));
+  rl = router_get_routerlist();
+  store = &rl->desc_store;
+  tt_int_op(smartlist_len(rl->routers), OP_EQ, 1);
+  sd_max = &((routerinfo_t*)smartlist_get(rl->routers, 0))->cache_info;
+  tt_int_op(sd_max->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_ptr_op(store->mmap, OP_EQ, NULL);
+
+  /* Start two rebuilds; the second one supersedes the first. */
+  smartlist_add(sds, sd_max);
+  tt_int_op(0, OP_EQ, router_rebuild_store_in_background(store, sds));
+  tt_int_op(0, OP_EQ, router_rebuild_store_in_background(store, sds));
+  tt_int_op(n_queued_store_jobs, OP_EQ, 2);
+  job_a = queued_store_jobs[0];
+  job_b = queued_store_jobs[1];
+  tt_str_op(job_a->fname, OP_NE, job_b->fname);
+  fname_a = tor_strdup(job_a->fname);
+  fname_b = tor_strdup(job_b->fname);
+
+  /* Another descriptor arrives while the workers are busy. */
+  tt_int_op(1, OP_EQ,
+            router_load_routers_from_string(EX_RI_MINIMAL, NULL,
+                                            SAVED_IN_JOURNAL, wanted, 1,
+                                            NULL));
+  tt_int_op(smartlist_len(rl->routers), OP_EQ, 2);
+  sd_min = &((routerinfo_t*)smartlist_get(rl->routers, 1))->cache_info;
+
+  tt_int_op(store_rebuild_threadfn(NULL, job_a), OP_EQ, WQ_RPL_REPLY);
+  tt_int_op(store_rebuild_threadfn(NULL, job_b), OP_EQ, WQ_RPL_REPLY);
+  tt_int_op(file_status(fname_a), OP_EQ, FN_FILE);
+  tt_int_op(file_status(fname_b), OP_EQ, FN_FILE);
+
+  /* The stale reply removes its own file, and nothing else. */
+  store_rebuild_replyfn(job_a);
+  tt_int_op(file_status(fname_a), OP_EQ, FN_NOENT);
+  tt_int_op(file_status(fname_b), OP_EQ, FN_FILE);
+  tt_ptr_op(store->mmap, OP_EQ, NULL);
+  tt_int_op(sd_max->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  /* The current one maps the new store, and moves what it wrote there. */
+  store_rebuild_replyfn(job_b);
+  tt_int_op(file_status(fname_b), OP_EQ, FN_NOENT);
+  tt_assert(store->mmap);
+  tt_int_op(sd_max->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_ptr_op(sd_max->signed_descriptor_body, OP_EQ, NULL);
+  body = signed_descriptor_get_body(sd_max);
+  tt_assert(body >= store->mmap->data &&
+            body < store->mmap->data + store->mmap->size);
+  tt_mem_op(body, OP_EQ, EX_RI_MAXIMAL, sd_max->signed_descriptor_len);
+
+  /* The journal now holds only the descriptor that wasn't in the
+   * snapshot. */
+  tt_int_op(sd_min->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  j = read_file_to_str(journal_fn, RFTS_BIN, NULL);
+  tt_assert(j);
+  tt_assert(strstr(j, EX_RI_MINIMAL));
+  tt_ptr_op(strstr(j, EX_RI_MAXIMAL), OP_EQ, NULL);
+  tt_int_op(store->journal_len, OP_EQ, strlen(j));
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  routerlist_free_all();
+  tor_free(options->DataDirectory);
+  SMARTLIST_FOREACH(wanted, char *, cp, tor_free(cp));
+  smartlist_free(wanted);
+  smartlist_free(sds);
+  tor_free(fname_a);
+  tor_free(fname_b);
+  tor_free(journal_fn);
+  tor_free(j);
+}
+#endif
+
 static int mock_get_by_ei_dd_calls = 0;
 static int mock_get_by_ei_dd_unrecognized = 0;
 
@@ -1368,6 +1536,155 @@ test_dir_measured_bw_kb_cache(void *arg)
   return;
 }
 
+static void
+test_dir_response_cache(void *arg)
+{
+  uint8_t k1[DIGEST256_LEN], k2[DIGEST256_LEN], k3[DIGEST256_LEN];
+  response_cache_entry_t *ent;
+  cached_dir_t *d;
+  (void)arg;
+
+  memset(k1, 1, sizeof(k1));
+  memset(k2, 2, sizeof(k2));
+  memset(k3, 3, sizeof(k3));
+  dirserv_response_cache_clear();
+
+  /* A body for a response nobody asked for gets dropped. */
+  dirserv_response_cache_set_body(k1, tor_strdup("abc"), 3);
+  tt_ptr_op(dirserv_response_cache_lookup(k1), OP_EQ, NULL);
+  tt_int_op(dirserv_response_cache_get_total_allocation(), OP_EQ, 0);
+
+  /* Requests get counted; bodies get accounted. */
+  ent = dirserv_response_cache_note_request(k1, 1000);
+  tt_int_op(ent->n_requests, OP_EQ, 1);
+  ent = dirserv_response_cache_note_request(k1, 1001);
+  tt_int_op(ent->n_requests, OP_EQ, 2);
+  tt_ptr_op(dirserv_response_cache_lookup(k1), OP_EQ, NULL);
+  dirserv_response_cache_set_body(k1, tor_strdup("0123456789"), 10);
+  d = dirserv_response_cache_lookup(k1);
+  tt_assert(d);
+  tt_mem_op(d->dir_z, OP_EQ, "0123456789", 10);
+  tt_int_op(dirserv_response_cache_get_total_allocation(), OP_EQ, 10);
+
+  dirserv_response_cache_note_request(k2, 1002);
+  dirserv_response_cache_set_body(k2, tor_strdup("01234"), 5);
+  dirserv_response_cache_note_request(k3, 1003);
+  dirserv_response_cache_set_body(k3, tor_strdup("0123"), 4);
+  tt_int_op(dirserv_response_cache_get_total_allocation(), OP_EQ, 19);
+
+  /* Shrinking drops the least recently requested responses first. */
+  dirserv_response_cache_note_request(k1, 1004);
+  dirserv_response_cache_shrink(15);
+  tt_ptr_op(dirserv_response_cache_lookup(k2), OP_EQ, NULL);
+  tt_assert(dirserv_response_cache_lookup(k1));
+  tt_assert(dirserv_response_cache_lookup(k3));
+  tt_int_op(dirserv_response_cache_get_total_allocation(), OP_EQ, 14);
+  dirserv_response_cache_shrink(10);
+  tt_ptr_op(dirserv_response_cache_lookup(k3), OP_EQ, NULL);
+  tt_assert(dirserv_response_cache_lookup(k1));
+  tt_int_op(dirserv_response_cache_get_total_allocation(), OP_EQ, 10);
+
+  /* A connection that's still spooling a body keeps it alive. */
+  d = dirserv_response_cache_lookup(k1);
+  ++d->refcnt;
+  dirserv_response_cache_clear();
+  tt_int_op(dirserv_response_cache_get_total_allocation(), OP_EQ, 0);
+  tt_ptr_op(dirserv_response_cache_lookup(k1), OP_EQ, NULL);
+  tt_mem_op(d->dir_z, OP_EQ, "0123456789", 10);
+  cached_dir_decref(d);
+
+ done:
+  dirserv_response_cache_clear();
+}
+
+/** Return the type of the first token that <b>table</b> finds in <b>s</b>,
+ * storing the token in *<b>tok_out</b>. */
+static directory_keyword
+first_token_type(memarea_t *area, const char *s, token_rule_t *table,
+                 directory_token_t **tok_out)
+{
+  const char *cp = s;
+  *tok_out = get_next_token(area, &cp, s + strlen(s), table);
+  return (*tok_out)->tp;
+}
+
+static void
+test_dir_token_table_lookup(void *arg)
+{
+  memarea_t *area = memarea_new();
+  directory_token_t *tok = NULL;
+  int i, idx;
+  (void)arg;
+
+  /* Every keyword in a table finds its own rule. */
+  for (i = 0; routerdesc_token_table[i].t; ++i) {
+    const char *kw = routerdesc_token_table[i].t;
+    idx = token_table_lookup(routerdesc_token_table, kw, strlen(kw));
+    tt_int_op(idx, OP_EQ, i);
+  }
+  for (i = 0; extrainfo_token_table[i].t; ++i) {
+    const char *kw = extrainfo_token_table[i].t;
+    idx = token_table_lookup(extrainfo_token_table, kw, strlen(kw));
+    tt_int_op(idx, OP_EQ, i);
+  }
+
+  /* Only the given length of the keyword counts. */
+  idx = token_table_lookup(routerdesc_token_table, "platform 1.2", 8);
+  tt_int_op(idx, OP_GE, 0);
+  tt_int_op(routerdesc_token_table[idx].v, OP_EQ, K_PLATFORM);
+  tt_int_op(token_table_lookup(routerdesc_token_table, "platform", 7),
+            OP_EQ, -1);
+  tt_int_op(token_table_lookup(routerdesc_token_table, "platforms", 9),
+            OP_EQ, -1);
+  tt_int_op(token_table_lookup(routerdesc_token_table, "", 0), OP_EQ, -1);
+
+  /* The same keyword can appear in several tables, at different places. */
+  idx = token_table_lookup(routerdesc_token_table, "published", 9);
+  tt_int_op(idx, OP_GE, 0);
+  tt_int_op(routerdesc_token_table[idx].v, OP_EQ, K_PUBLISHED);
+  i = token_table_lookup(extrainfo_token_table, "published", 9);
+  tt_int_op(i, OP_GE, 0);
+  tt_int_op(i, OP_NE, idx);
+  tt_int_op(extrainfo_token_table[i].v, OP_EQ, K_PUBLISHED);
+
+  /* But a keyword from one table means nothing in another. */
+  tt_int_op(token_table_lookup(extrainfo_token_table, "router", 6),
+            OP_EQ, -1);
+  tt_int_op(token_table_lookup(routerdesc_token_table, "extra-info", 10),
+            OP_EQ, -1);
+
+  /* The tokenizer uses the rules that it finds... */
+  tt_int_op(first_token_type(area, "platform Tor 0.2.7.6\n",
+                             routerdesc_token_table, &tok), OP_EQ,
+            K_PLATFORM);
+  tt_int_op(tok->n_args, OP_EQ, 1);
+  tt_str_op(tok->args[0], OP_EQ, "Tor 0.2.7.6");
+  tt_int_op(first_token_type(area, "opt hibernating 1\n",
+                             routerdesc_token_table, &tok), OP_EQ,
+            K_HIBERNATING);
+  tt_int_op(first_token_type(area, "extra-info nick ABCD\n",
+                             extrainfo_token_table, &tok), OP_EQ,
+            K_EXTRA_INFO);
+  tt_int_op(tok->n_args, OP_EQ, 2);
+
+  /* ...and calls anything else an unrecognized keyword or annotation. */
+  tt_int_op(first_token_type(area, "extra-info nick ABCD\n",
+                             routerdesc_token_table, &tok), OP_EQ, K_OPT);
+  tt_int_op(tok->n_args, OP_EQ, 1);
+  tt_str_op(tok->args[0], OP_EQ, "extra-info nick ABCD");
+  tt_int_op(first_token_type(area, "platformer x\n",
+                             routerdesc_token_table, &tok), OP_EQ, K_OPT);
+  tt_int_op(first_token_type(area, "@purpose bridge\n",
+                             extrainfo_token_table, &tok), OP_EQ,
+            A_UNKNOWN_);
+  tt_int_op(first_token_type(area, "@purpose bridge\n",
+                             routerdesc_token_table, &tok), OP_EQ,
+            A_PURPOSE);
+
+ done:
+  memarea_drop_all(area);
+}
+
 static void
 test_dir_param_voting(void *arg)
 {
@@ -3507,12 +3824,17 @@ struct testcase_t dir_tests[] = {
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
   DIR(load_routers, TT_FORK),
+#ifndef _WIN32
+  DIR(store_rebuild_bg, TT_FORK),
+#endif
   DIR(load_extrainfo, TT_FORK),
   DIR_LEGACY(versions),
   DIR_LEGACY(fp_pairs),
   DIR(split_fps, 0),
   DIR_LEGACY(measured_bw_kb),
   DIR_LEGACY(measured_bw_kb_cache),
+  DIR(response_cache, 0),
+  DIR(token_table_lookup, 0),
   DIR_LEGACY(param_voting),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
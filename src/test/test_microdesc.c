@@ -4,7 +4,9 @@
 #include "orconfig.h"
 #include "or.h"
 
+#define MICRODESC_PRIVATE
 #include "config.h"
+#include "cpuworker.h"
 #include "dirvote.h"
 #include "microdesc.h"
 #include "networkstatus.h"
@@ -249,6 +251,273 @@ test_md_cache(void *data)
   tor_free(fn);
 }
 
+/** Helper for test_md_cache_index: check that the index file <b>fn</b>
+ * lists <b>n_entries</b> microdescriptors from a cache file of
+ * <b>cache_size</b> bytes, including <b>md</b>. */
+static void
+check_md_index(const char *fn, size_t cache_size, int n_entries,
+               const microdesc_t *md)
+{
+  /* The index starts with a 16-byte magic and the size of the cache file,
+   * and then has one 52-byte entry per microdescriptor: its digest, its
+   * offset, its length and its last-listed time. */
+  const size_t header_len = 16 + 8, entry_len = DIGEST256_LEN + 8 + 4 + 8;
+  struct stat st;
+  char *s = read_file_to_str(fn, RFTS_BIN, &st);
+  const char *ent = NULL;
+  int i;
+
+  tt_assert(s);
+  tt_int_op(st.st_size, OP_EQ, header_len + n_entries * entry_len);
+  tt_mem_op(s, OP_EQ, "tor-md-index-v1\n", 16);
+  tt_int_op(ntohl(get_uint32(s + 16)), OP_EQ, (uint32_t)(cache_size >> 32));
+  tt_int_op(ntohl(get_uint32(s + 20)), OP_EQ, (uint32_t)cache_size);
+  for (i = 0; i < n_entries; ++i) {
+    const char *cp = s + header_len + i * entry_len;
+    if (fast_memeq(cp, md->digest, DIGEST256_LEN))
+      ent = cp;
+  }
+  tt_assert(ent);
+  ent += DIGEST256_LEN;
+  tt_int_op(ntohl(get_uint32(ent)), OP_EQ, 0);
+  tt_int_op(ntohl(get_uint32(ent + 4)), OP_EQ, md->off);
+  tt_int_op(ntohl(get_uint32(ent + 8)), OP_EQ, md->bodylen);
+  tt_int_op(ntohl(get_uint32(ent + 16)), OP_EQ, (uint32_t)md->last_listed);
+
+ done:
+  tor_free(s);
+}
+
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md1, *md3;
+  char d1[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  time_t time1 = time(NULL), time3 = time(NULL) - 2*24*60*60;
+  char *fn = NULL, *cache_fn = NULL;
+  struct stat st;
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test_idx"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  time1, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, time3, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+
+  /* Rebuilding the cache writes an index next to it. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs.idx",
+               options->DataDirectory);
+  tor_asprintf(&cache_fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->DataDirectory);
+  tt_int_op(0, OP_EQ, stat(cache_fn, &st));
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  tt_assert(md1);
+  check_md_index(fn, st.st_size, 2, md1);
+
+  /* Reload from the index: looking the microdescriptors up doesn't parse
+   * them, and they keep their last-listed times. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md1);
+  tt_assert(md3);
+  tt_int_op(md1->not_yet_parsed, OP_EQ, 1);
+  tt_int_op(md3->not_yet_parsed, OP_EQ, 1);
+  tt_ptr_op(md1->onion_pkey, OP_EQ, NULL);
+  tt_int_op(md1->last_listed, OP_EQ, time1);
+  tt_int_op(md3->last_listed, OP_EQ, time3);
+
+  /* They get parsed the first time somebody needs their contents. */
+  tt_int_op(microdesc_ensure_parsed(md1), OP_EQ, 0);
+  tt_int_op(md1->not_yet_parsed, OP_EQ, 0);
+  tt_assert(md1->onion_pkey);
+  tt_int_op(microdesc_ensure_parsed(md1), OP_EQ, 0);
+  tt_int_op(md3->not_yet_parsed, OP_EQ, 1);
+  tt_int_op(microdesc_ensure_parsed(md3), OP_EQ, 0);
+  tt_assert(md3->family);
+  tt_int_op(smartlist_len(md3->family), OP_EQ, 3);
+  tt_assert(md3->exit_policy);
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_CACHE);
+
+  /* A broken index makes us parse the whole cache, and replace the index. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fn, "tor-md-index-v1\nbogus", 1));
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md1);
+  tt_assert(md3);
+  tt_assert(md3->family);
+  tt_int_op(0, OP_EQ, stat(cache_fn, &st));
+  check_md_index(fn, st.st_size, 2, md3);
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(fn);
+  tor_free(cache_fn);
+}
+
+#ifndef _WIN32
+/** The last three jobs that microdesc_cache_rebuild_in_background() handed
+ * to mock_cpuworker_queue_work(). */
+static md_rebuild_job_t *queued_md_jobs[3];
+static int n_queued_md_jobs = 0;
+
+static int
+mock_cpuworker_queue_work(workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  tor_assert(fn == microdesc_rebuild_threadfn);
+  tor_assert(reply_fn == microdesc_rebuild_replyfn);
+  tor_assert(n_queued_md_jobs < 3);
+  queued_md_jobs[n_queued_md_jobs++] = arg;
+  return 0;
+}
+
+static void
+test_md_cache_rebuild_bg(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md1, *md2, *md3;
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  const char *old_body1;
+  md_rebuild_job_t *job_a, *job_b;
+  char *cache_fn = NULL, *journal_fn = NULL, *fname_a = NULL;
+  char *fname_b = NULL, *s = NULL, *j = NULL;
+  time_t now = time(NULL);
+  (void)data;
+
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test_bg"));
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+  tor_asprintf(&cache_fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->DataDirectory);
+  tor_asprintf(&journal_fn, "%s"PATH_SEPARATOR"cached-microdescs.new",
+               options->DataDirectory);
+
+  /* md1 lives in the cache file, and md2 in the journal. */
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md1 = smartlist_get(added, 0);
+  smartlist_free(added);
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md2 = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  old_body1 = md1->body;
+
+  /* Start two rebuilds; the second one supersedes the first.  They must not
+   * share a file. */
+  tt_int_op(microdesc_cache_rebuild_in_background(mc), OP_EQ, 0);
+  tt_int_op(microdesc_cache_rebuild_in_background(mc), OP_EQ, 0);
+  tt_int_op(n_queued_md_jobs, OP_EQ, 2);
+  job_a = queued_md_jobs[0];
+  job_b = queued_md_jobs[1];
+  tt_int_op(job_a->n, OP_EQ, 2);
+  tt_str_op(job_a->fname, OP_NE, job_b->fname);
+  fname_a = tor_strdup(job_a->fname);
+  fname_b = tor_strdup(job_b->fname);
+
+  /* md3 arrives while the workers are busy. */
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md3 = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = NULL;
+
+  tt_int_op(microdesc_rebuild_threadfn(NULL, job_a), OP_EQ, WQ_RPL_REPLY);
+  tt_int_op(microdesc_rebuild_threadfn(NULL, job_b), OP_EQ, WQ_RPL_REPLY);
+  tt_int_op(file_status(fname_a), OP_EQ, FN_FILE);
+  tt_int_op(file_status(fname_b), OP_EQ, FN_FILE);
+
+  /* The stale reply removes its own file, and nothing else. */
+  microdesc_rebuild_replyfn(job_a);
+  tt_int_op(file_status(fname_a), OP_EQ, FN_NOENT);
+  tt_int_op(file_status(fname_b), OP_EQ, FN_FILE);
+  tt_ptr_op(md1->body, OP_EQ, old_body1);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  /* The current one replaces the cache file, and moves what it wrote into
+   * the new mapping. */
+  microdesc_rebuild_replyfn(job_b);
+  tt_int_op(file_status(fname_b), OP_EQ, FN_NOENT);
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_ptr_op(md1->body, OP_NE, old_body1);
+  tt_ptr_op(md2->body - md2->off, OP_EQ, md1->body - md1->off);
+  s = read_file_to_str(cache_fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_mem_op(md1->body, OP_EQ, s + md1->off, md1->bodylen);
+  tt_mem_op(md2->body, OP_EQ, s + md2->off, md2->bodylen);
+  tt_mem_op(md1->body, OP_EQ, test_md1, strlen(test_md1));
+  tt_mem_op(md2->body, OP_EQ, test_md2, strlen(test_md2));
+
+  /* md3 wasn't in the snapshot, so the journal now holds just md3. */
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  j = read_file_to_str(journal_fn, RFTS_BIN, NULL);
+  tt_assert(j);
+  tt_assert(strstr(j, test_md3_noannotation));
+  tt_ptr_op(strstr(j, test_md1), OP_EQ, NULL);
+  tt_ptr_op(strstr(j, test_md2), OP_EQ, NULL);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  if (options)
+    tor_free(options->DataDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(cache_fn);
+  tor_free(journal_fn);
+  tor_free(fname_a);
+  tor_free(fname_b);
+  tor_free(s);
+  tor_free(j);
+}
+#endif
+
 static const char truncated_md[] =
   "@last-listed 2013-08-08 19:02:59\n"
   "onion-key\n"
@@ -843,6 +1112,10 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
+#ifndef _WIN32
+  { "cache_rebuild_bg", test_md_cache_rebuild_bg, TT_FORK, NULL, NULL },
+#endif
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
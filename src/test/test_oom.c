@@ -34,6 +34,20 @@ circuit_mark_for_close_dummy_(circuit_t *circ, int reason, int line,
   circ->marked_for_close_file = file;
 }
 
+/** The circuits that circuit_mark_for_close_recording_() has marked, in
+ * order. */
+static smartlist_t *circuits_marked = NULL;
+
+/* As circuit_mark_for_close_dummy_, but remember the order in which the
+ * circuits got marked. */
+static void
+circuit_mark_for_close_recording_(circuit_t *circ, int reason, int line,
+                                  const char *file)
+{
+  circuit_mark_for_close_dummy_(circ, reason, line, file);
+  smartlist_add(circuits_marked, circ);
+}
+
 static circuit_t *
 dummy_or_circuit_new(int n_p_cells, int n_n_cells)
 {
@@ -357,9 +371,71 @@ test_oom_streambuf(void *arg)
   UNMOCK(circuit_mark_for_close_);
 }
 
+/** Make sure that the OOM handler kills the circuits with the oldest queued
+ * cells first, and stops once it has freed enough. */
+static void
+test_oom_victim_order(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  /* When we'll queue each circuit's cells, in msec after the start.  The
+   * circuits with the oldest cells are not at the front of the list. */
+  static const int queued_at[] = { 50, 10, 90, 30, 70, 0, 60, 20, 80, 40 };
+  circuit_t *circs[ARRAY_LENGTH(queued_at)];
+  struct timeval tv = { 1389651270, 0 };
+  unsigned i;
+
+  (void) arg;
+
+  memset(circs, 0, sizeof(circs));
+  circuits_marked = smartlist_new();
+  MOCK(circuit_mark_for_close_, circuit_mark_for_close_recording_);
+
+  /* Ten circuits with ten cells each put us over this limit.  We need to get
+   * down to 72 cells, so three circuits have to go. */
+  options->MaxMemInQueues = 80*packed_cell_mem_cost();
+  options->CellStatistics = 0;
+
+  tt_int_op(cell_queues_check_size(), OP_EQ, 0); /* We don't start out OOM. */
+
+  for (i = 0; i < ARRAY_LENGTH(queued_at); ++i) {
+    tv.tv_usec = queued_at[i] * 1000;
+    tor_gettimeofday_cache_set(&tv);
+    circs[i] = dummy_or_circuit_new(10, 0);
+  }
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            packed_cell_mem_cost() * 100);
+
+  tv.tv_usec = 100*1000;
+  tor_gettimeofday_cache_set(&tv);
+  tt_int_op(cell_queues_check_size(), OP_EQ, 1); /* We are now OOM */
+
+  /* The three oldest died, oldest first. */
+  tt_int_op(smartlist_len(circuits_marked), OP_EQ, 3);
+  tt_ptr_op(smartlist_get(circuits_marked, 0), OP_EQ, circs[5]);
+  tt_ptr_op(smartlist_get(circuits_marked, 1), OP_EQ, circs[1]);
+  tt_ptr_op(smartlist_get(circuits_marked, 2), OP_EQ, circs[7]);
+  for (i = 0; i < ARRAY_LENGTH(queued_at); ++i)
+    tt_int_op(!! circs[i]->marked_for_close, OP_EQ, queued_at[i] < 30);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            packed_cell_mem_cost() * 70);
+
+  /* Once we're under the limit, nothing else dies. */
+  tt_int_op(cell_queues_check_size(), OP_EQ, 0);
+  tt_int_op(smartlist_len(circuits_marked), OP_EQ, 3);
+
+ done:
+  for (i = 0; i < ARRAY_LENGTH(queued_at); ++i)
+    circuit_free(circs[i]);
+  smartlist_free(circuits_marked);
+  circuits_marked = NULL;
+
+  UNMOCK(circuit_mark_for_close_);
+}
+
 struct testcase_t oom_tests[] = {
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
+  { "victim_order", test_oom_victim_order, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -6,6 +6,7 @@
 #include "circuitbuild.h"
 #define RELAY_PRIVATE
 #include "relay.h"
+#include "relay_crypto.h"
 /* For init/free stuff */
 #include "scheduler.h"
 
@@ -16,6 +17,7 @@
 static or_circuit_t * new_fake_orcirc(channel_t *nchan, channel_t *pchan);
 
 static void test_relay_append_cell_to_circuit_queue(void *arg);
+static void test_relay_crypto_roundtrip(void *arg);
 
 static or_circuit_t *
 new_fake_orcirc(channel_t *nchan, channel_t *pchan)
@@ -118,9 +120,115 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+/** Number of hops on the circuit in test_relay_crypto_roundtrip(). */
+#define N_TEST_HOPS 3
+
+static void
+test_relay_crypto_roundtrip(void *arg)
+{
+  origin_circuit_t *ocirc = NULL;
+  or_circuit_t *orcirc[N_TEST_HOPS];
+  crypt_path_t *hops[N_TEST_HOPS];
+  crypt_path_t *layer_hint = NULL;
+  char keys[N_TEST_HOPS][CPATH_KEY_MATERIAL_LEN];
+  cell_t cell, orig;
+  relay_header_t rh;
+  char recognized;
+  int i;
+  (void)arg;
+
+  memset(orcirc, 0, sizeof(orcirc));
+  memset(hops, 0, sizeof(hops));
+
+  /* Build a three-hop circuit, with the client's and each relay's view of
+   * every hop keyed from the same material. */
+  ocirc = tor_malloc_zero(sizeof(origin_circuit_t));
+  ocirc->base_.magic = ORIGIN_CIRCUIT_MAGIC;
+  ocirc->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  for (i = 0; i < N_TEST_HOPS; ++i) {
+    crypto_rand(keys[i], sizeof(keys[i]));
+    hops[i] = tor_malloc_zero(sizeof(crypt_path_t));
+    hops[i]->magic = CRYPT_PATH_MAGIC;
+    hops[i]->state = CPATH_STATE_OPEN;
+    tt_int_op(0, OP_EQ, relay_crypto_init(&hops[i]->crypto, keys[i], 0));
+    relay_crypto_assert_ok(&hops[i]->crypto);
+    onion_append_to_cpath(&ocirc->cpath, hops[i]);
+
+    orcirc[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    orcirc[i]->base_.magic = OR_CIRCUIT_MAGIC;
+    orcirc[i]->base_.purpose = CIRCUIT_PURPOSE_OR;
+    tt_int_op(0, OP_EQ, relay_crypto_init(&orcirc[i]->crypto, keys[i], 0));
+  }
+
+  /* Outbound: the client packages a cell for the last hop.  Only that hop
+   * recognizes it, and it comes out unchanged. */
+  memset(&orig, 0, sizeof(orig));
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.stream_id = 7;
+  rh.length = 100;
+  relay_header_pack(orig.payload, &rh);
+  crypto_rand((char*)orig.payload + RELAY_HEADER_SIZE, rh.length);
+  memcpy(&cell, &orig, sizeof(cell));
+
+  tt_int_op(0, OP_EQ,
+            relay_encrypt_cell_outbound(&cell, ocirc, hops[N_TEST_HOPS-1]));
+  tt_mem_op(cell.payload, OP_NE, orig.payload, CELL_PAYLOAD_SIZE);
+  for (i = 0; i < N_TEST_HOPS; ++i) {
+    recognized = 0;
+    tt_int_op(0, OP_EQ, relay_crypt(TO_CIRCUIT(orcirc[i]), &cell,
+                                    CELL_DIRECTION_OUT, NULL, &recognized));
+    tt_int_op(recognized, OP_EQ, i == N_TEST_HOPS-1);
+  }
+  relay_header_unpack(&rh, cell.payload);
+  tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DATA);
+  tt_int_op(rh.stream_id, OP_EQ, 7);
+  tt_mem_op(cell.payload + RELAY_HEADER_SIZE, OP_EQ,
+            orig.payload + RELAY_HEADER_SIZE,
+            CELL_PAYLOAD_SIZE - RELAY_HEADER_SIZE);
+
+  /* Inbound: the middle hop answers.  The first hop adds its layer, and the
+   * client peels both and says which hop sent it. */
+  memcpy(&cell, &orig, sizeof(cell));
+  tt_int_op(0, OP_EQ, relay_encrypt_cell_inbound(&cell, orcirc[1]));
+  recognized = 0;
+  tt_int_op(0, OP_EQ, relay_crypt(TO_CIRCUIT(orcirc[0]), &cell,
+                                  CELL_DIRECTION_IN, NULL, &recognized));
+  tt_int_op(recognized, OP_EQ, 0);
+  tt_int_op(0, OP_EQ, relay_crypt(TO_CIRCUIT(ocirc), &cell,
+                                  CELL_DIRECTION_IN, &layer_hint,
+                                  &recognized));
+  tt_int_op(recognized, OP_EQ, 1);
+  tt_ptr_op(layer_hint, OP_EQ, hops[1]);
+  tt_mem_op(cell.payload + RELAY_HEADER_SIZE, OP_EQ,
+            orig.payload + RELAY_HEADER_SIZE,
+            CELL_PAYLOAD_SIZE - RELAY_HEADER_SIZE);
+
+  /* A cell that nobody on the circuit encrypted isn't recognized, and the
+   * client closes the circuit. */
+  memcpy(&cell, &orig, sizeof(cell));
+  tt_int_op(0, OP_EQ, relay_encrypt_cell_inbound(&cell, orcirc[0]));
+  crypto_rand((char*)cell.payload, 4);
+  tt_int_op(-1, OP_EQ, relay_crypt(TO_CIRCUIT(ocirc), &cell,
+                                   CELL_DIRECTION_IN, &layer_hint,
+                                   &recognized));
+
+ done:
+  for (i = 0; i < N_TEST_HOPS; ++i) {
+    if (hops[i])
+      relay_crypto_clear(&hops[i]->crypto);
+    tor_free(hops[i]);
+    if (orcirc[i])
+      relay_crypto_clear(&orcirc[i]->crypto);
+    tor_free(orcirc[i]);
+  }
+  tor_free(ocirc);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "crypto_roundtrip", test_relay_crypto_roundtrip, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
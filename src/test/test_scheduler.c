@@ -14,9 +14,14 @@
 
 #define TOR_CHANNEL_INTERNAL_
 #define CHANNEL_PRIVATE_
+#define CONFIG_PRIVATE
 #include "or.h"
+#include "buffers.h"
 #include "compat_libevent.h"
 #include "channel.h"
+#include "channeltls.h"
+#include "config.h"
+#include "confparse.h"
 #define SCHEDULER_PRIVATE_
 #include "scheduler.h"
 
@@ -43,6 +48,8 @@ static circuitmux_t *mock_cgp_tgt_2 = NULL;
 static circuitmux_policy_t *mock_cgp_val_2 = NULL;
 static int scheduler_compare_channels_mock_ctr = 0;
 static int scheduler_run_mock_ctr = 0;
+static kist_sock_info_t mock_kist_sock_info;
+static int mock_kist_sock_info_result = 0;
 
 static void channel_flush_some_cells_mock_free_all(void);
 static void channel_flush_some_cells_mock_set(channel_t *chan,
@@ -62,12 +69,17 @@ static const circuitmux_policy_t * circuitmux_get_policy_mock(
 static int scheduler_compare_channels_mock(const void *c1_v,
                                            const void *c2_v);
 static void scheduler_run_noop_mock(void);
+static int scheduler_kist_get_sock_info_mock(tor_socket_t s,
+                                             kist_sock_info_t *info_out);
 static struct event_base * tor_libevent_get_base_mock(void);
 
 /* Scheduler test cases */
 static void test_scheduler_channel_states(void *arg);
 static void test_scheduler_compare_channels(void *arg);
 static void test_scheduler_initfree(void *arg);
+static void test_scheduler_kist_budget(void *arg);
+static void test_scheduler_kist_fallback(void *arg);
+static void test_scheduler_kist_options(void *arg);
 static void test_scheduler_loop(void *arg);
 static void test_scheduler_queue_heuristic(void *arg);
 
@@ -310,6 +322,18 @@ scheduler_run_noop_mock(void)
   ++scheduler_run_mock_ctr;
 }
 
+static int
+scheduler_kist_get_sock_info_mock(tor_socket_t s,
+                                  kist_sock_info_t *info_out)
+{
+  (void)s;
+
+  if (mock_kist_sock_info_result == 0)
+    memcpy(info_out, &mock_kist_sock_info, sizeof(*info_out));
+
+  return mock_kist_sock_info_result;
+}
+
 static struct event_base *
 tor_libevent_get_base_mock(void)
 {
@@ -546,6 +570,197 @@ test_scheduler_initfree(void *arg)
   return;
 }
 
+/** Allocate a TLS channel whose connection has socket <b>s</b> and
+ * <b>outbuf_len</b> bytes in its outbuf, for the KIST tests. */
+static channel_tls_t *
+new_fake_kist_chan(tor_socket_t s, size_t outbuf_len)
+{
+  channel_tls_t *tlschan = tor_malloc_zero(sizeof(channel_tls_t));
+  or_connection_t *orconn = tor_malloc_zero(sizeof(or_connection_t));
+  char *junk = tor_malloc_zero(outbuf_len + 1);
+
+  orconn->base_.magic = OR_CONNECTION_MAGIC;
+  orconn->base_.s = s;
+  orconn->base_.outbuf = buf_new();
+  write_to_buf(junk, outbuf_len, orconn->base_.outbuf);
+  tor_free(junk);
+
+  tlschan->base_.magic = TLS_CHAN_MAGIC;
+  tlschan->conn = orconn;
+  return tlschan;
+}
+
+static void
+free_fake_kist_chan(channel_tls_t *tlschan)
+{
+  if (!tlschan)
+    return;
+  if (tlschan->conn) {
+    buf_free(tlschan->conn->base_.outbuf);
+    tor_free(tlschan->conn);
+  }
+  tor_free(tlschan);
+}
+
+static void
+test_scheduler_kist_budget(void *arg)
+{
+  channel_tls_t *tlschan = NULL;
+  channel_t *chan;
+
+  (void)arg;
+
+  MOCK(scheduler_kist_get_sock_info, scheduler_kist_get_sock_info_mock);
+  scheduler_set_kist_params(10, 1.0);
+
+  tlschan = new_fake_kist_chan(7, 0);
+  chan = &(tlschan->base_);
+
+  /*
+   * 10-segment window of 1448 bytes with 4 segments in flight: 6 segments
+   * of room on the wire, plus one window of slack less the 1000 bytes
+   * already queued in the kernel.  That's 22168 bytes, or 40 cells of
+   * 514 + 29 bytes each.
+   */
+  mock_kist_sock_info_result = 0;
+  mock_kist_sock_info.cwnd = 10;
+  mock_kist_sock_info.unacked = 4;
+  mock_kist_sock_info.mss = 1448;
+  mock_kist_sock_info.notsent = 1000;
+  tt_int_op(scheduler_kist_cells_writeable(chan), ==, 40);
+
+  /* Whatever is in the outbuf counts against the slack too: 20168 bytes. */
+  free_fake_kist_chan(tlschan);
+  tlschan = new_fake_kist_chan(7, 2000);
+  chan = &(tlschan->base_);
+  tt_int_op(scheduler_kist_cells_writeable(chan), ==, 37);
+
+  /* More unacked segments than the window allows don't go negative. */
+  mock_kist_sock_info.unacked = 12;
+  tt_int_op(scheduler_kist_cells_writeable(chan), ==, (14480 - 3000) / 543);
+
+  /* With no slack, a full window and queued data mean no cells at all. */
+  scheduler_set_kist_params(10, 0.0);
+  tt_int_op(scheduler_kist_cells_writeable(chan), ==, 0);
+
+  /* ...but once the window opens, we can fill it. */
+  mock_kist_sock_info.unacked = 0;
+  mock_kist_sock_info.notsent = 0;
+  tt_int_op(scheduler_kist_cells_writeable(chan), ==, (14480 - 2000) / 543);
+
+  /* Twice the slack. */
+  scheduler_set_kist_params(10, 2.0);
+  tt_int_op(scheduler_kist_cells_writeable(chan), ==,
+            (14480 * 3 - 2000) / 543);
+
+ done:
+  free_fake_kist_chan(tlschan);
+  scheduler_set_kist_params(0, 1.0);
+  UNMOCK(scheduler_kist_get_sock_info);
+}
+
+static void
+test_scheduler_kist_fallback(void *arg)
+{
+  channel_tls_t *tlschan = NULL;
+  channel_t *chan = NULL;
+
+  (void)arg;
+
+  MOCK(scheduler_kist_get_sock_info, scheduler_kist_get_sock_info_mock);
+  scheduler_set_kist_params(10, 1.0);
+
+  /* If the kernel won't tell us about the socket, don't limit anything. */
+  tlschan = new_fake_kist_chan(7, 0);
+  mock_kist_sock_info_result = -1;
+  tt_int_op(scheduler_kist_cells_writeable(&(tlschan->base_)), ==, INT_MAX);
+
+  /* Same for connections without a socket... */
+  mock_kist_sock_info_result = 0;
+  memset(&mock_kist_sock_info, 0, sizeof(mock_kist_sock_info));
+  tlschan->conn->base_.s = TOR_INVALID_SOCKET;
+  tt_int_op(scheduler_kist_cells_writeable(&(tlschan->base_)), ==, INT_MAX);
+
+  /* ...TLS channels without a connection... */
+  buf_free(tlschan->conn->base_.outbuf);
+  tor_free(tlschan->conn);
+  tt_int_op(scheduler_kist_cells_writeable(&(tlschan->base_)), ==, INT_MAX);
+
+  /* ...and channels that aren't TLS channels at all. */
+  chan = tor_malloc_zero(sizeof(channel_t));
+  tt_int_op(scheduler_kist_cells_writeable(chan), ==, INT_MAX);
+
+ done:
+  free_fake_kist_chan(tlschan);
+  tor_free(chan);
+  scheduler_set_kist_params(0, 1.0);
+  UNMOCK(scheduler_kist_get_sock_info);
+}
+
+/** Validate <b>configuration</b> on top of the default options; return the
+ * result of options_validate() and store any error in *<b>msg_out</b>. */
+static int
+kist_options_validate(const char *configuration, char **msg_out)
+{
+  or_options_t *opt = options_new();
+  or_options_t *dflt;
+  config_line_t *cl = NULL;
+  int r;
+
+  opt->command = CMD_RUN_TOR;
+  options_init(opt);
+  dflt = config_dup(&options_format, opt);
+
+  r = config_get_lines(configuration, &cl, 1);
+  tt_int_op(r, ==, 0);
+  r = config_assign(&options_format, opt, cl, 0, 0, msg_out);
+  tt_int_op(r, ==, 0);
+
+  r = options_validate(NULL, opt, dflt, 0, msg_out);
+
+ done:
+  config_free_lines(cl);
+  or_options_free(opt);
+  or_options_free(dflt);
+  return r;
+}
+
+static void
+test_scheduler_kist_options(void *arg)
+{
+  char *msg = NULL;
+
+  (void)arg;
+
+  tt_int_op(kist_options_validate("KISTSchedRunInterval 10 msec\n"
+                                  "KISTSockBufSizeFactor 0.5\n", &msg),
+            ==, 0);
+  tt_ptr_op(msg, ==, NULL);
+
+  tt_int_op(kist_options_validate("KISTSchedRunInterval 100 msec\n"
+                                  "KISTSockBufSizeFactor 0\n", &msg),
+            ==, 0);
+  tt_ptr_op(msg, ==, NULL);
+
+  tt_int_op(kist_options_validate("KISTSchedRunInterval 101 msec\n", &msg),
+            ==, -1);
+  tt_str_op(msg, ==, "KISTSchedRunInterval must be between 0 and 100 msec.");
+  tor_free(msg);
+
+  tt_int_op(kist_options_validate("KISTSchedRunInterval 1 second\n", &msg),
+            ==, -1);
+  tt_str_op(msg, ==, "KISTSchedRunInterval must be between 0 and 100 msec.");
+  tor_free(msg);
+
+  tt_int_op(kist_options_validate("KISTSockBufSizeFactor -0.5\n", &msg),
+            ==, -1);
+  tt_str_op(msg, ==, "KISTSockBufSizeFactor must be nonnegative.");
+  tor_free(msg);
+
+ done:
+  tor_free(msg);
+}
+
 static void
 test_scheduler_loop(void *arg)
 {
@@ -766,6 +981,9 @@ struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
+  { "kist_budget", test_scheduler_kist_budget, TT_FORK, NULL, NULL },
+  { "kist_fallback", test_scheduler_kist_fallback, TT_FORK, NULL, NULL },
+  { "kist_options", test_scheduler_kist_options, TT_FORK, NULL, NULL },
   { "loop", test_scheduler_loop, TT_FORK, NULL, NULL },
   { "queue_heuristic", test_scheduler_queue_heuristic,
     TT_FORK, NULL, NULL },
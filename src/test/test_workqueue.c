@@ -315,6 +315,247 @@ replysock_readable_cb(tor_socket_t sock, short what, void *arg)
   }
 }
 
+/* Checks of threadpool and reply queue behavior, run before the benchmark.
+ * Their work items do nothing, or wait for the main thread to let them
+ * finish.  Each check waits for the pool to reach
+ * a known state before it looks at anything, so that its result doesn't
+ * depend on how the threads get scheduled. */
+
+static tor_mutex_t check_mutex;
+/** Signaled when check_gate_open becomes true. */
+static tor_cond_t check_gate_cond;
+/** True iff blocking check items may finish.  Protected by check_mutex. */
+static int check_gate_open = 0;
+/** Number of blocking check items that have started. Protected by
+ * check_mutex. */
+static int check_n_started = 0;
+/** Number of check replies handled in the main thread. */
+static int check_n_replied = 0;
+/** The pool we're checking. */
+static threadpool_t *check_pool = NULL;
+/** The reply queue we're checking. */
+static replyqueue_t *check_rq = NULL;
+/** True once handle_check_reply_requeue() has queued its extra item. */
+static int check_requeued = 0;
+
+static workqueue_reply_t
+workqueue_do_check(void *state, void *work)
+{
+  (void)state;
+  (void)work;
+  return WQ_RPL_REPLY;
+}
+
+/* As workqueue_do_check, but don't finish until check_gate_open is set. */
+static workqueue_reply_t
+workqueue_do_check_blocking(void *state, void *work)
+{
+  (void)state;
+  (void)work;
+  tor_mutex_acquire(&check_mutex);
+  ++check_n_started;
+  while (!check_gate_open)
+    tor_cond_wait(&check_gate_cond, &check_mutex, NULL);
+  tor_mutex_release(&check_mutex);
+  return WQ_RPL_REPLY;
+}
+
+static int
+check_get_n_started(void)
+{
+  int n;
+  tor_mutex_acquire(&check_mutex);
+  n = check_n_started;
+  tor_mutex_release(&check_mutex);
+  return n;
+}
+
+static int
+check_get_n_idle(threadpool_t *tp)
+{
+  int n_idle;
+  unsigned n_wakeups;
+  threadpool_get_idle_counts(tp, &n_idle, &n_wakeups);
+  return n_idle;
+}
+
+static unsigned
+check_get_n_wakeups(threadpool_t *tp)
+{
+  int n_idle;
+  unsigned n_wakeups;
+  threadpool_get_idle_counts(tp, &n_idle, &n_wakeups);
+  return n_wakeups;
+}
+
+/** Wait up to 10 seconds for <b>fn</b>(<b>arg</b>) to return <b>n</b>.
+ * Return 0 on success, -1 on timeout. */
+static int
+wait_for_count(int (*fn)(void *), void *arg, int n)
+{
+  int i;
+  for (i = 0; i < 10000 && fn(arg) != n; ++i)
+    tor_sleep_msec(1);
+  return fn(arg) == n ? 0 : -1;
+}
+
+static int
+count_started(void *arg)
+{
+  (void)arg;
+  return check_get_n_started();
+}
+
+static int
+count_idle(void *arg)
+{
+  return check_get_n_idle(arg);
+}
+
+static int
+count_pending(void *arg)
+{
+  return replyqueue_get_n_pending(arg);
+}
+
+/** Process replies on <b>rq</b> for up to 10 seconds, until <b>n</b> check
+ * replies have been handled.  Return 0 on success, -1 on timeout. */
+static int
+wait_for_check_replies(replyqueue_t *rq, int n)
+{
+  int i;
+  for (i = 0; i < 10000 && check_n_replied < n; ++i) {
+    replyqueue_process(rq);
+    if (check_n_replied < n)
+      tor_sleep_msec(1);
+  }
+  return check_n_replied >= n ? 0 : -1;
+}
+
+static void
+handle_check_reply(void *arg)
+{
+  (void)arg;
+  ++check_n_replied;
+}
+
+/* Queue one more item the first time we're called, and don't return until
+ * its reply is waiting on the reply queue. */
+static void
+handle_check_reply_requeue(void *arg)
+{
+  (void)arg;
+  ++check_n_replied;
+  if (check_requeued)
+    return;
+  check_requeued = 1;
+
+  threadpool_queue_work(check_pool, workqueue_do_check,
+                        handle_check_reply, NULL);
+  if (wait_for_count(count_pending, check_rq, 1) < 0)
+    puts("The extra reply never arrived.");
+}
+
+/** Make sure that threadpool_queue_work() wakes a thread when one is idle,
+ * and doesn't bother when none is.  Return 0 on success, -1 on failure. */
+static int
+check_idle_wakeups(threadpool_t *tp, replyqueue_t *rq)
+{
+  int i, n_extra = opt_n_threads * 4;
+  unsigned n_wakeups;
+  check_n_replied = check_n_started = 0;
+  check_gate_open = 0;
+
+  if (wait_for_count(count_idle, tp, opt_n_threads) < 0) {
+    puts("The workers never went idle.");
+    return -1;
+  }
+  n_wakeups = check_get_n_wakeups(tp);
+
+  /* While any thread is idle, every item wakes one.  A thread only stops
+   * being idle by taking an item, so each of these finds one idle. */
+  for (i = 0; i < opt_n_threads; ++i) {
+    if (!threadpool_queue_work(tp, workqueue_do_check_blocking,
+                               handle_check_reply, NULL))
+      return -1;
+  }
+  if (check_get_n_wakeups(tp) != n_wakeups + opt_n_threads) {
+    printf("Queueing %d items for %d idle threads woke %u of them.\n",
+           opt_n_threads, opt_n_threads,
+           check_get_n_wakeups(tp) - n_wakeups);
+    return -1;
+  }
+
+  /* Once every thread is busy, nobody gets woken. */
+  if (wait_for_count(count_started, NULL, opt_n_threads) < 0) {
+    puts("The blocking items never started.");
+    return -1;
+  }
+  n_wakeups = check_get_n_wakeups(tp);
+  for (i = 0; i < n_extra; ++i) {
+    if (!threadpool_queue_work(tp, workqueue_do_check,
+                               handle_check_reply, NULL))
+      return -1;
+  }
+  if (check_get_n_wakeups(tp) != n_wakeups) {
+    printf("Queueing work for busy threads woke them %u times.\n",
+           check_get_n_wakeups(tp) - n_wakeups);
+    return -1;
+  }
+
+  /* The busy threads pick up that work without being woken. */
+  tor_mutex_acquire(&check_mutex);
+  check_gate_open = 1;
+  tor_cond_signal_all(&check_gate_cond);
+  tor_mutex_release(&check_mutex);
+  if (wait_for_check_replies(rq, opt_n_threads + n_extra) < 0) {
+    printf("Only %d of %d items ran.\n", check_n_replied,
+           opt_n_threads + n_extra);
+    return -1;
+  }
+  return 0;
+}
+
+/** Make sure that replyqueue_process() handles the replies that were
+ * pending when it was called as one batch, and leaves replies that arrive
+ * while it runs for the next call. Return 0 on success, -1 on failure. */
+static int
+check_reply_batches(threadpool_t *tp, replyqueue_t *rq)
+{
+  const int n = 32;
+  int i;
+  check_n_replied = 0;
+  check_pool = tp;
+  check_rq = rq;
+  check_requeued = 0;
+
+  for (i = 0; i < n; ++i) {
+    if (!threadpool_queue_work(tp, workqueue_do_check,
+                               handle_check_reply_requeue, NULL))
+      return -1;
+  }
+  if (wait_for_count(count_pending, rq, n) < 0) {
+    puts("Batch replies never arrived.");
+    return -1;
+  }
+
+  replyqueue_process(rq);
+  if (check_n_replied != n) {
+    printf("Handled %d replies in one batch; expected %d.\n",
+           check_n_replied, n);
+    return -1;
+  }
+  if (replyqueue_get_n_pending(rq) != 1) {
+    puts("The reply that arrived during the batch wasn't left pending.");
+    return -1;
+  }
+  if (wait_for_check_replies(rq, n + 1) < 0) {
+    puts("The reply that arrived during the batch was lost.");
+    return -1;
+  }
+  return 0;
+}
+
 static void
 help(void)
 {
@@ -401,6 +642,13 @@ main(int argc, char **argv)
 
   crypto_seed_weak_rng(&weak_rng);
 
+  tor_mutex_init(&check_mutex);
+  tor_cond_init(&check_gate_cond);
+  if (check_idle_wakeups(tp, rq) < 0 || check_reply_batches(tp, rq) < 0) {
+    puts("FAIL");
+    return 1;
+  }
+
   memset(&evcfg, 0, sizeof(evcfg));
   tor_libevent_initialize(&evcfg);
 
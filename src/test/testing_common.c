@@ -17,6 +17,7 @@ const char tor_git_revision[] = "";
 #include "control.h"
 #include "config.h"
 #include "rephist.h"
+#include "routerparse.h"
 #include "backtrace.h"
 #include "test.h"
 
@@ -274,6 +275,7 @@ main(int c, const char **v)
   crypto_set_tls_dh_prime();
   crypto_seed_rng();
   rep_hist_init();
+  routerparse_init();
   network_init();
   setup_directory();
   options_init(options);